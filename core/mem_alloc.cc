@@ -28,6 +28,21 @@ void *mem_realloc(void *ptr, size_t size) {
   return new_ptr;
 }
 
+void *mem_alloc_aligned(size_t size, size_t align) {
+  void *ptr;
+
+  if (align < sizeof(void *)) {
+    align = sizeof(void *);
+  }
+
+  if (posix_memalign(&ptr, align, size)) {
+    return nullptr;
+  }
+
+  memset(ptr, 0, size);
+  return ptr;
+}
+
 void mem_free(void *ptr) {
   free(ptr);
 }
@@ -45,6 +60,10 @@ void *mem_realloc(void *ptr, size_t size) {
   return rte_realloc(ptr, size, /* align= */ 0);
 }
 
+void *mem_alloc_aligned(size_t size, size_t align) {
+  return rte_zmalloc(/* name= */ nullptr, size, align);
+}
+
 void mem_free(void *ptr) { rte_free(ptr); }
 
 #else
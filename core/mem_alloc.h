@@ -10,6 +10,10 @@ void *mem_alloc(size_t size); /* zero initialized by default */
 void *mem_realloc(void *ptr, size_t size);
 void mem_free(void *ptr);
 
+/* mem_alloc() with "align" (a power of 2) bytes of alignment, e.g., for
+ * cache-aligned arrays. Freed with mem_free(), but not for mem_realloc(). */
+void *mem_alloc_aligned(size_t size, size_t align);
+
 /* void *mem_alloc_ex(size_t size, size_t align, int socket); */
 
 #endif  // BESS_MEMALLOC_H_
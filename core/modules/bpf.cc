@@ -608,8 +608,8 @@ static int bpf_jit_optimize(struct bpf_insn *prog, u_int nins) {
 /*
  * Function that does the real stuff.
  */
-static bpf_filter_func_t bpf_jit_compile(struct bpf_insn *prog, u_int nins,
-                                         size_t *size) {
+bpf_filter_func_t bpf_jit_compile(struct bpf_insn *prog, u_int nins,
+                                  size_t *size) {
   bpf_bin_stream stream;
   struct bpf_insn *ins;
   int flags, fret, fpkt, fmem, fjmp, flen;
@@ -7,6 +7,13 @@
 
 typedef u_int (*bpf_filter_func_t)(u_char *, u_int, u_int);
 
+struct bpf_insn;
+
+/* Compiles a BPF program to native code, which must be munmap()ed with the
+ * size stored in *size. Returns NULL on failure. */
+bpf_filter_func_t bpf_jit_compile(struct bpf_insn *prog, u_int nins,
+                                  size_t *size);
+
 struct filter {
   bpf_filter_func_t func;
   int gate;
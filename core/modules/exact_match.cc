@@ -12,15 +12,15 @@ static inline int is_valid_gate(gate_idx_t gate) {
 }
 
 const Commands<Module> ExactMatch::cmds = {
-    {"add", MODULE_FUNC &ExactMatch::CommandAdd, 0},
-    {"delete", MODULE_FUNC &ExactMatch::CommandDelete, 0},
-    {"clear", MODULE_FUNC &ExactMatch::CommandClear, 0},
+    {"add", MODULE_FUNC &ExactMatch::CommandAdd, 1},
+    {"delete", MODULE_FUNC &ExactMatch::CommandDelete, 1},
+    {"clear", MODULE_FUNC &ExactMatch::CommandClear, 1},
     {"set_default_gate", MODULE_FUNC &ExactMatch::CommandSetDefaultGate, 1}};
 
 const PbCommands<Module> ExactMatch::pb_cmds = {
-    {"add", PB_MODULE_FUNC &ExactMatch::CommandAdd, 0},
-    {"delete", PB_MODULE_FUNC &ExactMatch::CommandDelete, 0},
-    {"clear", PB_MODULE_FUNC &ExactMatch::CommandClear, 0},
+    {"add", PB_MODULE_FUNC &ExactMatch::CommandAdd, 1},
+    {"delete", PB_MODULE_FUNC &ExactMatch::CommandDelete, 1},
+    {"clear", PB_MODULE_FUNC &ExactMatch::CommandClear, 1},
     {"set_default_gate", PB_MODULE_FUNC &ExactMatch::CommandSetDefaultGate, 1}};
 
 pb_error_t ExactMatch::AddFieldOne(const bess::pb::ExactMatchArg_Field &field,
@@ -149,7 +149,8 @@ struct snobj *ExactMatch::Init(struct snobj *arg) {
   num_fields_ = fields->size;
   total_key_size_ = align_ceil(size_acc, sizeof(uint64_t));
 
-  int ret = ht_.Init(total_key_size_, sizeof(gate_idx_t));
+  /* rules are updated while workers look them up */
+  int ret = ht_.Init(total_key_size_, sizeof(gate_idx_t), true);
   if (ret < 0) {
     return snobj_err(-ret, "hash table creation failed");
   }
@@ -180,7 +181,8 @@ pb_error_t ExactMatch::Init(const google::protobuf::Any &arg_) {
   num_fields_ = arg.fields_size();
   total_key_size_ = align_ceil(size_acc, sizeof(uint64_t));
 
-  int ret = ht_.Init(total_key_size_, sizeof(gate_idx_t));
+  /* rules are updated while workers look them up */
+  int ret = ht_.Init(total_key_size_, sizeof(gate_idx_t), true);
   if (ret < 0) {
     return pb_error(-ret, "hash table creation failed");
   }
@@ -233,10 +235,11 @@ void ExactMatch::ProcessBatch(struct pkt_batch *batch) {
     }
   }
 
+  gate_idx_t *values[MAX_PKT_BURST];
+  ht_.GetBulk(reinterpret_cast<em_hkey_t *>(keys), cnt, values);
+
   for (int i = 0; i < cnt; i++) {
-    gate_idx_t *ret = static_cast<gate_idx_t *>(
-        ht_.Get(reinterpret_cast<em_hkey_t *>(keys[i])));
-    out_gates[i] = ret ? *ret : default_gate;
+    out_gates[i] = values[i] ? *values[i] : default_gate;
   }
 
   RunSplit(out_gates, batch);
@@ -1,33 +1,30 @@
 #include "l2_forward.h"
 
-#include <glog/logging.h>
-#include <rte_byteorder.h>
-#include <rte_hash_crc.h>
+#include <algorithm>
 
-#include "../utils/simd.h"
+#include <rte_byteorder.h>
 
 #define MAX_TABLE_SIZE (1048576 * 64)
 #define DEFAULT_TABLE_SIZE 1024
 #define MAX_BUCKET_SIZE 4
 
-typedef uint64_t mac_addr_t;
-
 static int is_power_of_2(uint64_t n) {
   return (n != 0 && ((n & (n - 1)) == 0));
 }
 
 /*
  * l2_init:
- *  Initilizes the l2_table.
- *  It creates the slots of MAX_TABLE_SIZE multiplied by MAX_BUCKET_SIZE.
+ *  Initializes the l2_table with room for size * bucket entries. The table
+ *  grows as entries are added. Lookups run without synchronization, so the
+ *  table must only be updated while workers are paused.
  *
  * @l2tbl: pointer to
  * @size: number of hash value entries. must be power of 2, greater than 0, and
- *        less than equal to MAX_TABLE_SIZE (2^30)
+ *        less than equal to MAX_TABLE_SIZE (2^26)
  * @bucket: number of slots per hash value. must be power of 2, greater than 0,
  *        and less than equal to MAX_BUCKET_SIZE (4)
  */
-static int l2_init(struct l2_table *l2tbl, int size, int bucket) {
+static int l2_init(l2_table_t *l2tbl, int size, int bucket) {
   if (size <= 0 || size > MAX_TABLE_SIZE || !is_power_of_2(size)) {
     return -EINVAL;
   }
@@ -36,464 +33,45 @@ static int l2_init(struct l2_table *l2tbl, int size, int bucket) {
     return -EINVAL;
   }
 
-  if (l2tbl == nullptr) {
-    return -EINVAL;
-  }
-
-  l2tbl->table = static_cast<l2_entry *>(
-      mem_alloc(sizeof(struct l2_entry) * size * bucket));
-  if (l2tbl->table == nullptr) {
-    return -ENOMEM;
-  }
-
-  l2tbl->size = size;
-  l2tbl->bucket = bucket;
-
-  /* calculates the log_2 (size) */
-  l2tbl->size_power = 0;
-  while (size > 1) {
-    size = size >> 1;
-    l2tbl->size_power += 1;
-  }
-
-  return 0;
-}
-
-static int l2_deinit(struct l2_table *l2tbl) {
-  if (l2tbl == nullptr || l2tbl->table == nullptr || l2tbl->size == 0 ||
-      l2tbl->bucket == 0) {
-    return -EINVAL;
-  }
-
-  mem_free(l2tbl->table);
-
-  memset(l2tbl, 0, sizeof(struct l2_table));
-
-  return 0;
-}
+  l2_table_t::ht_params params = {};
 
-static uint32_t l2_ib_to_offset(struct l2_table *l2tbl, int index, int bucket) {
-  return index * l2tbl->bucket + bucket;
-}
-
-static uint32_t l2_hash(mac_addr_t addr) {
-  return rte_hash_crc_8byte(addr, 0);
-}
+  params.key_size = sizeof(mac_addr_t);
+  params.value_size = sizeof(gate_idx_t);
+  params.num_buckets = std::max(1, size * bucket / MAX_BUCKET_SIZE);
 
-static uint32_t l2_hash_to_index(uint32_t hash, uint32_t size) {
-  return hash & (size - 1);
+  return l2tbl->InitEx(&params);
 }
 
-static uint32_t l2_alt_index(uint32_t hash, uint32_t size_power,
-                             uint32_t index) {
-  uint64_t tag = (hash >> size_power) + 1;
-  tag = tag * 0x5bd1e995;
-  return (index ^ tag) & ((0x1lu << (size_power - 1)) - 1);
-}
+static int l2_find(const l2_table_t *l2tbl, mac_addr_t addr,
+                   gate_idx_t *gate) {
+  gate_idx_t *found = l2tbl->Get(&addr);
 
-static inline int find_index_basic(uint64_t addr, uint64_t *table) {
-  for (int i = 0; i < 4; i++) {
-    if ((addr | ((uint64_t)1 << 63)) == (table[i] & 0x8000ffffFFFFffffUL)) {
-      return i + 1;
-    }
+  if (!found) {
+    return -ENOENT;
   }
 
+  *gate = *found;
   return 0;
 }
 
-#if __AVX__
-const union {
-  uint64_t val[4];
-  __m256d _mask;
-} _mask = {.val = {0x8000ffffFFFFfffflu, 0x8000ffffFFFFfffflu,
-                   0x8000ffffFFFFfffflu, 0x8000ffffFFFFfffflu}};
-
-static inline int find_index_avx(uint64_t addr, uint64_t *table) {
-  __m256d _addr = (__m256d)_mm256_set1_epi64x(addr | ((uint64_t)1 << 63));
-  __m256d _table = _mm256_load_pd((double *)table);
-  _table = _mm256_and_pd(_table, _mask._mask);
-  __m256d cmp = _mm256_cmp_pd(_addr, _table, _CMP_EQ_OQ);
-
-  return __builtin_ffs(_mm256_movemask_pd(cmp));
-}
-#endif
-
-static inline int find_index(uint64_t addr, uint64_t *table, const uint64_t) {
-#if __AVX__
-  return find_index_avx(addr, table);
-#else
-  return find_index_basic(addr, table);
-#endif
-}
-
-static inline int l2_find(struct l2_table *l2tbl, uint64_t addr,
-                          gate_idx_t *gate) {
-  size_t i;
-  int ret = -ENOENT;
-  uint32_t hash, idx1, offset;
-  struct l2_entry *tbl = l2tbl->table;
-
-  hash = l2_hash(addr);
-  idx1 = l2_hash_to_index(hash, l2tbl->size);
-
-  offset = l2_ib_to_offset(l2tbl, idx1, 0);
-
-  if (l2tbl->bucket == 4) {
-    int tmp1 = find_index(addr, &tbl[offset].entry, l2tbl->count);
-    if (tmp1) {
-      *gate = tbl[offset + tmp1 - 1].gate;
-      return 0;
-    }
-
-    idx1 = l2_alt_index(hash, l2tbl->size_power, idx1);
-    offset = l2_ib_to_offset(l2tbl, idx1, 0);
-
-    int tmp2 = find_index(addr, &tbl[offset].entry, l2tbl->count);
-
-    if (tmp2) {
-      *gate = tbl[offset + tmp2 - 1].gate;
-      return 0;
-    }
-
-  } else {
-    /* search buckets for first index */
-    for (i = 0; i < l2tbl->bucket; i++) {
-      if (tbl[offset].occupied && addr == tbl[offset].addr) {
-        *gate = tbl[offset].gate;
-        return 0;
-      }
-
-      offset++;
-    }
-
-    idx1 = l2_alt_index(hash, l2tbl->size_power, idx1);
-    offset = l2_ib_to_offset(l2tbl, idx1, 0);
-    /* search buckets for alternate index */
-    for (i = 0; i < l2tbl->bucket; i++) {
-      if (tbl[offset].occupied && addr == tbl[offset].addr) {
-        *gate = tbl[offset].gate;
-        return 0;
-      }
-
-      offset++;
-    }
-  }
-
-  return ret;
-}
-
-static int l2_find_offset(struct l2_table *l2tbl, uint64_t addr,
-                          uint32_t *offset_out) {
-  size_t i;
-  uint32_t hash, idx1, offset;
-  struct l2_entry *tbl = l2tbl->table;
-
-  hash = l2_hash(addr);
-  idx1 = l2_hash_to_index(hash, l2tbl->size);
-
-  offset = l2_ib_to_offset(l2tbl, idx1, 0);
-  /* search buckets for first index */
-  for (i = 0; i < l2tbl->bucket; i++) {
-    if (tbl[offset].occupied && addr == tbl[offset].addr) {
-      *offset_out = offset;
-      return 0;
-    }
-
-    offset++;
-  }
-
-  idx1 = l2_alt_index(hash, l2tbl->size_power, idx1);
-  offset = l2_ib_to_offset(l2tbl, idx1, 0);
-  /* search buckets for alternate index */
-  for (i = 0; i < l2tbl->bucket; i++) {
-    if (tbl[offset].occupied && addr == tbl[offset].addr) {
-      *offset_out = offset;
-      return 0;
-    }
-
-    offset++;
-  }
-
-  return -ENOENT;
-}
-
-static int l2_find_slot(struct l2_table *l2tbl, mac_addr_t addr, uint32_t *idx,
-                        uint32_t *bucket) {
-  size_t i, j;
-  uint32_t hash;
-  uint32_t idx1, idx_v1, idx_v2;
-  uint32_t offset1, offset2;
-  struct l2_entry *tbl = l2tbl->table;
-
-  hash = l2_hash(addr);
-  idx1 = l2_hash_to_index(hash, l2tbl->size);
-
-  /* if there is available slot */
-  for (i = 0; i < l2tbl->bucket; i++) {
-    offset1 = l2_ib_to_offset(l2tbl, idx1, i);
-    if (!tbl[offset1].occupied) {
-      *idx = idx1;
-      *bucket = i;
-      return 0;
-    }
-  }
-
-  offset1 = l2_ib_to_offset(l2tbl, idx1, 0);
-
-  /* try moving */
-  for (i = 0; i < l2tbl->bucket; i++) {
-    offset1 = l2_ib_to_offset(l2tbl, idx1, i);
-    hash = l2_hash(tbl[offset1].addr);
-    idx_v1 = l2_hash_to_index(hash, l2tbl->size);
-    idx_v2 = l2_alt_index(hash, l2tbl->size_power, idx_v1);
-
-    /* if the alternate bucket is same as original skip it */
-    if (idx_v1 == idx_v2 || idx1 == idx_v2)
-      break;
-
-    for (j = 0; j < l2tbl->bucket; j++) {
-      offset2 = l2_ib_to_offset(l2tbl, idx_v2, j);
-      if (!tbl[offset2].occupied) {
-        /* move offset1 to offset2 */
-        tbl[offset2] = tbl[offset1];
-        /* clear offset1 */
-        tbl[offset1].occupied = 0;
-
-        *idx = idx1;
-        *bucket = 0;
-        return 0;
-      }
-    }
-  }
-
-  /* TODO:if alternate index is also full then start move */
-  return -ENOMEM;
-}
-
-static int l2_add_entry(struct l2_table *l2tbl, mac_addr_t addr,
-                        gate_idx_t gate) {
-  uint32_t offset;
-  uint32_t index;
-  uint32_t bucket;
-  gate_idx_t gate_idx_tmp;
-
-  /* if addr already exist then fail */
-  if (l2_find(l2tbl, addr, &gate_idx_tmp) == 0) {
+static int l2_add_entry(l2_table_t *l2tbl, mac_addr_t addr, gate_idx_t gate) {
+  if (l2tbl->Get(&addr)) {
     return -EEXIST;
   }
 
-  /* find slots to put entry */
-  if (l2_find_slot(l2tbl, addr, &index, &bucket) != 0) {
-    return -ENOMEM;
-  }
-
-  /* insert entry into empty slot */
-  offset = l2_ib_to_offset(l2tbl, index, bucket);
-
-  l2tbl->table[offset].addr = addr;
-  l2tbl->table[offset].gate = gate;
-  l2tbl->table[offset].occupied = 1;
-  l2tbl->count++;
-  return 0;
+  return std::min(l2tbl->Set(&addr, &gate), 0);
 }
 
-static int l2_del_entry(struct l2_table *l2tbl, uint64_t addr) {
-  uint32_t offset = 0xFFFFFFFF;
-
-  if (l2_find_offset(l2tbl, addr, &offset)) {
-    return -ENOENT;
-  }
-
-  l2tbl->table[offset].addr = 0;
-  l2tbl->table[offset].gate = 0;
-  l2tbl->table[offset].occupied = 0;
-  l2tbl->count--;
-  return 0;
+static int l2_del_entry(l2_table_t *l2tbl, mac_addr_t addr) {
+  return l2tbl->Del(&addr);
 }
 
-static int l2_flush(struct l2_table *l2tbl) {
-  if (nullptr == l2tbl || nullptr == l2tbl->table) {
-    return -EINVAL;
-  }
-
-  memset(l2tbl->table, 0,
-         sizeof(struct l2_entry) * l2tbl->size * l2tbl->bucket);
-
-  return 0;
-}
-
-static uint64_t l2_addr_to_u64(char *addr) {
+static mac_addr_t l2_addr_to_u64(char *addr) {
   uint64_t *addrp = (uint64_t *)addr;
 
   return (*addrp & 0x0000FFffFFffFFfflu);
 }
 
-/******************************************************************************/
-// TODO(barath): Move this test code elsewhere.
-
-#include <limits.h>
-#include <stdint.h>
-#include <stdio.h>
-#include <stdlib.h>
-
-static void l2_forward_init_test() {
-  int ret;
-  struct l2_table l2tbl;
-
-  ret = l2_init(&l2tbl, 0, 0);
-  assert(ret < 0);
-
-  ret = l2_init(&l2tbl, 4, 0);
-  assert(ret < 0);
-
-  ret = l2_init(&l2tbl, 0, 2);
-  assert(ret < 0);
-
-  ret = l2_init(&l2tbl, 4, 2);
-  assert(!ret);
-  ret = l2_deinit(&l2tbl);
-  assert(!ret);
-
-  ret = l2_init(&l2tbl, 4, 4);
-  assert(!ret);
-  ret = l2_deinit(&l2tbl);
-  assert(!ret);
-
-  ret = l2_init(&l2tbl, 4, 8);
-  assert(ret < 0);
-
-  ret = l2_init(&l2tbl, 6, 4);
-  assert(ret < 0);
-
-  ret = l2_init(&l2tbl, 2 << 10, 2);
-  assert(!ret);
-  ret = l2_deinit(&l2tbl);
-  assert(!ret);
-
-  ret = l2_init(&l2tbl, 2 << 10, 3);
-  assert(ret < 0);
-}
-
-static void l2_forward_entry_test() {
-  int ret;
-  struct l2_table l2tbl;
-
-  uint64_t addr1 = 0x0123456701234567;
-  uint64_t addr2 = 0x9876543210987654;
-  uint16_t index1 = 0x0123;
-  uint16_t gate_index = -1;
-
-  ret = l2_init(&l2tbl, 4, 4);
-  assert(!ret);
-
-  ret = l2_add_entry(&l2tbl, addr1, index1);
-  LOG(INFO) << "add entry: " << addr1 << ", index: " << index1;
-  assert(!ret);
-
-  ret = l2_find(&l2tbl, addr1, &gate_index);
-  LOG(INFO) << "find entry: " << addr1 << ", index: " << gate_index;
-  assert(!ret);
-  assert(index1 == gate_index);
-
-  ret = l2_find(&l2tbl, addr2, &gate_index);
-  assert(ret < 0);
-
-  ret = l2_del_entry(&l2tbl, addr1);
-  assert(!ret);
-
-  ret = l2_del_entry(&l2tbl, addr2);
-  assert(ret < 0);
-
-  ret = l2_find(&l2tbl, addr1, &gate_index);
-  assert(ret < 0);
-
-  ret = l2_deinit(&l2tbl);
-  assert(!ret);
-}
-
-static void l2_forward_flush_test() {
-  int ret;
-  struct l2_table l2tbl;
-
-  uint64_t addr1 = 0x0123456701234567;
-  uint16_t index1 = 0x0123;
-  uint16_t gate_index;
-
-  ret = l2_init(&l2tbl, 4, 4);
-  assert(!ret);
-
-  ret = l2_add_entry(&l2tbl, addr1, index1);
-  assert(!ret);
-
-  ret = l2_flush(&l2tbl);
-  assert(!ret);
-
-  ret = l2_find(&l2tbl, addr1, &gate_index);
-  assert(ret < 0);
-
-  ret = l2_deinit(&l2tbl);
-  assert(!ret);
-}
-
-static void l2_forward_collision_test() {
-  const int h_size = 4;
-  const int b_size = 4;
-  const int max_hb_cnt = h_size * b_size;
-
-  int ret;
-  int i;
-  struct l2_table l2tbl;
-
-  uint64_t addr[max_hb_cnt];
-  uint16_t idx[max_hb_cnt];
-  int success[max_hb_cnt];
-  uint32_t offset;
-
-  ret = l2_init(&l2tbl, h_size, b_size);
-  assert(!ret);
-
-  /* collision happens */
-  for (i = 0; i < max_hb_cnt; i++) {
-    addr[i] = random() % ULONG_MAX;
-    idx[i] = random() % USHRT_MAX;
-
-    ret = l2_add_entry(&l2tbl, addr[i], idx[i]);
-    LOG(INFO) << "insert result: " << addr[i] << " " << idx[i] << " " << ret;
-    success[i] = (ret >= 0);
-  }
-
-  /* collision happens */
-  for (i = 0; i < max_hb_cnt; i++) {
-    uint16_t gate_index;
-    gate_index = 0;
-    offset = 0;
-
-    ret = l2_find(&l2tbl, addr[i], &gate_index);
-
-    LOG(INFO) << "find result: " << addr[i] << " " << gate_index << " "
-              << offset;
-
-    if (success[i]) {
-      assert(!ret);
-      assert(idx[i] == gate_index);
-    } else {
-      assert(ret);
-    }
-  }
-
-  ret = l2_deinit(&l2tbl);
-  assert(!ret);
-}
-
-int test_all() {
-  l2_forward_init_test();
-  l2_forward_entry_test();
-  l2_forward_flush_test();
-  l2_forward_collision_test();
-
-  return 0;
-}
-
 static int parse_mac_addr(const char *str, char *addr) {
   if (str != nullptr && addr != nullptr) {
     int r = sscanf(str, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx", addr, addr + 1,
@@ -581,20 +159,26 @@ pb_error_t L2Forward::Init(const google::protobuf::Any &arg_) {
 }
 
 void L2Forward::Deinit() {
-  l2_deinit(&l2_table_);
+  l2_table_.Close();
 }
 
 void L2Forward::ProcessBatch(struct pkt_batch *batch) {
   gate_idx_t default_gate = ACCESS_ONCE(default_gate_);
   gate_idx_t out_gates[MAX_PKT_BURST];
+  mac_addr_t addrs[MAX_PKT_BURST];
+  gate_idx_t *gates[MAX_PKT_BURST];
+  int cnt = batch->cnt;
 
-  for (int i = 0; i < batch->cnt; i++) {
+  for (int i = 0; i < cnt; i++) {
     struct snbuf *snb = batch->pkts[i];
 
-    out_gates[i] = default_gate;
+    addrs[i] = l2_addr_to_u64(static_cast<char *>(snb_head_data(snb)));
+  }
+
+  l2_table_.GetBulk(addrs, cnt, gates);
 
-    l2_find(&l2_table_, l2_addr_to_u64(static_cast<char *>(snb_head_data(snb))),
-            &out_gates[i]);
+  for (int i = 0; i < cnt; i++) {
+    out_gates[i] = gates[i] ? *gates[i] : default_gate;
   }
 
   RunSplit(out_gates, batch);
@@ -1,26 +1,24 @@
 #ifndef BESS_MODULES_L2FORWARD_H_
 #define BESS_MODULES_L2FORWARD_H_
 
+#include <rte_config.h>
+#include <rte_hash_crc.h>
+
 #include "../module.h"
+#include "../utils/htable.h"
 
-struct l2_entry {
-  union {
-    struct {
-      uint64_t addr : 48;
-      uint64_t gate : 15;
-      uint64_t occupied : 1;
-    };
-    uint64_t entry;
-  };
-};
+typedef uint64_t mac_addr_t;
 
-struct l2_table {
-  struct l2_entry *table;
-  uint64_t size;
-  uint64_t size_power;
-  uint64_t bucket;
-  uint64_t count;
-};
+inline int l2_keycmp(const void *key, const void *key_stored, size_t) {
+  return *(const mac_addr_t *)key != *(const mac_addr_t *)key_stored;
+}
+
+inline uint32_t l2_hash(const void *key, uint32_t, uint32_t init_val) {
+  return rte_hash_crc_8byte(*(const mac_addr_t *)key, init_val);
+}
+
+/* MAC addresses and gates are small enough to be stored in the buckets */
+typedef HTable<mac_addr_t, gate_idx_t, l2_keycmp, l2_hash> l2_table_t;
 
 class L2Forward : public Module {
  public:
@@ -56,7 +54,7 @@ class L2Forward : public Module {
   static const PbCommands<Module> pb_cmds;
 
  private:
-  struct l2_table l2_table_ = {};
+  l2_table_t l2_table_;
   gate_idx_t default_gate_ = {};
 };
 
@@ -1,57 +1,1106 @@
 #include <arpa/inet.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
 #include <rte_byteorder.h>
 #include <rte_config.h>
 #include <rte_errno.h>
 #include <rte_ether.h>
 #include <rte_ip.h>
-#include <rte_tcp.h>
-#include <rte_udp.h>
 #include <rte_lpm.h>
 
-#include "../packetstore/packetstore.h"
 #include "netplay.h"
 
-const Commands<Module> NetPlay::cmds = { };
-const PbCommands<Module> NetPlay::pb_cmds = { };
+#include <pcap.h>
+#include <sys/mman.h>
+
+#include "../utils/time.h"
+#include "bpf.h"
+
+/* Offset of the IP total length field within a stored header */
+#define NETPLAY_IP_LEN_OFFSET \
+  (sizeof(struct ether_hdr) + offsetof(struct ipv4_hdr, total_length))
+
+static_assert(MAX_PKT_BURST <= netplay::header_batch::MAX_BATCH,
+              "header batch must hold a full packet batch");
+static_assert(netplay::header_batch::MAX_HDR_LEN <= NetPlay::kMaxHeaderSize,
+              "stored headers must fit in query results");
+
+const Commands<Module> NetPlay::cmds = {
+    {"add_stream", MODULE_FUNC &NetPlay::CommandAddStream, 0},
+    {"aggregate", MODULE_FUNC &NetPlay::CommandAggregate, 1},
+    {"export", MODULE_FUNC &NetPlay::CommandExport, 1},
+    {"flows", MODULE_FUNC &NetPlay::CommandFlows, 1},
+    {"query", MODULE_FUNC &NetPlay::CommandQuery, 1},
+    {"replay", MODULE_FUNC &NetPlay::CommandReplay, 0},
+};
+
+const PbCommands<Module> NetPlay::pb_cmds = {
+    {"add_stream", PB_MODULE_FUNC &NetPlay::CommandAddStream, 0},
+    {"aggregate", PB_MODULE_FUNC &NetPlay::CommandAggregate, 1},
+    {"export", PB_MODULE_FUNC &NetPlay::CommandExport, 1},
+    {"flows", PB_MODULE_FUNC &NetPlay::CommandFlows, 1},
+    {"query", PB_MODULE_FUNC &NetPlay::CommandQuery, 1},
+    {"replay", PB_MODULE_FUNC &NetPlay::CommandReplay, 0},
+};
+
+/* Converts "a.b.c.d" with the given prefix length into an inclusive range of
+ * host-order addresses. Returns 0 on success, -EINVAL otherwise. */
+static int parse_ip_prefix(const char *str, uint64_t prefix_len, uint32_t *beg,
+                           uint32_t *end) {
+  struct in_addr addr_be;
+
+  if (prefix_len == 0) {
+    prefix_len = 32;
+  }
+
+  if (prefix_len > 32 || inet_pton(AF_INET, str, &addr_be) != 1) {
+    return -EINVAL;
+  }
+
+  uint32_t mask = ~((uint32_t)(((uint64_t)1 << (32 - prefix_len)) - 1));
+  *beg = rte_be_to_cpu_32(addr_be.s_addr) & mask;
+  *end = *beg | ~mask;
+  return 0;
+}
+
+/* Current time on the clock workers see through ctx.current_ns() */
+static uint64_t worker_clock_ns() {
+  return rdtsc() * (1e9 / tsc_hz);
+}
+
+/* Length on the wire of a packet of which 'len' header bytes are stored */
+static uint32_t wire_len(const unsigned char *hdr, uint32_t len) {
+  if (len < NETPLAY_IP_LEN_OFFSET + sizeof(uint16_t) ||
+      ((hdr[12] << 8) | hdr[13]) != ETHER_TYPE_IPv4) {
+    return len;
+  }
+  uint16_t ip_len = (hdr[NETPLAY_IP_LEN_OFFSET] << 8) |
+                    hdr[NETPLAY_IP_LEN_OFFSET + 1];
+  return std::max<uint32_t>(len, sizeof(struct ether_hdr) + ip_len);
+}
+
+NetPlay::NetPlay()
+    : hugepages_(true),
+      store_(),
+      clock_offset_ns_(),
+      stop_checkpoints_(),
+      columns_(),
+      flows_(),
+      replay_(),
+      replay_next_(),
+      replay_timed_(),
+      replay_start_ns_(),
+      replay_base_ns_(),
+      handles_() {}
+
+void NetPlay::CreateStore(bool sharded) {
+  store_ = new netplay::sharded_packet_store(sharded ? MAX_WORKERS : 1);
+  for (int wid = 0; wid < MAX_WORKERS; wid++) {
+    handles_[wid] = store_->get_handle(sharded ? wid : 0);
+  }
+}
+
+const char *NetPlay::OpenStore(const std::string &dir,
+                               uint64_t checkpoint_ns) {
+  try {
+    if (!store_->open(dir)) {
+      return "'dir' cannot be combined with 'columns', 'compress' or "
+             "'max_flows', and must hold a store with the same 'sharded' "
+             "and retention";
+    }
+  } catch (const slog::segment_exception &) {
+    return "'dir' holds a segment that cannot be mapped";
+  }
+
+  uint64_t now_ns = worker_clock_ns();
+  uint64_t end_ns = store_->insert_end_ns();
+  clock_offset_ns_ = end_ns > now_ns ? end_ns - now_ns : 0;
+
+  if (checkpoint_ns == 0) {
+    checkpoint_ns = kDefaultCheckpointNs;
+  }
+  checkpointer_ = std::thread([this, checkpoint_ns] {
+    std::unique_lock<std::mutex> lock(checkpoint_mutex_);
+    while (!checkpoint_cv_.wait_for(lock,
+                                    std::chrono::nanoseconds(checkpoint_ns),
+                                    [this] { return stop_checkpoints_; })) {
+      store_->checkpoint();
+    }
+  });
+  return nullptr;
+}
+
+uint64_t NetPlay::StoreClockNs() const {
+  return worker_clock_ns() + clock_offset_ns_;
+}
+
+pb_error_t NetPlay::Init(const google::protobuf::Any &arg_) {
+  bess::pb::NetPlayArg arg;
+  arg_.UnpackTo(&arg);
+
+  CreateStore(arg.sharded());
+
+  if (!store_->set_retention(arg.max_bytes(), arg.max_age_ns())) {
+    return pb_error(EINVAL, "'max_bytes' must be at most %lu",
+                    slog::log_store::MAX_RETAINED_BYTES);
+  }
+
+  if (arg.hugepages()) {
+    store_->set_allocator(&hugepages_);
+  }
+
+  if (arg.columns()) {
+    columns_ = store_->enable_columns();
+  }
+
+  if (arg.compress()) {
+    store_->enable_compression();
+  }
+
+  if (arg.max_flows() > UINT32_MAX) {
+    return pb_error(EINVAL, "'max_flows' must be at most %u", UINT32_MAX);
+  }
+  if (arg.max_flows()) {
+    flows_ = store_->enable_flows(arg.max_flows());
+  }
+
+  if (!arg.dir().empty()) {
+    const char *err = arg.hugepages()
+                          ? "'dir' cannot be combined with 'hugepages'"
+                          : OpenStore(arg.dir(), arg.checkpoint_ns());
+    if (err) {
+      return pb_error(EINVAL, "%s", err);
+    }
+  }
+
+  if (arg.replay()) {
+    if (RegisterTask(nullptr) == INVALID_TASK_ID) {
+      return pb_error(ENOMEM, "Task creation failed");
+    }
+    replay_ = true;
+  }
+
+  return pb_errno(0);
+}
+
+struct snobj *NetPlay::Init(struct snobj *arg) {
+  CreateStore(snobj_eval_int(arg, "sharded"));
+
+  if (!store_->set_retention(snobj_eval_uint(arg, "max_bytes"),
+                             snobj_eval_uint(arg, "max_age_ns"))) {
+    return snobj_err(EINVAL, "'max_bytes' must be at most %lu",
+                     slog::log_store::MAX_RETAINED_BYTES);
+  }
+
+  if (snobj_eval_int(arg, "hugepages")) {
+    store_->set_allocator(&hugepages_);
+  }
+
+  if (snobj_eval_int(arg, "columns")) {
+    columns_ = store_->enable_columns();
+  }
+
+  if (snobj_eval_int(arg, "compress")) {
+    store_->enable_compression();
+  }
+
+  uint64_t max_flows = snobj_eval_uint(arg, "max_flows");
+  if (max_flows > UINT32_MAX) {
+    return snobj_err(EINVAL, "'max_flows' must be at most %u", UINT32_MAX);
+  }
+  if (max_flows) {
+    flows_ = store_->enable_flows(max_flows);
+  }
+
+  const char *dir = snobj_eval_str(arg, "dir");
+  if (dir && dir[0]) {
+    const char *err = snobj_eval_int(arg, "hugepages")
+                          ? "'dir' cannot be combined with 'hugepages'"
+                          : OpenStore(dir, snobj_eval_uint(arg,
+                                                           "checkpoint_ns"));
+    if (err) {
+      return snobj_err(EINVAL, "%s", err);
+    }
+  }
+
+  if (snobj_eval_int(arg, "replay")) {
+    if (RegisterTask(nullptr) == INVALID_TASK_ID) {
+      return snobj_err(ENOMEM, "Task creation failed");
+    }
+    replay_ = true;
+  }
+
+  return nullptr;
+}
+
+void NetPlay::Deinit() {
+  /* A last checkpoint covers all packets inserted */
+  if (checkpointer_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(checkpoint_mutex_);
+      stop_checkpoints_ = true;
+    }
+    checkpoint_cv_.notify_one();
+    checkpointer_.join();
+    store_->checkpoint();
+  }
+
+  for (int wid = 0; wid < MAX_WORKERS; wid++) {
+    delete handles_[wid];
+  }
+  delete store_;
+
+  for (const Stream &stream : streams_) {
+    munmap(reinterpret_cast<void *>(stream.func), stream.mmap_size);
+  }
+  streams_.clear();
+}
+
+uint64_t NetPlay::AddStream(const char *exp) {
+  struct bpf_program il_code;
+  Stream stream;
+
+  /* Filters see stored headers, which start with the Ethernet header */
+  if (pcap_compile_nopcap(0xffff, DLT_EN10MB, &il_code, exp, 1,
+                          PCAP_NETMASK_UNKNOWN) == -1) {
+    return 0;
+  }
+  stream.func =
+      bpf_jit_compile(il_code.bf_insns, il_code.bf_len, &stream.mmap_size);
+  pcap_freecode(&il_code);
+  if (!stream.func) {
+    return 0;
+  }
 
-NetPlay::NetPlay() {
-  handle_ = store_.get_handle();
+  streams_.push_back(stream);
+  return store_->add_stream(stream.func) + 1;
 }
 
 void NetPlay::ProcessBatch(struct pkt_batch *batch) {
   int cnt = batch->cnt;
+  uint64_t now_ns = ctx.current_ns() + clock_offset_ns_;
+
+  const unsigned char *pkts[MAX_PKT_BURST];
+  uint16_t pkt_lens[MAX_PKT_BURST];
+  netplay::header_batch hdrs;
 
   for (int i = 0; i < cnt; i++) {
-    slog::token_list tokens;
-    uint32_t num_bytes = 0;
+    pkts[i] = (const unsigned char *) snb_head_data(batch->pkts[i]);
+    pkt_lens[i] = snb_head_len(batch->pkts[i]);
+  }
 
-    void* pkt = snb_head_data(batch->pkts[i]);
-    struct ether_hdr *eth = (struct ether_hdr *) pkt;
-    num_bytes += sizeof(struct ether_hdr);
+  if (cnt > 0) {
+    /* Addresses and ports are extracted in host byte order, so that prefixes
+     * and port ranges map to contiguous token ranges */
+    netplay::header_parser::parse(pkts, pkt_lens, cnt, hdrs);
+    netplay::sharded_packet_store::handle *handle = handles_[ctx.wid()];
+    handle->insert_packets(pkts, hdrs, cnt, now_ns);
+    handle->expire(now_ns);
+  }
 
-    struct ipv4_hdr *ip = (struct ipv4_hdr *) (eth + 1);
-    num_bytes += sizeof(struct ipv4_hdr);
+  RunNextModule(batch);
+}
 
-    handle_->add_src_ip(tokens, ip->src_addr);
-    handle_->add_dst_ip(tokens, ip->dst_addr);
-    if (ip->next_proto_id == IPPROTO_TCP) {
-      struct tcp_hdr *tcp = (struct tcp_hdr *) (ip + 1);
-      num_bytes += sizeof(struct tcp_hdr);
+struct task_result NetPlay::RunTask(void *) {
+  struct pkt_batch batch;
+  uint64_t total_bytes = 0;
+  const int pkt_overhead = 24;
 
-      handle_->add_src_port(tokens, tcp->src_port);
-      handle_->add_dst_port(tokens, tcp->dst_port);
-    } else if (ip->next_proto_id == IPPROTO_UDP) {
-      struct udp_hdr *udp = (struct udp_hdr *) (ip + 1);
-      num_bytes += sizeof(struct udp_hdr);
+  batch_clear(&batch);
+  uint64_t now_ns = worker_clock_ns();
+  while (batch.cnt < MAX_PKT_BURST && replay_next_ < replay_ids_.size()) {
+    unsigned char hdr[kMaxHeaderSize];
+    uint32_t len;
+    uint64_t time_ns;
+    if (!store_->read(hdr, replay_ids_[replay_next_], len, time_ns)) {
+      replay_next_++; /* dropped since the replay started */
+      continue;
+    }
+
+    /* Timed replays hold packets back until as much time has passed since
+     * the first one as had when they were inserted */
+    if (replay_timed_) {
+      if (replay_start_ns_ == 0) {
+        replay_start_ns_ = now_ns;
+        replay_base_ns_ = time_ns;
+      }
+      if (time_ns > replay_base_ns_ &&
+          time_ns - replay_base_ns_ > now_ns - replay_start_ns_) {
+        break;
+      }
+    }
 
-      handle_->add_src_port(tokens, udp->src_port);
-      handle_->add_dst_port(tokens, udp->dst_port);
+    struct snbuf *pkt = snb_alloc();
+    if (!pkt) {
+      break;
+    }
+    void *data = snb_append(pkt, len);
+    if (!data) {
+      snb_free(pkt);
+      replay_next_++;
+      continue;
     }
-    handle_->insert((unsigned char*) pkt, num_bytes, tokens);
+    memcpy(data, hdr, len);
+    batch_add(&batch, pkt);
+    total_bytes += len;
+    replay_next_++;
   }
-  RunNextModule(batch);
+
+  if (batch.cnt > 0) {
+    RunChooseModule(kReplayGate, &batch);
+  }
+
+  return (struct task_result){
+      .packets = static_cast<uint64_t>(batch.cnt),
+      .bits = (total_bytes + batch.cnt * pkt_overhead) * 8,
+  };
 }
 
-ADD_MODULE(NetPlay, "netplay", "Indexes packet header data")
+/* Filter arguments of the query and aggregate commands */
+static NetPlay::FilterArgs ParseFilterArgs(struct snobj *arg) {
+  NetPlay::FilterArgs filter;
+  const char *src_ip = snobj_eval_str(arg, "src_ip");
+  const char *dst_ip = snobj_eval_str(arg, "dst_ip");
+  filter.src_ip = src_ip ? src_ip : "";
+  filter.src_ip_prefix_len = snobj_eval_uint(arg, "src_ip_prefix_len");
+  filter.dst_ip = dst_ip ? dst_ip : "";
+  filter.dst_ip_prefix_len = snobj_eval_uint(arg, "dst_ip_prefix_len");
+  filter.src_port = snobj_eval_uint(arg, "src_port");
+  filter.dst_port = snobj_eval_uint(arg, "dst_port");
+  filter.proto = snobj_eval_uint(arg, "proto");
+  filter.time_beg_ns = snobj_eval_uint(arg, "time_beg_ns");
+  filter.time_end_ns = snobj_eval_uint(arg, "time_end_ns");
+  filter.stream = snobj_eval_uint(arg, "stream");
+  filter.min_ttl = snobj_eval_uint(arg, "min_ttl");
+  filter.max_ttl = snobj_eval_uint(arg, "max_ttl");
+  filter.min_ip_len = snobj_eval_uint(arg, "min_ip_len");
+  filter.max_ip_len = snobj_eval_uint(arg, "max_ip_len");
+  filter.tcp_flags = snobj_eval_uint(arg, "tcp_flags");
+  filter.tcp_flags_mask = snobj_eval_uint(arg, "tcp_flags_mask");
+  filter.flow = snobj_eval_int(arg, "flow");
+  return filter;
+}
+
+template <typename T>
+static NetPlay::FilterArgs ParseFilterArgs(const T &arg) {
+  NetPlay::FilterArgs filter;
+  filter.src_ip = arg.src_ip();
+  filter.src_ip_prefix_len = arg.src_ip_prefix_len();
+  filter.dst_ip = arg.dst_ip();
+  filter.dst_ip_prefix_len = arg.dst_ip_prefix_len();
+  filter.src_port = arg.src_port();
+  filter.dst_port = arg.dst_port();
+  filter.proto = arg.proto();
+  filter.time_beg_ns = arg.time_beg_ns();
+  filter.time_end_ns = arg.time_end_ns();
+  filter.stream = arg.stream();
+  filter.min_ttl = arg.min_ttl();
+  filter.max_ttl = arg.max_ttl();
+  filter.min_ip_len = arg.min_ip_len();
+  filter.max_ip_len = arg.max_ip_len();
+  filter.tcp_flags = arg.tcp_flags();
+  filter.tcp_flags_mask = arg.tcp_flags_mask();
+  filter.flow = arg.flow();
+  return filter;
+}
+
+static uint32_t StreamOf(const NetPlay::FilterArgs &filter) {
+  return filter.stream ? filter.stream - 1
+                       : netplay::sharded_packet_store::NO_STREAM;
+}
+
+static netplay::sharded_packet_store::time_window WindowOf(
+    const NetPlay::FilterArgs &filter) {
+  return netplay::sharded_packet_store::time_window(filter.time_beg_ns,
+                                                    filter.time_end_ns);
+}
+
+static const netplay::flow_key *FlowOf(const NetPlay::FilterArgs &filter) {
+  return filter.flow ? &filter.flow_key : nullptr;
+}
+
+/* Predicates on the header columns; 'proto' is one as well if the store
+ * keeps columns, which saves extracting each match */
+static netplay::column_store::conjunction ColumnsOf(
+    const NetPlay::FilterArgs &filter, bool columns) {
+  typedef netplay::column_store::predicate predicate;
+  netplay::column_store::conjunction conj;
+  if (filter.min_ttl || filter.max_ttl) {
+    conj.push_back(predicate(netplay::column_store::TTL, filter.min_ttl,
+                             filter.max_ttl ? filter.max_ttl : UINT8_MAX));
+  }
+  if (filter.min_ip_len || filter.max_ip_len) {
+    conj.push_back(predicate(netplay::column_store::IP_LEN, filter.min_ip_len,
+                             filter.max_ip_len ? filter.max_ip_len
+                                               : UINT16_MAX));
+  }
+  if (filter.tcp_flags_mask) {
+    conj.push_back(predicate(netplay::column_store::TCP_FLAGS,
+                             filter.tcp_flags, filter.tcp_flags,
+                             filter.tcp_flags_mask));
+  }
+  if (columns && filter.proto && !filter.flow) {
+    conj.push_back(predicate(netplay::column_store::PROTO, filter.proto,
+                             filter.proto));
+  }
+  return conj;
+}
+
+const char *NetPlay::BuildQuery(FilterArgs *filter,
+                                slog::filter_query *query) {
+  query->assign(1, slog::filter_conjunction());
+  slog::filter_conjunction &conj = (*query)[0];
+  uint32_t beg;
+  uint32_t end;
+
+  if (!filter->src_ip.empty()) {
+    if (parse_ip_prefix(filter->src_ip.c_str(), filter->src_ip_prefix_len, &beg,
+                        &end)) {
+      return "invalid 'src_ip' prefix";
+    }
+    store_->filters().add_src_ip_filter(conj, beg, end);
+  }
+
+  if (!filter->dst_ip.empty()) {
+    if (parse_ip_prefix(filter->dst_ip.c_str(), filter->dst_ip_prefix_len, &beg,
+                        &end)) {
+      return "invalid 'dst_ip' prefix";
+    }
+    store_->filters().add_dst_ip_filter(conj, beg, end);
+  }
+
+  if (filter->src_port > UINT16_MAX || filter->dst_port > UINT16_MAX) {
+    return "ports must be 0-65535";
+  }
+
+  if (filter->proto > UINT8_MAX) {
+    return "'proto' must be 0-255";
+  }
+
+  if (filter->stream > store_->num_streams()) {
+    return "'stream' must be an id returned by add_stream";
+  }
+
+  if (filter->min_ttl || filter->max_ttl || filter->min_ip_len ||
+      filter->max_ip_len || filter->tcp_flags_mask) {
+    if (!columns_) {
+      return "ttl, ip_len and tcp_flags filters require the 'columns' option";
+    }
+    if (filter->min_ttl > UINT8_MAX || filter->max_ttl > UINT8_MAX) {
+      return "'min_ttl' and 'max_ttl' must be 0-255";
+    }
+    if (filter->min_ip_len > UINT16_MAX || filter->max_ip_len > UINT16_MAX) {
+      return "'min_ip_len' and 'max_ip_len' must be 0-65535";
+    }
+    if (filter->tcp_flags_mask > UINT8_MAX) {
+      return "'tcp_flags_mask' must be 0-255";
+    }
+    if ((filter->max_ttl && filter->min_ttl > filter->max_ttl) ||
+        (filter->max_ip_len && filter->min_ip_len > filter->max_ip_len)) {
+      return "minimums must not exceed maximums";
+    }
+    if (filter->tcp_flags & ~filter->tcp_flags_mask) {
+      return "'tcp_flags' must be within 'tcp_flags_mask'";
+    }
+  }
+
+  if (filter->src_port) {
+    store_->filters().add_src_port_filter(conj, filter->src_port,
+                                          filter->src_port);
+  }
+
+  if (filter->dst_port) {
+    store_->filters().add_dst_port_filter(conj, filter->dst_port,
+                                          filter->dst_port);
+  }
+
+  /* Time windows map to record id ranges through the time index of the
+   * store, rather than to index lookups */
+  if (!filter->time_end_ns) {
+    filter->time_end_ns = UINT64_MAX;
+  }
+  if (filter->time_beg_ns > filter->time_end_ns) {
+    return "'time_beg_ns' must not exceed 'time_end_ns'";
+  }
+
+  /* A connection is read off its chain in the flow index, instead of
+   * intersecting the posting lists of its addresses and ports */
+  if (filter->flow) {
+    if (!flows_) {
+      return "'flow' requires the 'max_flows' option";
+    }
+    uint32_t src_beg, src_end, dst_beg, dst_end;
+    if (filter->src_ip.empty() || filter->dst_ip.empty() ||
+        parse_ip_prefix(filter->src_ip.c_str(), filter->src_ip_prefix_len,
+                        &src_beg, &src_end) ||
+        parse_ip_prefix(filter->dst_ip.c_str(), filter->dst_ip_prefix_len,
+                        &dst_beg, &dst_end) ||
+        src_beg != src_end || dst_beg != dst_end || !filter->proto) {
+      return "'flow' requires full 'src_ip' and 'dst_ip' addresses and "
+             "'proto'";
+    }
+    filter->flow_key = netplay::flow_key(src_beg, dst_beg, filter->src_port,
+                                         filter->dst_port, filter->proto);
+    conj.clear();
+  }
+
+  if (conj.empty()) {
+    query->clear();
+  }
+
+  return nullptr;
+}
 
+const char *NetPlay::RunAggregate(slog::filter_query &query,
+                                  const FilterArgs &filter,
+                                  const std::string &group_by, uint64_t top_k,
+                                  bool by_bytes, AggregateResult *result) {
+  static const std::pair<const char *, netplay::aggregator::field> fields[] = {
+      {"", netplay::aggregator::NONE},
+      {"src_ip", netplay::aggregator::SRC_IP},
+      {"dst_ip", netplay::aggregator::DST_IP},
+      {"src_port", netplay::aggregator::SRC_PORT},
+      {"dst_port", netplay::aggregator::DST_PORT},
+      {"proto", netplay::aggregator::PROTO},
+  };
+
+  netplay::aggregator::field field = netplay::aggregator::NONE;
+  bool found = false;
+  for (const auto &f : fields) {
+    if (group_by == f.first) {
+      field = f.second;
+      found = true;
+    }
+  }
+  if (!found) {
+    return "'group_by' must be src_ip, dst_ip, src_port, dst_port or proto";
+  }
+
+  if (top_k == 0) {
+    top_k = kDefaultTopK;
+  } else if (top_k > kMaxTopK) {
+    return "'top_k' must be at most 65536";
+  }
+
+  /* Headers are read straight from the store, a batch at a time, and only
+   * the totals and top groups are returned */
+  netplay::aggregator agg(field, filter.proto);
+  store_->aggregate(agg, query, store_->snapshot(StoreClockNs()),
+                    StreamOf(filter), WindowOf(filter),
+                    ColumnsOf(filter, columns_), FlowOf(filter));
+
+  result->packets = agg.packets();
+  result->bytes = agg.bytes();
+  agg.top(result->groups, top_k, by_bytes);
+  return nullptr;
+}
+
+uint64_t NetPlay::Match(slog::filter_query &query, const FilterArgs &filter,
+                        uint64_t snapshot, uint64_t cursor, uint64_t limit,
+                        std::vector<uint64_t> *matches) {
+  /* Records below the low-water mark have been dropped by the retention
+   * policy; an empty query matches all others. 'proto' is checked on the
+   * stored headers, unless it is a column predicate or part of the flow. */
+  uint8_t proto = columns_ || filter.flow ? 0 : filter.proto;
+  return store_->filter(*matches, query, snapshot, StreamOf(filter),
+                        WindowOf(filter), ColumnsOf(filter, columns_),
+                        FlowOf(filter), proto, cursor, limit);
+}
+
+uint64_t NetPlay::Count(slog::filter_query &query, const FilterArgs &filter,
+                        uint64_t snapshot, uint64_t cursor) {
+  uint8_t proto = columns_ || filter.flow ? 0 : filter.proto;
+  return store_->count(query, snapshot, StreamOf(filter), WindowOf(filter),
+                       ColumnsOf(filter, columns_), FlowOf(filter), proto,
+                       cursor);
+}
+
+void NetPlay::RunQuery(slog::filter_query &query, const FilterArgs &filter,
+                       uint64_t snapshot, uint64_t cursor,
+                       uint64_t max_records, bool count_only,
+                       bool include_headers, QueryResult *result) {
+  /* Pin the query to a snapshot of the store, so that records inserted by
+   * the datapath while we run (or between pages) are never considered */
+  if (snapshot == 0) {
+    snapshot = store_->snapshot(StoreClockNs());
+  }
+
+  result->snapshot = snapshot;
+
+  /* Counts of queries without predicates are taken from the id ranges of
+   * the shards, without visiting the records */
+  if (count_only) {
+    result->next_cursor = 0;
+    result->count = Count(query, filter, snapshot, cursor);
+    return;
+  }
+
+  /* Each page resumes matching from its cursor, rather than matching the
+   * whole snapshot and skipping the earlier pages, and stops one match past
+   * the page */
+  result->next_cursor = Match(query, filter, snapshot, cursor, max_records,
+                              &result->record_ids);
+  result->count = result->record_ids.size();
+
+  if (!include_headers) {
+    return;
+  }
+  for (uint64_t id : result->record_ids) {
+    unsigned char hdr[kMaxHeaderSize];
+    uint32_t len = sizeof(hdr);
+    if (!store_->extract(hdr, id, 0, len)) {
+      len = 0;
+    }
+    result->headers.emplace_back(reinterpret_cast<char *>(hdr), len);
+  }
+}
+
+const char *NetPlay::RunFlows(uint64_t top_k, bool by_bytes,
+                              FlowsResult *result) {
+  if (!flows_) {
+    return "flows require the 'max_flows' option";
+  }
+
+  if (top_k == 0) {
+    top_k = kDefaultTopK;
+  } else if (top_k > kMaxTopK) {
+    return "'top_k' must be at most 65536";
+  }
+
+  std::vector<netplay::flow_summary> &flows = result->flows;
+  store_->flows(flows);
+  result->num_flows = flows.size();
+
+  auto larger = [by_bytes](const netplay::flow_summary &a,
+                           const netplay::flow_summary &b) {
+    return by_bytes ? a.bytes > b.bytes : a.packets > b.packets;
+  };
+  top_k = std::min<uint64_t>(top_k, flows.size());
+  std::partial_sort(flows.begin(), flows.begin() + top_k, flows.end(),
+                    larger);
+  flows.resize(top_k);
+  return nullptr;
+}
+
+int NetPlay::RunExport(slog::filter_query &query, const FilterArgs &filter,
+                       const std::string &path, ExportResult *result) {
+  uint64_t now_ns = StoreClockNs();
+  std::vector<uint64_t> matches;
+  Match(query, filter, store_->snapshot(now_ns), 0, UINT64_MAX, &matches);
+
+  /* Insertion times are on the store clock; pcap files are on the epoch */
+  uint64_t epoch_offset_ns = get_epoch_time() * 1e9 - now_ns;
+
+  netplay::pcap_writer writer;
+  int err = writer.open(path.c_str());
+  for (auto it = matches.begin(); !err && it != matches.end(); ++it) {
+    unsigned char hdr[kMaxHeaderSize];
+    uint32_t len;
+    uint64_t time_ns;
+    if (store_->read(hdr, *it, len, time_ns)) {
+      err = writer.add(hdr, len, wire_len(hdr, len), time_ns + epoch_offset_ns);
+    }
+  }
+  if (!err) {
+    err = writer.close();
+  }
+
+  result->packets = writer.num_records();
+  result->bytes = writer.num_bytes();
+  return err;
+}
+
+const char *NetPlay::StartReplay(slog::filter_query &query,
+                                 const FilterArgs &filter, bool timed,
+                                 uint64_t *num_packets) {
+  if (!replay_) {
+    return "replay requires the 'replay' option";
+  }
+
+  replay_ids_.clear();
+  Match(query, filter, store_->snapshot(StoreClockNs()), 0, UINT64_MAX,
+        &replay_ids_);
+  replay_next_ = 0;
+  replay_timed_ = timed;
+  replay_start_ns_ = 0;
+  replay_base_ns_ = 0;
+
+  *num_packets = replay_ids_.size();
+  return nullptr;
+}
+
+struct snobj *NetPlay::CommandAddStream(struct snobj *arg) {
+  const char *exp = snobj_eval_str(arg, "filter");
+  if (!exp) {
+    return snobj_err(EINVAL, "'filter' must be a string");
+  }
+
+  uint64_t stream = AddStream(exp);
+  if (!stream) {
+    return snobj_err(EINVAL, "BPF compilation error");
+  }
+
+  struct snobj *r = snobj_map();
+  snobj_map_set(r, "stream", snobj_uint(stream));
+  return r;
+}
+
+struct snobj *NetPlay::CommandAggregate(struct snobj *arg) {
+  FilterArgs filter = ParseFilterArgs(arg);
+  slog::filter_query query;
+  const char *err = BuildQuery(&filter, &query);
+  if (err) {
+    return snobj_err(EINVAL, "%s", err);
+  }
+
+  const char *group_by = snobj_eval_str(arg, "group_by");
+  AggregateResult result;
+  err = RunAggregate(query, filter, group_by ? group_by : "",
+                     snobj_eval_uint(arg, "top_k"),
+                     snobj_eval_int(arg, "by_bytes"), &result);
+  if (err) {
+    return snobj_err(EINVAL, "%s", err);
+  }
+
+  struct snobj *r = snobj_map();
+  snobj_map_set(r, "packets", snobj_uint(result.packets));
+  snobj_map_set(r, "bytes", snobj_uint(result.bytes));
+
+  struct snobj *groups = snobj_list();
+  for (const netplay::aggregate_group &g : result.groups) {
+    struct snobj *group = snobj_map();
+    snobj_map_set(group, "key", snobj_uint(g.key));
+    snobj_map_set(group, "packets", snobj_uint(g.packets));
+    snobj_map_set(group, "bytes", snobj_uint(g.bytes));
+    snobj_list_add(groups, group);
+  }
+  snobj_map_set(r, "groups", groups);
+
+  return r;
+}
+
+struct snobj *NetPlay::CommandExport(struct snobj *arg) {
+  FilterArgs filter = ParseFilterArgs(arg);
+  slog::filter_query query;
+  const char *err = BuildQuery(&filter, &query);
+  if (err) {
+    return snobj_err(EINVAL, "%s", err);
+  }
+
+  const char *path = snobj_eval_str(arg, "path");
+  if (!path) {
+    return snobj_err(EINVAL, "'path' must be a string");
+  }
+
+  ExportResult result;
+  int errnum = RunExport(query, filter, path, &result);
+  if (errnum) {
+    return snobj_err(errnum, "writing '%s' failed: %s", path,
+                     strerror(errnum));
+  }
+
+  struct snobj *r = snobj_map();
+  snobj_map_set(r, "packets", snobj_uint(result.packets));
+  snobj_map_set(r, "bytes", snobj_uint(result.bytes));
+  return r;
+}
+
+struct snobj *NetPlay::CommandFlows(struct snobj *arg) {
+  FlowsResult result;
+  const char *err = RunFlows(snobj_eval_uint(arg, "top_k"),
+                             snobj_eval_int(arg, "by_bytes"), &result);
+  if (err) {
+    return snobj_err(EINVAL, "%s", err);
+  }
+
+  struct snobj *r = snobj_map();
+  snobj_map_set(r, "num_flows", snobj_uint(result.num_flows));
+
+  struct snobj *flows = snobj_list();
+  for (const netplay::flow_summary &f : result.flows) {
+    struct snobj *flow = snobj_map();
+    snobj_map_set(flow, "ip_lo", snobj_uint(f.key.ip_lo));
+    snobj_map_set(flow, "port_lo", snobj_uint(f.key.port_lo));
+    snobj_map_set(flow, "ip_hi", snobj_uint(f.key.ip_hi));
+    snobj_map_set(flow, "port_hi", snobj_uint(f.key.port_hi));
+    snobj_map_set(flow, "proto", snobj_uint(f.key.proto));
+    snobj_map_set(flow, "packets", snobj_uint(f.packets));
+    snobj_map_set(flow, "bytes", snobj_uint(f.bytes));
+    snobj_map_set(flow, "first_ns", snobj_uint(f.first_ns));
+    snobj_map_set(flow, "last_ns", snobj_uint(f.last_ns));
+    snobj_list_add(flows, flow);
+  }
+  snobj_map_set(r, "flows", flows);
+
+  return r;
+}
+
+struct snobj *NetPlay::CommandQuery(struct snobj *arg) {
+  FilterArgs filter = ParseFilterArgs(arg);
+  slog::filter_query query;
+  const char *err = BuildQuery(&filter, &query);
+  if (err) {
+    return snobj_err(EINVAL, "%s", err);
+  }
+
+  uint64_t max_records = snobj_eval_uint(arg, "max_records");
+  if (max_records == 0) {
+    max_records = kDefaultPageSize;
+  } else if (max_records > kMaxPageSize) {
+    return snobj_err(EINVAL, "'max_records' must be 1-%lu", kMaxPageSize);
+  }
+
+  QueryResult result;
+  RunQuery(query, filter, snobj_eval_uint(arg, "snapshot"),
+           snobj_eval_uint(arg, "cursor"), max_records,
+           snobj_eval_int(arg, "count_only"),
+           snobj_eval_int(arg, "include_headers"), &result);
+
+  struct snobj *r = snobj_map();
+  snobj_map_set(r, "snapshot", snobj_uint(result.snapshot));
+  snobj_map_set(r, "count", snobj_uint(result.count));
+  snobj_map_set(r, "next_cursor", snobj_uint(result.next_cursor));
+
+  struct snobj *ids = snobj_list();
+  for (uint64_t id : result.record_ids) {
+    snobj_list_add(ids, snobj_uint(id));
+  }
+  snobj_map_set(r, "record_ids", ids);
+
+  if (!result.headers.empty()) {
+    struct snobj *headers = snobj_list();
+    for (const std::string &hdr : result.headers) {
+      snobj_list_add(headers, snobj_blob(hdr.data(), hdr.size()));
+    }
+    snobj_map_set(r, "headers", headers);
+  }
+
+  return r;
+}
+
+struct snobj *NetPlay::CommandReplay(struct snobj *arg) {
+  FilterArgs filter = ParseFilterArgs(arg);
+  slog::filter_query query;
+  const char *err = BuildQuery(&filter, &query);
+  if (err) {
+    return snobj_err(EINVAL, "%s", err);
+  }
+
+  uint64_t num_packets;
+  err = StartReplay(query, filter, snobj_eval_int(arg, "timed"),
+                    &num_packets);
+  if (err) {
+    return snobj_err(EINVAL, "%s", err);
+  }
+
+  struct snobj *r = snobj_map();
+  snobj_map_set(r, "packets", snobj_uint(num_packets));
+  return r;
+}
+
+bess::pb::ModuleCommandResponse NetPlay::CommandAddStream(
+    const google::protobuf::Any &arg_) {
+  bess::pb::NetPlayCommandAddStreamArg arg;
+  arg_.UnpackTo(&arg);
+
+  bess::pb::ModuleCommandResponse response;
+
+  uint64_t stream = AddStream(arg.filter().c_str());
+  if (!stream) {
+    set_cmd_response_error(&response,
+                           pb_error(EINVAL, "BPF compilation error"));
+    return response;
+  }
+
+  bess::pb::NetPlayCommandAddStreamResponse r;
+  r.set_stream(stream);
+
+  response.mutable_error()->set_err(0);
+  response.mutable_other()->PackFrom(r);
+  return response;
+}
+
+bess::pb::ModuleCommandResponse NetPlay::CommandAggregate(
+    const google::protobuf::Any &arg_) {
+  bess::pb::NetPlayCommandAggregateArg arg;
+  arg_.UnpackTo(&arg);
+
+  bess::pb::ModuleCommandResponse response;
+
+  FilterArgs filter = ParseFilterArgs(arg);
+  slog::filter_query query;
+  const char *err = BuildQuery(&filter, &query);
+  if (err) {
+    set_cmd_response_error(&response, pb_error(EINVAL, "%s", err));
+    return response;
+  }
+
+  AggregateResult result;
+  err = RunAggregate(query, filter, arg.group_by(), arg.top_k(),
+                     arg.by_bytes(), &result);
+  if (err) {
+    set_cmd_response_error(&response, pb_error(EINVAL, "%s", err));
+    return response;
+  }
+
+  bess::pb::NetPlayCommandAggregateResponse r;
+  r.set_packets(result.packets);
+  r.set_bytes(result.bytes);
+  for (const netplay::aggregate_group &g : result.groups) {
+    bess::pb::NetPlayCommandAggregateResponse::Group *group = r.add_groups();
+    group->set_key(g.key);
+    group->set_packets(g.packets);
+    group->set_bytes(g.bytes);
+  }
+
+  response.mutable_error()->set_err(0);
+  response.mutable_other()->PackFrom(r);
+  return response;
+}
+
+bess::pb::ModuleCommandResponse NetPlay::CommandExport(
+    const google::protobuf::Any &arg_) {
+  bess::pb::NetPlayCommandExportArg arg;
+  arg_.UnpackTo(&arg);
+
+  bess::pb::ModuleCommandResponse response;
+
+  FilterArgs filter = ParseFilterArgs(arg);
+  slog::filter_query query;
+  const char *err = BuildQuery(&filter, &query);
+  if (err) {
+    set_cmd_response_error(&response, pb_error(EINVAL, "%s", err));
+    return response;
+  }
+
+  ExportResult result;
+  int errnum = RunExport(query, filter, arg.path(), &result);
+  if (errnum) {
+    set_cmd_response_error(
+        &response, pb_error(errnum, "writing '%s' failed: %s",
+                            arg.path().c_str(), strerror(errnum)));
+    return response;
+  }
+
+  bess::pb::NetPlayCommandExportResponse r;
+  r.set_packets(result.packets);
+  r.set_bytes(result.bytes);
+
+  response.mutable_error()->set_err(0);
+  response.mutable_other()->PackFrom(r);
+  return response;
+}
+
+bess::pb::ModuleCommandResponse NetPlay::CommandFlows(
+    const google::protobuf::Any &arg_) {
+  bess::pb::NetPlayCommandFlowsArg arg;
+  arg_.UnpackTo(&arg);
+
+  bess::pb::ModuleCommandResponse response;
+
+  FlowsResult result;
+  const char *err = RunFlows(arg.top_k(), arg.by_bytes(), &result);
+  if (err) {
+    set_cmd_response_error(&response, pb_error(EINVAL, "%s", err));
+    return response;
+  }
+
+  bess::pb::NetPlayCommandFlowsResponse r;
+  r.set_num_flows(result.num_flows);
+  for (const netplay::flow_summary &f : result.flows) {
+    bess::pb::NetPlayCommandFlowsResponse::Flow *flow = r.add_flows();
+    flow->set_ip_lo(f.key.ip_lo);
+    flow->set_port_lo(f.key.port_lo);
+    flow->set_ip_hi(f.key.ip_hi);
+    flow->set_port_hi(f.key.port_hi);
+    flow->set_proto(f.key.proto);
+    flow->set_packets(f.packets);
+    flow->set_bytes(f.bytes);
+    flow->set_first_ns(f.first_ns);
+    flow->set_last_ns(f.last_ns);
+  }
+
+  response.mutable_error()->set_err(0);
+  response.mutable_other()->PackFrom(r);
+  return response;
+}
+
+bess::pb::ModuleCommandResponse NetPlay::CommandQuery(
+    const google::protobuf::Any &arg_) {
+  bess::pb::NetPlayCommandQueryArg arg;
+  arg_.UnpackTo(&arg);
+
+  bess::pb::ModuleCommandResponse response;
+
+  FilterArgs filter = ParseFilterArgs(arg);
+  slog::filter_query query;
+  const char *err = BuildQuery(&filter, &query);
+  if (err) {
+    set_cmd_response_error(&response, pb_error(EINVAL, "%s", err));
+    return response;
+  }
+
+  uint64_t max_records = arg.max_records();
+  if (max_records == 0) {
+    max_records = kDefaultPageSize;
+  } else if (max_records > kMaxPageSize) {
+    set_cmd_response_error(
+        &response,
+        pb_error(EINVAL, "'max_records' must be 1-%lu", kMaxPageSize));
+    return response;
+  }
+
+  QueryResult result;
+  RunQuery(query, filter, arg.snapshot(), arg.cursor(), max_records,
+           arg.count_only(), arg.include_headers(), &result);
+
+  bess::pb::NetPlayCommandQueryResponse r;
+  r.set_snapshot(result.snapshot);
+  r.set_count(result.count);
+  r.set_next_cursor(result.next_cursor);
+  for (uint64_t id : result.record_ids) {
+    r.add_record_ids(id);
+  }
+  for (const std::string &hdr : result.headers) {
+    r.add_headers(hdr);
+  }
+
+  response.mutable_error()->set_err(0);
+  response.mutable_other()->PackFrom(r);
+  return response;
+}
+
+bess::pb::ModuleCommandResponse NetPlay::CommandReplay(
+    const google::protobuf::Any &arg_) {
+  bess::pb::NetPlayCommandReplayArg arg;
+  arg_.UnpackTo(&arg);
+
+  bess::pb::ModuleCommandResponse response;
+
+  FilterArgs filter = ParseFilterArgs(arg);
+  slog::filter_query query;
+  const char *err = BuildQuery(&filter, &query);
+  if (err) {
+    set_cmd_response_error(&response, pb_error(EINVAL, "%s", err));
+    return response;
+  }
+
+  uint64_t num_packets;
+  err = StartReplay(query, filter, arg.timed(), &num_packets);
+  if (err) {
+    set_cmd_response_error(&response, pb_error(EINVAL, "%s", err));
+    return response;
+  }
+
+  bess::pb::NetPlayCommandReplayResponse r;
+  r.set_packets(num_packets);
+
+  response.mutable_error()->set_err(0);
+  response.mutable_other()->PackFrom(r);
+  return response;
+}
+
+ADD_MODULE(NetPlay, "netplay", "Indexes packet header data")
@@ -1,18 +1,231 @@
+#ifndef BESS_MODULES_NETPLAY_H_
+#define BESS_MODULES_NETPLAY_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "../module.h"
+#include "../packetstore/pcapwriter.h"
+#include "../packetstore/shardedstore.h"
+#include "../worker.h"
 
 class NetPlay : public Module {
  public:
   NetPlay();
 
+  virtual struct snobj *Init(struct snobj *arg);
+  virtual pb_error_t Init(const google::protobuf::Any &arg);
+  virtual void Deinit();
+
   virtual void ProcessBatch(struct pkt_batch *batch);
+  virtual struct task_result RunTask(void *arg);
+
+  struct snobj *CommandAddStream(struct snobj *arg);
+  struct snobj *CommandAggregate(struct snobj *arg);
+  struct snobj *CommandExport(struct snobj *arg);
+  struct snobj *CommandFlows(struct snobj *arg);
+  struct snobj *CommandQuery(struct snobj *arg);
+  struct snobj *CommandReplay(struct snobj *arg);
+  bess::pb::ModuleCommandResponse CommandAddStream(
+      const google::protobuf::Any &arg);
+  bess::pb::ModuleCommandResponse CommandAggregate(
+      const google::protobuf::Any &arg);
+  bess::pb::ModuleCommandResponse CommandExport(
+      const google::protobuf::Any &arg);
+  bess::pb::ModuleCommandResponse CommandFlows(
+      const google::protobuf::Any &arg);
+  bess::pb::ModuleCommandResponse CommandQuery(
+      const google::protobuf::Any &arg);
+  bess::pb::ModuleCommandResponse CommandReplay(
+      const google::protobuf::Any &arg);
+
+  /* Packet filter shared by the query and aggregate commands */
+  struct FilterArgs {
+    std::string src_ip; /* empty for any */
+    uint64_t src_ip_prefix_len;
+    std::string dst_ip;
+    uint64_t dst_ip_prefix_len;
+    uint64_t src_port;
+    uint64_t dst_port;
+    uint64_t proto;
+    uint64_t time_beg_ns; /* store clock; 0 for unbounded */
+    uint64_t time_end_ns; /* store clock; 0 (or UINT64_MAX) for unbounded */
+    uint64_t stream;      /* 1-based; 0 for none */
+    /* Filters on the header columns; a maximum of 0 is unbounded */
+    uint64_t min_ttl;
+    uint64_t max_ttl;
+    uint64_t min_ip_len;
+    uint64_t max_ip_len;
+    uint64_t tcp_flags; /* the bits of 'tcp_flags_mask' must equal these */
+    uint64_t tcp_flags_mask;
+    /* Match the connection given by the addresses, ports and 'proto', in
+     * both directions, through the flow index; set by BuildQuery() */
+    bool flow;
+    netplay::flow_key flow_key;
+  };
 
   static const gate_idx_t kNumIGates = 1;
-  static const gate_idx_t kNumOGates = 1;
+  /* Gate 0 passes packets through; gate 1 emits replayed packets */
+  static const gate_idx_t kNumOGates = 2;
+  static const gate_idx_t kReplayGate = 1;
+
+  /* Upper bound on the header bytes stored (and returned) per packet */
+  static const uint32_t kMaxHeaderSize = 138;
+
+  /* Time between checkpoints of a persisted store, unless given */
+  static const uint64_t kDefaultCheckpointNs = 1000000000;
+
+  /* Page size limits for query results */
+  static const uint64_t kDefaultPageSize = 1024;
+  static const uint64_t kMaxPageSize = 65536;
+
+  /* Number of groups returned by aggregates, and of flows by flows */
+  static const uint64_t kDefaultTopK = 10;
+  static const uint64_t kMaxTopK = 65536;
 
   static const Commands<Module> cmds;
   static const PbCommands<Module> pb_cmds;
 
  private:
-  netplay::packet_store::handle* handle_;
-  netplay::packet_store store_;
-};
\ No newline at end of file
+  /* A single page of query results */
+  struct QueryResult {
+    uint64_t snapshot;    /* number of records the query was evaluated over */
+    uint64_t count;       /* number of records in the page; with count_only,
+                             of matching records from the cursor on */
+    uint64_t next_cursor; /* cursor for the next page; 0 when done */
+    std::vector<uint64_t> record_ids;
+    std::vector<std::string> headers;
+  };
+
+  /* Totals and top groups of an aggregate */
+  struct AggregateResult {
+    uint64_t packets;
+    uint64_t bytes; /* sum of IP lengths */
+    std::vector<netplay::aggregate_group> groups;
+  };
+
+  /* Packets written by an export */
+  struct ExportResult {
+    uint64_t packets;
+    uint64_t bytes; /* pcap record bytes */
+  };
+
+  /* Largest flows in the flow index */
+  struct FlowsResult {
+    uint64_t num_flows; /* total number of flows */
+    std::vector<netplay::flow_summary> flows;
+  };
+
+  /* A stream of the packets matching a pcap-filter expression */
+  struct Stream {
+    slog::packet_filter_function func; /* JIT-compiled BPF program */
+    size_t mmap_size;                  /* needed for munmap() */
+  };
+
+  /* Creates the store, with one shard per worker if 'sharded' */
+  void CreateStore(bool sharded);
+
+  /* Persists the store in 'dir', restoring the packets of a checkpointed
+   * one, and checkpoints it every 'checkpoint_ns' (every second if 0) until
+   * Deinit(). Returns an error message, or nullptr. */
+  const char *OpenStore(const std::string &dir, uint64_t checkpoint_ns);
+
+  /* Current time on the clock packets are inserted on: the worker clock,
+   * shifted past the packets restored by OpenStore() */
+  uint64_t StoreClockNs() const;
+
+  /* Compiles 'exp' and adds a stream of the packets it matches to the store.
+   * Returns the (1-based) stream id, or 0 if 'exp' does not compile. */
+  uint64_t AddStream(const char *exp);
+
+  /* Validates 'filter' and builds its index query; the time window, 'proto',
+   * 'stream' and the header column filters are applied by the store.
+   * Returns an error message, or nullptr. */
+  const char *BuildQuery(FilterArgs *filter, slog::filter_query *query);
+
+  /* Aggregates the packets matching 'query' and 'filter' over a new snapshot
+   * of the store, grouped by 'group_by' (one of "src_ip", "dst_ip",
+   * "src_port", "dst_port", "proto", or empty for none), and returns the
+   * 'top_k' largest groups. Returns an error message, or nullptr. */
+  const char *RunAggregate(slog::filter_query &query, const FilterArgs &filter,
+                           const std::string &group_by, uint64_t top_k,
+                           bool by_bytes, AggregateResult *result);
+
+  /* Evaluates 'query' and 'filter' over a snapshot of the store, and
+   * returns the ids of the first 'limit' matching records from 'cursor' on
+   * (from the start if 0) in time order. Returns the cursor of the next
+   * page, or 0 if there are no more matches. */
+  uint64_t Match(slog::filter_query &query, const FilterArgs &filter,
+                 uint64_t snapshot, uint64_t cursor, uint64_t limit,
+                 std::vector<uint64_t> *matches);
+
+  /* Counts the records that Match() would return from 'cursor' on, without
+   * a limit. */
+  uint64_t Count(slog::filter_query &query, const FilterArgs &filter,
+                 uint64_t snapshot, uint64_t cursor);
+
+  /* Evaluates 'query' and 'filter' over a snapshot of the store (a new one
+   * if 'snapshot' is 0), and returns the matching record ids from 'cursor'
+   * on in time order, at most 'max_records' of them. */
+  void RunQuery(slog::filter_query &query, const FilterArgs &filter,
+                uint64_t snapshot, uint64_t cursor, uint64_t max_records,
+                bool count_only, bool include_headers, QueryResult *result);
+
+  /* Returns the 'top_k' largest flows in the flow index, by packets or
+   * bytes. Returns an error message, or nullptr. */
+  const char *RunFlows(uint64_t top_k, bool by_bytes, FlowsResult *result);
+
+  /* Writes the packets matching 'query' and 'filter' over a new snapshot
+   * of the store to a pcap file at 'path', with their insertion times.
+   * Returns an errno value, or 0. */
+  int RunExport(slog::filter_query &query, const FilterArgs &filter,
+                const std::string &path, ExportResult *result);
+
+  /* Queues the packets matching 'query' and 'filter' over a new snapshot
+   * of the store for RunTask() to send out of kReplayGate, replacing any
+   * replay in progress; as fast as possible, or 'timed' as they were
+   * inserted. Returns an error message, or nullptr. */
+  const char *StartReplay(slog::filter_query &query, const FilterArgs &filter,
+                          bool timed, uint64_t *num_packets);
+
+  /* Maps header storage from hugetlbfs pages, if enabled */
+  slog::page_allocator hugepages_;
+
+  netplay::sharded_packet_store *store_;
+
+  /* Offset of the store clock from the worker clock; restored packets were
+   * inserted on the clock of an earlier process */
+  uint64_t clock_offset_ns_;
+
+  /* Checkpoints a persisted store; see OpenStore() */
+  std::thread checkpointer_;
+  std::mutex checkpoint_mutex_;
+  std::condition_variable checkpoint_cv_;
+  bool stop_checkpoints_;
+
+  /* Whether the store keeps header columns */
+  bool columns_;
+
+  /* Whether the store indexes packets by flow */
+  bool flows_;
+
+  /* Whether RunTask() is registered to replay packets */
+  bool replay_;
+
+  /* Replay in progress; see StartReplay() */
+  std::vector<uint64_t> replay_ids_;
+  size_t replay_next_;
+  bool replay_timed_;
+  uint64_t replay_start_ns_; /* worker clock at the first packet */
+  uint64_t replay_base_ns_;  /* insertion time of the first packet */
+
+  std::vector<Stream> streams_;
+
+  /* Inserts the packets processed by each worker */
+  netplay::sharded_packet_store::handle *handles_[MAX_WORKERS];
+};
+
+#endif  // BESS_MODULES_NETPLAY_H_
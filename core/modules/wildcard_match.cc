@@ -1,7 +1,14 @@
 #include "wildcard_match.h"
 
+#include <algorithm>
+
+#include "../mem_alloc.h"
 #include "../utils/format.h"
 
+/* # of rules per word of the Bloom filter of a tuple, after it is rebuilt.
+ * It is rebuilt twice as large once the number doubles. */
+#define BLOOM_KEYS_PER_WORD 2
+
 /* k1 = k2 & mask */
 static void mask(void *k1, const void *k2, const void *mask, int key_size) {
   uint64_t *a = static_cast<uint64_t *>(k1);
@@ -30,6 +37,16 @@ static void mask(void *k1, const void *k2, const void *mask, int key_size) {
   }
 }
 
+/* The bits that a key with the hash value "hv" sets in its word of a Bloom
+ * filter. The word is hv & bloom_mask; the bits are taken from the high bits
+ * of a multiplicative hash, to be independent from it. */
+static inline uint64_t bloom_bits(uint32_t hv) {
+  uint64_t h = hv * 0x9e3779b97f4a7c15ull;
+
+  return (1ull << (h >> 58)) | (1ull << ((h >> 52) & 63)) |
+         (1ull << ((h >> 46) & 63));
+}
+
 // XXX: this is repeated in many modules. get rid of them when converting .h to
 // .hh, etc... it's in defined in some old header
 static inline int is_valid_gate(gate_idx_t gate) {
@@ -184,35 +201,10 @@ pb_error_t WildcardMatch::Init(const google::protobuf::Any &arg_) {
 void WildcardMatch::Deinit() {
   for (int i = 0; i < num_tuples_; i++) {
     tuples_[i].ht.Close();
+    mem_free(tuples_[i].bloom);
   }
 }
 
-gate_idx_t WildcardMatch::LookupEntry(wm_hkey_t *key, gate_idx_t def_gate) {
-  struct WmData result = {
-      .priority = INT_MIN, .ogate = def_gate,
-  };
-
-  const int key_size = total_key_size_;
-  const int num_tuples = num_tuples_;
-
-  wm_hkey_t key_masked;
-
-  for (int i = 0; i < num_tuples; i++) {
-    struct WmTuple *tuple = &tuples_[i];
-    struct WmData *cand;
-
-    mask(&key_masked, key, &tuple->mask, key_size);
-
-    cand = static_cast<struct WmData *>(tuple->ht.Get(&key_masked));
-
-    if (cand && cand->priority >= result.priority) {
-      result = *cand;
-    }
-  }
-
-  return result.ogate;
-}
-
 void WildcardMatch::ProcessBatch(struct pkt_batch *batch) {
   gate_idx_t default_gate;
   gate_idx_t out_gates[MAX_PKT_BURST];
@@ -249,42 +241,75 @@ void WildcardMatch::ProcessBatch(struct pkt_batch *batch) {
     }
   }
 
-#if 1
-  for (int i = 0; i < cnt; i++) {
-    out_gates[i] = LookupEntry((wm_hkey_t *)keys[i], default_gate);
-  }
-#else
-  /* A version with an outer loop for tuples and an inner loop for pkts.
-   * Significantly slower. */
-
-  int priorities[MAX_PKT_BURST];
+  /* Tuples are looked up one after another, each for all packets at once,
+   * so that the cache misses of the packets overlap within a tuple.
+   * A match is better than another if its priority is higher or, for the
+   * same priority, if its tuple was added later (has a higher index).
+   * Tuples are visited from the one with the best possible match (see
+   * SortTuples()), so a packet is looked up only in the tuples that may have
+   * a better match than the one it has so far. */
+  int64_t priorities[MAX_PKT_BURST];
+  int matched[MAX_PKT_BURST]; /* index of the tuple of the match, or -1 */
   const int key_size = total_key_size_;
 
   for (int i = 0; i < cnt; i++) {
-    priorities[i] = INT_MIN;
+    priorities[i] = INT64_MIN;
+    matched[i] = -1;
     out_gates[i] = default_gate;
   }
 
   for (int i = 0; i < num_tuples_; i++) {
-    const struct WmTuple *tuple = &tuples_[i];
-    const struct htable *ht = &tuple->ht;
-    const wm_hkey_t *tuple_mask = &tuple->mask;
+    const int t = tuple_order_[i];
+    struct WmTuple *tuple = &tuples_[t];
+    wm_hkey_t keys_masked[MAX_PKT_BURST];
+    uint32_t hashes[MAX_PKT_BURST];
+    struct WmData *cands[MAX_PKT_BURST];
+    int pkt_idx[MAX_PKT_BURST];
+    int n = 0;
+    bool beatable = false;
 
     for (int j = 0; j < cnt; j++) {
-      wm_hkey_t key_masked;
-      struct WmData *cand;
+      if (priorities[j] > tuple->max_priority ||
+          (priorities[j] == tuple->max_priority && matched[j] > t)) {
+        continue;
+      }
+      beatable = true;
+
+      mask(&keys_masked[n], keys[j], &tuple->mask, key_size);
+
+      /* the same hash value is used for the Bloom filter and the table */
+      uint32_t hv = tuple->ht.Hash(&keys_masked[n]);
+      uint64_t bits = bloom_bits(hv);
+      if ((tuple->bloom[hv & tuple->bloom_mask] & bits) == bits) {
+        hashes[n] = hv;
+        pkt_idx[n++] = j;
+      }
+    }
 
-      mask(&key_masked, keys[j], tuple_mask, key_size);
+    /* neither this nor any further tuple has a better match */
+    if (!beatable) {
+      break;
+    }
 
-      cand = ht->Get(&key_masked);
+    if (!n || !tuple->ht.GetBulkHash(hashes, keys_masked, n, cands)) {
+      continue;
+    }
 
-      if (cand && cand->priority >= priorities[j]) {
-        out_gates[j] = cand->ogate;
-        priorities[j] = cand->priority;
+    for (int k = 0; k < n; k++) {
+      int j = pkt_idx[k];
+
+      if (!cands[k]) {
+        continue;
+      }
+
+      if (cands[k]->priority > priorities[j] ||
+          (cands[k]->priority == priorities[j] && t > matched[j])) {
+        out_gates[j] = cands[k]->ogate;
+        priorities[j] = cands[k]->priority;
+        matched[j] = t;
       }
     }
   }
-#endif
 
   RunSplit(out_gates, batch);
 }
@@ -491,7 +516,7 @@ int WildcardMatch::AddTuple(wm_hkey_t *mask) {
     return -ENOSPC;
   }
 
-  tuple = &tuples_[num_tuples_++];
+  tuple = &tuples_[num_tuples_];
   memcpy(&tuple->mask, mask, sizeof(*mask));
 
   ret = tuple->ht.Init(total_key_size_, sizeof(struct WmData));
@@ -499,22 +524,54 @@ int WildcardMatch::AddTuple(wm_hkey_t *mask) {
     return ret;
   }
 
+  tuple->bloom = static_cast<uint64_t *>(mem_alloc(sizeof(uint64_t)));
+  if (!tuple->bloom) {
+    tuple->ht.Close();
+    return -ENOMEM;
+  }
+  tuple->bloom_mask = 0;
+  tuple->max_priority = INT64_MIN;
+
+  num_tuples_++;
+  SortTuples();
+
   return tuple - tuples_;
 }
 
 int WildcardMatch::AddEntry(struct WmTuple *tuple, wm_hkey_t *key,
                             struct WmData *data) {
-  int ret;
+  struct WmData *old = tuple->ht.Get(key);
+  bool lowered = old && old->priority == tuple->max_priority &&
+                 data->priority < old->priority;
 
-  ret = tuple->ht.Set(key, data);
+  int ret = tuple->ht.Set(key, data);
   if (ret < 0) {
     return ret;
   }
 
+  if (lowered) {
+    UpdateMaxPriority(tuple);
+  } else {
+    tuple->max_priority = std::max<int64_t>(tuple->max_priority,
+                                            data->priority);
+  }
+  SortTuples();
+
+  if (tuple->ht.Count() >
+      BLOOM_KEYS_PER_WORD * 2 * (int)(tuple->bloom_mask + 1)) {
+    BuildBloom(tuple);
+  } else {
+    uint32_t hv = tuple->ht.Hash(key);
+    tuple->bloom[hv & tuple->bloom_mask] |= bloom_bits(hv);
+  }
+
   return 0;
 }
 
 int WildcardMatch::DelEntry(struct WmTuple *tuple, wm_hkey_t *key) {
+  struct WmData *old = tuple->ht.Get(key);
+  bool was_max = old && old->priority == tuple->max_priority;
+
   int ret = tuple->ht.Del(key);
   if (ret) {
     return ret;
@@ -524,15 +581,86 @@ int WildcardMatch::DelEntry(struct WmTuple *tuple, wm_hkey_t *key) {
     int idx = tuple - tuples_;
 
     tuple->ht.Close();
+    mem_free(tuple->bloom);
 
     num_tuples_--;
     memmove(&tuples_[idx], &tuples_[idx + 1],
             sizeof(*tuple) * (num_tuples_ - idx));
+
+    /* the last tuple has moved; its old copy must not free its tables */
+    memset(&tuples_[num_tuples_], 0, sizeof(*tuple));
+  } else if (was_max) {
+    UpdateMaxPriority(tuple);
   }
+  SortTuples();
 
   return 0;
 }
 
+void WildcardMatch::ClearTuples() {
+  for (int i = 0; i < num_tuples_; i++) {
+    struct WmTuple *tuple = &tuples_[i];
+
+    tuple->ht.Clear();
+    tuple->max_priority = INT64_MIN;
+    memset(tuple->bloom, 0, sizeof(uint64_t) * (tuple->bloom_mask + 1));
+  }
+  SortTuples();
+}
+
+void WildcardMatch::UpdateMaxPriority(struct WmTuple *tuple) {
+  uint32_t next = 0;
+  void *key;
+
+  tuple->max_priority = INT64_MIN;
+
+  while ((key = tuple->ht.Iterate(&next))) {
+    struct WmData *data = tuple->ht.Get(static_cast<wm_hkey_t *>(key));
+    tuple->max_priority = std::max<int64_t>(tuple->max_priority,
+                                            data->priority);
+  }
+}
+
+/* Orders the tuples by their best possible match: by max_priority, and
+ * then by index, as ties go to the later tuple. A packet that cannot get a
+ * better match from a tuple cannot get one from any tuple after it. */
+void WildcardMatch::SortTuples() {
+  for (int i = 0; i < num_tuples_; i++) {
+    tuple_order_[i] = i;
+  }
+
+  std::sort(tuple_order_, tuple_order_ + num_tuples_, [this](int a, int b) {
+    if (tuples_[a].max_priority != tuples_[b].max_priority) {
+      return tuples_[a].max_priority > tuples_[b].max_priority;
+    }
+    return a > b;
+  });
+}
+
+/* Resizes the Bloom filter of the tuple for its current number of rules,
+ * and refills it. Keeps the old one if out of memory. */
+void WildcardMatch::BuildBloom(struct WmTuple *tuple) {
+  uint32_t num_words =
+      align_ceil_pow2(tuple->ht.Count() / BLOOM_KEYS_PER_WORD + 1);
+  uint64_t *bloom =
+      static_cast<uint64_t *>(mem_alloc(sizeof(uint64_t) * num_words));
+  uint32_t next = 0;
+  void *key;
+
+  if (!bloom) {
+    return;
+  }
+
+  while ((key = tuple->ht.Iterate(&next))) {
+    uint32_t hv = tuple->ht.Hash(static_cast<wm_hkey_t *>(key));
+    bloom[hv & (num_words - 1)] |= bloom_bits(hv);
+  }
+
+  mem_free(tuple->bloom);
+  tuple->bloom = bloom;
+  tuple->bloom_mask = num_words - 1;
+}
+
 bess::pb::ModuleCommandResponse WildcardMatch::CommandAdd(
     const google::protobuf::Any &arg_) {
   bess::pb::WildcardMatchCommandAddArg arg;
@@ -619,9 +747,7 @@ bess::pb::ModuleCommandResponse WildcardMatch::CommandDelete(
 
 bess::pb::ModuleCommandResponse WildcardMatch::CommandClear(
     const google::protobuf::Any &) {
-  for (int i = 0; i < num_tuples_; i++) {
-    tuples_[i].ht.Clear();
-  }
+  ClearTuples();
 
   bess::pb::ModuleCommandResponse response;
 
@@ -708,9 +834,7 @@ struct snobj *WildcardMatch::CommandDelete(struct snobj *arg) {
 }
 
 struct snobj *WildcardMatch::CommandClear(struct snobj *) {
-  for (int i = 0; i < num_tuples_; i++) {
-    tuples_[i].ht.Clear();
-  }
+  ClearTuples();
 
   return nullptr;
 }
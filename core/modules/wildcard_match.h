@@ -51,6 +51,7 @@ class WildcardMatch : public Module {
         fields_(),
         num_tuples_(),
         tuples_(),
+        tuple_order_(),
         next_table_id_() {}
 
   virtual struct snobj *Init(struct snobj *arg);
@@ -153,9 +154,15 @@ class WildcardMatch : public Module {
   struct WmTuple {
     HTable<wm_hkey_t, struct WmData, wm_keycmp, wm_hash> ht;
     wm_hkey_t mask;
-  };
 
-  gate_idx_t LookupEntry(wm_hkey_t *key, gate_idx_t def_gate);
+    /* the highest priority of the rules, INT64_MIN if there are none */
+    int64_t max_priority;
+
+    /* Bloom filter of the keys of the rules: each key sets a few bits in one
+     * of the words. Deleted keys are not cleared until it is rebuilt. */
+    uint64_t *bloom;
+    uint32_t bloom_mask; /* # of words - 1 */
+  };
 
   struct snobj *AddFieldOne(struct snobj *field, struct WmField *f);
   pb_error_t AddFieldOne(const bess::pb::WildcardMatchArg_Field &field,
@@ -173,6 +180,11 @@ class WildcardMatch : public Module {
   int AddTuple(wm_hkey_t *mask);
   int AddEntry(struct WmTuple *tuple, wm_hkey_t *key, struct WmData *data);
   int DelEntry(struct WmTuple *tuple, wm_hkey_t *key);
+  void ClearTuples();
+
+  void UpdateMaxPriority(struct WmTuple *tuple);
+  void SortTuples();
+  void BuildBloom(struct WmTuple *tuple);
 
   gate_idx_t default_gate_;
 
@@ -184,6 +196,10 @@ class WildcardMatch : public Module {
   int num_tuples_;
   struct WmTuple tuples_[MAX_TUPLES];
 
+  /* indices of tuples_, in the descending order of their max_priority and
+   * then of the index itself */
+  int tuple_order_[MAX_TUPLES];
+
   int next_table_id_;
 };
 
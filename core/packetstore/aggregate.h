@@ -0,0 +1,200 @@
+#ifndef NETPLAY_AGGREGATE_H_
+#define NETPLAY_AGGREGATE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "headerparse.h"
+
+namespace netplay {
+
+/* Packet and IP byte counts of a group of packets */
+struct aggregate_group {
+  uint64_t key;
+  uint64_t packets;
+  uint64_t bytes;
+};
+
+/**
+ * Aggregates stored packet headers: counts the packets and sums their IP
+ * lengths, in total and per value of a header field (group-by), from which
+ * the top-k groups are selected.
+ *
+ * Headers are parsed a batch at a time with the (vectorized) header_parser,
+ * so an aggregate over a set of records reads each of them once, straight
+ * from the data-log; see sharded_packet_store::aggregate().
+ */
+class aggregator {
+ public:
+  /* Header fields to group by; addresses and ports are in host byte order */
+  enum field {
+    NONE = 0,
+    SRC_IP = 1,
+    DST_IP = 2,
+    SRC_PORT = 3,
+    DST_PORT = 4,
+    PROTO = 5
+  };
+
+  /**
+   * Constructor to initialize the aggregator.
+   *
+   * @param group_by The field to group packets by, or NONE.
+   * @param proto If not 0, only IPv4 packets of this protocol are counted.
+   */
+  explicit aggregator(field group_by = NONE, uint8_t proto = 0)
+      : group_by_(group_by),
+        proto_(proto),
+        packets_(0),
+        bytes_(0) {
+  }
+
+  /**
+   * Add a batch of stored headers, starting at their Ethernet headers.
+   * Packets without the group-by field count towards the totals only.
+   *
+   * @param hdrs The headers.
+   * @param hdr_lens The lengths of the headers.
+   * @param num_hdrs The number of headers (at most header_batch::MAX_BATCH).
+   */
+  void add(const unsigned char* const * hdrs, const uint16_t* hdr_lens,
+           uint32_t num_hdrs) {
+    header_batch batch;
+    header_parser::parse(hdrs, hdr_lens, num_hdrs, batch);
+
+    for (uint32_t i = 0; i < num_hdrs; i++) {
+      bool ipv4 = batch.flags[i] & header_batch::IPV4;
+      if (proto_ != 0 && (!ipv4 || batch.proto[i] != proto_)) {
+        continue;
+      }
+
+      uint64_t bytes = ipv4 ? batch.ip_len[i] : 0;
+      packets_++;
+      bytes_ += bytes;
+
+      uint64_t key;
+      if (key_of(batch, i, key)) {
+        std::pair<uint64_t, uint64_t>& group = groups_[key];
+        group.first++;
+        group.second += bytes;
+      }
+    }
+  }
+
+  /**
+   * Merge the counts of another aggregator with the same group-by field.
+   *
+   * @param other The other aggregator.
+   */
+  void merge(const aggregator& other) {
+    packets_ += other.packets_;
+    bytes_ += other.bytes_;
+    for (const auto& group : other.groups_) {
+      std::pair<uint64_t, uint64_t>& mine = groups_[group.first];
+      mine.first += group.second.first;
+      mine.second += group.second.second;
+    }
+  }
+
+  /**
+   * Get the k largest groups, by packets (or by bytes), in descending order;
+   * ties are broken by key. Selected with a heap of k groups.
+   *
+   * @param groups The groups.
+   * @param k The number of groups; 0 for all groups.
+   * @param by_bytes Whether to rank groups by bytes rather than packets.
+   */
+  void top(std::vector<aggregate_group>& groups, size_t k,
+           bool by_bytes) const {
+    if (k == 0 || k > groups_.size()) {
+      k = groups_.size();
+    }
+
+    /* Min-heap of the k largest groups so far; the smallest is on top */
+    auto larger = [by_bytes](const aggregate_group& a,
+                             const aggregate_group& b) {
+      uint64_t va = by_bytes ? a.bytes : a.packets;
+      uint64_t vb = by_bytes ? b.bytes : b.packets;
+      return va > vb || (va == vb && a.key < b.key);
+    };
+    std::priority_queue<aggregate_group, std::vector<aggregate_group>,
+        decltype(larger)> heap(larger);
+    for (const auto& group : groups_) {
+      aggregate_group g = { group.first, group.second.first,
+                            group.second.second };
+      if (heap.size() < k) {
+        heap.push(g);
+      } else if (k != 0 && larger(g, heap.top())) {
+        heap.pop();
+        heap.push(g);
+      }
+    }
+
+    groups.resize(heap.size());
+    for (size_t i = groups.size(); i > 0; i--) {
+      groups[i - 1] = heap.top();
+      heap.pop();
+    }
+  }
+
+  field group_by() const {
+    return group_by_;
+  }
+
+  uint8_t proto() const {
+    return proto_;
+  }
+
+  uint64_t packets() const {
+    return packets_;
+  }
+
+  uint64_t bytes() const {
+    return bytes_;
+  }
+
+  size_t num_groups() const {
+    return groups_.size();
+  }
+
+ private:
+  bool key_of(const header_batch& batch, uint32_t i, uint64_t& key) const {
+    switch (group_by_) {
+      case SRC_IP:
+      case DST_IP:
+      case PROTO:
+        if (!(batch.flags[i] & header_batch::IPV4)) {
+          return false;
+        }
+        key = group_by_ == SRC_IP ? batch.src_ip[i] :
+            group_by_ == DST_IP ? batch.dst_ip[i] : batch.proto[i];
+        return true;
+      case SRC_PORT:
+      case DST_PORT:
+        if (!(batch.flags[i] & header_batch::PORTS)) {
+          return false;
+        }
+        key = group_by_ == SRC_PORT ? batch.src_port[i] : batch.dst_port[i];
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  field group_by_;
+  uint8_t proto_;
+
+  uint64_t packets_;
+  uint64_t bytes_;
+
+  /* Packets and bytes per group-by key */
+  std::unordered_map<uint64_t, std::pair<uint64_t, uint64_t>> groups_;
+};
+
+}
+
+#endif /* NETPLAY_AGGREGATE_H_ */
@@ -0,0 +1,124 @@
+#include "aggregate.h"
+
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "shardedstore.h"
+#include "testpackets.h"
+
+namespace {
+
+const uint32_t kBatch = netplay::test::packet_batch::SIZE;
+const uint16_t kHeaderLen = 42;  // Ethernet + IPv4 + UDP
+
+// Packet number n is a UDP packet (TCP every fifth) from 10.0.0.(n % 7) to
+// port 53 + n % 3, with an IP length of 100 + n % 50.
+uint16_t BuildPacket(unsigned char *pkt, uint64_t n) {
+  netplay::test::packet_fields f = {};
+  f.proto = n % 5 == 0 ? 6 : 17;
+  f.src_ip = 0x0a000000 + n % 7;
+  f.dst_port = 53 + n % 3;
+  f.ip_len = 100 + n % 50;
+  return netplay::test::build_packet(pkt, kHeaderLen, f);
+}
+
+// Inserts a batch of packets, numbered from batch * kBatch.
+void InsertBatch(netplay::sharded_packet_store::handle *handle,
+                 uint64_t batch) {
+  netplay::test::packet_batch packets(batch * kBatch, BuildPacket);
+  handle->insert_packets(packets.pkts, packets.hdrs, kBatch, batch + 1);
+}
+
+TEST(AggregatorTest, TopGroups) {
+  netplay::aggregator agg(netplay::aggregator::DST_PORT);
+  unsigned char bufs[6][kHeaderLen];
+  const unsigned char *hdrs[6];
+  uint16_t hdr_lens[6];
+  for (uint64_t n = 0; n < 6; n++) {
+    BuildPacket(bufs[n], 1 + n % 2);
+    hdrs[n] = bufs[n];
+    hdr_lens[n] = kHeaderLen;
+  }
+  // Three packets to port 54 (101 bytes each), three to port 55 (102 bytes)
+  agg.add(hdrs, hdr_lens, 6);
+  ASSERT_EQ(6U, agg.packets());
+  ASSERT_EQ(3 * 101U + 3 * 102U, agg.bytes());
+
+  std::vector<netplay::aggregate_group> groups;
+  agg.top(groups, 1, false);
+  ASSERT_EQ(1U, groups.size());
+  ASSERT_EQ(54U, groups[0].key);  // ties are broken by key
+  agg.top(groups, 1, true);
+  ASSERT_EQ(55U, groups[0].key);
+  ASSERT_EQ(306U, groups[0].bytes);
+  agg.top(groups, 0, true);
+  ASSERT_EQ(2U, groups.size());
+  ASSERT_EQ(54U, groups[1].key);
+  ASSERT_EQ(3U, groups[1].packets);
+}
+
+TEST(AggregatorTest, AggregatesShards) {
+  const uint64_t kBatches = 40;
+  for (uint32_t shards : {1U, 3U}) {
+    netplay::sharded_packet_store store(shards);
+    for (uint64_t b = 0; b < kBatches; b++) {
+      netplay::sharded_packet_store::handle *handle =
+          store.get_handle(b % shards);
+      InsertBatch(handle, b);
+      delete handle;
+    }
+
+    // UDP packets to port 53, by source
+    std::map<uint64_t, netplay::aggregate_group> expected;
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    for (uint64_t n = 0; n < kBatches * kBatch; n++) {
+      if (n % 3 == 0 && n % 5 != 0) {
+        netplay::aggregate_group &g = expected[0x0a000000 + n % 7];
+        g.packets++;
+        g.bytes += 100 + n % 50;
+        packets++;
+        bytes += 100 + n % 50;
+      }
+    }
+
+    slog::filter_query query(1);
+    store.filters().add_dst_port_filter(query[0], 53, 53);
+    netplay::aggregator agg(netplay::aggregator::SRC_IP, 17);
+    store.aggregate(agg, query, store.snapshot(UINT64_MAX));
+    ASSERT_EQ(packets, agg.packets());
+    ASSERT_EQ(bytes, agg.bytes());
+    ASSERT_EQ(expected.size(), agg.num_groups());
+
+    std::vector<netplay::aggregate_group> groups;
+    agg.top(groups, 3, false);
+    ASSERT_EQ(3U, groups.size());
+    for (size_t i = 0; i < groups.size(); i++) {
+      const netplay::aggregate_group &g = expected[groups[i].key];
+      ASSERT_EQ(g.packets, groups[i].packets);
+      ASSERT_EQ(g.bytes, groups[i].bytes);
+      if (i > 0) {
+        ASSERT_GE(groups[i - 1].packets, groups[i].packets);
+      }
+      for (const auto &e : expected) {
+        // No group left out has more packets than the last one selected
+        bool selected = false;
+        for (const netplay::aggregate_group &s : groups) {
+          selected |= s.key == e.first;
+        }
+        ASSERT_TRUE(selected || e.second.packets <= groups.back().packets);
+      }
+    }
+
+    // The empty query counts all packets
+    netplay::aggregator all;
+    store.aggregate(all, slog::filter_query(), store.snapshot(UINT64_MAX));
+    ASSERT_EQ(kBatches * kBatch, all.packets());
+    ASSERT_EQ(0U, all.num_groups());
+  }
+}
+
+}  // namespace (unnamed)
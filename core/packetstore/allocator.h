@@ -0,0 +1,163 @@
+#ifndef SLOG_ALLOCATOR_H_
+#define SLOG_ALLOCATOR_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <sys/mman.h>
+
+namespace slog {
+
+/**
+ * Allocates the buckets of a MonoLog.
+ *
+ * MonoLogs allocate their buckets on the heap, unless they are constructed
+ * with a bucket allocator. Buckets are identified by their bucket numbers,
+ * so an allocator that serves a single log may place each bucket in memory
+ * of its choosing (e.g., in a file).
+ */
+class bucket_allocator {
+ public:
+  virtual ~bucket_allocator() {
+  }
+
+  /**
+   * Allocate bucket bucket_idx. The bucket is zero-filled, unless the
+   * allocator holds contents for it from an earlier instance of the log.
+   * Several threads may race to allocate the same bucket; all but one
+   * deallocate theirs.
+   *
+   * @param bucket_idx The bucket number.
+   * @param size The size of the bucket in bytes.
+   * @return The bucket.
+   */
+  virtual void* allocate(uint64_t bucket_idx, size_t size) = 0;
+
+  /**
+   * Deallocate a bucket that is no longer used by the log, keeping its
+   * contents (if the allocator persists any).
+   *
+   * @param bucket The bucket.
+   * @param size The size of the bucket in bytes.
+   */
+  virtual void deallocate(void* bucket, size_t size) = 0;
+
+  /**
+   * Release bucket bucket_idx, whose contents were dropped from the log.
+   * Readers may still access the bucket, so it is freed by the returned
+   * function, once no reader can; the function may outlive the allocator.
+   *
+   * @param bucket_idx The bucket number.
+   * @param bucket The bucket.
+   * @param size The size of the bucket in bytes.
+   * @return The function that frees the bucket.
+   */
+  virtual std::function<void()> release(uint64_t bucket_idx, void* bucket,
+                                        size_t size) = 0;
+};
+
+/**
+ * Bucket allocator that maps buckets from anonymous memory, which the kernel
+ * zero-fills and faults in lazily, so a bucket only costs memory once it is
+ * written to. Large buckets are backed by hugepages where possible: from the
+ * hugetlbfs pool (MAP_HUGETLB) if requested and pages are available, and by
+ * transparent hugepages otherwise. Small buckets come from the heap.
+ *
+ * The allocator keeps no per-bucket state, so a single instance can serve
+ * several logs.
+ */
+class page_allocator : public bucket_allocator {
+ public:
+  /* Allocations smaller than this come from the heap */
+  static const size_t MIN_MAPPED_SIZE = 64 * 1024;
+
+  static const size_t HUGEPAGE_SIZE = 2 * 1024 * 1024;
+
+  /**
+   * Constructor to initialize the allocator.
+   *
+   * @param hugetlb Whether to take large buckets from the hugetlbfs pool,
+   *  while pages are available.
+   */
+  explicit page_allocator(bool hugetlb = false)
+      : hugetlb_(hugetlb) {
+  }
+
+  void* allocate(uint64_t, size_t size) {
+    return map_pages(size, hugetlb_);
+  }
+
+  void deallocate(void* bucket, size_t size) {
+    unmap_pages(bucket, size, hugetlb_);
+  }
+
+  std::function<void()> release(uint64_t, void* bucket, size_t size) {
+    bool hugetlb = hugetlb_;
+    return [bucket, size, hugetlb] { unmap_pages(bucket, size, hugetlb); };
+  }
+
+  /**
+   * Map size bytes of zero-filled memory, faulted in lazily.
+   *
+   * @param size The number of bytes.
+   * @param hugetlb Whether to try the hugetlbfs pool first.
+   * @return The memory; must be freed with unmap_pages() with the same size
+   *  and hugetlb.
+   * @throws std::bad_alloc if no memory can be mapped.
+   */
+  static void* map_pages(size_t size, bool hugetlb = false) {
+    if (size < MIN_MAPPED_SIZE) {
+      void* mem = calloc(1, size);
+      if (mem == NULL) {
+        throw std::bad_alloc();
+      }
+      return mem;
+    }
+
+    size_t len = mapped_size(size, hugetlb);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void* mem = MAP_FAILED;
+    if (hugetlb) {
+      // Hugepages are reserved up front, so a depleted pool fails the mapping
+      // (rather than faulting later) and the bucket falls back to normal pages
+      mem = mmap(NULL, len, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    }
+    if (mem == MAP_FAILED) {
+      mem = mmap(NULL, len, PROT_READ | PROT_WRITE, flags | MAP_NORESERVE, -1,
+                 0);
+      if (mem == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+      if (len >= HUGEPAGE_SIZE) {
+        madvise(mem, len, MADV_HUGEPAGE);
+      }
+    }
+    return mem;
+  }
+
+  static void unmap_pages(void* mem, size_t size, bool hugetlb = false) {
+    if (size < MIN_MAPPED_SIZE) {
+      free(mem);
+    } else {
+      munmap(mem, mapped_size(size, hugetlb));
+    }
+  }
+
+ private:
+  // Hugetlbfs mappings span whole hugepages; fallback mappings use the same
+  // length, so that both are unmapped alike.
+  static size_t mapped_size(size_t size, bool hugetlb) {
+    if (!hugetlb) {
+      return size;
+    }
+    return (size + HUGEPAGE_SIZE - 1) / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+  }
+
+  const bool hugetlb_;
+};
+
+}
+
+#endif /* SLOG_ALLOCATOR_H_ */
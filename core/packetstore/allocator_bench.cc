@@ -0,0 +1,151 @@
+// Benchmarks for the memory footprint and TLB behavior of the packet store
+// under the bucket allocators of its logs.
+
+#include "allocator.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include <benchmark/benchmark.h>
+
+#include "packetstore.h"
+#include "testpackets.h"
+
+namespace {
+
+const uint32_t kBatch = netplay::test::packet_batch::SIZE;
+
+enum Allocator { kHeap = 0, kPages = 1, kHugetlb = 2 };
+
+// Resident set size of the process, in bytes.
+size_t ResidentBytes() {
+  FILE *f = fopen("/proc/self/statm", "r");
+  unsigned long size = 0, resident = 0;
+  if (f != NULL) {
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(f);
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Counts the data TLB misses of the calling thread, if the kernel allows.
+class TlbMissCounter {
+ public:
+  TlbMissCounter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+
+  ~TlbMissCounter() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  bool available() const { return fd_ >= 0; }
+
+  void Start() {
+    if (fd_ >= 0) {
+      ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+
+  uint64_t Stop() {
+    uint64_t count = 0;
+    if (fd_ >= 0) {
+      ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+        count = 0;
+      }
+    }
+    return count;
+  }
+
+ private:
+  int fd_;
+};
+
+void SetAllocator(netplay::packet_store &store, slog::page_allocator &hugetlb,
+                  int allocator) {
+  if (allocator == kHeap) {
+    store.set_allocator(NULL);
+  } else if (allocator == kHugetlb) {
+    store.set_allocator(&hugetlb);
+  }
+}
+
+// Inserts batch number seq of the benchmark packets, with the tokens NetPlay
+// extracts from them.
+void InsertBatch(netplay::packet_store::handle *handle, uint64_t seq) {
+  netplay::test::packet_batch batch(seq * kBatch,
+                                    netplay::test::build_bench_packet);
+  netplay::test::insert_tokens(handle, batch);
+}
+
+}  // namespace (unnamed)
+
+// Memory resident after creating a packet store and inserting one batch.
+static void BM_Startup(benchmark::State &state) {
+  slog::page_allocator hugetlb(true);
+  size_t resident = 0;
+  while (state.KeepRunning()) {
+    size_t before = ResidentBytes();
+    netplay::packet_store *store = new netplay::packet_store;
+    SetAllocator(*store, hugetlb, state.range(0));
+    netplay::packet_store::handle *handle = store->get_handle();
+    InsertBatch(handle, 0);
+    resident = ResidentBytes() - before;
+
+    state.PauseTiming();
+    delete handle;
+    delete store;
+    state.ResumeTiming();
+  }
+  state.counters["resident_mb"] = resident / 1048576.0;
+}
+
+BENCHMARK(BM_Startup)->Arg(kHeap)->Arg(kPages)->Arg(kHugetlb)->Iterations(1);
+
+// Insert throughput, with the data TLB misses per record.
+static void BM_Insert(benchmark::State &state) {
+  slog::page_allocator hugetlb(true);
+  netplay::packet_store store;
+  SetAllocator(store, hugetlb, state.range(0));
+  netplay::packet_store::handle *handle = store.get_handle();
+  TlbMissCounter misses;
+
+  uint64_t seq = 0;
+  misses.Start();
+  while (state.KeepRunning()) {
+    InsertBatch(handle, seq++);
+  }
+  uint64_t num_misses = misses.Stop();
+
+  state.SetItemsProcessed(seq * kBatch);
+  if (misses.available()) {
+    state.counters["dtlb_misses_per_record"] =
+        (double) num_misses / (seq * kBatch);
+  }
+  delete handle;
+}
+
+BENCHMARK(BM_Insert)->Arg(kHeap)->Arg(kPages)->Arg(kHugetlb);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,97 @@
+#include "allocator.h"
+
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "monolog.h"
+#include "logstore.h"
+
+namespace {
+
+const size_t kLarge = 4 * slog::page_allocator::HUGEPAGE_SIZE + 4096;
+
+bool IsZero(const void *mem, size_t size) {
+  const unsigned char *bytes = static_cast<const unsigned char *>(mem);
+  for (size_t i = 0; i < size; i++) {
+    if (bytes[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+TEST(PageAllocatorTest, MapsZeroFilledPages) {
+  for (bool hugetlb : {false, true}) {
+    // Served from the heap and from a mapping, respectively; without
+    // hugetlbfs pages, hugetlb mappings fall back to normal pages
+    for (size_t size : {size_t(100), kLarge}) {
+      void *mem = slog::page_allocator::map_pages(size, hugetlb);
+      ASSERT_TRUE(IsZero(mem, size));
+      memset(mem, 0xab, size);
+      slog::page_allocator::unmap_pages(mem, size, hugetlb);
+    }
+  }
+}
+
+TEST(PageAllocatorTest, BacksMonoLogs) {
+  slog::page_allocator pages;
+  slog::__monolog_base<uint64_t, 64, 16> log(&pages);
+  for (uint64_t i = 0; i < 1000000; i++) {
+    log.set(i, i * 7);
+  }
+  for (uint64_t i = 0; i < 1000000; i += 11) {
+    ASSERT_EQ(i * 7, log.get(i));
+  }
+
+  // Released buckets are freed by the retire callback, and only then
+  std::vector<std::function<void()>> frees;
+  log.release_below(500000, [&](std::function<void()> free_bucket) {
+    frees.push_back(free_bucket);
+  });
+  ASSERT_FALSE(frees.empty());
+  ASSERT_EQ(999999U * 7, log.get(999999));
+  for (auto &fn : frees) {
+    fn();
+  }
+}
+
+TEST(PageAllocatorTest, BacksLinearLogs) {
+  slog::page_allocator pages(true);
+  slog::__monolog_linear_base<uint8_t, 8, 1024 * 1024> log(&pages);
+  ASSERT_EQ(8 * sizeof(void *), log.storage_size());
+
+  const char data[] = "spans two blocks";
+  log.write(1024 * 1024 - 4, reinterpret_cast<const uint8_t *>(data),
+            sizeof(data));
+  char out[sizeof(data)];
+  log.read(1024 * 1024 - 4, reinterpret_cast<uint8_t *>(out), sizeof(data));
+  ASSERT_STREQ(data, out);
+}
+
+TEST(PageAllocatorTest, LogStoreAllocators) {
+  slog::page_allocator pages(true);
+  std::vector<slog::bucket_allocator *> allocators = {&pages, NULL};
+  for (slog::bucket_allocator *allocator : allocators) {
+    slog::log_store store;
+    uint32_t index_id = store.add_index(4);
+    ASSERT_TRUE(store.set_allocator(allocator));
+
+    unsigned char record[64];
+    memset(record, 0x5a, sizeof(record));
+    slog::token_list tokens;
+    tokens.push_back(slog::token_t(index_id, 42));
+    const unsigned char *records[] = { record };
+    uint16_t record_lens[] = { sizeof(record) };
+    ASSERT_EQ(0U, store.insert_batch(records, record_lens, &tokens, 1));
+    ASSERT_FALSE(store.set_allocator(NULL));
+
+    unsigned char out[64];
+    ASSERT_TRUE(store.get(out, 0));
+    ASSERT_EQ(0, memcmp(record, out, sizeof(record)));
+  }
+}
+
+}  // namespace (unnamed)
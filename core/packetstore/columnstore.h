@@ -0,0 +1,540 @@
+#ifndef NETPLAY_COLUMNSTORE_H_
+#define NETPLAY_COLUMNSTORE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <x86intrin.h>
+
+#include "exceptions.h"
+#include "headerparse.h"
+
+namespace netplay {
+
+/**
+ * Columnar copy of the parsed header fields of the records in a store, for
+ * predicates on fields that are not indexed (e.g., TTL, TCP flags or IP
+ * length).
+ *
+ * Records are kept in chunks of CHUNK_RECORDS records, addressed by record
+ * id, with one fixed-width array per field. Each chunk keeps a zone map (the
+ * minimum and maximum value of each field over its records), so a scan
+ * skips the chunks that cannot match, and compares the fields of the others
+ * 32 records at a time over contiguous memory (with AVX2, if available).
+ *
+ * Chunks are allocated as records are appended, and dropped along with the
+ * records of the store (see drop_below()); as in slog::log_store, their
+ * memory is freed once no reader is active.
+ */
+class column_store {
+ public:
+  static const uint32_t CHUNK_SHIFT = 16;
+  static const uint64_t CHUNK_RECORDS = 1ULL << CHUNK_SHIFT;
+  static const uint64_t CHUNK_MASK = CHUNK_RECORDS - 1;
+
+  /* Maximum number of live chunks */
+  static const uint32_t MAX_CHUNKS = 16384;
+
+  /* Stored fields; addresses, ports and lengths are in host byte order */
+  enum field {
+    SRC_IP = 0,
+    DST_IP = 1,
+    SRC_PORT = 2,
+    DST_PORT = 3,
+    IP_LEN = 4,
+    PROTO = 5,
+    TTL = 6,
+    TCP_FLAGS = 7,
+    NUM_FIELDS = 8
+  };
+
+  /**
+   * Matches the records that have a field and whose value, masked, lies in
+   * [beg, end]; e.g., a TTL range, or TCP flags with SYN set and ACK clear.
+   */
+  struct predicate {
+    predicate(field f, uint32_t b, uint32_t e, uint32_t m = UINT32_MAX)
+        : col(f),
+          beg(b),
+          end(e),
+          mask(m) {
+    }
+
+    field col;
+    uint32_t beg;
+    uint32_t end;
+    uint32_t mask;
+  };
+
+  /* Predicates that must all match */
+  typedef std::vector<predicate> conjunction;
+
+  column_store()
+      : first_chunk_(0),
+        num_chunks_(0),
+        readers_(0) {
+    for (uint32_t i = 0; i < MAX_CHUNKS; i++) {
+      chunks_[i].store(NULL);
+    }
+    dropping_.clear();
+  }
+
+  ~column_store() {
+    for (uint32_t i = 0; i < MAX_CHUNKS; i++) {
+      delete chunks_[i].load();
+    }
+    for (chunk* c : retired_) {
+      delete c;
+    }
+    for (chunk* c : draining_) {
+      delete c;
+    }
+  }
+
+  /**
+   * Append the parsed headers of a batch of records, which have consecutive
+   * record ids. The records are visible to filter() once appended.
+   *
+   * @param start_id The record id of the first record.
+   * @param hdrs The parsed headers of the records.
+   * @param num_records The number of records (at most header_batch::MAX_BATCH).
+   */
+  void append(uint64_t start_id, const header_batch& hdrs,
+              uint32_t num_records) {
+    uint32_t i = 0;
+    while (i < num_records) {
+      uint64_t id = start_id + i;
+      uint32_t off = id & CHUNK_MASK;
+      uint32_t n = std::min<uint64_t>(num_records - i, CHUNK_RECORDS - off);
+      chunk* c = get_chunk(id >> CHUNK_SHIFT);
+      if (c != NULL) {
+        write(c, off, hdrs, i, n);
+      }
+      i += n;
+    }
+  }
+
+  /**
+   * Get the records with ids in [min_rid, max_rid) that match all
+   * predicates of a conjunction. Records without a field that a predicate
+   * is on (e.g., the ports of non-TCP/UDP packets) do not match.
+   *
+   * @param results The sorted record ids of the matching records.
+   * @param conj The predicates; an empty conjunction matches all records.
+   * @param min_rid The smallest record id to consider.
+   * @param max_rid One past the largest record id to consider.
+   */
+  void filter(std::vector<uint64_t>& results, const conjunction& conj,
+              uint64_t min_rid, uint64_t max_rid) const {
+    results.clear();
+
+    /* Clamp predicates to the width of their fields */
+    conjunction preds;
+    uint8_t required = WRITTEN;
+    for (const predicate& f : conj) {
+      uint32_t max_value = max_value_of(f.col);
+      if (f.beg > f.end || f.beg > max_value) {
+        return;
+      }
+      preds.push_back(predicate(f.col, f.beg, std::min(f.end, max_value),
+                                f.mask & max_value));
+      required |= required_flags(f.col);
+    }
+
+    reader_guard guard(readers_);
+    min_rid = std::max(min_rid, first_chunk_.load() << CHUNK_SHIFT);
+    if (min_rid >= max_rid) {
+      return;
+    }
+
+    uint64_t last = (max_rid - 1) >> CHUNK_SHIFT;
+    for (uint64_t n = min_rid >> CHUNK_SHIFT; n <= last; n++) {
+      const chunk* c = chunks_[n % MAX_CHUNKS].load(std::memory_order_acquire);
+      if (c == NULL || c->number != n || !may_match(c, preds)) {
+        continue;
+      }
+      uint64_t base = n << CHUNK_SHIFT;
+      uint32_t beg = std::max(min_rid, base) - base;
+      uint32_t end = (n < last ? CHUNK_MASK : (max_rid - 1) & CHUNK_MASK) + 1;
+      scan(c, preds, required, beg, end, base, results);
+    }
+  }
+
+  /**
+   * Drop the chunks that only hold records with ids smaller than record_id;
+   * e.g., the records dropped by the retention policy of the store. Calls
+   * that overlap with another call return immediately.
+   *
+   * @param record_id The smallest record id to keep.
+   */
+  void drop_below(uint64_t record_id) {
+    uint64_t end = record_id >> CHUNK_SHIFT;
+    if (end <= first_chunk_.load()
+        || dropping_.test_and_set(std::memory_order_acquire)) {
+      return;
+    }
+
+    for (uint64_t n = first_chunk_.load(); n < end; n++) {
+      std::atomic<chunk*>& slot = chunks_[n % MAX_CHUNKS];
+      chunk* c = slot.load(std::memory_order_acquire);
+      if (c != NULL && c->number == n) {
+        slot.store(NULL);
+        retired_.push_back(c);
+        num_chunks_.fetch_sub(1U);
+      }
+    }
+    first_chunk_.store(std::max(end, first_chunk_.load()));
+    reclaim();
+
+    dropping_.clear(std::memory_order_release);
+  }
+
+  /**
+   * Get the number of live chunks.
+   */
+  uint64_t num_chunks() const {
+    return num_chunks_.load();
+  }
+
+  size_t storage_size() const {
+    return num_chunks() * sizeof(chunk);
+  }
+
+ private:
+  /* Flags stored with each record, besides those of header_batch */
+  static const uint8_t TCP = 0x40;      /* tcp_flags */
+  static const uint8_t WRITTEN = 0x80;  /* the record has been appended */
+
+  struct chunk {
+    explicit chunk(uint64_t n)
+        : number(n) {
+      for (uint32_t f = 0; f < NUM_FIELDS; f++) {
+        min[f].store(UINT32_MAX);
+        max[f].store(0);
+      }
+      memset(flags, 0, sizeof(flags));
+    }
+
+    const uint64_t number;
+
+    /* Zone map, over the records that have each field */
+    std::atomic<uint32_t> min[NUM_FIELDS];
+    std::atomic<uint32_t> max[NUM_FIELDS];
+
+    uint32_t src_ip[CHUNK_RECORDS];
+    uint32_t dst_ip[CHUNK_RECORDS];
+    uint16_t src_port[CHUNK_RECORDS];
+    uint16_t dst_port[CHUNK_RECORDS];
+    uint16_t ip_len[CHUNK_RECORDS];
+    uint8_t proto[CHUNK_RECORDS];
+    uint8_t ttl[CHUNK_RECORDS];
+    uint8_t tcp_flags[CHUNK_RECORDS];
+    uint8_t flags[CHUNK_RECORDS];
+  };
+
+  /* Marks a reader active for its lifetime; see drop_below() */
+  class reader_guard {
+   public:
+    reader_guard(std::atomic<uint32_t>& readers)
+        : readers_(readers) {
+      readers_.fetch_add(1U);
+    }
+
+    ~reader_guard() {
+      readers_.fetch_sub(1U, std::memory_order_release);
+    }
+
+   private:
+    std::atomic<uint32_t>& readers_;
+  };
+
+  static uint32_t max_value_of(field f) {
+    switch (f) {
+      case SRC_IP:
+      case DST_IP:
+        return UINT32_MAX;
+      case SRC_PORT:
+      case DST_PORT:
+      case IP_LEN:
+        return UINT16_MAX;
+      default:
+        return UINT8_MAX;
+    }
+  }
+
+  static uint8_t required_flags(field f) {
+    switch (f) {
+      case SRC_PORT:
+      case DST_PORT:
+        return header_batch::PORTS;
+      case TCP_FLAGS:
+        return TCP;
+      default:
+        return header_batch::IPV4;
+    }
+  }
+
+  static void update_min(std::atomic<uint32_t>& a, uint32_t v) {
+    uint32_t cur = a.load(std::memory_order_relaxed);
+    while (v < cur
+        && !a.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {
+    }
+  }
+
+  static void update_max(std::atomic<uint32_t>& a, uint32_t v) {
+    uint32_t cur = a.load(std::memory_order_relaxed);
+    while (v > cur
+        && !a.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {
+    }
+  }
+
+  /**
+   * Get chunk n, creating it if necessary; NULL if it has been dropped
+   * already (e.g., by a writer that fell behind the retention policy).
+   */
+  chunk* get_chunk(uint64_t n) {
+    std::atomic<chunk*>& slot = chunks_[n % MAX_CHUNKS];
+    chunk* c = slot.load(std::memory_order_acquire);
+    if (c == NULL) {
+      if (n < first_chunk_.load()) {
+        return NULL;
+      }
+      chunk* created = new chunk(n);
+      if (slot.compare_exchange_strong(c, created)) {
+        c = created;
+        num_chunks_.fetch_add(1U);
+      } else {
+        delete created;
+      }
+    }
+    if (c->number != n) {
+      throw slog::log_overflow_exception();
+    }
+    return c;
+  }
+
+  /* Write records [first, first + n) of a batch at offset off of a chunk */
+  static void write(chunk* c, uint32_t off, const header_batch& hdrs,
+                    uint32_t first, uint32_t n) {
+    uint32_t lo[NUM_FIELDS];
+    uint32_t hi[NUM_FIELDS];
+    std::fill(lo, lo + NUM_FIELDS, UINT32_MAX);
+    std::fill(hi, hi + NUM_FIELDS, 0);
+    auto note = [&lo, &hi](field f, uint32_t v) {
+      lo[f] = std::min(lo[f], v);
+      hi[f] = std::max(hi[f], v);
+    };
+
+    uint8_t flags[header_batch::MAX_BATCH];
+    for (uint32_t j = 0; j < n; j++) {
+      uint32_t i = first + j;
+      uint32_t r = off + j;
+      uint8_t f = hdrs.flags[i];
+      if (f & header_batch::IPV4) {
+        c->src_ip[r] = hdrs.src_ip[i];
+        c->dst_ip[r] = hdrs.dst_ip[i];
+        c->ip_len[r] = hdrs.ip_len[i];
+        c->proto[r] = hdrs.proto[i];
+        c->ttl[r] = hdrs.ttl[i];
+        note(SRC_IP, hdrs.src_ip[i]);
+        note(DST_IP, hdrs.dst_ip[i]);
+        note(IP_LEN, hdrs.ip_len[i]);
+        note(PROTO, hdrs.proto[i]);
+        note(TTL, hdrs.ttl[i]);
+      }
+      if (f & header_batch::PORTS) {
+        c->src_port[r] = hdrs.src_port[i];
+        c->dst_port[r] = hdrs.dst_port[i];
+        note(SRC_PORT, hdrs.src_port[i]);
+        note(DST_PORT, hdrs.dst_port[i]);
+        if (hdrs.proto[i] == header_parser::PROTO_TCP) {
+          c->tcp_flags[r] = hdrs.tcp_flags[i];
+          note(TCP_FLAGS, hdrs.tcp_flags[i]);
+          f |= TCP;
+        }
+      }
+      flags[j] = f | WRITTEN;
+    }
+
+    for (uint32_t f = 0; f < NUM_FIELDS; f++) {
+      if (lo[f] <= hi[f]) {
+        update_min(c->min[f], lo[f]);
+        update_max(c->max[f], hi[f]);
+      }
+    }
+
+    /* Publish the records: readers see their fields once they see their
+     * flags */
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(c->flags + off, flags, n);
+  }
+
+  /* Whether the zone map of a chunk admits records matching all predicates */
+  static bool may_match(const chunk* c, const conjunction& preds) {
+    for (const predicate& f : preds) {
+      uint32_t min = c->min[f.col].load(std::memory_order_relaxed);
+      uint32_t max = c->max[f.col].load(std::memory_order_relaxed);
+      /* Masking only lowers values, so the maximum still bounds them */
+      if (min > max || f.beg > max
+          || (f.mask == max_value_of(f.col) && f.end < min)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /* Scan records [beg, end) of a chunk, 32 at a time */
+  static void scan(const chunk* c, const conjunction& preds,
+                   uint8_t required, uint32_t beg, uint32_t end,
+                   uint64_t base, std::vector<uint64_t>& results) {
+    for (uint32_t b = beg & ~31U; b < end; b += 32) {
+      uint32_t m = flags_mask(c->flags + b, required);
+      if (b < beg) {
+        m &= ~0U << (beg - b);
+      }
+      if (end - b < 32) {
+        m &= (1U << (end - b)) - 1;
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      for (size_t k = 0; m != 0 && k < preds.size(); k++) {
+        m &= field_mask(c, preds[k], b);
+      }
+      while (m != 0) {
+        results.push_back(base + b + __builtin_ctz(m));
+        m &= m - 1;
+      }
+    }
+  }
+
+  static uint32_t field_mask(const chunk* c, const predicate& f, uint32_t b) {
+    switch (f.col) {
+      case SRC_IP:
+        return range_mask(c->src_ip + b, f);
+      case DST_IP:
+        return range_mask(c->dst_ip + b, f);
+      case SRC_PORT:
+        return range_mask(c->src_port + b, f);
+      case DST_PORT:
+        return range_mask(c->dst_port + b, f);
+      case IP_LEN:
+        return range_mask(c->ip_len + b, f);
+      case PROTO:
+        return range_mask(c->proto + b, f);
+      case TTL:
+        return range_mask(c->ttl + b, f);
+      case TCP_FLAGS:
+        return range_mask(c->tcp_flags + b, f);
+      default:
+        return 0;
+    }
+  }
+
+#if __AVX2__
+  /* Bit j is set if (flags[j] & required) == required */
+  static inline uint32_t flags_mask(const uint8_t* flags, uint8_t required) {
+    __m256i req = _mm256_set1_epi8(required);
+    __m256i x = _mm256_loadu_si256((const __m256i*) flags);
+    return _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_and_si256(x, req), req));
+  }
+
+  /* Bit j is set if the masked value j of a column lies in [f.beg, f.end];
+   * unsigned compares are done as min/max against the bounds */
+  static inline uint32_t range_mask(const uint32_t* col, const predicate& f) {
+    __m256i beg = _mm256_set1_epi32(f.beg);
+    __m256i end = _mm256_set1_epi32(f.end);
+    __m256i mask = _mm256_set1_epi32(f.mask);
+    uint32_t bits = 0;
+    for (uint32_t k = 0; k < 4; k++) {
+      __m256i x = _mm256_and_si256(
+          _mm256_loadu_si256((const __m256i*) (col + 8 * k)), mask);
+      __m256i in = _mm256_and_si256(
+          _mm256_cmpeq_epi32(_mm256_max_epu32(x, beg), x),
+          _mm256_cmpeq_epi32(_mm256_min_epu32(x, end), x));
+      bits |= (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(in))
+          << (8 * k);
+    }
+    return bits;
+  }
+
+  static inline uint32_t range_mask(const uint16_t* col, const predicate& f) {
+    __m256i beg = _mm256_set1_epi16(f.beg);
+    __m256i end = _mm256_set1_epi16(f.end);
+    __m256i mask = _mm256_set1_epi16(f.mask);
+    __m256i in[2];
+    for (uint32_t k = 0; k < 2; k++) {
+      __m256i x = _mm256_and_si256(
+          _mm256_loadu_si256((const __m256i*) (col + 16 * k)), mask);
+      in[k] = _mm256_and_si256(
+          _mm256_cmpeq_epi16(_mm256_max_epu16(x, beg), x),
+          _mm256_cmpeq_epi16(_mm256_min_epu16(x, end), x));
+    }
+    /* Narrow to bytes; packing interleaves the 128-bit lanes */
+    __m256i packed = _mm256_permute4x64_epi64(
+        _mm256_packs_epi16(in[0], in[1]), _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm256_movemask_epi8(packed);
+  }
+
+  static inline uint32_t range_mask(const uint8_t* col, const predicate& f) {
+    __m256i beg = _mm256_set1_epi8(f.beg);
+    __m256i end = _mm256_set1_epi8(f.end);
+    __m256i x = _mm256_and_si256(_mm256_loadu_si256((const __m256i*) col),
+                                 _mm256_set1_epi8(f.mask));
+    __m256i in = _mm256_and_si256(
+        _mm256_cmpeq_epi8(_mm256_max_epu8(x, beg), x),
+        _mm256_cmpeq_epi8(_mm256_min_epu8(x, end), x));
+    return _mm256_movemask_epi8(in);
+  }
+#else
+  static inline uint32_t flags_mask(const uint8_t* flags, uint8_t required) {
+    uint32_t bits = 0;
+    for (uint32_t j = 0; j < 32; j++) {
+      bits |= (uint32_t) ((flags[j] & required) == required) << j;
+    }
+    return bits;
+  }
+
+  template<typename T>
+  static inline uint32_t range_mask(const T* col, const predicate& f) {
+    uint32_t bits = 0;
+    for (uint32_t j = 0; j < 32; j++) {
+      uint32_t v = col[j] & f.mask;
+      bits |= (uint32_t) (v - f.beg <= f.end - f.beg) << j;
+    }
+    return bits;
+  }
+#endif
+
+  /**
+   * Free the chunks dropped by earlier calls to drop_below() if no reader is
+   * active; chunks dropped by this call wait for the next one.
+   */
+  void reclaim() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (readers_.load() == 0) {
+      for (chunk* c : draining_) {
+        delete c;
+      }
+      draining_.clear();
+    }
+    draining_.insert(draining_.end(), retired_.begin(), retired_.end());
+    retired_.clear();
+  }
+
+  std::atomic<chunk*> chunks_[MAX_CHUNKS];
+  std::atomic<uint64_t> first_chunk_;
+  std::atomic<uint64_t> num_chunks_;
+
+  mutable std::atomic<uint32_t> readers_;
+  std::atomic_flag dropping_;
+  std::vector<chunk*> retired_;
+  std::vector<chunk*> draining_;
+};
+
+}
+
+#endif /* NETPLAY_COLUMNSTORE_H_ */
@@ -0,0 +1,147 @@
+#include "columnstore.h"
+
+#include <cstring>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "testpackets.h"
+
+namespace {
+
+typedef netplay::column_store::predicate Predicate;
+
+const uint32_t kBatch = netplay::test::packet_batch::SIZE;
+const uint16_t kPacketLen = 54;  // Ethernet + IPv4 + TCP
+const uint64_t kChunk = netplay::column_store::CHUNK_RECORDS;
+
+// Packet number n is an ARP frame if n % 10 == 9, and otherwise an IPv4
+// packet with a TTL of n % 64 and an IP length of 100 + n % 50: a TCP SYN if
+// n % 4 == 0, a TCP ACK if n % 4 == 2, and a UDP packet if n is odd.
+uint16_t BuildPacket(unsigned char *pkt, uint64_t n) {
+  if (n % 10 == 9) {
+    memset(pkt, 0, kPacketLen);
+    pkt[12] = 0x08;
+    pkt[13] = 0x06;
+    return kPacketLen;
+  }
+  netplay::test::packet_fields f = {};
+  f.proto = n % 2 ? 17 : 6;
+  f.src_ip = 0x0a000000;
+  f.dst_port = 8080;
+  f.ip_len = 100 + n % 50;
+  f.ttl = n % 64;
+  f.tcp_flags = n % 4 ? 0x10 : 0x02;
+  return netplay::test::build_packet(pkt, kPacketLen, f);
+}
+
+bool IsIpv4(uint64_t n) {
+  return n % 10 != 9;
+}
+
+// Appends packets [first, first + kBatch), parsed as NetPlay does.
+void AppendBatch(netplay::column_store &store, uint64_t first) {
+  netplay::test::packet_batch packets(first, BuildPacket);
+  store.append(first, packets.hdrs, kBatch);
+}
+
+// Appends records [first, first + n) with the given TTL.
+void AppendTtl(netplay::column_store &store, uint64_t first, uint32_t n,
+               uint8_t ttl) {
+  netplay::header_batch hdrs;
+  for (uint32_t i = 0; i < n; i++) {
+    hdrs.flags[i] = netplay::header_batch::IPV4;
+    hdrs.src_ip[i] = 0x0a000001;
+    hdrs.dst_ip[i] = 0x0a000002;
+    hdrs.ip_len[i] = 100;
+    hdrs.proto[i] = 17;
+    hdrs.ttl[i] = ttl;
+  }
+  store.append(first, hdrs, n);
+}
+
+TEST(ColumnStoreTest, FiltersParsedFields) {
+  const uint64_t kRecords = 200 * kBatch;
+  netplay::column_store store;
+  for (uint64_t first = 0; first < kRecords; first += kBatch) {
+    AppendBatch(store, first);
+  }
+
+  std::vector<uint64_t> results;
+  netplay::column_store::conjunction ttl_range = {
+      Predicate(netplay::column_store::TTL, 10, 20)};
+  store.filter(results, ttl_range, 0, kRecords);
+  std::vector<uint64_t> expected;
+  for (uint64_t n = 0; n < kRecords; n++) {
+    if (IsIpv4(n) && n % 64 >= 10 && n % 64 <= 20) {
+      expected.push_back(n);
+    }
+  }
+  ASSERT_EQ(expected, results);
+
+  // SYN set and ACK clear; UDP packets have no TCP flags
+  netplay::column_store::conjunction syn = {
+      Predicate(netplay::column_store::TCP_FLAGS, 0x02, 0x02, 0x12),
+      Predicate(netplay::column_store::IP_LEN, 100, 119)};
+  store.filter(results, syn, 1000, 3000);
+  expected.clear();
+  for (uint64_t n = 1000; n < 3000; n++) {
+    if (IsIpv4(n) && n % 4 == 0 && n % 50 < 20) {
+      expected.push_back(n);
+    }
+  }
+  ASSERT_EQ(expected, results);
+
+  // The empty conjunction matches all records; bounds beyond the width of a
+  // field match nothing
+  store.filter(results, netplay::column_store::conjunction(), 5, 37);
+  ASSERT_EQ(32U, results.size());
+  ASSERT_EQ(5U, results[0]);
+  store.filter(results, {Predicate(netplay::column_store::TTL, 256, 300)}, 0,
+               kRecords);
+  ASSERT_TRUE(results.empty());
+}
+
+TEST(ColumnStoreTest, SkipsChunksAndUnwrittenRecords) {
+  netplay::column_store store;
+  // Records with TTL c + 1 at the start of chunk c, and a gap in chunk 1
+  for (uint32_t c = 0; c < 3; c++) {
+    AppendTtl(store, c * kChunk, kBatch, c + 1);
+  }
+  AppendTtl(store, kChunk + 2 * kBatch, kBatch, 2);
+  ASSERT_EQ(3U, store.num_chunks());
+
+  std::vector<uint64_t> results;
+  store.filter(results, {Predicate(netplay::column_store::TTL, 2, 2)}, 0,
+               3 * kChunk);
+  ASSERT_EQ(2 * kBatch, results.size());
+  for (uint32_t i = 0; i < kBatch; i++) {
+    ASSERT_EQ(kChunk + i, results[i]);
+    ASSERT_EQ(kChunk + 2 * kBatch + i, results[kBatch + i]);
+  }
+
+  // Records without the field never match
+  store.filter(results, {Predicate(netplay::column_store::DST_PORT, 0, 0)}, 0,
+               3 * kChunk);
+  ASSERT_TRUE(results.empty());
+}
+
+TEST(ColumnStoreTest, DropsChunks) {
+  netplay::column_store store;
+  for (uint32_t c = 0; c < 3; c++) {
+    AppendTtl(store, c * kChunk, kBatch, 64);
+  }
+  store.drop_below(2 * kChunk + 5);
+  ASSERT_EQ(1U, store.num_chunks());
+
+  std::vector<uint64_t> results;
+  store.filter(results, netplay::column_store::conjunction(), 0, 3 * kChunk);
+  ASSERT_EQ(kBatch, results.size());
+  ASSERT_EQ(2 * kChunk, results[0]);
+
+  // Appends to dropped chunks are ignored
+  AppendTtl(store, kChunk + kBatch, kBatch, 64);
+  ASSERT_EQ(1U, store.num_chunks());
+}
+
+}  // namespace (unnamed)
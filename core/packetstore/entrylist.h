@@ -1,11 +1,554 @@
 #ifndef SLOG_ENTRYLIST_H_
 #define SLOG_ENTRYLIST_H_
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <vector>
+
 #include "monolog.h"
+#include "utils.h"
 
 namespace slog {
 
-typedef monolog_relaxed<uint64_t, 24> entry_list;
+/*
+ * Exponential buckets: the first 36 buckets hold ~1.1 * 10^12 entries, and a
+ * short list only pays for the first bucket.
+ */
+typedef monolog_relaxed<uint64_t, 36> entry_list;
+
+/**
+ * Bucket allocator for lists of record ids. Buckets come from the heap with
+ * all entries set to EMPTY (rather than zero-filled), so that entries that
+ * have not been written yet compare larger than any record id.
+ */
+class empty_entry_allocator : public bucket_allocator {
+ public:
+  static const uint64_t EMPTY = UINT64_MAX;
+
+  static empty_entry_allocator* instance() {
+    static empty_entry_allocator allocator;
+    return &allocator;
+  }
+
+  void* allocate(uint64_t, size_t size) {
+    uint64_t* bucket = new uint64_t[size / sizeof(uint64_t)];
+    std::fill(bucket, bucket + size / sizeof(uint64_t), uint64_t(EMPTY));
+    return bucket;
+  }
+
+  void deallocate(void* bucket, size_t) {
+    delete[] static_cast<uint64_t*>(bucket);
+  }
+
+  std::function<void()> release(uint64_t, void* bucket, size_t) {
+    return [bucket] { delete[] static_cast<uint64_t*>(bucket); };
+  }
+};
+
+/**
+ * Uncompressed list of record ids that can be searched while it is appended
+ * to: entries that have not been written yet read as EMPTY, so a list whose
+ * entries are appended in increasing order stays sorted.
+ */
+class searchable_entry_list : public entry_list {
+ public:
+  static const uint64_t EMPTY = empty_entry_allocator::EMPTY;
+
+  searchable_entry_list()
+      : entry_list(empty_entry_allocator::instance()) {
+  }
+
+  // Invokes fn, in increasing order, on every id of the sorted vector ids
+  // that is among the first n entries of the list; the entries must be
+  // sorted. Gallops through the list, so m ids cost O(m log(n/m))
+  // comparisons.
+  template<typename F>
+  void for_each_in(const std::vector<uint64_t>& ids, uint64_t n,
+                   F fn) const {
+    uint64_t pos = 0;
+    for (uint64_t id : ids) {
+      pos = seek(id, pos, n);
+      if (pos == n) {
+        return;
+      }
+      if (entry(pos) == id) {
+        fn(id);
+      }
+    }
+  }
+
+ private:
+  // Gets the entry at idx; entries in buckets that a concurrent push_back has
+  // not allocated yet read as EMPTY.
+  uint64_t entry(uint64_t idx) const {
+    uint32_t bucket_idx;
+    uint64_t bucket_off;
+    layout::locate(idx, bucket_idx, bucket_off);
+    const uint64_t* bucket = buckets_[slot(bucket_idx)].load(
+        std::memory_order_acquire);
+    return bucket == NULL ? EMPTY : bucket[bucket_off];
+  }
+
+  // Position of the first of the entries in [pos, n) not smaller than id.
+  uint64_t seek(uint64_t id, uint64_t pos, uint64_t n) const {
+    if (pos >= n || entry(pos) >= id) {
+      return pos;
+    }
+
+    /* entry(pos + bound / 2) < id <= entry(pos + bound) */
+    uint64_t bound = 1;
+    while (pos + bound < n && entry(pos + bound) < id) {
+      bound <<= 1;
+    }
+    uint64_t lo = pos + (bound >> 1) + 1;
+    uint64_t hi = std::min(pos + bound, n);
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (entry(mid) < id) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+};
+
+/**
+ * Compressed (append-only) list of record ids.
+ *
+ * Entries are appended lock-free to raw (uncompressed) tail blocks. The thread
+ * that completes a block seals it: the block is re-encoded as a variable-byte
+ * sequence of zig-zag encoded deltas, and the raw block is retired. Since
+ * record ids are mostly appended in increasing order, most deltas fit in a
+ * single byte.
+ *
+ * The first blocks are small (16, 32 and 64 entries), so that short lists do
+ * not pay for a full raw block; all subsequent blocks hold 128 entries.
+ *
+ * Retired raw blocks are freed once no readers are active on the list: by the
+ * thread that retires them, or else by the last reader to leave.
+ */
+class compressed_entry_list {
+ public:
+  static const uint32_t FBS = 16;
+  static const uint32_t FBS_HIBIT = 4;
+  static const uint32_t SMALL_BLOCKS = 3;
+  static const uint32_t SMALL_ENTRIES = 112;  // 16 + 32 + 64
+  static const uint32_t BLOCK_SIZE = 128;
+
+  compressed_entry_list()
+      : tail_(0),
+        readers_(0),
+        retired_(NULL),
+        data_size_(0) {
+  }
+
+  ~compressed_entry_list() {
+    uint64_t num_blocks = block_count(tail_.load(std::memory_order_acquire));
+    for (uint64_t i = 0; i < num_blocks; i++) {
+      uintptr_t ref = blocks_.try_load(i);
+      if (ref & PACKED) {
+        delete[] reinterpret_cast<uint8_t*>(ref & ~PACKED);
+      } else if (ref) {
+        free_raw(reinterpret_cast<raw_block*>(ref));
+      }
+    }
+    free_retired(retired_.load(std::memory_order_acquire));
+  }
+
+  // Append an entry at the end of the list.
+  uint64_t push_back(const uint64_t val) {
+    uint64_t idx = tail_.fetch_add(1U, std::memory_order_release);
+    uint64_t block_idx;
+    uint32_t block_off;
+    locate(idx, block_idx, block_off);
+
+    raw_block* block = get_raw(block_idx);
+    block->entries()[block_off].store(val, std::memory_order_release);
+    if (block->filled.fetch_add(1U, std::memory_order_acq_rel) + 1
+        == capacity(block_idx)) {
+      seal(block_idx, block);
+    }
+    return idx;
+  }
+
+  // Get the number of entries appended to the list.
+  uint64_t size() const {
+    return tail_.load(std::memory_order_acquire);
+  }
+
+  // Invokes fn on every entry in the list, in insertion order. Entries that
+  // are still being appended may be skipped.
+  template<typename F>
+  void for_each(F fn) const {
+    uint64_t num_entries = size();
+    if (num_entries == 0) {
+      return;
+    }
+
+    readers_.fetch_add(1U);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    uint64_t num_blocks = block_count(num_entries);
+    uint64_t block_beg = 0;
+    for (uint64_t i = 0; i < num_blocks; i++) {
+      uint32_t n = std::min<uint64_t>(capacity(i), num_entries - block_beg);
+      uintptr_t ref = blocks_.try_load(i);
+      if (ref & PACKED) {
+        decode(reinterpret_cast<const uint8_t*>(ref & ~PACKED), n, fn);
+      } else if (ref) {
+        const std::atomic<uint64_t>* entries =
+            reinterpret_cast<raw_block*>(ref)->entries();
+        for (uint32_t j = 0; j < n; j++) {
+          uint64_t val = entries[j].load(std::memory_order_acquire);
+          if (val != EMPTY) {
+            fn(val);
+          }
+        }
+      }
+      block_beg += capacity(i);
+    }
+
+    leave();
+  }
+
+  // Invokes fn, in increasing order, on every id of the sorted vector ids
+  // that is among the first n entries of the list; the entries must be
+  // sorted. Gallops over the first entries of the blocks, and only decodes
+  // the blocks that may hold one of the ids.
+  template<typename F>
+  void for_each_in(const std::vector<uint64_t>& ids, uint64_t n,
+                   F fn) const {
+    uint64_t num_blocks = block_count(std::min(n, size()));
+    if (num_blocks == 0 || ids.empty()) {
+      return;
+    }
+
+    readers_.fetch_add(1U);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    uint64_t entries[BLOCK_SIZE];
+    uint32_t num_entries = 0;
+    uint64_t loaded = num_blocks;
+    uint64_t b = 0;
+    for (uint64_t id : ids) {
+      if (first_entry(b) > id) {
+        continue;
+      }
+
+      /* Find the last block whose first entry is not larger than id:
+       * first_entry(b + bound / 2) <= id < first_entry(b + bound) */
+      uint64_t bound = 1;
+      while (b + bound < num_blocks && first_entry(b + bound) <= id) {
+        bound <<= 1;
+      }
+      uint64_t lo = b + (bound >> 1);
+      uint64_t hi = std::min(b + bound, num_blocks);
+      while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (first_entry(mid) <= id) {
+          lo = mid;
+        } else {
+          hi = mid;
+        }
+      }
+      b = lo;
+
+      if (b != loaded) {
+        num_entries = load_block(b, n, entries);
+        loaded = b;
+      }
+      if (std::binary_search(entries, entries + num_entries, id)) {
+        fn(id);
+      }
+    }
+
+    leave();
+  }
+
+  size_t storage_size() const {
+    return blocks_.storage_size() + data_size_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  static const uintptr_t PACKED = 1;
+  static const uint64_t EMPTY = UINT64_MAX;
+
+  /* Maximum encoded size of a block: a full varint header plus deltas */
+  static const uint32_t MAX_PACKED_SIZE = 10 * BLOCK_SIZE;
+
+  struct raw_block {
+    std::atomic<uint32_t> filled;
+    uint32_t capacity;
+    raw_block* next;
+
+    size_t size() const {
+      return sizeof(raw_block) + capacity * sizeof(uint64_t);
+    }
+
+    std::atomic<uint64_t>* entries() {
+      return reinterpret_cast<std::atomic<uint64_t>*>(this + 1);
+    }
+  };
+
+  static inline uint32_t capacity(uint64_t block_idx) {
+    return block_idx < SMALL_BLOCKS ? (FBS << block_idx) : BLOCK_SIZE;
+  }
+
+  static inline void locate(uint64_t idx, uint64_t& block_idx,
+                            uint32_t& block_off) {
+    if (idx < SMALL_ENTRIES) {
+      uint32_t pos = idx + FBS;
+      uint32_t hibit = bit_utils::highest_bit(pos);
+      block_idx = hibit - FBS_HIBIT;
+      block_off = pos ^ (1 << hibit);
+    } else {
+      block_idx = SMALL_BLOCKS + (idx - SMALL_ENTRIES) / BLOCK_SIZE;
+      block_off = (idx - SMALL_ENTRIES) % BLOCK_SIZE;
+    }
+  }
+
+  // Index of the first entry of a block.
+  static inline uint64_t block_begin(uint64_t block_idx) {
+    if (block_idx < SMALL_BLOCKS) {
+      return FBS * ((1ULL << block_idx) - 1);
+    }
+    return SMALL_ENTRIES + (block_idx - SMALL_BLOCKS) * BLOCK_SIZE;
+  }
+
+  // Number of blocks spanned by the first num_entries entries.
+  static inline uint64_t block_count(uint64_t num_entries) {
+    if (num_entries == 0) {
+      return 0;
+    }
+    uint64_t block_idx;
+    uint32_t block_off;
+    locate(num_entries - 1, block_idx, block_off);
+    return block_idx + 1;
+  }
+
+  // Gets the raw block at block_idx, allocating it if necessary.
+  raw_block* get_raw(uint64_t block_idx) {
+    uintptr_t ref = blocks_.try_load(block_idx);
+    if (ref != 0) {
+      return reinterpret_cast<raw_block*>(ref);
+    }
+
+    blocks_.alloc(block_idx);
+    raw_block* block = new_raw(block_idx);
+    uintptr_t null_ref = 0;
+
+    // Only one thread will be successful in replacing the NULL reference with
+    // newly allocated block.
+    if (!blocks_.cas(block_idx, null_ref,
+                     reinterpret_cast<uintptr_t>(block))) {
+      // All other threads will deallocate the newly allocated block.
+      free_raw(block);
+      return reinterpret_cast<raw_block*>(null_ref);
+    }
+    data_size_.fetch_add(block->size(), std::memory_order_relaxed);
+    return block;
+  }
+
+  raw_block* new_raw(uint64_t block_idx) {
+    uint32_t cap = capacity(block_idx);
+    void* mem = ::operator new(sizeof(raw_block) + cap * sizeof(uint64_t));
+    raw_block* block = new (mem) raw_block;
+    block->filled.store(0U, std::memory_order_relaxed);
+    block->capacity = cap;
+    block->next = NULL;
+    std::atomic<uint64_t>* entries = block->entries();
+    for (uint32_t i = 0; i < cap; i++) {
+      new (&entries[i]) std::atomic<uint64_t>(EMPTY);
+    }
+    return block;
+  }
+
+  static void free_raw(raw_block* block) {
+    block->~raw_block();
+    ::operator delete(block);
+  }
+
+  static void free_retired(raw_block* block) {
+    while (block != NULL) {
+      raw_block* next = block->next;
+      free_raw(block);
+      block = next;
+    }
+  }
+
+  // Encodes a completed raw block, publishes the encoded block in its place
+  // and retires the raw block. Only the thread that completes the block calls
+  // this, so the block slot is never concurrently modified.
+  void seal(uint64_t block_idx, raw_block* block) {
+    uint8_t buf[MAX_PACKED_SIZE];
+    const std::atomic<uint64_t>* entries = block->entries();
+    uint32_t len = 0;
+    uint64_t prev = 0;
+    for (uint32_t i = 0; i < block->capacity; i++) {
+      uint64_t val = entries[i].load(std::memory_order_acquire);
+      int64_t delta = (int64_t) (val - prev);
+      len += put_varint(buf + len, (uint64_t) ((delta << 1) ^ (delta >> 63)));
+      prev = val;
+    }
+
+    uint8_t* packed = new uint8_t[len];
+    memcpy(packed, buf, len);
+    blocks_.store(block_idx, reinterpret_cast<uintptr_t>(packed) | PACKED);
+    data_size_.fetch_add(len, std::memory_order_relaxed);
+
+    retire(block);
+  }
+
+  // Adds an unlinked raw block to the retired list, and frees all retired
+  // blocks if there are no active readers.
+  void retire(raw_block* block) {
+    block->next = retired_.load(std::memory_order_relaxed);
+    while (!retired_.compare_exchange_weak(block->next, block))
+      ;
+    reclaim();
+  }
+
+  // Ends a read; the last reader to leave frees the blocks that were retired
+  // while it was active.
+  void leave() const {
+    if (readers_.fetch_sub(1U) == 1 && retired_.load() != NULL) {
+      reclaim();
+    }
+  }
+
+  // Frees all retired blocks if there are no active readers, and puts them
+  // back for a later attempt otherwise. Either the last reader to leave sees
+  // the blocks put back, or they are seen to have left and the attempt is
+  // repeated.
+  void reclaim() const {
+    while (true) {
+      raw_block* list = retired_.exchange(NULL);
+      if (list == NULL) {
+        return;
+      }
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (readers_.load() == 0) {
+        // Readers that start from here on cannot observe the unlinked blocks.
+        while (list != NULL) {
+          raw_block* next = list->next;
+          data_size_.fetch_sub(list->size(), std::memory_order_relaxed);
+          free_raw(list);
+          list = next;
+        }
+        return;
+      }
+
+      // Put the blocks back for a later attempt.
+      while (list != NULL) {
+        raw_block* next = list->next;
+        list->next = retired_.load(std::memory_order_relaxed);
+        while (!retired_.compare_exchange_weak(list->next, list))
+          ;
+        list = next;
+      }
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (readers_.load() != 0) {
+        return;
+      }
+    }
+  }
+
+  // Gets the first entry of a block; the first delta of a packed block is
+  // relative to zero. Unallocated blocks read as EMPTY.
+  uint64_t first_entry(uint64_t block_idx) const {
+    uintptr_t ref = blocks_.try_load(block_idx);
+    if (ref & PACKED) {
+      const uint8_t* buf = reinterpret_cast<const uint8_t*>(ref & ~PACKED);
+      uint64_t zz = get_varint(buf);
+      return (zz >> 1) ^ (~(zz & 1) + 1);
+    } else if (ref) {
+      return reinterpret_cast<raw_block*>(ref)->entries()[0].load(
+          std::memory_order_acquire);
+    }
+    return EMPTY;
+  }
+
+  // Copies the entries of a block that are among the first n entries of the
+  // list to out, and returns their number.
+  uint32_t load_block(uint64_t block_idx, uint64_t n, uint64_t* out) const {
+    uint32_t num_entries = std::min<uint64_t>(capacity(block_idx),
+                                              n - block_begin(block_idx));
+    uintptr_t ref = blocks_.try_load(block_idx);
+    if (ref & PACKED) {
+      uint32_t i = 0;
+      auto copy = [&](uint64_t val) { out[i++] = val; };
+      decode(reinterpret_cast<const uint8_t*>(ref & ~PACKED), num_entries,
+             copy);
+    } else if (ref) {
+      const std::atomic<uint64_t>* entries =
+          reinterpret_cast<raw_block*>(ref)->entries();
+      for (uint32_t i = 0; i < num_entries; i++) {
+        out[i] = entries[i].load(std::memory_order_acquire);
+      }
+    } else {
+      std::fill(out, out + num_entries, uint64_t(EMPTY));
+    }
+    return num_entries;
+  }
+
+  static inline uint32_t put_varint(uint8_t* buf, uint64_t val) {
+    uint32_t len = 0;
+    while (val >= 0x80) {
+      buf[len++] = (uint8_t) (val | 0x80);
+      val >>= 7;
+    }
+    buf[len++] = (uint8_t) val;
+    return len;
+  }
+
+  static inline uint64_t get_varint(const uint8_t*& buf) {
+    uint64_t val = 0;
+    uint32_t shift = 0;
+    while (*buf & 0x80) {
+      val |= (uint64_t) (*buf++ & 0x7f) << shift;
+      shift += 7;
+    }
+    val |= (uint64_t) (*buf++) << shift;
+    return val;
+  }
+
+  template<typename F>
+  static void decode(const uint8_t* buf, uint32_t n, F& fn) {
+    uint64_t val = 0;
+    for (uint32_t i = 0; i < n; i++) {
+      uint64_t zz = get_varint(buf);
+      val += (zz >> 1) ^ (~(zz & 1) + 1);
+      fn(val);
+    }
+  }
+
+  std::atomic<uint64_t> tail_;
+
+  /* Readers free the blocks retired while they were active */
+  mutable std::atomic<uint32_t> readers_;
+  mutable std::atomic<raw_block*> retired_;
+  mutable std::atomic<size_t> data_size_;
+
+  /* Each slot holds either a raw block or a packed block (tagged PACKED) */
+  __atomic_monolog_base<uintptr_t, 32> blocks_;
+};
+
+/*
+ * Posting list type used by the tiered indexes. Define
+ * SLOG_COMPRESSED_POSTINGS (make COMPRESSED_POSTINGS=1) to store postings in
+ * compressed blocks.
+ */
+#ifdef SLOG_COMPRESSED_POSTINGS
+typedef compressed_entry_list posting_list;
+#else
+typedef searchable_entry_list posting_list;
+#endif
 
 }
 
@@ -0,0 +1,201 @@
+#include "entrylist.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+// List sizes around the block boundaries of compressed lists (16, 48, 112,
+// then every 128 entries) and the bucket boundaries of uncompressed ones.
+const uint64_t kSizes[] = {0, 1, 15, 16, 17, 47, 48, 49, 111, 112, 113, 239,
+                           240, 241, 1000, 5000};
+
+// Checks that for_each_in over the first n entries of a list of the even ids
+// below 2 * size finds exactly the even probes below 2 * n, for dense and
+// sparse probes.
+template <typename LIST>
+void CheckForEachIn(uint64_t size) {
+  LIST list;
+  for (uint64_t i = 0; i < size; i++) {
+    list.push_back(2 * i);
+  }
+
+  for (uint64_t step : {1, 37}) {
+    std::vector<uint64_t> probes;
+    for (uint64_t id = 0; id < 2 * size + 4; id += step) {
+      probes.push_back(id);
+    }
+
+    for (uint64_t n : {size, size / 2}) {
+      std::vector<uint64_t> expected;
+      for (uint64_t id : probes) {
+        if (id % 2 == 0 && id < 2 * n) {
+          expected.push_back(id);
+        }
+      }
+
+      std::vector<uint64_t> found;
+      list.for_each_in(probes, n, [&](uint64_t id) { found.push_back(id); });
+      ASSERT_EQ(expected, found) << "size " << size << ", n " << n
+                                 << ", step " << step;
+    }
+  }
+}
+
+TEST(EntryListTest, ForEachIn) {
+  for (uint64_t size : kSizes) {
+    CheckForEachIn<slog::searchable_entry_list>(size);
+  }
+}
+
+TEST(EntryListTest, UnwrittenEntriesAreEmpty) {
+  slog::searchable_entry_list list;
+  list.push_back(7);
+  ASSERT_EQ(7U, list.at(0));
+  const uint64_t empty = slog::searchable_entry_list::EMPTY;
+  for (uint64_t i = 1; i < 16; i++) {
+    ASSERT_EQ(empty, list.at(i));
+  }
+}
+
+TEST(CompressedEntryListTest, ForEachIn) {
+  for (uint64_t size : kSizes) {
+    CheckForEachIn<slog::compressed_entry_list>(size);
+  }
+}
+
+// Returns the entries of a list, in insertion order.
+std::vector<uint64_t> Entries(const slog::compressed_entry_list &list) {
+  std::vector<uint64_t> entries;
+  list.for_each([&](uint64_t id) { entries.push_back(id); });
+  return entries;
+}
+
+TEST(CompressedEntryListTest, BlockBoundaries) {
+  // Blocks of 16, 32, 64 and then 128 entries end at these sizes
+  const uint64_t kBoundaries[] = {16, 48, 112, 240, 368};
+  for (uint64_t boundary : kBoundaries) {
+    for (uint64_t size = boundary - 1; size <= boundary + 1; size++) {
+      slog::compressed_entry_list list;
+      std::vector<uint64_t> expected;
+      for (uint64_t i = 0; i < size; i++) {
+        list.push_back(3 * i + 1);
+        expected.push_back(3 * i + 1);
+      }
+      ASSERT_EQ(size, list.size());
+      ASSERT_EQ(expected, Entries(list)) << "size " << size;
+    }
+
+    // Completing a block packs it and frees its raw entries
+    slog::compressed_entry_list open_block;
+    slog::compressed_entry_list sealed;
+    for (uint64_t i = 0; i < boundary; i++) {
+      if (i + 1 < boundary) {
+        open_block.push_back(i);
+      }
+      sealed.push_back(i);
+    }
+    ASSERT_LT(sealed.storage_size(), open_block.storage_size())
+        << "boundary " << boundary;
+  }
+}
+
+TEST(CompressedEntryListTest, ZigZagDeltas) {
+  // Ids out of order, with deltas of both signs and of all lengths
+  std::vector<uint64_t> ids = {5, 3, 1000000, 0, UINT64_MAX - 1, 1,
+                               1ULL << 40, (1ULL << 40) - 1, 127, 128, 63, 64};
+  uint64_t x = 12345;
+  while (ids.size() < 1000) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    ids.push_back((x >> (x % 64)) % (UINT64_MAX - 1));
+  }
+
+  slog::compressed_entry_list list;
+  for (uint64_t id : ids) {
+    list.push_back(id);
+  }
+  ASSERT_EQ(ids, Entries(list));
+}
+
+TEST(CompressedEntryListTest, ConcurrentAppendAndRead) {
+  const uint64_t kWriters = 4;
+  const uint64_t kPerWriter = 20000;
+  slog::compressed_entry_list list;
+  std::atomic<bool> done(false);
+
+  // Readers only see appended entries, each at most once
+  std::thread reader([&] {
+    while (!done.load()) {
+      std::vector<bool> seen(kWriters * kPerWriter);
+      uint64_t num_seen = 0;
+      list.for_each([&](uint64_t id) {
+        ASSERT_LT(id, kWriters * kPerWriter);
+        ASSERT_FALSE(seen[id]);
+        seen[id] = true;
+        num_seen++;
+      });
+      ASSERT_LE(num_seen, list.size());
+    }
+  });
+
+  std::vector<std::thread> writers;
+  for (uint64_t w = 0; w < kWriters; w++) {
+    writers.push_back(std::thread([&list, w] {
+      for (uint64_t i = 0; i < kPerWriter; i++) {
+        list.push_back(w * kPerWriter + i);
+      }
+    }));
+  }
+  for (std::thread &t : writers) {
+    t.join();
+  }
+  done.store(true);
+  reader.join();
+
+  std::vector<uint64_t> entries = Entries(list);
+  std::sort(entries.begin(), entries.end());
+  ASSERT_EQ(kWriters * kPerWriter, entries.size());
+  for (uint64_t i = 0; i < entries.size(); i++) {
+    ASSERT_EQ(i, entries[i]);
+  }
+}
+
+TEST(CompressedEntryListTest, LastReaderFreesRetiredBlocks) {
+  slog::compressed_entry_list list;
+  slog::compressed_entry_list reference;
+  for (uint64_t i = 0; i < 10; i++) {
+    list.push_back(i);
+    reference.push_back(i);
+  }
+
+  // Blocks sealed while a reader is active are retired, not freed
+  std::atomic<bool> reading(false);
+  std::atomic<bool> go(false);
+  std::thread reader([&] {
+    list.for_each([&](uint64_t) {
+      reading.store(true);
+      while (!go.load()) {
+        std::this_thread::yield();
+      }
+    });
+  });
+  while (!reading.load()) {
+    std::this_thread::yield();
+  }
+  for (uint64_t i = 10; i < 100; i++) {
+    list.push_back(i);
+    reference.push_back(i);
+  }
+  ASSERT_GT(list.storage_size(), reference.storage_size());
+
+  // ... until the reader leaves
+  go.store(true);
+  reader.join();
+  ASSERT_EQ(reference.storage_size(), list.storage_size());
+}
+
+}  // namespace (unnamed)
@@ -2,6 +2,7 @@
 #define SLOG_EXCEPTIONS_H_
 
 #include <exception>
+#include <string>
 
 namespace slog {
 
@@ -11,6 +12,26 @@ class log_overflow_exception : public std::exception {
   }
 };
 
+class segment_exception : public std::exception {
+ public:
+  segment_exception(const std::string& path)
+      : msg_("Cannot map segment " + path) {
+  }
+
+  virtual const char* what() const throw () {
+    return msg_.c_str();
+  }
+
+ private:
+  std::string msg_;
+};
+
+class eventfd_exception : public std::exception {
+  virtual const char* what() const throw () {
+    return "Cannot create eventfd";
+  }
+};
+
 }
 
 #endif /* SLOG_EXCEPTIONS_H_ */
@@ -0,0 +1,392 @@
+#ifndef NETPLAY_FLOWCODEC_H_
+#define NETPLAY_FLOWCODEC_H_
+
+#include <cstdint>
+#include <cstring>
+
+#include "headerparse.h"
+
+namespace netplay {
+
+/**
+ * Encodes the stored headers of TCP packets as deltas against an earlier
+ * header of the same flow (its reference), which is stored in full.
+ *
+ * Consecutive headers of a flow differ in a few fields only: the IP length,
+ * ID and checksum, the TCP sequence and acknowledgment numbers, flags,
+ * window and checksum, and the insertion time prefixed to records by a
+ * sharded store. A delta holds the fields that differ, counters as varints
+ * of their difference, and any other bytes that differ (e.g., TCP timestamp
+ * options) as (offset, value) pairs. Deltas are taken against a reference
+ * rather than the previous header of the flow, so a record is decoded from
+ * two stored records at most.
+ *
+ * Encoded records start with a kind byte: FULL records are followed by the
+ * record itself; DELTA records by a mask of the fields present, the
+ * distance (in record ids) back to the reference, and the fields.
+ */
+class header_codec {
+ public:
+  static const uint8_t FULL = 0;
+  static const uint8_t DELTA = 1;
+
+  /* Length of a time prefix that is encoded as a counter */
+  static const uint32_t TIME_PREFIX_LEN = sizeof(uint64_t);
+
+  /* Maximum length of a record, and of an encoded one */
+  static const uint32_t MAX_RECORD_LEN =
+      TIME_PREFIX_LEN + header_batch::MAX_HDR_LEN;
+  static const uint32_t MAX_ENCODED_LEN = 1 + MAX_RECORD_LEN;
+
+  /* Longer deltas are stored in full instead, and become the reference */
+  static const uint32_t MAX_DELTA_LEN = 32;
+
+  /* Maximum number of other bytes that may differ in a delta */
+  static const uint32_t MAX_PATCHES = 8;
+
+  /* Length of an Ethernet/IPv4/TCP header without options */
+  static const uint32_t MIN_TCP_HDR_LEN = 54;
+
+  /**
+   * Constructor to initialize the codec.
+   *
+   * @param prefix_len Number of record bytes before the packet header; a
+   *  TIME_PREFIX_LEN-byte prefix is encoded as a counter, other prefixes as
+   *  other bytes.
+   */
+  explicit header_codec(uint32_t prefix_len)
+      : prefix_len_(prefix_len),
+        num_fields_(0) {
+    memset(covered_, 0, sizeof(covered_));
+    if (prefix_len == TIME_PREFIX_LEN) {
+      add_field(0, TIME_PREFIX_LEN, COUNTER | HOST_ORDER);
+    }
+    add_field(prefix_len + 16, 2, COUNTER);  /* IP length */
+    add_field(prefix_len + 18, 2, COUNTER);  /* IP ID */
+    add_field(prefix_len + 24, 2, 0);        /* IP checksum */
+    add_field(prefix_len + 38, 4, COUNTER);  /* TCP sequence number */
+    add_field(prefix_len + 42, 4, COUNTER);  /* TCP acknowledgment number */
+    add_field(prefix_len + 46, 2, 0);        /* TCP data offset and flags */
+    add_field(prefix_len + 48, 2, 0);        /* TCP window */
+    add_field(prefix_len + 50, 2, 0);        /* TCP checksum */
+  }
+
+  uint32_t prefix_len() const {
+    return prefix_len_;
+  }
+
+  /**
+   * Whether a record may be encoded as a delta, or serve as a reference: an
+   * IPv4 header without options and a TCP header.
+   *
+   * @param hdrs The parsed headers of the packets.
+   * @param i The index of the packet in hdrs.
+   */
+  static bool is_tcp(const header_batch& hdrs, uint32_t i) {
+    uint8_t flags = hdrs.flags[i];
+    return (flags & header_batch::IPV4) && (flags & header_batch::PORTS)
+        && !(flags & header_batch::FRAGMENT)
+        && hdrs.proto[i] == header_parser::PROTO_TCP
+        && hdrs.hdr_len[i] >= MIN_TCP_HDR_LEN;
+  }
+
+  /**
+   * Encode a record in full.
+   *
+   * @param record The record.
+   * @param len The length of the record (at most MAX_RECORD_LEN).
+   * @param out The encoded record (at most MAX_ENCODED_LEN bytes).
+   * @return The length of the encoded record.
+   */
+  static uint16_t encode_full(const unsigned char* record, uint16_t len,
+                              unsigned char* out) {
+    out[0] = FULL;
+    memcpy(out + 1, record, len);
+    return len + 1;
+  }
+
+  /**
+   * Encode a record as a delta against a reference of the same length.
+   *
+   * @param ref The reference.
+   * @param record The record.
+   * @param len The length of both.
+   * @param distance The record id of the record minus that of the reference.
+   * @param out The encoded record (at most MAX_ENCODED_LEN bytes).
+   * @return The length of the encoded record; 0 if the delta would be longer
+   *  than MAX_DELTA_LEN.
+   */
+  uint16_t encode_delta(const unsigned char* ref, const unsigned char* record,
+                        uint16_t len, uint64_t distance,
+                        unsigned char* out) const {
+    if (len < prefix_len_ + MIN_TCP_HDR_LEN || len > MAX_RECORD_LEN) {
+      return 0;
+    }
+
+    unsigned char buf[MAX_ENCODED_LEN + 2 * MAX_PATCHES];
+    uint32_t n = 3;
+    n += put_varint(distance, buf + n);
+
+    uint16_t mask = 0;
+    for (uint32_t f = 0; f < num_fields_; f++) {
+      const field& fld = fields_[f];
+      uint64_t a = load(ref + fld.offset, fld.width, fld.flags);
+      uint64_t b = load(record + fld.offset, fld.width, fld.flags);
+      if (a == b) {
+        continue;
+      }
+      mask |= 1 << f;
+      if (fld.flags & COUNTER) {
+        n += put_varint(zigzag(sign_extend(b - a, fld.width)), buf + n);
+      } else {
+        memcpy(buf + n, record + fld.offset, fld.width);
+        n += fld.width;
+      }
+    }
+
+    uint32_t num_patches = 0;
+    uint32_t patches_at = n + 1;
+    for (uint32_t off = 0; off < len; off++) {
+      if (!covered_[off] && ref[off] != record[off]) {
+        if (++num_patches > MAX_PATCHES) {
+          return 0;
+        }
+        buf[patches_at + 2 * (num_patches - 1)] = off;
+        buf[patches_at + 2 * (num_patches - 1) + 1] = record[off];
+      }
+    }
+    if (num_patches != 0) {
+      mask |= PATCHES;
+      buf[n] = num_patches;
+      n = patches_at + 2 * num_patches;
+    }
+
+    if (n > MAX_DELTA_LEN) {
+      return 0;
+    }
+    buf[0] = DELTA;
+    buf[1] = mask & 0xff;
+    buf[2] = mask >> 8;
+    memcpy(out, buf, n);
+    return n;
+  }
+
+  /**
+   * Get the distance back to the reference of an encoded record.
+   *
+   * @param encoded The encoded record.
+   * @param len The length of the encoded record.
+   * @return The distance in record ids; 0 if the record is stored in full.
+   */
+  static uint64_t distance_of(const unsigned char* encoded, uint16_t len) {
+    uint64_t distance = 0;
+    if (len > 3 && encoded[0] == DELTA) {
+      get_varint(encoded + 3, encoded + len, distance);
+    }
+    return distance;
+  }
+
+  /**
+   * Decode a record.
+   *
+   * @param encoded The encoded record.
+   * @param len The length of the encoded record.
+   * @param ref The decoded reference, for a delta.
+   * @param ref_len The length of the reference.
+   * @param out The decoded record (at most MAX_RECORD_LEN bytes).
+   * @return The length of the decoded record; 0 if it is malformed.
+   */
+  uint16_t decode(const unsigned char* encoded, uint16_t len,
+                  const unsigned char* ref, uint16_t ref_len,
+                  unsigned char* out) const {
+    if (len == 0) {
+      return 0;
+    }
+    if (encoded[0] == FULL) {
+      memcpy(out, encoded + 1, len - 1);
+      return len - 1;
+    }
+    if (encoded[0] != DELTA || len < 4 || ref_len > MAX_RECORD_LEN) {
+      return 0;
+    }
+
+    const unsigned char* p = encoded + 3;
+    const unsigned char* end = encoded + len;
+    uint16_t mask = encoded[1] | (encoded[2] << 8);
+    uint64_t distance;
+    p = get_varint(p, end, distance);
+
+    memcpy(out, ref, ref_len);
+    for (uint32_t f = 0; f < num_fields_ && p != NULL; f++) {
+      if (!(mask & (1 << f))) {
+        continue;
+      }
+      const field& fld = fields_[f];
+      if (fld.flags & COUNTER) {
+        uint64_t delta;
+        p = get_varint(p, end, delta);
+        uint64_t v = load(ref + fld.offset, fld.width, fld.flags);
+        store(out + fld.offset, fld.width, fld.flags, v + unzigzag(delta));
+      } else if (end - p >= fld.width) {
+        memcpy(out + fld.offset, p, fld.width);
+        p += fld.width;
+      } else {
+        p = NULL;
+      }
+    }
+
+    if (p != NULL && (mask & PATCHES)) {
+      uint32_t num_patches = p < end ? *p++ : 0;
+      if (end - p < 2 * num_patches) {
+        return 0;
+      }
+      for (uint32_t k = 0; k < num_patches; k++, p += 2) {
+        if (p[0] < ref_len) {
+          out[p[0]] = p[1];
+        }
+      }
+    }
+    return p != NULL ? ref_len : 0;
+  }
+
+ private:
+  /* Field flags */
+  static const uint8_t COUNTER = 1;     /* encoded as a difference */
+  static const uint8_t HOST_ORDER = 2;  /* not in network byte order */
+
+  /* Mask bit of the other bytes that differ */
+  static const uint16_t PATCHES = 0x8000;
+
+  static const uint32_t MAX_FIELDS = 15;
+
+  struct field {
+    uint32_t offset;
+    uint32_t width;
+    uint8_t flags;
+  };
+
+  void add_field(uint32_t offset, uint32_t width, uint8_t flags) {
+    field& fld = fields_[num_fields_++];
+    fld.offset = offset;
+    fld.width = width;
+    fld.flags = flags;
+    memset(covered_ + offset, 1, width);
+  }
+
+  static uint64_t load(const unsigned char* p, uint32_t width, uint8_t flags) {
+    uint64_t v = 0;
+    if (flags & HOST_ORDER) {
+      memcpy(&v, p, width);
+    } else {
+      for (uint32_t i = 0; i < width; i++) {
+        v = (v << 8) | p[i];
+      }
+    }
+    return v;
+  }
+
+  static void store(unsigned char* p, uint32_t width, uint8_t flags,
+                    uint64_t v) {
+    if (flags & HOST_ORDER) {
+      memcpy(p, &v, width);
+    } else {
+      for (uint32_t i = width; i > 0; i--) {
+        p[i - 1] = v & 0xff;
+        v >>= 8;
+      }
+    }
+  }
+
+  /* Differences wrap around at the width of their field */
+  static int64_t sign_extend(uint64_t v, uint32_t width) {
+    uint32_t shift = 64 - 8 * width;
+    return (int64_t) (v << shift) >> shift;
+  }
+
+  static uint64_t zigzag(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+  }
+
+  static int64_t unzigzag(uint64_t v) {
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+  }
+
+  static uint32_t put_varint(uint64_t v, unsigned char* out) {
+    uint32_t n = 0;
+    while (v >= 0x80) {
+      out[n++] = (v & 0x7f) | 0x80;
+      v >>= 7;
+    }
+    out[n++] = v;
+    return n;
+  }
+
+  /* Returns the position after the varint, or NULL if it is truncated */
+  static const unsigned char* get_varint(const unsigned char* p,
+                                         const unsigned char* end,
+                                         uint64_t& v) {
+    v = 0;
+    for (uint32_t shift = 0; p != NULL && p < end && shift < 64; shift += 7) {
+      unsigned char byte = *p++;
+      v |= (uint64_t) (byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        return p;
+      }
+    }
+    return NULL;
+  }
+
+  uint32_t prefix_len_;
+  field fields_[MAX_FIELDS];
+  uint32_t num_fields_;
+
+  /* Whether each record byte belongs to a field */
+  unsigned char covered_[MAX_RECORD_LEN];
+};
+
+/**
+ * Per-writer table of the reference header of recent TCP flows, for
+ * header_codec. Direct-mapped on a hash of the addresses and ports of the
+ * flow; a flow that collides with another one starts from a new reference.
+ */
+class flow_table {
+ public:
+  static const uint32_t NUM_SLOTS = 1024;
+
+  struct entry {
+    uint64_t key;
+    uint64_t ref_id;     /* record id of the reference */
+    uint64_t ref_epoch;  /* epoch of the log-store it was inserted in */
+    uint16_t ref_len;    /* 0 if the entry is empty */
+    unsigned char ref[header_codec::MAX_RECORD_LEN];
+  };
+
+  flow_table() {
+    for (uint32_t i = 0; i < NUM_SLOTS; i++) {
+      slots_[i].ref_len = 0;
+    }
+  }
+
+  /**
+   * Get the entry of the flow of a TCP packet.
+   *
+   * @param hdrs The parsed headers of the packets.
+   * @param i The index of the packet in hdrs.
+   * @param key The key of the flow.
+   * @return The entry; it holds the reference of the flow if its key and
+   *  ref_len match.
+   */
+  entry& lookup(const header_batch& hdrs, uint32_t i, uint64_t& key) {
+    key = ((uint64_t) hdrs.src_ip[i] << 32 | hdrs.dst_ip[i])
+        ^ ((uint64_t) hdrs.src_port[i] << 16 | hdrs.dst_port[i]) * 0x9e3779b1;
+    uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+    return slots_[(h >> 32) % NUM_SLOTS];
+  }
+
+ private:
+  entry slots_[NUM_SLOTS];
+};
+
+}
+
+#endif /* NETPLAY_FLOWCODEC_H_ */
@@ -0,0 +1,227 @@
+#include "packetstore.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "testpackets.h"
+
+namespace {
+
+const uint32_t kBatch = netplay::test::packet_batch::SIZE;
+const uint16_t kTcpLen = 66;  // Ethernet + IPv4 + TCP with timestamps
+const uint16_t kUdpLen = 42;  // Ethernet + IPv4 + UDP
+const uint32_t kFlows = 16;
+
+// Packet number n belongs to flow n % kFlows; each of its packets advances
+// the IP ID by 1, the sequence number by 1448 and the timestamp option by
+// 1, and every fourth one updates the window. Every 50th packet is UDP.
+uint16_t BuildPacket(unsigned char *pkt, uint64_t n) {
+  uint32_t flow = n % kFlows;
+  uint32_t k = n / kFlows;
+  bool udp = n % 50 == 49;
+  uint16_t len = udp ? kUdpLen : kTcpLen;
+  memset(pkt, 0, len);
+  pkt[12] = 0x08;
+  unsigned char *ip = pkt + 14;
+  ip[0] = 0x45;
+  uint16_t ip_len = udp ? 28 : 1500;
+  ip[2] = ip_len >> 8;
+  ip[3] = ip_len & 0xff;
+  ip[4] = k >> 8;
+  ip[5] = k & 0xff;
+  ip[8] = 64;
+  ip[9] = udp ? 17 : 6;
+  ip[10] = n >> 8;
+  ip[11] = n & 0xff;
+  ip[12] = 10;
+  ip[15] = flow;
+  ip[16] = 10;
+  ip[19] = 100;
+  unsigned char *l4 = ip + 20;
+  l4[0] = 0x9c;
+  l4[1] = flow;
+  l4[3] = 80;
+  if (udp) {
+    return len;
+  }
+  uint32_t seq = 1000 * flow + 1448 * k;
+  for (int i = 0; i < 4; i++) {
+    l4[4 + i] = seq >> (24 - 8 * i);
+  }
+  l4[12] = 0x80;
+  l4[13] = 0x10;
+  l4[14] = 0x01;
+  l4[15] = k / 4;
+  l4[16] = k * 7;
+  l4[17] = n;
+  l4[20] = 1;
+  l4[21] = 1;
+  l4[22] = 8;
+  l4[23] = 10;
+  l4[27] = k;
+  return len;
+}
+
+// Inserts packets [first, first + kBatch), prefixed by their insertion time if
+// prefix is set.
+void InsertBatch(netplay::packet_store::handle *handle, uint64_t first,
+                 bool prefix) {
+  netplay::test::packet_batch packets(first, BuildPacket);
+  uint64_t now_ns = first * 1000;
+  if (!prefix) {
+    handle->insert_packets(packets.pkts, packets.hdrs, kBatch, now_ns);
+    return;
+  }
+
+  unsigned char recs[kBatch][sizeof(uint64_t) + kTcpLen];
+  const unsigned char *rec_ptrs[kBatch];
+  uint16_t rec_lens[kBatch];
+  for (uint32_t i = 0; i < kBatch; i++) {
+    uint64_t time_ns = now_ns + i;
+    memcpy(recs[i], &time_ns, sizeof(time_ns));
+    memcpy(recs[i] + sizeof(time_ns), packets.pkts[i], packets.lens[i]);
+    rec_ptrs[i] = recs[i];
+    rec_lens[i] = sizeof(time_ns) + packets.lens[i];
+  }
+  handle->insert_packets(rec_ptrs, rec_lens, packets.hdrs, kBatch, now_ns);
+}
+
+TEST(FlowCodecTest, RoundTripsDeltas) {
+  netplay::header_codec codec(0);
+  unsigned char ref[kTcpLen], pkt[kTcpLen], enc[kTcpLen + 1], out[kTcpLen];
+  BuildPacket(ref, 0);
+  for (uint64_t k = 1; k < 300; k++) {
+    BuildPacket(pkt, k * kFlows);
+    uint16_t len = codec.encode_delta(ref, pkt, kTcpLen, k * kFlows, enc);
+    ASSERT_NE(0, len);
+    ASSERT_GE(32, len);  // header_codec::MAX_DELTA_LEN
+    ASSERT_EQ(k * kFlows, netplay::header_codec::distance_of(enc, len));
+    ASSERT_EQ(kTcpLen, codec.decode(enc, len, ref, kTcpLen, out));
+    ASSERT_EQ(0, memcmp(pkt, out, kTcpLen));
+  }
+
+  // Headers that differ in too many other bytes are not encoded as deltas
+  BuildPacket(pkt, kFlows);
+  memset(pkt, 0xff, 12);
+  ASSERT_EQ(0, codec.encode_delta(ref, pkt, kTcpLen, 1, enc));
+  uint16_t len = netplay::header_codec::encode_full(pkt, kTcpLen, enc);
+  ASSERT_EQ(kTcpLen + 1, len);
+  ASSERT_EQ(0U, netplay::header_codec::distance_of(enc, len));
+  ASSERT_EQ(kTcpLen, codec.decode(enc, len, NULL, 0, out));
+  ASSERT_EQ(0, memcmp(pkt, out, kTcpLen));
+}
+
+TEST(FlowCodecTest, CompressesPacketStore) {
+  const uint64_t kPackets = 400 * kBatch;
+  netplay::packet_store plain;
+  netplay::packet_store compressed;
+  ASSERT_TRUE(compressed.enable_compression(sizeof(uint64_t)));
+  netplay::packet_store::handle *plain_handle = plain.get_handle();
+  netplay::packet_store::handle *handle = compressed.get_handle();
+  for (uint64_t first = 0; first < kPackets; first += kBatch) {
+    InsertBatch(plain_handle, first, true);
+    InsertBatch(handle, first, true);
+  }
+  ASSERT_FALSE(compressed.enable_compression(sizeof(uint64_t)));
+
+  // TCP headers with timestamps shrink from 74 bytes to at most 24 bytes
+  ASSERT_GT(plain_handle->size(), 3 * handle->size());
+
+  unsigned char expected[sizeof(uint64_t) + kTcpLen];
+  unsigned char actual[netplay::header_codec::MAX_RECORD_LEN];
+  for (uint64_t id = 0; id < kPackets; id++) {
+    ASSERT_TRUE(plain_handle->get(expected, id));
+    ASSERT_TRUE(handle->get(actual, id));
+    uint16_t len = sizeof(uint64_t) + (id % 50 == 49 ? kUdpLen : kTcpLen);
+    ASSERT_EQ(0, memcmp(expected, actual, len)) << id;
+
+    uint32_t extracted = 4;
+    ASSERT_TRUE(handle->extract(actual, id, 8 + 14 + 24 + 4, extracted));
+    ASSERT_EQ(id % 50 == 49 ? 0U : 4U, extracted);
+    ASSERT_EQ(0, memcmp(expected + 8 + 14 + 24 + 4, actual, extracted));
+  }
+
+  // Scans return the same portions of the records as uncompressed
+  std::vector<uint64_t> ids;
+  for (uint64_t id = 0; id < kPackets; id += 3) {
+    ids.push_back(id);
+  }
+  std::vector<std::vector<unsigned char>> plain_scan, scan;
+  auto collect = [](std::vector<std::vector<unsigned char>> &out) {
+    return [&out](const unsigned char *const *data, const uint16_t *lens,
+                  uint32_t n) {
+      for (uint32_t i = 0; i < n; i++) {
+        out.emplace_back(data[i], data[i] + lens[i]);
+      }
+    };
+  };
+  plain_handle->scan(ids, sizeof(uint64_t), 40, collect(plain_scan));
+  handle->scan(ids, sizeof(uint64_t), 40, collect(scan));
+  ASSERT_EQ(ids.size(), scan.size());
+  ASSERT_EQ(plain_scan, scan);
+
+  delete plain_handle;
+  delete handle;
+}
+
+// Packet filter with the signature of a JIT-compiled BPF program; matches TCP
+// packets.
+u_int IsTcp(u_char *pkt, u_int wirelen, u_int buflen) {
+  return wirelen == kTcpLen && buflen == kTcpLen && pkt[23] == 6;
+}
+
+TEST(FlowCodecTest, StreamsSeeDecodedHeaders) {
+  netplay::packet_store store;
+  ASSERT_TRUE(store.enable_compression());
+  uint32_t stream_id = store.add_stream(IsTcp);
+  netplay::packet_store::handle *handle = store.get_handle();
+  for (uint64_t first = 0; first < 10 * kBatch; first += kBatch) {
+    InsertBatch(handle, first, false);
+  }
+
+  std::vector<uint64_t> results;
+  handle->filter_stream(results, stream_id, handle->num_records());
+  ASSERT_EQ(10 * kBatch - 6, results.size());
+  for (uint64_t id : results) {
+    ASSERT_NE(49U, id % 50);
+  }
+  delete handle;
+}
+
+TEST(FlowCodecTest, SubscriptionsDecodeRecords) {
+  netplay::packet_store store;
+  ASSERT_TRUE(store.enable_compression(sizeof(uint64_t)));
+  uint32_t stream_id = store.add_stream(IsTcp, sizeof(uint64_t));
+  netplay::packet_store::handle *handle = store.get_handle();
+  netplay::packet_store::subscription *packets =
+      handle->subscribe(stream_id, 0, false, sizeof(uint64_t));
+  netplay::packet_store::subscription *records = handle->subscribe(stream_id);
+  for (uint64_t first = 0; first < 10 * kBatch; first += kBatch) {
+    InsertBatch(handle, first, true);
+  }
+
+  // Records are decoded, and cut at the offset of the subscription
+  std::vector<uint64_t> ids, record_ids;
+  std::vector<std::string> pkts, recs;
+  ASSERT_EQ(10 * kBatch - 6, packets->poll(ids, 10 * kBatch, &pkts));
+  ASSERT_EQ(ids.size(), records->poll(record_ids, 10 * kBatch, &recs));
+  ASSERT_EQ(ids, record_ids);
+  for (size_t i = 0; i < ids.size(); i++) {
+    unsigned char pkt[kTcpLen];
+    ASSERT_EQ(kTcpLen, BuildPacket(pkt, ids[i]));
+    ASSERT_EQ(std::string((const char *) pkt, kTcpLen), pkts[i]) << ids[i];
+
+    uint64_t time_ns = ids[i] / kBatch * kBatch * 1000 + ids[i] % kBatch;
+    ASSERT_EQ(sizeof(time_ns) + kTcpLen, recs[i].size());
+    ASSERT_EQ(0, memcmp(&time_ns, recs[i].data(), sizeof(time_ns)));
+    ASSERT_EQ(pkts[i], recs[i].substr(sizeof(time_ns)));
+  }
+  delete packets;
+  delete records;
+  delete handle;
+}
+
+}  // namespace (unnamed)
@@ -0,0 +1,324 @@
+#ifndef NETPLAY_FLOWINDEX_H_
+#define NETPLAY_FLOWINDEX_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+#include "entrylist.h"
+#include "headerparse.h"
+
+namespace netplay {
+
+/**
+ * Canonical 5-tuple of a flow: the endpoint with the smaller (address, port)
+ * comes first, so that both directions of a connection share a key. Ports
+ * are 0 for packets without ports.
+ */
+struct flow_key {
+  flow_key()
+      : ip_lo(0),
+        ip_hi(0),
+        port_lo(0),
+        port_hi(0),
+        proto(0) {
+  }
+
+  flow_key(uint32_t src_ip, uint32_t dst_ip, uint16_t src_port,
+           uint16_t dst_port, uint8_t proto_)
+      : proto(proto_) {
+    if (src_ip < dst_ip || (src_ip == dst_ip && src_port <= dst_port)) {
+      ip_lo = src_ip;
+      ip_hi = dst_ip;
+      port_lo = src_port;
+      port_hi = dst_port;
+    } else {
+      ip_lo = dst_ip;
+      ip_hi = src_ip;
+      port_lo = dst_port;
+      port_hi = src_port;
+    }
+  }
+
+  bool operator==(const flow_key& other) const {
+    return ip_lo == other.ip_lo && ip_hi == other.ip_hi
+        && port_lo == other.port_lo && port_hi == other.port_hi
+        && proto == other.proto;
+  }
+
+  uint64_t hash() const {
+    uint64_t h = ((uint64_t) ip_lo << 32 | ip_hi) * 0x9e3779b97f4a7c15ULL;
+    h ^= ((uint64_t) port_lo << 24 | (uint64_t) port_hi << 8 | proto)
+        * 0xc2b2ae3d27d4eb4fULL;
+    return h ^ (h >> 29);
+  }
+
+  uint32_t ip_lo;
+  uint32_t ip_hi;
+  uint16_t port_lo;
+  uint16_t port_hi;
+  uint8_t proto;
+};
+
+/* Counters of a flow */
+struct flow_summary {
+  flow_key key;
+  uint64_t packets;
+  uint64_t bytes;     /* sum of IP lengths */
+  uint64_t first_ns;  /* insertion time of the first packet */
+  uint64_t last_ns;   /* insertion time of the last packet */
+};
+
+/**
+ * Index from the 5-tuple of IPv4 packets to flows, each with the chain of
+ * the record ids of its packets and its counters; e.g., to get all packets
+ * of a connection in time proportional to its size, rather than by
+ * intersecting the posting lists of its addresses and ports.
+ *
+ * Flows are numbered in order of their first packet, and found through an
+ * open-addressing hash table of flow ids. Inserters take a mutex only to
+ * add a flow; lookups, chain appends and counter updates are lock-free.
+ * Chains are compressed_entry_lists, so ids take a byte or two each.
+ *
+ * The index holds up to max_flows flows; packets of further flows are not
+ * indexed by flow. Flows are not dropped by the retention policy of the
+ * store, but their chains are read from its low-water mark on.
+ */
+class flow_index {
+ public:
+  static const uint32_t NO_FLOW = UINT32_MAX;
+  static const uint32_t DEFAULT_MAX_FLOWS = 1U << 20;
+
+  /* Flows are allocated in chunks of CHUNK_FLOWS */
+  static const uint32_t CHUNK_SHIFT = 10;
+  static const uint32_t CHUNK_FLOWS = 1U << CHUNK_SHIFT;
+
+  /**
+   * Constructor to initialize the flow index.
+   *
+   * @param max_flows Maximum number of flows.
+   */
+  explicit flow_index(uint32_t max_flows = DEFAULT_MAX_FLOWS)
+      : max_flows_(std::max(max_flows, 1U)),
+        num_flows_(0),
+        untracked_(0) {
+    /* At most half the slots are in use */
+    num_slots_ = 2;
+    while (num_slots_ < 2 * (uint64_t) max_flows_) {
+      num_slots_ *= 2;
+    }
+    slots_ = static_cast<std::atomic<uint32_t>*>(
+        calloc(num_slots_, sizeof(std::atomic<uint32_t>)));
+    num_chunks_ = (max_flows_ + CHUNK_FLOWS - 1) >> CHUNK_SHIFT;
+    chunks_ = new std::atomic<flow*>[num_chunks_];
+    for (uint32_t i = 0; i < num_chunks_; i++) {
+      chunks_[i].store(NULL, std::memory_order_relaxed);
+    }
+  }
+
+  ~flow_index() {
+    for (uint32_t i = 0; i < num_chunks_; i++) {
+      delete[] chunks_[i].load(std::memory_order_acquire);
+    }
+    delete[] chunks_;
+    free(slots_);
+  }
+
+  /**
+   * Add a batch of parsed packet headers to the flows of their IPv4
+   * packets.
+   *
+   * @param start_id The record id of the first packet.
+   * @param hdrs The parsed headers of the packets.
+   * @param num_pkts The number of packets.
+   * @param now_ns The insertion time of the batch.
+   */
+  void add(uint64_t start_id, const header_batch& hdrs, uint32_t num_pkts,
+           uint64_t now_ns) {
+    for (uint32_t i = 0; i < num_pkts; i++) {
+      if (!(hdrs.flags[i] & header_batch::IPV4)) {
+        continue;
+      }
+      bool ports = hdrs.flags[i] & header_batch::PORTS;
+      flow_key key(hdrs.src_ip[i], hdrs.dst_ip[i],
+                   ports ? hdrs.src_port[i] : 0,
+                   ports ? hdrs.dst_port[i] : 0, hdrs.proto[i]);
+      uint32_t flow_id = find_or_add(key, now_ns);
+      if (flow_id == NO_FLOW) {
+        untracked_.fetch_add(1U, std::memory_order_relaxed);
+        continue;
+      }
+
+      flow& f = at(flow_id);
+      f.ids.push_back(start_id + i);
+      f.packets.fetch_add(1U, std::memory_order_relaxed);
+      f.bytes.fetch_add(hdrs.ip_len[i], std::memory_order_relaxed);
+      uint64_t last = f.last_ns.load(std::memory_order_relaxed);
+      while (last < now_ns
+          && !f.last_ns.compare_exchange_weak(last, now_ns,
+                                              std::memory_order_relaxed)) {
+      }
+    }
+  }
+
+  /**
+   * Find the flow with a given key.
+   *
+   * @param key The key of the flow.
+   * @return The flow id, or NO_FLOW if the flow is not indexed.
+   */
+  uint32_t find(const flow_key& key) const {
+    uint64_t mask = num_slots_ - 1;
+    for (uint64_t s = key.hash() & mask;; s = (s + 1) & mask) {
+      uint32_t slot = slots_[s].load(std::memory_order_acquire);
+      if (slot == 0) {
+        return NO_FLOW;
+      }
+      if (at(slot - 1).key == key) {
+        return slot - 1;
+      }
+    }
+  }
+
+  /**
+   * Get the record ids of the packets of a flow in [min_rid, max_rid).
+   *
+   * @param results The sorted record ids.
+   * @param flow_id The flow id, from find().
+   * @param min_rid The smallest record id to consider.
+   * @param max_rid One past the largest record id to consider.
+   */
+  void records(std::vector<uint64_t>& results, uint32_t flow_id,
+               uint64_t min_rid, uint64_t max_rid) const {
+    results.clear();
+    if (flow_id >= num_flows()) {
+      return;
+    }
+    at(flow_id).ids.for_each([&results, min_rid, max_rid](uint64_t id) {
+      if (id >= min_rid && id < max_rid) {
+        results.push_back(id);
+      }
+    });
+
+    /* Ids are appended in order, unless several inserters share the store */
+    if (!std::is_sorted(results.begin(), results.end())) {
+      std::sort(results.begin(), results.end());
+    }
+  }
+
+  /**
+   * Get the counters of a flow.
+   *
+   * @param summary The counters.
+   * @param flow_id The flow id.
+   * @return true if the flow exists, false otherwise.
+   */
+  bool summary(flow_summary& summary, uint32_t flow_id) const {
+    if (flow_id >= num_flows()) {
+      return false;
+    }
+    const flow& f = at(flow_id);
+    summary.key = f.key;
+    summary.packets = f.packets.load(std::memory_order_relaxed);
+    summary.bytes = f.bytes.load(std::memory_order_relaxed);
+    summary.first_ns = f.first_ns;
+    summary.last_ns = f.last_ns.load(std::memory_order_relaxed);
+    return true;
+  }
+
+  /**
+   * Get the number of flows; flow ids are below it.
+   */
+  uint32_t num_flows() const {
+    return num_flows_.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Get the number of IPv4 packets not indexed because the index was full.
+   */
+  uint64_t num_untracked() const {
+    return untracked_.load(std::memory_order_relaxed);
+  }
+
+  size_t storage_size() const {
+    size_t size = num_slots_ * sizeof(std::atomic<uint32_t>);
+    uint32_t n = num_flows();
+    for (uint32_t i = 0; i < n; i++) {
+      size += at(i).ids.storage_size();
+    }
+    return size + ((n + CHUNK_FLOWS - 1) >> CHUNK_SHIFT)
+        * CHUNK_FLOWS * sizeof(flow);
+  }
+
+ private:
+  struct flow {
+    flow_key key;
+    uint64_t first_ns;
+    std::atomic<uint64_t> packets;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> last_ns;
+    slog::compressed_entry_list ids;
+  };
+
+  flow& at(uint32_t flow_id) const {
+    flow* chunk = chunks_[flow_id >> CHUNK_SHIFT].load(
+        std::memory_order_acquire);
+    return chunk[flow_id & (CHUNK_FLOWS - 1)];
+  }
+
+  uint32_t find_or_add(const flow_key& key, uint64_t now_ns) {
+    uint32_t flow_id = find(key);
+    if (flow_id != NO_FLOW) {
+      return flow_id;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t mask = num_slots_ - 1;
+    uint64_t s = key.hash() & mask;
+    for (;; s = (s + 1) & mask) {
+      uint32_t slot = slots_[s].load(std::memory_order_relaxed);
+      if (slot == 0) {
+        break;
+      }
+      if (at(slot - 1).key == key) {
+        return slot - 1;
+      }
+    }
+
+    flow_id = num_flows_.load(std::memory_order_relaxed);
+    if (flow_id >= max_flows_) {
+      return NO_FLOW;
+    }
+    std::atomic<flow*>& chunk = chunks_[flow_id >> CHUNK_SHIFT];
+    if (chunk.load(std::memory_order_relaxed) == NULL) {
+      chunk.store(new flow[CHUNK_FLOWS], std::memory_order_release);
+    }
+
+    /* The flow is initialized before it is published */
+    flow& f = at(flow_id);
+    f.key = key;
+    f.first_ns = now_ns;
+    f.packets.store(0, std::memory_order_relaxed);
+    f.bytes.store(0, std::memory_order_relaxed);
+    f.last_ns.store(now_ns, std::memory_order_relaxed);
+    slots_[s].store(flow_id + 1, std::memory_order_release);
+    num_flows_.store(flow_id + 1, std::memory_order_release);
+    return flow_id;
+  }
+
+  const uint32_t max_flows_;
+  uint64_t num_slots_;
+  std::atomic<uint32_t>* slots_;  /* flow id + 1; 0 if empty */
+  uint32_t num_chunks_;
+  std::atomic<flow*>* chunks_;
+  std::atomic<uint32_t> num_flows_;
+  std::atomic<uint64_t> untracked_;
+  std::mutex mutex_;
+};
+
+}
+
+#endif /* NETPLAY_FLOWINDEX_H_ */
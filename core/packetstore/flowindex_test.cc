@@ -0,0 +1,110 @@
+#include "flowindex.h"
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+const uint32_t kBatch = 32;
+
+// Fills a batch of headers of UDP packets from 10.0.0.1 port 1000 to
+// 10.0.0.2 port first + i, or back if reverse is set.
+void BuildBatch(netplay::header_batch &hdrs, uint32_t first, bool reverse) {
+  for (uint32_t i = 0; i < kBatch; i++) {
+    hdrs.flags[i] = netplay::header_batch::IPV4 | netplay::header_batch::PORTS;
+    hdrs.src_ip[i] = reverse ? 0x0a000002 : 0x0a000001;
+    hdrs.dst_ip[i] = reverse ? 0x0a000001 : 0x0a000002;
+    hdrs.src_port[i] = reverse ? first + i : 1000;
+    hdrs.dst_port[i] = reverse ? 1000 : first + i;
+    hdrs.proto[i] = 17;
+    hdrs.ip_len[i] = 100 + i;
+  }
+}
+
+TEST(FlowIndexTest, ChainsRecordsOfBothDirections) {
+  netplay::flow_index index;
+  netplay::header_batch hdrs;
+  for (uint64_t b = 0; b < 100; b++) {
+    BuildBatch(hdrs, 0, b % 2);
+    index.add(b * kBatch, hdrs, kBatch, b + 1);
+  }
+  ASSERT_EQ(kBatch, index.num_flows());
+
+  netplay::flow_key key(0x0a000002, 0x0a000001, 5, 1000, 17);
+  uint32_t flow_id = index.find(key);
+  ASSERT_EQ(5U, flow_id);
+  ASSERT_TRUE(index.find(netplay::flow_key(0x0a000002, 0x0a000001, 5, 1000, 6))
+              == netplay::flow_index::NO_FLOW);
+
+  std::vector<uint64_t> results;
+  index.records(results, flow_id, 0, UINT64_MAX);
+  ASSERT_EQ(100U, results.size());
+  for (uint64_t b = 0; b < 100; b++) {
+    ASSERT_EQ(b * kBatch + 5, results[b]);
+  }
+  index.records(results, flow_id, 10 * kBatch, 20 * kBatch);
+  ASSERT_EQ(10U, results.size());
+  ASSERT_EQ(10 * kBatch + 5, results[0]);
+
+  netplay::flow_summary summary;
+  ASSERT_TRUE(index.summary(summary, flow_id));
+  ASSERT_TRUE(summary.key == key);
+  ASSERT_EQ(100U, summary.packets);
+  ASSERT_EQ(100U * 105, summary.bytes);
+  ASSERT_EQ(1U, summary.first_ns);
+  ASSERT_EQ(100U, summary.last_ns);
+  ASSERT_FALSE(index.summary(summary, kBatch));
+}
+
+TEST(FlowIndexTest, BoundsNumberOfFlows) {
+  netplay::flow_index index(40);
+  netplay::header_batch hdrs;
+  BuildBatch(hdrs, 0, false);
+  index.add(0, hdrs, kBatch, 1);
+  BuildBatch(hdrs, kBatch, false);
+  index.add(kBatch, hdrs, kBatch, 2);
+  ASSERT_EQ(40U, index.num_flows());
+  ASSERT_EQ(2 * kBatch - 40, index.num_untracked());
+
+  // Known flows are still indexed
+  BuildBatch(hdrs, 0, true);
+  index.add(2 * kBatch, hdrs, kBatch, 3);
+  ASSERT_EQ(2 * kBatch - 40, index.num_untracked());
+}
+
+TEST(FlowIndexTest, ConcurrentInserters) {
+  const uint32_t kThreads = 4;
+  const uint64_t kBatches = 500;
+  netplay::flow_index index;
+
+  // Thread t inserts the even (or odd) batches of flows [t / 2 * kBatch, ...)
+  std::vector<std::thread> writers;
+  for (uint32_t t = 0; t < kThreads; t++) {
+    writers.push_back(std::thread([&index, t] {
+      netplay::header_batch hdrs;
+      BuildBatch(hdrs, t / 2 * kBatch, t % 2);
+      for (uint64_t b = t % 2; b < kBatches; b += 2) {
+        index.add((t / 2 * kBatches + b) * kBatch, hdrs, kBatch, b + 1);
+      }
+    }));
+  }
+  for (std::thread &w : writers) {
+    w.join();
+  }
+  ASSERT_EQ(2 * kBatch, index.num_flows());
+
+  std::vector<uint64_t> results;
+  for (uint32_t port = 0; port < 2 * kBatch; port++) {
+    netplay::flow_key key(0x0a000001, 0x0a000002, 1000, port, 17);
+    index.records(results, index.find(key), 0, UINT64_MAX);
+    ASSERT_EQ(kBatches, results.size());
+    uint64_t base = port / kBatch * kBatches * kBatch + port % kBatch;
+    for (uint64_t b = 0; b < kBatches; b++) {
+      ASSERT_EQ(base + b * kBatch, results[b]);
+    }
+  }
+}
+
+}  // namespace (unnamed)
@@ -0,0 +1,287 @@
+#ifndef NETPLAY_HEADERPARSE_H_
+#define NETPLAY_HEADERPARSE_H_
+
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
+
+#include <x86intrin.h>
+
+namespace netplay {
+
+/**
+ * Header fields extracted from a batch of packets, in struct-of-arrays
+ * layout. Addresses, ports and lengths are in host byte order.
+ */
+struct header_batch {
+  static const uint32_t MAX_BATCH = 32;
+
+  /* Flags describing which fields are valid for a packet */
+  static const uint8_t IPV4 = 1;      /* src_ip, dst_ip, proto, ip_len, ttl */
+  static const uint8_t PORTS = 2;     /* src_port, dst_port, tcp_flags */
+  static const uint8_t FRAGMENT = 4;  /* packet is an IPv4 fragment */
+
+  /* Maximum number of header bytes stored for a packet:
+   * Ethernet (14) + IPv4 with options (60) + TCP with options (60) */
+  static const uint16_t MAX_HDR_LEN = 134;
+
+  uint32_t src_ip[MAX_BATCH];
+  uint32_t dst_ip[MAX_BATCH];
+  uint16_t src_port[MAX_BATCH];
+  uint16_t dst_port[MAX_BATCH];
+  uint16_t ip_len[MAX_BATCH];
+  uint16_t hdr_len[MAX_BATCH];  /* number of header bytes to store */
+  uint8_t proto[MAX_BATCH];
+  uint8_t ttl[MAX_BATCH];
+  uint8_t tcp_flags[MAX_BATCH];  /* 0 unless proto is TCP */
+  uint8_t flags[MAX_BATCH];
+};
+
+/**
+ * Parses Ethernet/IPv4/TCP-UDP headers for a batch of packets.
+ *
+ * Non-IPv4 frames (including VLAN-tagged ones) are recorded with their
+ * Ethernet header only and no IPv4 fields. Non-first IPv4 fragments carry no
+ * transport header, so they are recorded without ports; first fragments keep
+ * their ports. Truncated headers are never read past the packet length.
+ */
+class header_parser {
+ public:
+  static const uint16_t ETHER_HDR_LEN = 14;
+  static const uint16_t IPV4_MIN_HDR_LEN = 20;
+  static const uint16_t TCP_MIN_HDR_LEN = 20;
+  static const uint16_t UDP_HDR_LEN = 8;
+  static const uint8_t PROTO_TCP = 6;
+  static const uint8_t PROTO_UDP = 17;
+
+  /**
+   * Parse the headers of a batch of packets.
+   *
+   * @param pkts Pointers to the first byte (Ethernet header) of each packet.
+   * @param pkt_lens The number of contiguous bytes available for each packet.
+   * @param num_pkts The number of packets (at most header_batch::MAX_BATCH).
+   * @param hdrs The parsed header fields.
+   */
+  static void parse(const unsigned char* const * pkts, const uint16_t* pkt_lens,
+                    uint32_t num_pkts, header_batch& hdrs) {
+    if (num_pkts > header_batch::MAX_BATCH) {
+      num_pkts = header_batch::MAX_BATCH;
+    }
+
+    uint32_t i = 0;
+#if __AVX2__
+    for (; i + 4 <= num_pkts; i += 4) {
+      parse4(pkts, pkt_lens, i, hdrs);
+    }
+
+    /* At most 3 packets are left; the bounded count lets the compiler see
+     * that the tail stays within the batch */
+    for (uint32_t j = 0; j < (num_pkts & 3); j++) {
+      parse_one(pkts[i + j], pkt_lens[i + j], i + j, hdrs);
+    }
+#else
+    for (; i < num_pkts; i++) {
+      parse_one(pkts[i], pkt_lens[i], i, hdrs);
+    }
+#endif
+  }
+
+  /**
+   * Parse the headers of a single packet into slot i of a header batch.
+   */
+  static void parse_one(const unsigned char* pkt, uint16_t pkt_len, uint32_t i,
+                        header_batch& hdrs) {
+    assert(i < header_batch::MAX_BATCH);
+
+    hdrs.flags[i] = 0;
+    hdrs.hdr_len[i] = pkt_len < ETHER_HDR_LEN ? pkt_len : ETHER_HDR_LEN;
+
+    if (pkt_len < ETHER_HDR_LEN + IPV4_MIN_HDR_LEN
+        || be16(pkt + 12) != 0x0800) {
+      return;
+    }
+
+    const unsigned char* ip = pkt + ETHER_HDR_LEN;
+    uint16_t ihl = (ip[0] & 0xf) << 2;
+    if ((ip[0] >> 4) != 4 || ihl < IPV4_MIN_HDR_LEN
+        || pkt_len < ETHER_HDR_LEN + ihl) {
+      return;
+    }
+
+    uint16_t frag = be16(ip + 6);
+    hdrs.flags[i] = header_batch::IPV4;
+    hdrs.ip_len[i] = be16(ip + 2);
+    hdrs.proto[i] = ip[9];
+    hdrs.ttl[i] = ip[8];
+    hdrs.tcp_flags[i] = 0;
+    hdrs.src_ip[i] = be32(ip + 12);
+    hdrs.dst_ip[i] = be32(ip + 16);
+    hdrs.hdr_len[i] = ETHER_HDR_LEN + ihl;
+
+    if (frag & 0x3fff) {
+      hdrs.flags[i] |= header_batch::FRAGMENT;
+      /* Only the first fragment carries the transport header */
+      if (frag & 0x1fff) {
+        return;
+      }
+    }
+
+    const unsigned char* l4 = ip + ihl;
+    uint16_t l4_avail = pkt_len - ETHER_HDR_LEN - ihl;
+    uint16_t l4_len;
+    if (hdrs.proto[i] == PROTO_TCP) {
+      if (l4_avail < TCP_MIN_HDR_LEN) {
+        return;
+      }
+      l4_len = (l4[12] >> 4) << 2;
+      if (l4_len < TCP_MIN_HDR_LEN) {
+        l4_len = TCP_MIN_HDR_LEN;
+      }
+      hdrs.tcp_flags[i] = l4[13];
+    } else if (hdrs.proto[i] == PROTO_UDP) {
+      if (l4_avail < UDP_HDR_LEN) {
+        return;
+      }
+      l4_len = UDP_HDR_LEN;
+    } else {
+      return;
+    }
+
+    hdrs.flags[i] |= header_batch::PORTS;
+    hdrs.src_port[i] = be16(l4);
+    hdrs.dst_port[i] = be16(l4 + 2);
+    hdrs.hdr_len[i] += std::min(l4_len, l4_avail);
+  }
+
+ private:
+  static inline uint16_t be16(const unsigned char* p) {
+    return (p[0] << 8) | p[1];
+  }
+
+  static inline uint32_t be32(const unsigned char* p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+        | ((uint32_t) p[2] << 8) | p[3];
+  }
+
+#if __AVX2__
+  /* Gathers the 32-bit words at byte offset off from 4 packets. Lanes that
+   * are not set in mask are not loaded and read as zero. */
+  static inline __m128i gather4(__m256i addrs, int64_t off, __m128i mask) {
+    return _mm256_mask_i64gather_epi32(
+        _mm_setzero_si128(), (const int*) 0,
+        _mm256_add_epi64(addrs, _mm256_set1_epi64x(off)), mask, 1);
+  }
+
+  /**
+   * Parses 4 packets at a time. The fast path handles unfragmented IPv4
+   * TCP/UDP packets whose headers are fully present; all other packets fall
+   * back to parse_one().
+   */
+  static inline void parse4(const unsigned char* const * pkts,
+                            const uint16_t* pkt_lens, uint32_t i,
+                            header_batch& hdrs) {
+    const __m128i bswap32 = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5,
+                                         6, 7, 0, 1, 2, 3);
+    /* Low 16 bits of each lane, byte-swapped, packed into the low 8 bytes */
+    const __m128i lo16 = _mm_set_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 12, 13,
+                                      8, 9, 4, 5, 0, 1);
+    /* High 16 bits of each lane, byte-swapped, packed into the low 8 bytes */
+    const __m128i hi16 = _mm_set_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 14, 15,
+                                      10, 11, 6, 7, 2, 3);
+    /* Byte 3 of each lane, packed into the low 4 bytes */
+    const __m128i byte3 = _mm_set_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                       -1, -1, 15, 11, 7, 3);
+    /* Bytes 2 and 1 of each lane, likewise */
+    const __m128i byte2 = _mm_set_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                       -1, -1, 14, 10, 6, 2);
+    const __m128i byte1 = _mm_set_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                       -1, -1, 13, 9, 5, 1);
+
+    __m256i addrs = _mm256_loadu_si256((const __m256i*) (pkts + i));
+    __m128i lens = _mm_cvtepu16_epi32(
+        _mm_loadl_epi64((const __m128i*) (pkt_lens + i)));
+
+    /* Fixed-offset fields: ethertype, version/IHL, total length, fragment
+     * offset, protocol and addresses all lie within the first 34 bytes */
+    __m128i mask = _mm_cmpgt_epi32(
+        lens, _mm_set1_epi32(ETHER_HDR_LEN + IPV4_MIN_HDR_LEN - 1));
+    __m128i w12 = gather4(addrs, 12, mask);  /* ethertype, ver/ihl, tos */
+    __m128i w16 = gather4(addrs, 16, mask);  /* total length, id */
+    __m128i w20 = gather4(addrs, 20, mask);  /* fragment, ttl, proto */
+    __m128i src = gather4(addrs, 26, mask);
+    __m128i dst = gather4(addrs, 30, mask);
+
+    /* IPv4 with version 4 (ethertype 0x0800 read little-endian) */
+    __m128i ver_ihl = _mm_and_si128(_mm_srli_epi32(w12, 16),
+                                    _mm_set1_epi32(0xff));
+    __m128i ihl = _mm_slli_epi32(_mm_and_si128(ver_ihl, _mm_set1_epi32(0xf)),
+                                 2);
+    mask = _mm_and_si128(
+        mask, _mm_cmpeq_epi32(_mm_and_si128(w12, _mm_set1_epi32(0xf0ffff)),
+                              _mm_set1_epi32(0x400008)));
+    mask = _mm_andnot_si128(
+        _mm_cmpgt_epi32(_mm_set1_epi32(IPV4_MIN_HDR_LEN), ihl), mask);
+
+    /* Not a fragment: MF and offset bits (0x3fff, read little-endian) */
+    mask = _mm_and_si128(
+        mask, _mm_cmpeq_epi32(_mm_and_si128(w20, _mm_set1_epi32(0xff3f)),
+                              _mm_setzero_si128()));
+
+    /* TCP or UDP, with the minimal transport header present */
+    __m128i proto = _mm_srli_epi32(w20, 24);
+    __m128i is_tcp = _mm_cmpeq_epi32(proto, _mm_set1_epi32(PROTO_TCP));
+    __m128i is_udp = _mm_cmpeq_epi32(proto, _mm_set1_epi32(PROTO_UDP));
+    __m128i l4_min = _mm_or_si128(
+        _mm_and_si128(is_tcp, _mm_set1_epi32(TCP_MIN_HDR_LEN)),
+        _mm_and_si128(is_udp, _mm_set1_epi32(UDP_HDR_LEN)));
+    __m128i l4_off = _mm_add_epi32(ihl, _mm_set1_epi32(ETHER_HDR_LEN));
+    mask = _mm_and_si128(mask, _mm_or_si128(is_tcp, is_udp));
+    mask = _mm_andnot_si128(
+        _mm_cmpgt_epi32(_mm_add_epi32(l4_off, l4_min), lens), mask);
+
+    /* Variable-offset fields: ports, and the TCP data offset and flags */
+    __m256i l4_addrs = _mm256_add_epi64(addrs, _mm256_cvtepu32_epi64(l4_off));
+    __m128i ports = gather4(l4_addrs, 0, mask);
+    __m128i w_tcp = gather4(l4_addrs, 12, _mm_and_si128(mask, is_tcp));
+    __m128i doff = _mm_slli_epi32(
+        _mm_srli_epi32(_mm_and_si128(w_tcp, _mm_set1_epi32(0xff)), 4), 2);
+    doff = _mm_max_epi32(doff, _mm_set1_epi32(TCP_MIN_HDR_LEN));
+    __m128i l4_len = _mm_or_si128(_mm_and_si128(is_tcp, doff),
+                                  _mm_and_si128(is_udp, l4_min));
+    __m128i hdr_len = _mm_min_epi32(_mm_add_epi32(l4_off, l4_len), lens);
+
+    _mm_storeu_si128((__m128i*) (hdrs.src_ip + i),
+                     _mm_shuffle_epi8(src, bswap32));
+    _mm_storeu_si128((__m128i*) (hdrs.dst_ip + i),
+                     _mm_shuffle_epi8(dst, bswap32));
+    _mm_storel_epi64((__m128i*) (hdrs.src_port + i),
+                     _mm_shuffle_epi8(ports, lo16));
+    _mm_storel_epi64((__m128i*) (hdrs.dst_port + i),
+                     _mm_shuffle_epi8(ports, hi16));
+    _mm_storel_epi64((__m128i*) (hdrs.ip_len + i),
+                     _mm_shuffle_epi8(w16, lo16));
+    _mm_storel_epi64((__m128i*) (hdrs.hdr_len + i),
+                     _mm_packus_epi32(hdr_len, hdr_len));
+    *(uint32_t*) (hdrs.proto + i) = _mm_cvtsi128_si32(
+        _mm_shuffle_epi8(w20, byte3));
+    *(uint32_t*) (hdrs.ttl + i) = _mm_cvtsi128_si32(
+        _mm_shuffle_epi8(w20, byte2));
+    *(uint32_t*) (hdrs.tcp_flags + i) = _mm_cvtsi128_si32(
+        _mm_shuffle_epi8(w_tcp, byte1));
+    *(uint32_t*) (hdrs.flags + i) = _mm_cvtsi128_si32(_mm_and_si128(
+        _mm_shuffle_epi8(mask, byte3),
+        _mm_set1_epi8(header_batch::IPV4 | header_batch::PORTS)));
+
+    int fast = _mm_movemask_ps(_mm_castsi128_ps(mask));
+    for (uint32_t j = 0; j < 4; j++) {
+      if (!(fast & (1 << j))) {
+        parse_one(pkts[i + j], pkt_lens[i + j], i + j, hdrs);
+      }
+    }
+  }
+#endif
+};
+
+}
+
+#endif /* NETPLAY_HEADERPARSE_H_ */
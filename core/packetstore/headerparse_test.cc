@@ -0,0 +1,224 @@
+#include "headerparse.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+typedef std::vector<unsigned char> Packet;
+
+const uint8_t kTcp = netplay::header_parser::PROTO_TCP;
+const uint8_t kUdp = netplay::header_parser::PROTO_UDP;
+const uint8_t kIcmp = 1;
+
+// Builds an Ethernet/IPv4 packet with opt_words 32-bit words of IPv4 options,
+// the given fragment field and protocol, and a transport header of
+// doff_words 32-bit words for TCP, 8 bytes for UDP and 8 bytes otherwise.
+// With vlan set, the IPv4 header follows an 802.1Q tag. Addresses, ports,
+// TTL and TCP flags are derived from n.
+Packet BuildPacket(uint32_t n, uint8_t proto, uint8_t opt_words = 0,
+                   uint16_t frag = 0, uint8_t doff_words = 5,
+                   bool vlan = false) {
+  uint16_t ihl = 20 + 4 * opt_words;
+  uint16_t l4_len = proto == kTcp ? 4 * doff_words : 8;
+  uint16_t l2_len = vlan ? 18 : 14;
+  Packet pkt(l2_len + ihl + l4_len);
+  for (int i = 0; i < 12; i++) {
+    pkt[i] = n + i;
+  }
+  if (vlan) {
+    pkt[12] = 0x81;
+    pkt[15] = 7;
+  }
+  pkt[l2_len - 2] = 0x08;
+
+  unsigned char *ip = pkt.data() + l2_len;
+  ip[0] = 0x40 | (ihl / 4);
+  ip[2] = (ihl + l4_len) >> 8;
+  ip[3] = (ihl + l4_len) & 0xff;
+  ip[4] = n >> 8;
+  ip[5] = n;
+  ip[6] = frag >> 8;
+  ip[7] = frag & 0xff;
+  ip[8] = 1 + n % 255;
+  ip[9] = proto;
+  ip[12] = 10;
+  ip[13] = n >> 16;
+  ip[14] = n >> 8;
+  ip[15] = n;
+  ip[16] = 192;
+  ip[17] = 168;
+  ip[18] = n >> 4;
+  ip[19] = n * 3;
+  for (uint16_t i = 20; i < ihl; i++) {
+    ip[i] = 0x01;  // NOP options
+  }
+
+  unsigned char *l4 = ip + ihl;
+  l4[0] = n >> 8;
+  l4[1] = n;
+  l4[2] = 0x1f;
+  l4[3] = n * 7;
+  if (proto == kTcp) {
+    l4[12] = doff_words << 4;
+    l4[13] = n * 5;
+  }
+  return pkt;
+}
+
+// Returns a copy of pkt cut to len bytes.
+Packet Truncate(const Packet &pkt, uint16_t len) {
+  return Packet(pkt.begin(), pkt.begin() + len);
+}
+
+// Checks that the fields of packet i that its flags mark as valid are the
+// same in both batches.
+void ExpectSameHeaders(const netplay::header_batch &expected,
+                       const netplay::header_batch &parsed, uint32_t i) {
+  ASSERT_EQ(expected.flags[i], parsed.flags[i]) << "packet " << i;
+  ASSERT_EQ(expected.hdr_len[i], parsed.hdr_len[i]) << "packet " << i;
+  if (expected.flags[i] & netplay::header_batch::IPV4) {
+    ASSERT_EQ(expected.src_ip[i], parsed.src_ip[i]) << "packet " << i;
+    ASSERT_EQ(expected.dst_ip[i], parsed.dst_ip[i]) << "packet " << i;
+    ASSERT_EQ(expected.ip_len[i], parsed.ip_len[i]) << "packet " << i;
+    ASSERT_EQ(expected.proto[i], parsed.proto[i]) << "packet " << i;
+    ASSERT_EQ(expected.ttl[i], parsed.ttl[i]) << "packet " << i;
+    ASSERT_EQ(expected.tcp_flags[i], parsed.tcp_flags[i]) << "packet " << i;
+  }
+  if (expected.flags[i] & netplay::header_batch::PORTS) {
+    ASSERT_EQ(expected.src_port[i], parsed.src_port[i]) << "packet " << i;
+    ASSERT_EQ(expected.dst_port[i], parsed.dst_port[i]) << "packet " << i;
+  }
+}
+
+// Parses the first num_pkts packets as a batch, and checks the result against
+// parsing them one at a time. Each packet is in its own allocation of exactly
+// its length, so that reads past the end can be caught by sanitizers.
+void CheckBatch(const std::vector<Packet> &pkts, uint32_t num_pkts) {
+  const unsigned char *pkt_ptrs[netplay::header_batch::MAX_BATCH];
+  uint16_t pkt_lens[netplay::header_batch::MAX_BATCH];
+  netplay::header_batch expected;
+  for (uint32_t i = 0; i < num_pkts; i++) {
+    pkt_ptrs[i] = pkts[i].data();
+    pkt_lens[i] = pkts[i].size();
+    netplay::header_parser::parse_one(pkt_ptrs[i], pkt_lens[i], i, expected);
+  }
+
+  netplay::header_batch parsed;
+  netplay::header_parser::parse(pkt_ptrs, pkt_lens, num_pkts, parsed);
+  for (uint32_t i = 0; i < num_pkts; i++) {
+    ExpectSameHeaders(expected, parsed, i);
+  }
+}
+
+// Checks every batch size of a mix of packets, so that each packet is parsed
+// both by the 4-packet path and as part of the tail.
+void CheckAllBatchSizes(const std::vector<Packet> &pkts) {
+  for (uint32_t n = 1; n <= pkts.size(); n++) {
+    SCOPED_TRACE(n);
+    CheckBatch(pkts, n);
+    if (testing::Test::HasFatalFailure()) {
+      return;
+    }
+  }
+}
+
+TEST(HeaderParseTest, TcpAndUdp) {
+  std::vector<Packet> pkts;
+  for (uint32_t n = 0; n < netplay::header_batch::MAX_BATCH; n++) {
+    pkts.push_back(n % 3 ? BuildPacket(n, kTcp, 0, 0, 5 + n % 11)
+                         : BuildPacket(n, kUdp));
+  }
+  CheckAllBatchSizes(pkts);
+
+  // The fast path takes these, with ports and TCP flags
+  netplay::header_batch hdrs;
+  const unsigned char *pkt_ptrs[] = {pkts[1].data()};
+  uint16_t pkt_lens[] = {(uint16_t) pkts[1].size()};
+  netplay::header_parser::parse(pkt_ptrs, pkt_lens, 1, hdrs);
+  ASSERT_EQ(netplay::header_batch::IPV4 | netplay::header_batch::PORTS,
+            hdrs.flags[0]);
+  ASSERT_EQ(0x1f07, hdrs.dst_port[0]);
+  ASSERT_EQ(5, hdrs.tcp_flags[0]);
+  ASSERT_EQ(pkts[1].size(), hdrs.hdr_len[0]);
+}
+
+TEST(HeaderParseTest, VlanFrames) {
+  std::vector<Packet> pkts;
+  for (uint32_t n = 0; n < netplay::header_batch::MAX_BATCH; n++) {
+    pkts.push_back(BuildPacket(n, n % 2 ? kTcp : kUdp, 0, 0, 5, n % 4 != 3));
+  }
+  CheckAllBatchSizes(pkts);
+}
+
+TEST(HeaderParseTest, Ipv4Options) {
+  std::vector<Packet> pkts;
+  for (uint32_t n = 0; n < netplay::header_batch::MAX_BATCH; n++) {
+    pkts.push_back(BuildPacket(n, n % 2 ? kTcp : kUdp, n % 11, 0, 5 + n % 3));
+  }
+  CheckAllBatchSizes(pkts);
+}
+
+TEST(HeaderParseTest, Fragments) {
+  // More fragments with offset 0 (first), and offsets with and without the
+  // more-fragments bit (non-first); the don't-fragment bit is not a fragment
+  const uint16_t kFrags[] = {0x2000, 0x2001, 0x00b9, 0x4000, 0x1fff, 0x6000};
+  std::vector<Packet> pkts;
+  for (uint32_t n = 0; n < netplay::header_batch::MAX_BATCH; n++) {
+    pkts.push_back(BuildPacket(n, n % 2 ? kTcp : kUdp, n % 3,
+                               kFrags[n % 6]));
+  }
+  CheckAllBatchSizes(pkts);
+}
+
+TEST(HeaderParseTest, OtherProtocols) {
+  const uint8_t kProtos[] = {kTcp, kIcmp, kUdp, 47, 132, 0};
+  std::vector<Packet> pkts;
+  for (uint32_t n = 0; n < netplay::header_batch::MAX_BATCH; n++) {
+    pkts.push_back(BuildPacket(n, kProtos[n % 6], n % 2));
+  }
+
+  // Non-IPv4 ethertypes and IP versions, and too short IHLs
+  pkts[5][12] = 0x86;
+  pkts[5][13] = 0xdd;
+  pkts[12][13] = 0x06;
+  pkts[9][14] = 0x65;
+  pkts[13][14] = 0x44;
+  pkts[17][14] = 0x40;
+  CheckAllBatchSizes(pkts);
+}
+
+TEST(HeaderParseTest, TruncatedPackets) {
+  const Packet tcp = BuildPacket(1, kTcp, 0, 0, 8);
+  const Packet udp = BuildPacket(2, kUdp);
+  const Packet opts = BuildPacket(3, kTcp, 2);
+  for (uint16_t len = 0; len <= 54; len++) {
+    SCOPED_TRACE(len);
+
+    // Cut packets in every lane, next to whole packets
+    std::vector<Packet> pkts;
+    for (uint32_t n = 0; n < netplay::header_batch::MAX_BATCH; n++) {
+      switch (n % 5) {
+        case 0:
+          pkts.push_back(Truncate(tcp, len));
+          break;
+        case 1:
+          pkts.push_back(Truncate(udp, std::min<uint16_t>(len, udp.size())));
+          break;
+        case 2:
+          pkts.push_back(Truncate(opts, len));
+          break;
+        default:
+          pkts.push_back(BuildPacket(n, kTcp));
+      }
+    }
+    CheckAllBatchSizes(pkts);
+    if (HasFatalFailure()) {
+      return;
+    }
+  }
+}
+
+}  // namespace (unnamed)
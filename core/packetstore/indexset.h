@@ -0,0 +1,376 @@
+#ifndef SLOG_INDEXSET_H_
+#define SLOG_INDEXSET_H_
+
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+#include "tokens.h"
+#include "tieredindex.h"
+#include "monolog.h"
+
+#define OFFSETMIN 1024
+#define OFFSET1 1024
+#define OFFSET2 2048
+#define OFFSET3 4096
+#define OFFSET4 8192
+#define OFFSET5 16384
+#define OFFSET6 32768
+#define OFFSET7 65536
+#define OFFSET8 131072
+
+namespace slog {
+
+/**
+ * A set of indexes on tokens of 1 to 8 bytes.
+ *
+ * Each index is identified by OFFSETn + i for the i-th index on n-byte tokens,
+ * so index sets that are built by adding the same sequence of token lengths
+ * assign the same index ids.
+ */
+class index_set {
+ public:
+  index_set() {
+    idx1_ = new monolog_linearizable<__index1 *>;
+    idx2_ = new monolog_linearizable<__index2 *>;
+    idx3_ = new monolog_linearizable<__index3 *>;
+    idx4_ = new monolog_linearizable<__index4 *>;
+    idx5_ = new monolog_linearizable<__index5 *>;
+    idx6_ = new monolog_linearizable<__index6 *>;
+    idx7_ = new monolog_linearizable<__index7 *>;
+    idx8_ = new monolog_linearizable<__index8 *>;
+  }
+
+  ~index_set() {
+    free_indexes(idx1_);
+    free_indexes(idx2_);
+    free_indexes(idx3_);
+    free_indexes(idx4_);
+    free_indexes(idx5_);
+    free_indexes(idx6_);
+    free_indexes(idx7_);
+    free_indexes(idx8_);
+  }
+
+  /**
+   * Add a new index for tokens of specified length.
+   *
+   * @param token_length Length of the tokens to be indexed.
+   *
+   * @return The id (> 0) of the newly created index. Returns zero on failure.
+   */
+  uint32_t add_index(uint32_t token_length) {
+    switch (token_length) {
+      case 1:
+        return OFFSET1 + idx1_->push_back(new __index1);
+      case 2:
+        return OFFSET2 + idx2_->push_back(new __index2);
+      case 3:
+        return OFFSET3 + idx3_->push_back(new __index3);
+      case 4:
+        return OFFSET4 + idx4_->push_back(new __index4);
+      case 5:
+        return OFFSET5 + idx5_->push_back(new __index5);
+      case 6:
+        return OFFSET6 + idx6_->push_back(new __index6);
+      case 7:
+        return OFFSET7 + idx7_->push_back(new __index7);
+      case 8:
+        return OFFSET8 + idx8_->push_back(new __index8);
+    }
+
+    return 0;
+  }
+
+  /**
+   * Add (token, recordId) entries to the indexes.
+   *
+   * @param record_id The id of the record whose index entries are being added.
+   * @param tokens The tokens associated with the record.
+   */
+  void add_entries(uint64_t record_id, token_list& tokens) {
+    for (token_t& token : tokens) {
+      /* Identify which index token belongs to */
+      uint32_t idx = token.index_id() / OFFSETMIN;
+      uint32_t off = token.index_id() % OFFSETMIN;
+
+      /* Update relevant index */
+      uint64_t key = token.data();
+      switch (idx) {
+        case 1: {
+          idx1_->at(off)->add_entry(key, record_id);
+          break;
+        }
+        case 2: {
+          idx2_->at(off)->add_entry(key, record_id);
+          break;
+        }
+        case 4: {
+          idx3_->at(off)->add_entry(key, record_id);
+          break;
+        }
+        case 8: {
+          idx4_->at(off)->add_entry(key, record_id);
+          break;
+        }
+        case 16: {
+          idx5_->at(off)->add_entry(key, record_id);
+          break;
+        }
+        case 32: {
+          idx6_->at(off)->add_entry(key, record_id);
+          break;
+        }
+        case 64: {
+          idx7_->at(off)->add_entry(key, record_id);
+          break;
+        }
+        case 128: {
+          idx8_->at(off)->add_entry(key, record_id);
+          break;
+        }
+      }
+    }
+  }
+
+  /**
+   * Whether add_entries() appends the entries of a batch of records to each
+   * posting list in record id order. Since tokens are added position by
+   * position, that only fails if an index appears at different positions.
+   *
+   * @param tokens The tokens associated with each record.
+   * @param num_records The number of records in the batch.
+   * @return True if the entries are appended in record id order.
+   */
+  static bool in_id_order(token_list* tokens, uint32_t num_records) {
+    /* The position at which each index id appears, as (index_id, pos) */
+    std::vector<std::pair<uint32_t, size_t>> positions;
+    for (uint32_t i = 0; i < num_records; i++) {
+      for (size_t pos = 0; pos < tokens[i].size(); pos++) {
+        uint32_t index_id = tokens[i][pos].index_id();
+        size_t j = 0;
+        while (j < positions.size() && positions[j].first != index_id) {
+          j++;
+        }
+        if (j == positions.size()) {
+          positions.push_back(std::make_pair(index_id, pos));
+        } else if (positions[j].second != pos) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Add (token, recordId) entries to the indexes for a batch of records with
+   * consecutive ids.
+   *
+   * Records in a batch typically carry the same sequence of index ids, so
+   * tokens are processed position by position; runs of records sharing the
+   * index at a position are added with a single index lookup.
+   *
+   * @param start_id The id of the first record in the batch.
+   * @param tokens The tokens associated with each record.
+   * @param num_records The number of records in the batch.
+   */
+  void add_entries(uint64_t start_id, token_list* tokens,
+                   uint32_t num_records) {
+    size_t num_positions = 0;
+    for (uint32_t i = 0; i < num_records; i++) {
+      num_positions = std::max(num_positions, tokens[i].size());
+    }
+
+    for (size_t pos = 0; pos < num_positions; pos++) {
+      uint32_t beg = 0;
+      while (beg < num_records) {
+        if (tokens[beg].size() <= pos) {
+          beg++;
+          continue;
+        }
+
+        uint32_t index_id = tokens[beg][pos].index_id();
+        uint32_t end = beg + 1;
+        while (end < num_records && tokens[end].size() > pos
+            && tokens[end][pos].index_id() == index_id) {
+          end++;
+        }
+
+        /* Identify which index the run belongs to */
+        uint32_t idx = index_id / OFFSETMIN;
+        uint32_t off = index_id % OFFSETMIN;
+
+        /* Update relevant index */
+        switch (idx) {
+          case 1: {
+            add_entries(idx1_->at(off), start_id, tokens, pos, beg, end);
+            break;
+          }
+          case 2: {
+            add_entries(idx2_->at(off), start_id, tokens, pos, beg, end);
+            break;
+          }
+          case 4: {
+            add_entries(idx3_->at(off), start_id, tokens, pos, beg, end);
+            break;
+          }
+          case 8: {
+            add_entries(idx4_->at(off), start_id, tokens, pos, beg, end);
+            break;
+          }
+          case 16: {
+            add_entries(idx5_->at(off), start_id, tokens, pos, beg, end);
+            break;
+          }
+          case 32: {
+            add_entries(idx6_->at(off), start_id, tokens, pos, beg, end);
+            break;
+          }
+          case 64: {
+            add_entries(idx7_->at(off), start_id, tokens, pos, beg, end);
+            break;
+          }
+          case 128: {
+            add_entries(idx8_->at(off), start_id, tokens, pos, beg, end);
+            break;
+          }
+        }
+        beg = end;
+      }
+    }
+  }
+
+  /**
+   * Invokes fn on every populated posting list in the index identified by
+   * index_id, for tokens in [token_beg, token_end]. Only populated slots are
+   * visited, and no posting lists are allocated.
+   *
+   * @param index_id The id of the index.
+   * @param token_beg The first token in the range.
+   * @param token_end The last token in the range.
+   * @param fn The function to invoke on each posting list.
+   */
+  template<typename F>
+  void for_each_list(uint32_t index_id, uint64_t token_beg, uint64_t token_end,
+                     F fn) const {
+    /* Identify which index the filter is on */
+    uint32_t idx = index_id / OFFSETMIN;
+    uint32_t off = index_id % OFFSETMIN;
+    switch (idx) {
+      case 1:
+        for_each_list(idx1_->at(off), token_beg, token_end, fn);
+        break;
+      case 2:
+        for_each_list(idx2_->at(off), token_beg, token_end, fn);
+        break;
+      case 4:
+        for_each_list(idx3_->at(off), token_beg, token_end, fn);
+        break;
+      case 8:
+        for_each_list(idx4_->at(off), token_beg, token_end, fn);
+        break;
+      case 16:
+        for_each_list(idx5_->at(off), token_beg, token_end, fn);
+        break;
+      case 32:
+        for_each_list(idx6_->at(off), token_beg, token_end, fn);
+        break;
+      case 64:
+        for_each_list(idx7_->at(off), token_beg, token_end, fn);
+        break;
+      case 128:
+        for_each_list(idx8_->at(off), token_beg, token_end, fn);
+        break;
+    }
+  }
+
+  /**
+   * Adds the storage footprint of each index to the running totals in sizes,
+   * postings and posting_sizes (see logstore_storage); the totals are
+   * extended as needed, one entry per index.
+   */
+  void storage_footprint(std::vector<size_t>& sizes,
+                         std::vector<size_t>& postings,
+                         std::vector<size_t>& posting_sizes) const {
+    size_t pos = 0;
+    storage_footprint(sizes, postings, posting_sizes, pos, idx1_);
+    storage_footprint(sizes, postings, posting_sizes, pos, idx2_);
+    storage_footprint(sizes, postings, posting_sizes, pos, idx3_);
+    storage_footprint(sizes, postings, posting_sizes, pos, idx4_);
+    storage_footprint(sizes, postings, posting_sizes, pos, idx5_);
+    storage_footprint(sizes, postings, posting_sizes, pos, idx6_);
+    storage_footprint(sizes, postings, posting_sizes, pos, idx7_);
+    storage_footprint(sizes, postings, posting_sizes, pos, idx8_);
+  }
+
+ private:
+  /**
+   * Add the tokens at position pos of records [beg, end) in a batch to an
+   * index.
+   *
+   * @param index The index.
+   * @param start_id The id of the first record in the batch.
+   * @param tokens The tokens associated with each record.
+   * @param pos The token position.
+   * @param beg The first record in the run.
+   * @param end One past the last record in the run.
+   */
+  template<typename INDEX>
+  void add_entries(INDEX* index, uint64_t start_id, token_list* tokens,
+                   size_t pos, uint32_t beg, uint32_t end) {
+    for (uint32_t i = beg; i < end; i++) {
+      index->add_entry(tokens[i][pos].data(), start_id + i);
+    }
+  }
+
+  template<typename INDEX, typename F>
+  void for_each_list(const INDEX* index, uint64_t token_beg,
+                     uint64_t token_end, F& fn) const {
+    index->for_each(token_beg, token_end,
+                    [&](uint64_t, const posting_list* list) {
+                      fn(list);
+                    });
+  }
+
+  template<typename INDEX>
+  void storage_footprint(std::vector<size_t>& sizes,
+                         std::vector<size_t>& postings,
+                         std::vector<size_t>& posting_sizes, size_t& pos,
+                         monolog_linearizable<INDEX*> *idx) const {
+    uint32_t num_indexes = idx->size();
+    for (uint32_t i = 0; i < num_indexes; i++, pos++) {
+      if (sizes.size() <= pos) {
+        sizes.resize(pos + 1, 0);
+        postings.resize(pos + 1, 0);
+        posting_sizes.resize(pos + 1, 0);
+      }
+      size_t num_postings = 0, list_size = 0;
+      idx->at(i)->posting_footprint(num_postings, list_size);
+      sizes[pos] += idx->at(i)->storage_size();
+      postings[pos] += num_postings;
+      posting_sizes[pos] += list_size;
+    }
+  }
+
+  template<typename INDEX>
+  static void free_indexes(monolog_linearizable<INDEX*> *idx) {
+    uint32_t num_indexes = idx->size();
+    for (uint32_t i = 0; i < num_indexes; i++) {
+      delete idx->at(i);
+    }
+    delete idx;
+  }
+
+  monolog_linearizable<__index1 *> *idx1_;
+  monolog_linearizable<__index2 *> *idx2_;
+  monolog_linearizable<__index3 *> *idx3_;
+  monolog_linearizable<__index4 *> *idx4_;
+  monolog_linearizable<__index5 *> *idx5_;
+  monolog_linearizable<__index6 *> *idx6_;
+  monolog_linearizable<__index7 *> *idx7_;
+  monolog_linearizable<__index8 *> *idx8_;
+};
+
+}
+
+#endif /* SLOG_INDEXSET_H_ */
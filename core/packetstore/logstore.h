@@ -7,37 +7,40 @@
 #include <cstring>
 #include <climits>
 #include <cassert>
+#include <cerrno>
 #include <sys/types.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <string>
 #include <unordered_set>
 #include <map>
+#include <memory>
 #include <unordered_map>
 #include <vector>
 #include <algorithm>
 #include <fstream>
 #include <atomic>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 #include "tokens.h"
-#include "tieredindex.h"
+#include "indexset.h"
 #include "streamlog.h"
 #include "offsetlog.h"
+#include "segment.h"
 #include "filterops.h"
+#include "setops.h"
 #include "utils.h"
 #include "exceptions.h"
 
-#define OFFSETMIN 1024
-#define OFFSET1 1024
-#define OFFSET2 2048
-#define OFFSET3 4096
-#define OFFSET4 8192
-#define OFFSET5 16384
-#define OFFSET6 32768
-#define OFFSET7 65536
-#define OFFSET8 131072
-
 namespace slog {
 
 struct logstore_storage {
@@ -45,10 +48,39 @@ struct logstore_storage {
   size_t olog_size;
   std::vector<size_t> idx_sizes;
   std::vector<size_t> stream_sizes;
+
+  /* Posting list footprint for each index, to compare posting list formats:
+   * the number of (token, record) postings, and the storage used by the
+   * posting lists alone (excluding index tiers). An uncompressed list takes
+   * at least sizeof(uint64_t) bytes per posting. */
+  std::vector<size_t> idx_postings;
+  std::vector<size_t> idx_posting_sizes;
 };
 
 class log_store {
  public:
+  /* Data-log blocks; the retention policy drops whole blocks */
+  static const uint32_t DLOG_NBUCKETS = 32768;
+  static const uint32_t DLOG_BLOCK_SIZE = 64 * 1024 * 1024;
+
+  /* Number of epochs each retention limit is split into */
+  static const uint64_t EPOCHS_PER_LIMIT = 8;
+
+  /* Data-log blocks per epoch under an age limit alone */
+  static const uint64_t AGE_EPOCH_BLOCKS = 4;
+
+  /* Largest size limit; half the capacity of the data-log */
+  static const uint64_t MAX_RETAINED_BYTES = (uint64_t) DLOG_NBUCKETS
+      * DLOG_BLOCK_SIZE / 2;
+
+  /* Maximum number of records passed to a scan() callback at once */
+  static const uint32_t SCAN_BATCH = 32;
+
+  /* Extracts the tokens of a record; see open() */
+  typedef std::function<void(const unsigned char*, uint16_t, token_list&)> tokenizer_function;
+
+  class subscription;
+
   class handle {
    public:
     /**
@@ -92,6 +124,17 @@ class log_store {
       return base_.add_stream(fn);
     }
 
+    /**
+     * Add a new stream with a filter function on raw record data.
+     *
+     * @param fn The filter function.
+     * @param offset Number of leading record bytes the filter does not see.
+     * @return The id of the newly created stream.
+     */
+    uint32_t add_stream(packet_filter_function fn, uint32_t offset = 0) {
+      return base_.add_stream(fn, offset);
+    }
+
     /**
      * Insert a new record into the log-store.
      *
@@ -102,25 +145,88 @@ class log_store {
      */
     uint64_t insert(const unsigned char* record, uint16_t record_len,
                     token_list& tkns) {
-      if (remaining_ids_ == 0) {
+      /* Reserved ids and bytes that have since been dropped by the retention
+       * policy are abandoned */
+      if (remaining_ids_ == 0 || cur_id_ < base_.olog_->low_water()) {
         cur_id_ = base_.olog_->request_id_block(id_block_size_);
         remaining_ids_ = id_block_size_;
       }
 
-      if (remaining_bytes_ < record_len) {
+      if (remaining_bytes_ < record_len || cur_offset_ < base_.low_offset()) {
         cur_offset_ = base_.request_bytes(data_block_size_);
         remaining_bytes_ = data_block_size_;
       }
 
       base_.append_record(record, record_len, cur_offset_);
-      base_.update_indexes(cur_id_, tkns);
+      base_.update_indexes(cur_id_, cur_offset_, tkns);
       base_.olog_->set(cur_id_, cur_offset_, record_len);
       base_.olog_->end(cur_id_);
       remaining_ids_--;
+      remaining_bytes_ -= record_len;
       cur_offset_ += record_len;
       return ++cur_id_;
     }
 
+    /**
+     * Insert a batch of records into the log-store. Record ids and data-log
+     * bytes for the whole batch are reserved at once.
+     *
+     * @param records The buffers containing record data.
+     * @param record_lens The lengths of the records.
+     * @param tkns Tokens associated with each of the records.
+     * @param num_records The number of records in the batch.
+     * @return The record id of the first record; the records in the batch
+     *  are assigned consecutive ids.
+     */
+    uint64_t insert_batch(const unsigned char* const * records,
+                          const uint16_t* record_lens, token_list* tkns,
+                          uint32_t num_records) {
+      return base_.insert_batch(records, record_lens, tkns, num_records);
+    }
+
+    /**
+     * Reserve consecutive record ids for a batch inserted with
+     * insert_batch(start_id, ...); e.g., to encode records against earlier
+     * records by id.
+     *
+     * @param num_records The number of records in the batch.
+     * @return The first reserved record id.
+     */
+    uint64_t reserve_ids(uint32_t num_records) {
+      return base_.reserve_ids(num_records);
+    }
+
+    /**
+     * Insert a batch of records with reserved ids; see
+     * log_store::insert_batch(start_id, ...).
+     *
+     * @param start_id The first record id, from reserve_ids().
+     * @param records The buffers containing record data.
+     * @param record_lens The lengths of the records.
+     * @param tkns Tokens associated with each of the records.
+     * @param num_records The number of records in the batch.
+     * @param views The record data the stream filters see.
+     * @param view_lens The lengths of the views.
+     * @return The record id of the first record.
+     */
+    uint64_t insert_batch(uint64_t start_id,
+                          const unsigned char* const * records,
+                          const uint16_t* record_lens, token_list* tkns,
+                          uint32_t num_records,
+                          const unsigned char* const * views,
+                          const uint16_t* view_lens) {
+      return base_.insert_batch(start_id, records, record_lens, tkns,
+                                num_records, views, view_lens);
+    }
+
+    /**
+     * Get the number of the epoch that currently receives records; see
+     * log_store::head_epoch().
+     */
+    uint64_t head_epoch() const {
+      return base_.head_epoch();
+    }
+
     /**
      * Atomically fetch a record from the log-store given its recordId. The
      * record buffer must be pre-allocated with sufficient size.
@@ -161,16 +267,111 @@ class log_store {
       base_.filter(results, query);
     }
 
+    /**
+     * Filter index-entries based on query, considering only records with ids
+     * smaller than max_rid.
+     *
+     * @param results The results of the filter query.
+     * @param query The filter query.
+     * @param max_rid Snapshot of the number of records to consider.
+     */
+    void filter(std::unordered_set<uint64_t>& results, filter_query& query,
+                uint64_t max_rid) const {
+      base_.filter(results, query, max_rid);
+    }
+
+    /**
+     * Filter index-entries based on query.
+     *
+     * @param results The sorted record ids matching the filter query.
+     * @param query The filter query.
+     */
+    void filter(std::vector<uint64_t>& results, filter_query& query) const {
+      base_.filter(results, query);
+    }
+
+    /**
+     * Filter index-entries based on query, considering only records with ids
+     * smaller than max_rid.
+     *
+     * @param results The sorted record ids matching the filter query.
+     * @param query The filter query.
+     * @param max_rid Snapshot of the number of records to consider.
+     */
+    void filter(std::vector<uint64_t>& results, filter_query& query,
+                uint64_t max_rid) const {
+      base_.filter(results, query, max_rid);
+    }
+
+    /**
+     * Filter index-entries based on query, considering only records with ids
+     * in [min_rid, max_rid).
+     *
+     * @param results The sorted record ids matching the filter query.
+     * @param query The filter query.
+     * @param min_rid The smallest record id to consider.
+     * @param max_rid Snapshot of the number of records to consider.
+     */
+    void filter(std::vector<uint64_t>& results, filter_query& query,
+                uint64_t min_rid, uint64_t max_rid) const {
+      base_.filter(results, query, min_rid, max_rid);
+    }
+
     /**
      * Get the stream associated with a given stream id.
      *
      * @param stream_id The id of the stream.
      * @return The stream associated with the id.
      */
-    entry_list* get_stream(uint32_t stream_id) const {
+    stream_list* get_stream(uint32_t stream_id) const {
       return base_.get_stream(stream_id);
     }
 
+    /**
+     * Get the records of a stream with ids smaller than max_rid.
+     *
+     * @param results The sorted record ids in the stream.
+     * @param stream_id The id of the stream.
+     * @param max_rid Snapshot of the number of records to consider.
+     */
+    void filter_stream(std::vector<uint64_t>& results, uint32_t stream_id,
+                       uint64_t max_rid) const {
+      base_.filter_stream(results, stream_id, max_rid);
+    }
+
+    /**
+     * Read a portion of each of a set of records, in batches; see
+     * log_store::scan().
+     *
+     * @param record_ids The ids of the records.
+     * @param offset The offset into each record to begin reading.
+     * @param max_length The maximum number of bytes read per record.
+     * @param fn The function called on each batch.
+     */
+    template<typename F>
+    void scan(const std::vector<uint64_t>& record_ids, uint32_t offset,
+              uint16_t max_length, F fn) const {
+      base_.scan(record_ids, offset, max_length, fn);
+    }
+
+    uint32_t num_streams() const {
+      return base_.num_streams();
+    }
+
+    /**
+     * Subscribe to a stream; see log_store::subscribe().
+     *
+     * @param stream_id The id of the stream.
+     * @param batch_delay_ns How long subscription::wait() holds off for a
+     *  full batch once a record is available.
+     * @param from_start Whether to return the records already in the stream.
+     * @return A subscription to the stream.
+     */
+    subscription* subscribe(uint32_t stream_id, uint64_t batch_delay_ns = 0,
+                            bool from_start = false) {
+      return base_.subscribe(stream_id, batch_delay_ns, from_start);
+    }
+
     /* Statistics and helpers */
 
     /** Atomically get the number of currently readable records.
@@ -189,6 +390,25 @@ class log_store {
       return base_.size();
     }
 
+    /**
+     * Get the smallest record id that has not been dropped by the retention
+     * policy.
+     *
+     * @return The low-water mark for record ids.
+     */
+    uint64_t first_record() const {
+      return base_.first_record();
+    }
+
+    /**
+     * Apply the retention policy of the log-store.
+     *
+     * @param now_ns The current time, in nanoseconds.
+     */
+    void expire(uint64_t now_ns) {
+      base_.expire(now_ns);
+    }
+
     /** Get storage statistics
      *
      * @param storage_stats The storage structure which will be populated with
@@ -211,31 +431,288 @@ class log_store {
     log_store& base_;
   };
 
+  /**
+   * Cursor over a stream, for consumers that tail it continuously.
+   *
+   * A subscription returns the records appended to its stream since its
+   * last read, in stream order; records that are still being inserted are
+   * returned once they become readable, and records dropped by the
+   * retention policy are skipped. Consumers may block on an eventfd until
+   * new records arrive, rather than poll the stream. Any number of
+   * subscriptions may tail a stream independently; each is used by a
+   * single thread.
+   */
+  class subscription {
+   public:
+    /**
+     * Constructor to initialize the subscription.
+     *
+     * @param base The base log-store.
+     * @param stream_id The id of the stream.
+     * @param batch_delay_ns Once a record is available, how long wait()
+     *  holds off for a full batch.
+     * @param from_start Whether to return the records already in the
+     *  stream, rather than only the ones appended from here on.
+     * @throws eventfd_exception if the eventfd cannot be created.
+     */
+    subscription(log_store& base, uint32_t stream_id, uint64_t batch_delay_ns,
+                 bool from_start)
+        : base_(base),
+          stream_(base.streams_->at(stream_id)),
+          batch_delay_ns_(batch_delay_ns) {
+      pos_ = from_start ? 0 : stream_->num_published();
+      fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (fd_ == -1) {
+        throw eventfd_exception();
+      }
+    }
+
+    ~subscription() {
+      stream_->disarm(fd_);
+      close(fd_);
+    }
+
+    /**
+     * Get the eventfd the subscription blocks on, e.g., to add it to an
+     * epoll set; it becomes readable after arm(), once new records arrive.
+     *
+     * @return The eventfd.
+     */
+    int fd() const {
+      return fd_;
+    }
+
+    /**
+     * Have the eventfd signaled once new records arrive.
+     *
+     * @return false if records are available already (or all waiter slots
+     *  of the stream are taken), in which case the eventfd is not signaled.
+     */
+    bool arm() {
+      drain();
+      if (!stream_->arm(fd_)) {
+        return false;
+      }
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (available() != 0) {
+        disarm();
+        return false;
+      }
+      return true;
+    }
+
+    /**
+     * Get the records appended to the stream since the last read, without
+     * blocking.
+     *
+     * @param record_ids The ids of the records.
+     * @param max_records The maximum number of records to return.
+     * @param records If not NULL, the record data of each of the records, as
+     * stored; packet stores return them decoded through their own
+     * subscriptions.
+     * @return The number of records returned.
+     */
+    size_t poll(std::vector<uint64_t>& record_ids, size_t max_records,
+                std::vector<std::string>* records = NULL) {
+      record_ids.clear();
+      if (records != NULL) {
+        records->clear();
+      }
+
+      reader_guard guard(base_.readers_);
+      uint64_t end = stream_->num_published();
+      stream_list* entries = stream_->get_stream();
+      pos_ = std::max(pos_, stream_->first());
+      while (pos_ < end && record_ids.size() < max_records) {
+        uint64_t record_id = entries->at(pos_);
+        if (base_.olog_->is_valid(record_id)) {
+          record_ids.push_back(record_id);
+          if (records != NULL) {
+            uint64_t offset;
+            uint16_t length;
+            base_.olog_->lookup(record_id, offset, length);
+            records->push_back(std::string(length, '\0'));
+            base_.dlog_->read(
+                offset, reinterpret_cast<uint8_t*>(&records->back()[0]),
+                length);
+          }
+        } else if (record_id >= base_.olog_->low_water()) {
+          /* Still being inserted */
+          break;
+        }
+        pos_++;
+      }
+      return record_ids.size();
+    }
+
+    /**
+     * Get the records appended to the stream since the last read, blocking
+     * until at least one is available. Once one is, waits up to the batch
+     * delay for max_records of them.
+     *
+     * @param record_ids The ids of the records.
+     * @param max_records The maximum number of records to return.
+     * @param timeout_ns How long to block for the first record.
+     * @param records If not NULL, the record data of each of the records, as
+     * stored; packet stores return them decoded through their own
+     * subscriptions.
+     * @return The number of records returned; 0 on timeout.
+     */
+    size_t wait(std::vector<uint64_t>& record_ids, size_t max_records,
+                uint64_t timeout_ns, std::vector<std::string>* records = NULL) {
+      uint64_t now = now_ns();
+      block_until(1, now + timeout_ns);
+      if (batch_delay_ns_ != 0) {
+        block_until(max_records, now_ns() + batch_delay_ns_);
+      }
+      return poll(record_ids, max_records, records);
+    }
+
+   private:
+    static uint64_t now_ns() {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+    }
+
+    /* Upper bound on the entries a poll() would consume */
+    uint64_t available() const {
+      return stream_->num_published() - pos_;
+    }
+
+    /* Blocks until count entries are published and the last of them is
+     * readable, or until the deadline */
+    void block_until(uint64_t count, uint64_t deadline_ns) {
+      while (!readable(count)) {
+        uint64_t now = now_ns();
+        if (now >= deadline_ns) {
+          return;
+        }
+
+        /* Without a waiter slot, fall back to polling every millisecond */
+        int timeout_ms = std::min((deadline_ns - now + 999999) / 1000000,
+                                  (uint64_t) INT_MAX);
+        bool armed = stream_->arm(fd_);
+        if (!armed) {
+          timeout_ms = std::min(timeout_ms, 1);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!readable(count)) {
+          struct pollfd pfd = { fd_, POLLIN, 0 };
+          ::poll(&pfd, 1, timeout_ms);
+        }
+        if (armed) {
+          disarm();
+        }
+      }
+    }
+
+    /* Whether the first count unread entries are readable */
+    bool readable(uint64_t count) const {
+      if (available() < count) {
+        return false;
+      }
+      reader_guard guard(base_.readers_);
+      uint64_t idx = pos_ + count - 1;
+      if (idx < stream_->first()) {
+        /* Released along with its record */
+        return true;
+      }
+      uint64_t record_id = stream_->get_stream()->at(idx);
+      return base_.olog_->is_valid(record_id)
+          || record_id < base_.olog_->low_water();
+    }
+
+    void disarm() {
+      if (!stream_->disarm(fd_)) {
+        /* Signaled in the meantime */
+        drain();
+      }
+    }
+
+    void drain() {
+      uint64_t count;
+      while (read(fd_, &count, sizeof(count)) == sizeof(count)) {
+      }
+    }
+
+    log_store& base_;
+    streamlog* stream_;
+    uint64_t batch_delay_ns_;
+    uint64_t pos_;
+    int fd_;
+  };
+
   /**
    * Constructor to initialize the log-store.
    */
-  log_store() {
-    /* Initialize data log and offset log */
-    dlog_ = new __monolog_linear_base <uint8_t>;
-    olog_ = new offsetlog;
+  log_store()
+      : max_bytes_(0),
+        max_age_ns_(0),
+        epoch_bytes_(UINT64_MAX),
+        rotate_ns_(0),
+        indexers_(0),
+        index_tail_(0),
+        readers_(0),
+        stop_reclaimer_(false),
+        data_segments_(NULL),
+        offlen_segments_(NULL),
+        valid_segments_(NULL) {
+    /* Initialize data log and offset log; their buckets are mapped lazily */
+    dlog_ = new data_log(&pages_);
+    olog_ = new offsetlog(&pages_, &pages_);
 
     /* Initialize data log tail to zero. */
     dtail_.store(0);
 
-    /* Initialize all index classes */
-    idx1_ = new monolog_linearizable<__index1 *>;
-    idx2_ = new monolog_linearizable<__index2 *>;
-    idx3_ = new monolog_linearizable<__index3 *>;
-    idx4_ = new monolog_linearizable<__index4 *>;
-    idx5_ = new monolog_linearizable<__index5 *>;
-    idx6_ = new monolog_linearizable<__index6 *>;
-    idx7_ = new monolog_linearizable<__index7 *>;
-    idx8_ = new monolog_linearizable<__index8 *>;
+    /* Initialize the epochs; without a retention policy, all records belong
+     * to the first epoch */
+    for (auto& x : epochs_) {
+      x.store(NULL);
+    }
+    epochs_[0].store(new epoch(0));
+    first_epoch_.store(0);
+    low_offset_.store(0);
+    expiring_.clear();
 
     /* Initialize stream logs */
     streams_ = new monolog_linearizable<streamlog*>;
   }
 
+  /**
+   * Destructor; no handle or reader may use the log-store any more. The
+   * segments of a persisted log-store are kept.
+   */
+  ~log_store() {
+    if (reclaimer_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(reclaim_mutex_);
+        stop_reclaimer_ = true;
+      }
+      reclaim_cv_.notify_one();
+      reclaimer_.join();
+    }
+    for (auto& fn : draining_) {
+      fn();
+    }
+    for (auto& fn : retired_) {
+      fn();
+    }
+    for (auto& x : epochs_) {
+      delete x.load();
+    }
+    uint32_t num_streams = streams_->size();
+    for (uint32_t i = 0; i < num_streams; i++) {
+      delete streams_->at(i);
+    }
+    delete streams_;
+    delete dlog_;
+    delete olog_;
+    delete data_segments_;
+    delete offlen_segments_;
+    delete valid_segments_;
+  }
+
   /**
    * Get a handle to the log-store.
    *
@@ -245,6 +722,20 @@ class log_store {
     return new handle(*this);
   }
 
+  /**
+   * Subscribe to a stream; see subscription.
+   *
+   * @param stream_id The id of the stream.
+   * @param batch_delay_ns How long subscription::wait() holds off for a full
+   *  batch once a record is available.
+   * @param from_start Whether to return the records already in the stream.
+   * @return A subscription to the stream.
+   */
+  subscription* subscribe(uint32_t stream_id, uint64_t batch_delay_ns = 0,
+                          bool from_start = false) {
+    return new subscription(*this, stream_id, batch_delay_ns, from_start);
+  }
+
   /**
    * Add a new index for tokens of specified length.
    *
@@ -253,26 +744,294 @@ class log_store {
    * @return The id (> 0) of the newly created index. Returns zero on failure.
    */
   uint32_t add_index(uint32_t token_length) {
-    switch (token_length) {
-      case 1:
-        return OFFSET1 + idx1_->push_back(new __index1);
-      case 2:
-        return OFFSET2 + idx2_->push_back(new __index2);
-      case 3:
-        return OFFSET3 + idx3_->push_back(new __index3);
-      case 4:
-        return OFFSET4 + idx4_->push_back(new __index4);
-      case 5:
-        return OFFSET5 + idx5_->push_back(new __index5);
-      case 6:
-        return OFFSET6 + idx6_->push_back(new __index6);
-      case 7:
-        return OFFSET7 + idx7_->push_back(new __index7);
-      case 8:
-        return OFFSET8 + idx8_->push_back(new __index8);
+    std::lock_guard<std::mutex> lock(epoch_mutex_);
+    index_lengths_.push_back(token_length);
+
+    /* Add the index to all live epochs; epochs created later add all indexes
+     * in index_lengths_, in order, and hence assign the same ids */
+    uint64_t head = dtail_.load() / epoch_bytes_;
+    create_epoch(head);
+    uint32_t index_id = 0;
+    for (uint64_t n = first_epoch_.load(); n <= head; n++) {
+      epoch* e = epochs_[n % MAX_EPOCHS].load(std::memory_order_acquire);
+      if (e != NULL && e->number == n) {
+        index_id = e->indexes.add_index(token_length);
+      }
+    }
+
+    return index_id;
+  }
+
+  /**
+   * Set the retention policy of the log-store. Records are dropped, oldest
+   * first, once the data-log holds more than max_bytes bytes of records, or
+   * once they are older than max_age_ns; see expire().
+   *
+   * Records are grouped into epochs of consecutive data-log blocks, each with
+   * its own indexes, and whole epochs are dropped at once. Each limit is split
+   * into EPOCHS_PER_LIMIT epochs, so up to 1 / EPOCHS_PER_LIMIT of the limit
+   * may be dropped early.
+   *
+   * Must be called before any record is inserted.
+   *
+   * @param max_bytes Maximum number of record bytes retained; zero for no
+   *  limit. At most MAX_RETAINED_BYTES.
+   * @param max_age_ns Maximum age of retained records, in nanoseconds on the
+   *  clock passed to expire(); zero for no limit.
+   * @return true if the policy was set, false otherwise.
+   */
+  bool set_retention(uint64_t max_bytes, uint64_t max_age_ns) {
+    if (dtail_.load() != 0 || max_bytes > MAX_RETAINED_BYTES) {
+      return false;
+    }
+
+    max_bytes_.store(max_bytes);
+    max_age_ns_ = max_age_ns;
+    rotate_ns_ = max_age_ns / EPOCHS_PER_LIMIT;
+    if (max_bytes != 0) {
+      epoch_bytes_ = std::max<uint64_t>(
+          1, max_bytes / (EPOCHS_PER_LIMIT * DLOG_BLOCK_SIZE)) * DLOG_BLOCK_SIZE;
+    } else if (max_age_ns != 0) {
+      epoch_bytes_ = AGE_EPOCH_BLOCKS * DLOG_BLOCK_SIZE;
+    } else {
+      epoch_bytes_ = UINT64_MAX;
+    }
+    if ((max_bytes != 0 || max_age_ns != 0) && !reclaimer_.joinable()) {
+      reclaimer_ = std::thread([this] {reclaim_dropped();});
+    }
+    return true;
+  }
+
+  /**
+   * Change the size limit of the retention policy, e.g., to rebalance a limit
+   * shared with other log-stores. The epochs keep the size they were given by
+   * set_retention(). May be called while records are inserted and expired.
+   *
+   * @param max_bytes Maximum number of record bytes retained; non-zero, and
+   *  at most MAX_RETAINED_BYTES.
+   * @return true if the limit was changed, false if set_retention() set no
+   *  size limit.
+   */
+  bool set_size_limit(uint64_t max_bytes) {
+    if (max_bytes_.load() == 0 || max_bytes == 0
+        || max_bytes > MAX_RETAINED_BYTES) {
+      return false;
+    }
+    max_bytes_.store(max_bytes);
+    return true;
+  }
+
+  /**
+   * Set the allocator for the blocks of the data-log and the buckets of the
+   * offset-log, which are otherwise mapped lazily from (transparent) hugepages
+   * by a page_allocator. The allocator must outlive the log-store; open()
+   * replaces it with segment allocators.
+   *
+   * Must be called before any record is inserted.
+   *
+   * @param allocator The allocator, or NULL to allocate on the heap.
+   * @return true if the allocator was set, false otherwise.
+   */
+  bool set_allocator(bucket_allocator* allocator) {
+    if (!dir_.empty() || dtail_.load() != 0 || olog_->num_ids() != 0) {
+      return false;
+    }
+
+    delete dlog_;
+    delete olog_;
+    dlog_ = new data_log(allocator);
+    olog_ = new offsetlog(allocator, allocator);
+    return true;
+  }
+
+  /**
+   * Persist the log-store in directory dir, creating the directory if
+   * necessary.
+   *
+   * The data-log and the offset-log are kept in segment files in dir, one
+   * per block or bucket, which are flushed in the background as they fill
+   * up; checkpoint() flushes them and records the tails in a manifest. If dir
+   * holds a checkpointed log-store, its records are restored: the logs are
+   * remapped from their segments, records that were not covered by the last
+   * checkpoint are discarded, and the indexes are rebuilt by passing each
+   * restored record to tokenize. Streams are not persisted.
+   *
+   * Must be called after the indexes and the retention policy are set, both
+   * the same as those of the stored log-store, and before any record is
+   * inserted.
+   *
+   * @param dir The directory to persist the log-store in.
+   * @param tokenize Extracts the tokens of a restored record.
+   * @return true if the log-store was opened, false otherwise.
+   * @throws segment_exception if a segment cannot be mapped.
+   */
+  bool open(const std::string& dir, tokenizer_function tokenize) {
+    if (!dir_.empty() || dtail_.load() != 0 || olog_->num_ids() != 0
+        || (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)) {
+      return false;
+    }
+
+    log_manifest::entries manifest;
+    if (log_manifest::load(manifest_path(dir), manifest)
+        && manifest["epoch_bytes"] != epoch_bytes_) {
+      return false;
+    }
+    uint64_t first_id = manifest["first_record"];
+    uint64_t num_ids = manifest["num_records"];
+    uint64_t low_offset = manifest["low_offset"];
+    uint64_t tail = manifest["size"];
+
+    /* Remove the segments of dropped records, and of records that were not
+     * covered by the last checkpoint, before the logs map their buckets */
+    dir_ = dir;
+    data_segments_ = new segment_allocator(dir, "data");
+    offlen_segments_ = new segment_allocator(dir, "offsets");
+    valid_segments_ = new segment_allocator(dir, "valid");
+    data_segments_->remove_outside(low_offset / DLOG_BLOCK_SIZE,
+                                   tail / DLOG_BLOCK_SIZE + 1);
+    offlen_segments_->remove_outside(
+        offsetlog::offlen_log::layout::bucket_of(first_id),
+        offsetlog::offlen_log::layout::bucket_of(num_ids) + 1);
+    valid_segments_->remove_outside(
+        offsetlog::valid_log::layout::bucket_of(
+            first_id >> offsetlog::VALID_SHIFT),
+        offsetlog::valid_log::layout::bucket_of(
+            num_ids >> offsetlog::VALID_SHIFT) + 1);
+
+    delete dlog_;
+    delete olog_;
+    dlog_ = new data_log(data_segments_);
+    olog_ = new offsetlog(offlen_segments_, valid_segments_);
+
+    /* Restore the tails; no reader can access the dropped buckets yet */
+    auto free_now = [](std::function<void()> free_bucket) { free_bucket(); };
+    olog_->restore(first_id, num_ids, free_now);
+    dlog_->release_below(low_offset, free_now);
+    dlog_->ensure_alloc(low_offset, tail);
+    dtail_.store(tail);
+    low_offset_.store(low_offset);
+    if (epoch_bytes_ != UINT64_MAX && low_offset / epoch_bytes_ != 0) {
+      first_epoch_.store(low_offset / epoch_bytes_);
+      delete epochs_[0].exchange(NULL);
+    }
+
+    /* Rebuild the indexes */
+    std::vector<unsigned char> record(UINT16_MAX);
+    token_list tokens;
+    for (uint64_t id = first_id; id < num_ids; id++) {
+      if (!olog_->valid_bit(id)) {
+        continue;
+      }
+      uint64_t offset;
+      uint16_t length;
+      olog_->lookup(id, offset, length);
+      if (offset < low_offset || offset + length > tail) {
+        olog_->invalidate(id);
+        continue;
+      }
+      dlog_->read(offset, record.data(), length);
+      tokens.clear();
+      tokenize(record.data(), length, tokens);
+      update_indexes(id, offset, tokens);
+    }
+    return true;
+  }
+
+  /**
+   * Flush the segments of a persisted log-store and durably record its
+   * tails, so that open() restores all records inserted before the call.
+   * Records inserted concurrently may or may not be restored.
+   *
+   * @return true if the checkpoint was recorded, false otherwise.
+   */
+  bool checkpoint() {
+    if (dir_.empty()) {
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(checkpoint_mutex_);
+    log_manifest::entries manifest;
+    manifest["epoch_bytes"] = epoch_bytes_;
+    manifest["first_record"] = olog_->low_water();
+    manifest["low_offset"] = low_offset_.load();
+    manifest["num_records"] = olog_->num_ids();
+    manifest["size"] = dtail_.load();
+
+    bool ok = data_segments_->sync();
+    ok = offlen_segments_->sync() && ok;
+    ok = valid_segments_->sync() && ok;
+    return ok && log_manifest::save(manifest_path(dir_), manifest);
+  }
+
+  /**
+   * Apply the retention policy: drop the oldest epochs while the log-store
+   * exceeds its size limit, or while their most recent records are older
+   * than the age limit. The epoch that receives new records is never
+   * dropped, so it is closed once it spans 1 / EPOCHS_PER_LIMIT of the age
+   * limit.
+   *
+   * Dropping an epoch raises the low-water mark for record ids past its
+   * records and unlinks its data-log blocks, offset-log buckets, indexes and
+   * stream entries, at a cost independent of the number of records. The
+   * memory is freed by the reclaimer thread of the log-store once no reader
+   * is active, and no earlier than the next time an epoch is dropped, so
+   * that writers which reserved space before the drop are done with it.
+   *
+   * Cheap unless an epoch is dropped; meant to be called after every insert
+   * batch. Calls that overlap with another call return immediately.
+   *
+   * @param now_ns The current time, in nanoseconds.
+   */
+  void expire(uint64_t now_ns) {
+    uint64_t max_bytes = max_bytes_.load(std::memory_order_relaxed);
+    if ((max_bytes == 0 && max_age_ns_ == 0)
+        || expiring_.test_and_set(std::memory_order_acquire)) {
+      return;
+    }
+
+    /* Track the age of the head epoch, and close it if it spans its share
+     * of the age limit; skipping to the next epoch only wastes address space
+     * in the data-log */
+    uint64_t tail = dtail_.load();
+    uint64_t head = tail / epoch_bytes_;
+    epoch* e = epochs_[head % MAX_EPOCHS].load(std::memory_order_acquire);
+    if (e != NULL && e->number == head) {
+      if (e->first_ns.load(std::memory_order_relaxed) == 0) {
+        e->first_ns.store(now_ns, std::memory_order_relaxed);
+        mark_streams(e);
+      }
+      e->last_ns.store(now_ns, std::memory_order_relaxed);
+      if (max_age_ns_ != 0
+          && now_ns - e->first_ns.load(std::memory_order_relaxed) >= rotate_ns_) {
+        uint64_t expected = tail;
+        dtail_.compare_exchange_strong(expected, (head + 1) * epoch_bytes_);
+      }
     }
 
-    return 0;
+    bool dropped = false;
+    for (uint64_t n = first_epoch_.load(); n < head; n++) {
+      epoch* old = epochs_[n % MAX_EPOCHS].load(std::memory_order_acquire);
+      if (old != NULL && old->last_ns.load(std::memory_order_relaxed) == 0) {
+        /* Epochs that were never the head here (e.g., restored by open())
+         * age from now */
+        old->last_ns.store(now_ns, std::memory_order_relaxed);
+      }
+      bool over_size = max_bytes != 0 && tail - n * epoch_bytes_ > max_bytes;
+      bool over_age = max_age_ns_ != 0
+          && (old == NULL
+              || old->last_ns.load(std::memory_order_relaxed) + max_age_ns_
+                  <= now_ns);
+      if (!over_size && !over_age) {
+        break;
+      }
+      drop_epoch(n, old);
+      dropped = true;
+    }
+
+    if (dropped) {
+      reclaim();
+    }
+    expiring_.clear(std::memory_order_release);
   }
 
   /**
@@ -285,6 +1044,19 @@ class log_store {
     return streams_->push_back(new streamlog(fn));
   }
 
+  /**
+   * Add a new stream with a filter function on raw record data, e.g., a
+   * JIT-compiled BPF program. The stream receives the records inserted from
+   * here on.
+   *
+   * @param fn The filter function.
+   * @param offset Number of leading record bytes the filter does not see.
+   * @return The id of the newly created stream.
+   */
+  uint32_t add_stream(packet_filter_function fn, uint32_t offset = 0) {
+    return streams_->push_back(new streamlog(fn, offset));
+  }
+
   /**
    * Insert a new record into the log-store.
    *
@@ -305,18 +1077,107 @@ class log_store {
     append_record(record, record_len, offset);
 
     /* Add the index entries to index logs */
-    update_indexes(record_id, tokens);
+    update_indexes(record_id, offset, tokens);
 
     /* Add the record entry to appropriate streams */
     update_streams(record_id, record, record_len, tokens);
 
     /* End the write operation; makes the record available for query */
     olog_->end(record_id);
+    notify_streams();
 
     /* Return record_id */
     return record_id;
   }
 
+  /**
+   * Insert a batch of records into the log-store.
+   *
+   * Record ids and data-log bytes for the whole batch are reserved with a
+   * single atomic operation each, the records are copied back to back,
+   * index updates are grouped by index, and the batch is made available
+   * for queries at once.
+   *
+   * @param records The buffers containing record data.
+   * @param record_lens The lengths of the records.
+   * @param tokens Tokens associated with each of the records.
+   * @param num_records The number of records in the batch.
+   * @return The record id of the first record; the records in the batch
+   *  are assigned consecutive ids.
+   */
+  uint64_t insert_batch(const unsigned char* const * records,
+                        const uint16_t* record_lens, token_list* tokens,
+                        uint32_t num_records) {
+    return insert_batch(reserve_ids(num_records), records, record_lens,
+                        tokens, num_records, records, record_lens);
+  }
+
+  /**
+   * Reserve consecutive record ids for a batch of records, to be inserted
+   * with insert_batch(start_id, ...).
+   *
+   * @param num_records The number of records in the batch.
+   * @return The first reserved record id.
+   */
+  uint64_t reserve_ids(uint32_t num_records) {
+    return olog_->request_id_block(num_records);
+  }
+
+  /**
+   * Insert a batch of records with ids reserved by reserve_ids(), as
+   * insert_batch(). The stream filters see a view of each record rather
+   * than the record itself; e.g., the record before it was encoded.
+   *
+   * @param start_id The first record id, from reserve_ids().
+   * @param records The buffers containing record data.
+   * @param record_lens The lengths of the records.
+   * @param tokens Tokens associated with each of the records.
+   * @param num_records The number of records in the batch.
+   * @param views The record data the stream filters see.
+   * @param view_lens The lengths of the views.
+   * @return The record id of the first record.
+   */
+  uint64_t insert_batch(uint64_t start_id, const unsigned char* const * records,
+                        const uint16_t* record_lens, token_list* tokens,
+                        uint32_t num_records,
+                        const unsigned char* const * views,
+                        const uint16_t* view_lens) {
+    /* Atomically request bytes for the whole batch */
+    uint64_t total_len = 0;
+    for (uint32_t i = 0; i < num_records; i++) {
+      total_len += record_lens[i];
+    }
+    uint64_t start_offset = request_bytes(total_len);
+    uint64_t offset = start_offset;
+
+    /* Append the record values to data log, back to back */
+    for (uint32_t i = 0; i < num_records; i++) {
+      append_record(records[i], record_lens[i], offset);
+      olog_->set(start_id + i, offset, record_lens[i]);
+      offset += record_lens[i];
+    }
+
+    /* Add the index entries to index logs */
+    update_indexes(start_id, start_offset, record_lens, tokens, num_records);
+
+    /* Add the record entries to appropriate streams */
+    update_streams(start_id, views, view_lens, tokens, num_records);
+
+    /* End the write operation; makes the batch available for query */
+    olog_->end(start_id, num_records);
+    notify_streams();
+
+    return start_id;
+  }
+
+  /**
+   * Get the number of the epoch that currently receives records. Records in
+   * the same epoch are dropped together by the retention policy.
+   */
+  uint64_t head_epoch() const {
+    return dtail_.load() / epoch_bytes_;
+  }
+
   /**
    * Atomically fetch a record from the log-store given its recordId. The
    * record buffer must be pre-allocated with sufficient size.
@@ -326,6 +1187,7 @@ class log_store {
    * @return true if the fetch is successful, false otherwise.
    */
   bool get(unsigned char* record, const uint64_t record_id) const {
+    reader_guard guard(readers_);
 
     /* Checks if the record_id has been written yet, returns false on failure. */
     if (!olog_->is_valid(record_id))
@@ -356,6 +1218,7 @@ class log_store {
    */
   bool extract(unsigned char* record, const uint64_t record_id, uint32_t offset,
                uint32_t& length) const {
+    reader_guard guard(readers_);
 
     /* Checks if the record_id has been written yet, returns false on failure. */
     if (!olog_->is_valid(record_id))
@@ -375,16 +1238,93 @@ class log_store {
     return true;
   }
 
+  /**
+   * Read a portion of each of a set of records, in batches of up to
+   * SCAN_BATCH records; e.g., to aggregate over the records rather than
+   * fetch them one at a time. The offsets of a batch are looked up before
+   * its data is read, so the data-log reads of a batch overlap. Records
+   * that are not valid are skipped.
+   *
+   * @param record_ids The ids of the records.
+   * @param offset The offset into each record to begin reading.
+   * @param max_length The maximum number of bytes read per record.
+   * @param fn The function called on each batch, with the data read for
+   *  each record of the batch, its length and the number of records.
+   */
+  template<typename F>
+  void scan(const std::vector<uint64_t>& record_ids, uint32_t offset,
+            uint16_t max_length, F fn) const {
+    std::vector<unsigned char> buf((size_t) SCAN_BATCH * max_length);
+    const unsigned char* data[SCAN_BATCH];
+    uint64_t offsets[SCAN_BATCH];
+    uint16_t lengths[SCAN_BATCH];
+
+    reader_guard guard(readers_);
+    size_t i = 0;
+    while (i < record_ids.size()) {
+      uint32_t n = 0;
+      for (; n < SCAN_BATCH && i < record_ids.size(); i++) {
+        uint64_t record_id = record_ids[i];
+        if (!olog_->is_valid(record_id)) {
+          continue;
+        }
+        uint16_t length;
+        olog_->lookup(record_id, offsets[n], length);
+        lengths[n] = length > offset ?
+            std::min<uint32_t>(length - offset, max_length) : 0;
+        n++;
+      }
+
+      for (uint32_t j = 0; j < n; j++) {
+        unsigned char* out = &buf[(size_t) j * max_length];
+        dlog_->read(offsets[j] + offset, out, lengths[j]);
+        data[j] = out;
+      }
+      if (n != 0) {
+        fn(data, lengths, n);
+      }
+    }
+  }
+
   /**
    * Get the stream associated with a given stream id.
    *
    * @param stream_id The id of the stream.
    * @return The stream associated with the id.
    */
-  entry_list* get_stream(uint32_t stream_id) const {
+  stream_list* get_stream(uint32_t stream_id) const {
     return streams_->at(stream_id)->get_stream();
   }
 
+  /**
+   * Get the records of a stream with ids smaller than max_rid, skipping
+   * records that were dropped or are still being inserted.
+   *
+   * @param results The sorted record ids in the stream.
+   * @param stream_id The id of the stream.
+   * @param max_rid Snapshot of the number of records to consider.
+   */
+  void filter_stream(std::vector<uint64_t>& results, uint32_t stream_id,
+                     uint64_t max_rid) const {
+    max_rid = std::min(max_rid, olog_->num_ids());
+    results.clear();
+    reader_guard guard(readers_);
+    streamlog* stream = streams_->at(stream_id);
+    stream->get_stream()->for_each([&](uint64_t record_id) {
+      if (olog_->is_valid(record_id, max_rid)) {
+        results.push_back(record_id);
+      }
+    }, stream->first());
+    sort_unique(results);
+  }
+
+  /**
+   * Get the number of streams.
+   */
+  uint32_t num_streams() const {
+    return streams_->size();
+  }
+
   /* Statistics and helpers */
 
   /** Atomically get the number of currently readable records.
@@ -403,6 +1343,16 @@ class log_store {
     return dtail_.load();
   }
 
+  /**
+   * Get the smallest record id that has not been dropped by the retention
+   * policy. Records with smaller ids are no longer valid.
+   *
+   * @return The low-water mark for record ids.
+   */
+  uint64_t first_record() const {
+    return olog_->low_water();
+  }
+
   /**
    * Filter index-entries based on query.
    *
@@ -411,65 +1361,96 @@ class log_store {
    */
   void filter(std::unordered_set<uint64_t>& results,
               filter_query& query) const {
-    uint64_t max_rid = olog_->num_ids();
-    for (filter_conjunction& conjunction : query) {
-      std::unordered_set<uint64_t> conjunction_results;
-      for (basic_filter& basic : conjunction) {
-        /* Identify which index the filter is on */
-        uint32_t idx = basic.index_id() / OFFSETMIN;
-        uint32_t off = basic.index_id() % OFFSETMIN;
-
-        /* Query relevant index */
-        std::unordered_set<uint64_t> filter_res;
-        switch (idx) {
-          case 1: {
-            filter(filter_res, idx1_->at(off), basic.token_beg(),
-                   basic.token_end(), max_rid, conjunction_results);
-            break;
-          }
-          case 2: {
-            filter(filter_res, idx2_->at(off), basic.token_beg(),
-                   basic.token_end(), max_rid, conjunction_results);
-            break;
-          }
-          case 4: {
-            filter(filter_res, idx3_->at(off), basic.token_beg(),
-                   basic.token_end(), max_rid, conjunction_results);
-            break;
-          }
-          case 8: {
-            filter(filter_res, idx4_->at(off), basic.token_beg(),
-                   basic.token_end(), max_rid, conjunction_results);
-            break;
-          }
-          case 16: {
-            filter(filter_res, idx5_->at(off), basic.token_beg(),
-                   basic.token_end(), max_rid, conjunction_results);
-            break;
-          }
-          case 32: {
-            filter(filter_res, idx6_->at(off), basic.token_beg(),
-                   basic.token_end(), max_rid, conjunction_results);
-            break;
-          }
-          case 64: {
-            filter(filter_res, idx7_->at(off), basic.token_beg(),
-                   basic.token_end(), max_rid, conjunction_results);
-            break;
-          }
-          case 128: {
-            filter(filter_res, idx8_->at(off), basic.token_beg(),
-                   basic.token_end(), max_rid, conjunction_results);
-            break;
-          }
-        }
-        /* Stop this sequence of conjunctions if filter results are empty */
-        if (filter_res.empty())
-          break;
+    filter(results, query, olog_->num_ids());
+  }
+
+  /**
+   * Filter index-entries based on query, considering only records with ids
+   * smaller than max_rid. Passing the same max_rid across calls yields results
+   * over a consistent snapshot of the log-store, irrespective of concurrent
+   * inserts.
+   *
+   * @param results The results of the filter query.
+   * @param query The filter query.
+   * @param max_rid Snapshot of the number of records to consider.
+   */
+  void filter(std::unordered_set<uint64_t>& results, filter_query& query,
+              uint64_t max_rid) const {
+    std::vector<uint64_t> sorted_results;
+    filter(sorted_results, query, max_rid);
+    results.insert(sorted_results.begin(), sorted_results.end());
+  }
+
+  /**
+   * Filter index-entries based on query.
+   *
+   * @param results The sorted record ids matching the filter query.
+   * @param query The filter query.
+   */
+  void filter(std::vector<uint64_t>& results, filter_query& query) const {
+    filter(results, query, olog_->num_ids());
+  }
+
+  /**
+   * Filter index-entries based on query, considering only records with ids
+   * smaller than max_rid.
+   *
+   * Each conjunction is evaluated as a sequence of sorted streams: the basic
+   * filters are ordered by their estimated number of postings, the smallest
+   * one is materialized, and the running result, which only shrinks, is
+   * intersected with each subsequent filter by galloping through the larger
+   * side.
+   *
+   * @param results The sorted record ids matching the filter query.
+   * @param query The filter query.
+   * @param max_rid Snapshot of the number of records to consider.
+   */
+  void filter(std::vector<uint64_t>& results, filter_query& query,
+              uint64_t max_rid) const {
+    filter(results, query, 0, max_rid);
+  }
 
-        conjunction_results = filter_res;
+  /**
+   * Filter index-entries based on query, considering only records with ids
+   * in [min_rid, max_rid); e.g., a time range from a time index. Epochs that
+   * end below min_rid are skipped.
+   *
+   * @param results The sorted record ids matching the filter query.
+   * @param query The filter query.
+   * @param min_rid The smallest record id to consider.
+   * @param max_rid Snapshot of the number of records to consider.
+   */
+  void filter(std::vector<uint64_t>& results, filter_query& query,
+              uint64_t min_rid, uint64_t max_rid) const {
+    max_rid = std::min(max_rid, olog_->num_ids());
+    results.clear();
+    if (min_rid >= max_rid) {
+      return;
+    }
+    reader_guard guard(readers_);
+
+    /* Each epoch has its own indexes */
+    uint64_t head = dtail_.load() / epoch_bytes_;
+    for (uint64_t n = first_epoch_.load(); n <= head; n++) {
+      const epoch* e = epochs_[n % MAX_EPOCHS].load(std::memory_order_acquire);
+      if (e == NULL || e->number != n)
+        continue;
+      if (n < head && e->end_id.load(std::memory_order_acquire) <= min_rid)
+        continue;
+
+      for (filter_conjunction& conjunction : query) {
+        if (conjunction.empty())
+          continue;
+
+        std::vector<uint64_t> conjunction_results;
+        filter(conjunction_results, *e, conjunction, max_rid);
+        union_sorted(results, conjunction_results);
       }
-      results.insert(conjunction_results.begin(), conjunction_results.end());
+    }
+
+    if (min_rid != 0) {
+      results.erase(results.begin(),
+                    std::lower_bound(results.begin(), results.end(), min_rid));
     }
   }
 
@@ -479,25 +1460,235 @@ class log_store {
    * storage statistics at the end of the call.
    */
   void storage_footprint(logstore_storage& storage_stats) const {
+    reader_guard guard(readers_);
+
     /* Get size for data-log and offset-log */
     storage_stats.dlog_size = dlog_->storage_size();
     storage_stats.olog_size = olog_->storage_size();
 
-    /* Get size for index-logs */
-    index_size(storage_stats.idx_sizes, idx1_);
-    index_size(storage_stats.idx_sizes, idx2_);
-    index_size(storage_stats.idx_sizes, idx3_);
-    index_size(storage_stats.idx_sizes, idx4_);
-    index_size(storage_stats.idx_sizes, idx5_);
-    index_size(storage_stats.idx_sizes, idx6_);
-    index_size(storage_stats.idx_sizes, idx7_);
-    index_size(storage_stats.idx_sizes, idx8_);
+    /* Get size and posting list footprint for index-logs, summed over all
+     * live epochs */
+    uint64_t head = dtail_.load() / epoch_bytes_;
+    for (uint64_t n = first_epoch_.load(); n <= head; n++) {
+      const epoch* e = epochs_[n % MAX_EPOCHS].load(std::memory_order_acquire);
+      if (e != NULL && e->number == n) {
+        e->indexes.storage_footprint(storage_stats.idx_sizes,
+                                     storage_stats.idx_postings,
+                                     storage_stats.idx_posting_sizes);
+      }
+    }
 
     /* Get size of stream-logs */
     stream_size(storage_stats.stream_sizes);
   }
 
  private:
+  typedef __monolog_linear_base<uint8_t, DLOG_NBUCKETS, DLOG_BLOCK_SIZE> data_log;
+
+  /* Epochs never outnumber data-log blocks */
+  static const uint32_t MAX_EPOCHS = DLOG_NBUCKETS;
+
+  /**
+   * An epoch: the records that start in a range of epoch_bytes_ bytes of the
+   * data-log, along with their indexes.
+   */
+  struct epoch {
+    epoch(uint64_t n)
+        : number(n),
+          end_id(0),
+          first_ns(0),
+          last_ns(0),
+          unsorted(false) {
+    }
+
+    /* Raises end_id to at least id */
+    void extend(uint64_t id) {
+      uint64_t cur = end_id.load(std::memory_order_relaxed);
+      while (cur < id && !end_id.compare_exchange_weak(cur, id))
+        ;
+    }
+
+    const uint64_t number;
+    index_set indexes;
+    std::atomic<uint64_t> end_id;  /* One past the largest record id */
+    std::atomic<uint64_t> first_ns;
+    std::atomic<uint64_t> last_ns;
+
+    /* Set before entries are appended to the posting lists out of record id
+     * order; until then, the posting lists are sorted and can be searched */
+    std::atomic<bool> unsorted;
+
+    /* Number of published entries of each stream once the epoch became the
+     * head, which only refer to records in this or earlier epochs; only
+     * accessed by expire() */
+    std::vector<uint64_t> stream_marks;
+  };
+
+  /* Marks a reader active for its lifetime; see expire() */
+  class reader_guard {
+   public:
+    reader_guard(std::atomic<uint32_t>& readers)
+        : readers_(readers) {
+      readers_.fetch_add(1U);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    ~reader_guard() {
+      readers_.fetch_sub(1U, std::memory_order_release);
+    }
+
+   private:
+    std::atomic<uint32_t>& readers_;
+  };
+
+  /* Defers freeing a memory block unlinked by the retention policy */
+  struct deferred_free {
+    std::vector<std::function<void()>>& frees;
+
+    void operator()(std::function<void()> free_block) {
+      frees.push_back(free_block);
+    }
+  };
+
+  static std::string manifest_path(const std::string& dir) {
+    return dir + "/MANIFEST";
+  }
+
+  /**
+   * Get the epoch that the record at a data-log offset belongs to, creating
+   * it if necessary.
+   *
+   * @param offset The offset of the record in the data-log.
+   * @return The epoch.
+   */
+  epoch* get_epoch(uint64_t offset) {
+    uint64_t n = offset / epoch_bytes_;
+    epoch* e = epochs_[n % MAX_EPOCHS].load(std::memory_order_acquire);
+    if (e == NULL) {
+      std::lock_guard<std::mutex> lock(epoch_mutex_);
+      e = create_epoch(n);
+    }
+    if (e->number != n) {
+      throw log_overflow_exception();
+    }
+    return e;
+  }
+
+  /**
+   * Create epoch n with all indexes added so far, unless it exists already.
+   * Must be called with epoch_mutex_ held.
+   *
+   * @param n The epoch number.
+   * @return The epoch in the slot for epoch n.
+   */
+  epoch* create_epoch(uint64_t n) {
+    std::atomic<epoch*>& slot = epochs_[n % MAX_EPOCHS];
+    if (slot.load(std::memory_order_acquire) == NULL) {
+      epoch* e = new epoch(n);
+      for (uint32_t token_length : index_lengths_) {
+        e->indexes.add_index(token_length);
+      }
+      slot.store(e, std::memory_order_release);
+    }
+    return slot.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Record in the head epoch the number of published entries of each
+   * stream, to be released when the epoch is dropped. Skipped if the
+   * data-log moved past the epoch meanwhile, since the entries may then
+   * refer to records in later epochs.
+   *
+   * @param e The head epoch.
+   */
+  void mark_streams(epoch* e) {
+    std::vector<uint64_t> marks;
+    uint32_t num_streams = streams_->size();
+    for (uint32_t i = 0; i < num_streams; i++) {
+      marks.push_back(streams_->at(i)->num_published());
+    }
+    if (dtail_.load() / epoch_bytes_ == e->number) {
+      e->stream_marks.swap(marks);
+    }
+  }
+
+  /**
+   * Drop epoch n: raise the low-water mark past its records, and unlink its
+   * data-log blocks, the offset-log buckets below the low-water mark, its
+   * indexes, and the stream entries marked in it. The unlinked memory is
+   * added to retired_.
+   *
+   * @param n The epoch number; must be first_epoch_.
+   * @param e The epoch, or NULL if no record was added to it.
+   */
+  void drop_epoch(uint64_t n, epoch* e) {
+    deferred_free retire = { retired_ };
+    if (e != NULL) {
+      olog_->drop_below(e->end_id.load(std::memory_order_acquire), retire);
+      for (size_t i = 0; i < e->stream_marks.size(); i++) {
+        streams_->at(i)->drop_below(e->stream_marks[i], retire);
+      }
+    }
+
+    uint64_t end_offset = (n + 1) * epoch_bytes_;
+    low_offset_.store(end_offset);
+    dlog_->release_below(end_offset, retire);
+
+    if (e != NULL) {
+      epochs_[n % MAX_EPOCHS].store(NULL);
+      retired_.push_back([e] { delete e; });
+    }
+    first_epoch_.store(n + 1);
+  }
+
+  /**
+   * Hand the memory dropped by earlier calls to expire() to the reclaimer
+   * thread if no reader is active; memory dropped by this call waits for the
+   * next one.
+   */
+  void reclaim() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (readers_.load() == 0 && !draining_.empty()) {
+      /* Readers that start from here on cannot observe the unlinked memory */
+      {
+        std::lock_guard<std::mutex> lock(reclaim_mutex_);
+        reclaimable_.insert(reclaimable_.end(), draining_.begin(),
+                            draining_.end());
+      }
+      reclaim_cv_.notify_one();
+      draining_.clear();
+    }
+    draining_.insert(draining_.end(), retired_.begin(), retired_.end());
+    retired_.clear();
+  }
+
+  /* Body of the reclaimer thread; frees the memory handed over by reclaim()
+   * until the log-store is destroyed */
+  void reclaim_dropped() {
+    std::unique_lock<std::mutex> lock(reclaim_mutex_);
+    while (true) {
+      reclaim_cv_.wait(lock, [this] {
+        return stop_reclaimer_ || !reclaimable_.empty();
+      });
+      if (reclaimable_.empty()) {
+        return;
+      }
+      std::vector<std::function<void()>> frees;
+      frees.swap(reclaimable_);
+      lock.unlock();
+      for (auto& fn : frees) {
+        fn();
+      }
+      lock.lock();
+    }
+  }
+
+  /**
+   * Get the smallest data-log offset that has not been dropped.
+   */
+  uint64_t low_offset() const {
+    return low_offset_.load();
+  }
 
   /**
    * Atomically request bytes from the data-log.
@@ -526,54 +1717,82 @@ class log_store {
   }
 
   /**
-   * Add (token, recordId) entries to index logs.
+   * Add (token, recordId) entries to the indexes of the epoch the record
+   * belongs to.
    *
    * @param record_id The id of the record whose index entries are being added.
+   * @param offset The offset of the record in the data-log.
    * @param tokens The tokens associated with the record.
    */
-  void update_indexes(uint64_t record_id, token_list& tokens) {
-    for (token_t& token : tokens) {
-      /* Identify which index token belongs to */
-      uint32_t idx = token.index_id() / OFFSETMIN;
-      uint32_t off = token.index_id() % OFFSETMIN;
-
-      /* Update relevant index */
-      uint64_t key = token.data();
-      switch (idx) {
-        case 1: {
-          idx1_->at(off)->add_entry(key, record_id);
-          break;
-        }
-        case 2: {
-          idx2_->at(off)->add_entry(key, record_id);
-          break;
-        }
-        case 4: {
-          idx3_->at(off)->add_entry(key, record_id);
-          break;
-        }
-        case 8: {
-          idx4_->at(off)->add_entry(key, record_id);
-          break;
-        }
-        case 16: {
-          idx5_->at(off)->add_entry(key, record_id);
-          break;
-        }
-        case 32: {
-          idx6_->at(off)->add_entry(key, record_id);
-          break;
-        }
-        case 64: {
-          idx7_->at(off)->add_entry(key, record_id);
-          break;
-        }
-        case 128: {
-          idx8_->at(off)->add_entry(key, record_id);
-          break;
-        }
+  void update_indexes(uint64_t record_id, uint64_t offset,
+                      token_list& tokens) {
+    epoch* e = get_epoch(offset);
+    if (!begin_indexing(record_id, record_id + 1)) {
+      e->unsorted.store(true);
+    }
+    e->indexes.add_entries(record_id, tokens);
+    e->extend(record_id + 1);
+    indexers_.fetch_sub(1U, std::memory_order_release);
+  }
+
+  /**
+   * Add (token, recordId) entries to index logs for a batch of records with
+   * consecutive ids, stored back to back in the data-log. A batch that
+   * crosses an epoch boundary is split, and each part is added to the indexes
+   * of the epoch its records belong to.
+   *
+   * @param start_id The id of the first record in the batch.
+   * @param start_offset The offset of the first record in the data-log.
+   * @param record_lens The lengths of the records.
+   * @param tokens The tokens associated with each record.
+   * @param num_records The number of records in the batch.
+   */
+  void update_indexes(uint64_t start_id, uint64_t start_offset,
+                      const uint16_t* record_lens, token_list* tokens,
+                      uint32_t num_records) {
+    bool in_order = begin_indexing(start_id, start_id + num_records)
+        && index_set::in_id_order(tokens, num_records);
+    uint64_t offset = start_offset;
+    uint32_t i = 0;
+    while (i < num_records) {
+      epoch* e = get_epoch(offset);
+
+      /* Records that start before the end of the epoch belong to it */
+      uint64_t end_offset = (e->number + 1) * epoch_bytes_;
+      uint32_t first = i;
+      while (i < num_records && offset < end_offset) {
+        offset += record_lens[i++];
       }
+
+      if (!in_order) {
+        e->unsorted.store(true);
+      }
+      e->indexes.add_entries(start_id + first, tokens + first, i - first);
+      e->extend(start_id + i);
     }
+    indexers_.fetch_sub(1U, std::memory_order_release);
+  }
+
+  /**
+   * Registers a writer of index entries for the ids in [start_id, end_id);
+   * the writer must unregister by decrementing indexers_ once done.
+   *
+   * Entries are appended to the posting lists in record id order as long as
+   * writers do not overlap and index increasing ids. Otherwise, the writer
+   * must mark the epochs it writes to unsorted before appending to them:
+   * readers check the mark after reading the size of a posting list, so they
+   * never search entries that were appended out of order.
+   *
+   * @param start_id The first id to be indexed.
+   * @param end_id One past the last id to be indexed.
+   * @return Whether the writer appends entries in record id order.
+   */
+  bool begin_indexing(uint64_t start_id, uint64_t end_id) {
+    bool alone = indexers_.fetch_add(1U) == 0;
+    uint64_t tail = index_tail_.load();
+    while (tail < end_id && !index_tail_.compare_exchange_weak(tail, end_id))
+      ;
+    return alone && tail <= start_id;
   }
 
   /**
@@ -593,65 +1812,196 @@ class log_store {
   }
 
   /**
-   * Atomically filter record ids from a given index for a token prefix.
+   * Add the records of a batch to all streams which are satisfied by them.
+   * Each stream filters the whole batch in turn, so that its filter stays
+   * hot in cache.
    *
-   * @param results The results set to be populated with matching records ids.
-   * @param ilog The index log associated with the token.
-   * @param token_prefix The prefix of the token being searched.
-   * @param token_prefix_len The length of the prefix.
-   * @param max_rid Largest record-id to consider.
-   * @param superset The superset to which the results must belong.
+   * @param start_id Id of the first record.
+   * @param records Record data.
+   * @param record_lens Record data lengths.
+   * @param tokens Tokens of each of the records.
+   * @param num_records The number of records.
    */
-  template<typename INDEX>
-  void filter(std::unordered_set<uint64_t>& results, INDEX* index,
-              uint64_t token_beg, uint64_t token_end, const uint64_t max_rid,
-              const std::unordered_set<uint64_t>& superset) const {
+  void update_streams(uint64_t start_id, const unsigned char* const * records,
+                      const uint16_t* record_lens, const token_list* tokens,
+                      uint32_t num_records) {
+    uint32_t num_streams = streams_->size();
+    for (uint32_t i = 0; i < num_streams; i++) {
+      streams_->at(i)->check_and_add(start_id, records, record_lens, tokens,
+                                     num_records);
+    }
+  }
+
+  /* Wakes the subscriptions waiting on any stream */
+  void notify_streams() {
+    uint32_t num_streams = streams_->size();
+    for (uint32_t i = 0; i < num_streams; i++) {
+      streams_->at(i)->notify();
+    }
+  }
 
-    for (uint64_t i = token_beg; i <= token_end; i++) {
-      entry_list* list = index->get(i);
-      sweep_list(results, list, max_rid, superset);
+  /**
+   * Filter the index-entries of an epoch based on a conjunction, considering
+   * only records with ids smaller than max_rid.
+   *
+   * The conjunction is evaluated as a sequence of sorted streams: the basic
+   * filters are ordered by their estimated number of postings, the smallest
+   * one is materialized, and the running result, which only shrinks, is
+   * intersected with each subsequent filter.
+   *
+   * @param results The sorted record ids matching the conjunction.
+   * @param e The epoch.
+   * @param conjunction The (non-empty) conjunction.
+   * @param max_rid Snapshot of the number of records to consider.
+   */
+  void filter(std::vector<uint64_t>& results, const epoch& e,
+              filter_conjunction& conjunction, uint64_t max_rid) const {
+    /* Order filters by their estimated result size */
+    std::vector<std::pair<uint64_t, basic_filter*>> order;
+    for (basic_filter& basic : conjunction) {
+      order.push_back(std::make_pair(estimate(e.indexes, basic), &basic));
+    }
+    std::sort(order.begin(), order.end(),
+              [](const std::pair<uint64_t, basic_filter*>& a,
+                 const std::pair<uint64_t, basic_filter*>& b) {
+                return a.first < b.first;
+              });
+
+    if (order.front().first != 0) {
+      collect(results, e.indexes, *order.front().second, max_rid);
+    }
+    for (size_t i = 1; i < order.size(); i++) {
+      /* Stop this sequence of conjunctions if filter results are empty */
+      if (results.empty())
+        break;
+
+      std::vector<uint64_t> filter_res;
+      intersect(filter_res, e, *order[i].second, results);
+      results.swap(filter_res);
     }
   }
 
   /**
-   * Sweeps through the entry-list, adding all valid entries to the results.
+   * Estimate the number of records matching a basic filter.
    *
+   * @param indexes The indexes to consult.
+   * @param basic The basic filter.
+   * @return The number of postings for the filter's token range.
+   */
+  uint64_t estimate(const index_set& indexes, basic_filter& basic) const {
+    uint64_t num_postings = 0;
+    indexes.for_each_list(basic.index_id(), basic.token_beg(),
+                          basic.token_end(),
+                          [&](const posting_list* list) {
+                            num_postings += list->size();
+                          });
+    return num_postings;
+  }
+
+  /**
+   * Collect all valid record ids matching a basic filter. The ids of each
+   * posting list form a sorted run, and the runs are merged.
    *
-   * @param results The set of results to be populated.
-   * @param list The entry list.
+   * @param results Populated with the sorted matching record ids.
+   * @param indexes The indexes to consult.
+   * @param basic The basic filter.
    * @param max_rid The maximum permissible record id.
-   * @param superset The superset to which the results must belong.
-   * @param superset_check Flag which determines whether to perform superset
-   *  check or not.
    */
-  void sweep_list(std::unordered_set<uint64_t>& results, entry_list* list,
-                  uint64_t max_rid,
-                  const std::unordered_set<uint64_t>& superset) const {
-    if (list == NULL)
-      return;
+  void collect(std::vector<uint64_t>& results, const index_set& indexes,
+               basic_filter& basic, uint64_t max_rid) const {
+    std::vector<size_t> ends;
+    indexes.for_each_list(basic.index_id(), basic.token_beg(),
+                          basic.token_end(),
+                          [&](const posting_list* list) {
+                            size_t beg = results.size();
+                            list->for_each([&](uint64_t record_id) {
+                              if (olog_->is_valid(record_id, max_rid))
+                                results.push_back(record_id);
+                            });
+                            end_run(results, beg, ends);
+                          });
+    merge_runs(results, ends);
+  }
 
-    uint32_t size = list->size();
-    for (uint32_t i = 0; i < size; i++) {
-      uint64_t record_id = list->at(i);
-      if (olog_->is_valid(record_id, max_rid)
-          && (superset.empty() || superset.find(record_id) != superset.end()))
-        results.insert(record_id);
-    }
+  /**
+   * Intersect the record ids matching a basic filter with a sorted set of
+   * valid record ids, one posting list at a time, and merge the results.
+   *
+   * The smaller side drives the intersection: the set gallops through each
+   * posting list that is larger than it, as long as the epoch's posting lists
+   * are sorted. Smaller (or unsorted) lists are swept, and each entry is
+   * probed against the set, with a bitmap if the set is dense, and by
+   * galloping through it otherwise.
+   *
+   * @param results Populated with the sorted record ids in the intersection.
+   * @param e The epoch whose indexes to consult.
+   * @param basic The basic filter.
+   * @param superset The sorted set of record ids to intersect with.
+   */
+  void intersect(std::vector<uint64_t>& results, const epoch& e,
+                 basic_filter& basic,
+                 const std::vector<uint64_t>& superset) const {
+    std::unique_ptr<rid_bitmap> bitmap;
+    std::vector<size_t> ends;
+    auto add = [&](uint64_t record_id) { results.push_back(record_id); };
+    e.indexes.for_each_list(basic.index_id(), basic.token_beg(),
+                            basic.token_end(),
+                            [&](const posting_list* list) {
+      size_t beg = results.size();
+
+      /* The entries counted by size() were appended before the epoch was
+       * marked unsorted, unless the mark is seen */
+      uint64_t n = list->size();
+      if (n > superset.size() && !e.unsorted.load()) {
+        list->for_each_in(superset, n, add);
+      } else if (rid_bitmap::is_dense(superset)) {
+        if (!bitmap) {
+          bitmap.reset(new rid_bitmap(superset));
+        }
+        sweep_list(results, list, *bitmap);
+      } else {
+        sorted_probe probe(superset);
+        sweep_list(results, list, probe);
+      }
+      end_run(results, beg, ends);
+    });
+    merge_runs(results, ends);
   }
 
   /**
-   * Compute the sizes of index-logs.
+   * Sweeps through a posting list, adding all entries contained in the
+   * superset to the results.
    *
-   * @param sizes Vector to be populated with index sizes.
-   * @param idx Monolog containing indexes.
+   * @param results The results to be populated.
+   * @param list The posting list.
+   * @param superset The superset to which the results must belong.
    */
-  template<typename INDEX>
-  void index_size(std::vector<size_t>& sizes,
-                  monolog_linearizable<INDEX*> *idx) const {
-    uint32_t num_indexes = idx->size();
-    for (uint32_t i = 0; i < num_indexes; i++) {
-      sizes.push_back(idx->at(i)->storage_size());
+  template<typename SET>
+  void sweep_list(std::vector<uint64_t>& results, const posting_list* list,
+                  SET& superset) const {
+    list->for_each([&](uint64_t record_id) {
+      if (superset.contains(record_id))
+        results.push_back(record_id);
+    });
+  }
+
+  /**
+   * Ends the run of results added from a posting list, sorting it if the
+   * list's entries were appended out of order.
+   *
+   * @param results The results, ending with the run.
+   * @param beg The start of the run.
+   * @param ends The ends of the runs so far; extended with the run.
+   */
+  static void end_run(std::vector<uint64_t>& results, size_t beg,
+                      std::vector<size_t>& ends) {
+    if (results.size() == beg) {
+      return;
+    }
+    if (!std::is_sorted(results.begin() + beg, results.end())) {
+      std::sort(results.begin() + beg, results.end());
     }
+    ends.push_back(results.size());
   }
 
   /**
@@ -666,22 +2016,48 @@ class log_store {
     }
   }
 
-  /* Data log and offset log */
-  __monolog_linear_base <uint8_t>* dlog_;
+  /* Data log and offset log, and the default allocator of their buckets */
+  page_allocator pages_;
+  data_log* dlog_;
   offsetlog* olog_;
 
   /* Tail for preserving atomicity */
   std::atomic<uint64_t> dtail_;
 
-  /* Index logs */
-  monolog_linearizable<__index1 *> *idx1_;
-  monolog_linearizable<__index2 *> *idx2_;
-  monolog_linearizable<__index3 *> *idx3_;
-  monolog_linearizable<__index4 *> *idx4_;
-  monolog_linearizable<__index5 *> *idx5_;
-  monolog_linearizable<__index6 *> *idx6_;
-  monolog_linearizable<__index7 *> *idx7_;
-  monolog_linearizable<__index8 *> *idx8_;
+  /* Retention policy; the size limit may be changed by set_size_limit() */
+  std::atomic<uint64_t> max_bytes_;
+  uint64_t max_age_ns_;
+  uint64_t epoch_bytes_;
+  uint64_t rotate_ns_;
+
+  /* Epochs, with their indexes; epoch n is kept in slot n % MAX_EPOCHS */
+  std::array<std::atomic<epoch*>, MAX_EPOCHS> epochs_;
+  std::atomic<uint64_t> first_epoch_;
+  std::atomic<uint64_t> low_offset_;
+  std::vector<uint32_t> index_lengths_;
+  std::mutex epoch_mutex_;
+
+  /* Writers of index entries, and one past the largest id they indexed */
+  std::atomic<uint32_t> indexers_;
+  std::atomic<uint64_t> index_tail_;
+
+  /* Reclamation of dropped epochs */
+  std::atomic_flag expiring_;
+  mutable std::atomic<uint32_t> readers_;
+  std::vector<std::function<void()>> retired_;
+  std::vector<std::function<void()>> draining_;
+  std::vector<std::function<void()>> reclaimable_;
+  std::mutex reclaim_mutex_;
+  std::condition_variable reclaim_cv_;
+  bool stop_reclaimer_;
+  std::thread reclaimer_;
+
+  /* Persistence; the allocators are NULL unless the log-store is opened */
+  std::string dir_;
+  segment_allocator* data_segments_;
+  segment_allocator* offlen_segments_;
+  segment_allocator* valid_segments_;
+  std::mutex checkpoint_mutex_;
 
   /* Stream logs */
   monolog_linearizable<streamlog*> *streams_;
@@ -0,0 +1,547 @@
+#include "logstore.h"
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+const uint64_t kBlock = slog::log_store::DLOG_BLOCK_SIZE;
+const uint32_t kBatch = 32;
+const uint64_t kKeys = 16;
+
+// Inserts a batch of records of record_len bytes, each holding its record id
+// in its first 8 bytes, and indexed on its record id modulo kKeys.
+uint64_t InsertBatch(slog::log_store &store, uint32_t index_id,
+                     uint16_t record_len) {
+  uint64_t next_id = store.num_records();
+  std::vector<unsigned char> bufs(kBatch * record_len);
+  const unsigned char *records[kBatch];
+  uint16_t record_lens[kBatch];
+  slog::token_list tokens[kBatch];
+  for (uint32_t i = 0; i < kBatch; i++) {
+    uint64_t id = next_id + i;
+    memcpy(&bufs[i * record_len], &id, sizeof(id));
+    records[i] = &bufs[i * record_len];
+    record_lens[i] = record_len;
+    tokens[i].push_back(slog::token_t(index_id, id % kKeys));
+  }
+  return store.insert_batch(records, record_lens, tokens, kBatch);
+}
+
+// Checks that exactly the valid records match a filter on key.
+void CheckFilter(slog::log_store &store, uint32_t index_id, uint64_t key) {
+  slog::filter_query query(1);
+  query[0].push_back(slog::basic_filter(index_id, key));
+  std::vector<uint64_t> results;
+  store.filter(results, query);
+
+  std::vector<uint64_t> expected;
+  for (uint64_t id = 0; id < store.num_records(); id++) {
+    unsigned char record[8];
+    uint32_t len = sizeof(record);
+    if (id % kKeys == key && store.extract(record, id, 0, len)) {
+      expected.push_back(id);
+    }
+  }
+  ASSERT_EQ(expected, results);
+}
+
+// Stream filter that keeps the records with odd record ids.
+bool OddRecord(uint64_t &, const unsigned char *record, const uint16_t,
+               const slog::token_list &) {
+  return record[0] & 1;
+}
+
+uint64_t RecordId(const std::string &record) {
+  uint64_t id;
+  memcpy(&id, record.data(), sizeof(id));
+  return id;
+}
+
+// Record id modulo the moduli of the indexes used by the filter tests
+const uint64_t kModuli[] = {2, 7, 101};
+
+// Tokens of a record holding value in the filter tests: the value modulo
+// each of kModuli, in the indexes index_ids.
+slog::token_list ModuloTokens(const uint32_t *index_ids, uint64_t value) {
+  slog::token_list tokens;
+  for (size_t i = 0; i < 3; i++) {
+    tokens.push_back(slog::token_t(index_ids[i], value % kModuli[i]));
+  }
+  return tokens;
+}
+
+typedef std::vector<std::pair<uint64_t, uint64_t>> KeyRanges;
+
+// Checks that a conjunction, in every order of its filters, yields exactly
+// the valid records whose value modulo kModuli[filters[f]] is in ranges[f],
+// for each filter f.
+void CheckConjunction(slog::log_store &store, const uint32_t *index_ids,
+                      const std::vector<size_t> &filters,
+                      const KeyRanges &ranges) {
+  std::vector<uint64_t> expected;
+  for (uint64_t id = 0; id < store.num_records(); id++) {
+    uint64_t value;
+    uint32_t len = sizeof(value);
+    bool match = store.extract(reinterpret_cast<unsigned char *>(&value), id,
+                               0, len);
+    for (size_t f = 0; f < filters.size(); f++) {
+      uint64_t key = value % kModuli[filters[f]];
+      match = match && key >= ranges[f].first && key <= ranges[f].second;
+    }
+    if (match) {
+      expected.push_back(id);
+    }
+  }
+  ASSERT_FALSE(expected.empty());
+
+  std::vector<size_t> order(filters.size());
+  for (size_t f = 0; f < order.size(); f++) {
+    order[f] = f;
+  }
+  do {
+    slog::filter_query query(1);
+    for (size_t f : order) {
+      query[0].push_back(slog::basic_filter(index_ids[filters[f]],
+                                            ranges[f].first,
+                                            ranges[f].second));
+    }
+    std::vector<uint64_t> results;
+    store.filter(results, query);
+    ASSERT_EQ(expected, results);
+  } while (std::next_permutation(order.begin(), order.end()));
+}
+
+// Checks conjunctions of posting lists of very different sizes: the small
+// filters are galloped through the large lists, and swept otherwise.
+void CheckConjunctions(slog::log_store &store, const uint32_t *index_ids) {
+  CheckConjunction(store, index_ids, {0, 1, 2},
+                   {{0, 0}, {1, 3}, {0, 9}});
+  CheckConjunction(store, index_ids, {1, 2}, {{0, 5}, {0, 60}});
+  CheckConjunction(store, index_ids, {0, 2}, {{1, 1}, {42, 42}});
+}
+
+TEST(LogStoreFilterTest, ConjunctionOrder) {
+  slog::log_store store;
+  uint32_t index_ids[] = {store.add_index(2), store.add_index(2),
+                          store.add_index(1)};
+
+  // Single records, then batches
+  const uint64_t kRecords = 20000;
+  while (store.num_records() < kRecords / 2) {
+    uint64_t id = store.num_records();
+    slog::token_list tokens = ModuloTokens(index_ids, id);
+    store.insert(reinterpret_cast<unsigned char *>(&id), sizeof(id), tokens);
+  }
+  while (store.num_records() < kRecords) {
+    uint64_t ids[kBatch];
+    const unsigned char *records[kBatch];
+    uint16_t record_lens[kBatch];
+    slog::token_list tokens[kBatch];
+    for (uint32_t i = 0; i < kBatch; i++) {
+      ids[i] = store.num_records() + i;
+      records[i] = reinterpret_cast<unsigned char *>(&ids[i]);
+      record_lens[i] = sizeof(ids[i]);
+      tokens[i] = ModuloTokens(index_ids, ids[i]);
+    }
+    store.insert_batch(records, record_lens, tokens, kBatch);
+  }
+  CheckConjunctions(store, index_ids);
+}
+
+TEST(LogStoreFilterTest, InterleavedWriters) {
+  slog::log_store store;
+  uint32_t index_ids[] = {store.add_index(2), store.add_index(2),
+                          store.add_index(1)};
+
+  // Each handle reserves blocks of ids, so the posting lists interleave them
+  // out of order
+  slog::log_store::handle *handles[] = {store.get_handle(),
+                                        store.get_handle()};
+  for (uint64_t value = 0; value < 20000; value++) {
+    slog::token_list tokens = ModuloTokens(index_ids, value);
+    handles[(value / 3) % 2]->insert(
+        reinterpret_cast<unsigned char *>(&value), sizeof(value), tokens);
+  }
+  CheckConjunctions(store, index_ids);
+  delete handles[0];
+  delete handles[1];
+}
+
+TEST(LogStoreFilterTest, IndexAtDifferentPositions) {
+  slog::log_store store;
+  uint32_t index_ids[] = {store.add_index(2), store.add_index(2),
+                          store.add_index(1)};
+
+  // Odd records carry their last two tokens swapped, so a batch appends the
+  // entries of a posting list out of order
+  while (store.num_records() < 20000) {
+    uint64_t ids[kBatch];
+    const unsigned char *records[kBatch];
+    uint16_t record_lens[kBatch];
+    slog::token_list tokens[kBatch];
+    for (uint32_t i = 0; i < kBatch; i++) {
+      ids[i] = store.num_records() + i;
+      records[i] = reinterpret_cast<unsigned char *>(&ids[i]);
+      record_lens[i] = sizeof(ids[i]);
+      tokens[i] = ModuloTokens(index_ids, ids[i]);
+      if (ids[i] & 1) {
+        std::swap(tokens[i][1], tokens[i][2]);
+      }
+    }
+    store.insert_batch(records, record_lens, tokens, kBatch);
+  }
+  CheckConjunctions(store, index_ids);
+}
+
+TEST(LogStoreSubscriptionTest, TailsStream) {
+  slog::log_store store;
+  uint32_t index_id = store.add_index(1);
+  uint32_t stream_id = store.add_stream(OddRecord);
+  InsertBatch(store, index_id, 64);
+
+  slog::log_store::subscription *tail = store.subscribe(stream_id);
+  slog::log_store::subscription *head = store.subscribe(stream_id, 0, true);
+  std::vector<uint64_t> ids;
+  std::vector<std::string> records;
+  ASSERT_EQ(0U, tail->poll(ids, 1024));
+  ASSERT_EQ(kBatch / 2, head->poll(ids, 1024));
+  ASSERT_EQ(0U, head->poll(ids, 1024));
+
+  InsertBatch(store, index_id, 64);
+  InsertBatch(store, index_id, 64);
+
+  // Subscriptions read independently, in batches of at most max_records
+  for (slog::log_store::subscription *sub : {tail, head}) {
+    uint64_t next_id = kBatch + 1;
+    while (sub->poll(ids, 5, &records) != 0) {
+      ASSERT_LE(ids.size(), 5U);
+      ASSERT_EQ(ids.size(), records.size());
+      for (size_t i = 0; i < ids.size(); i++) {
+        ASSERT_EQ(next_id, ids[i]);
+        ASSERT_EQ(64U, records[i].size());
+        ASSERT_EQ(next_id, RecordId(records[i]));
+        next_id += 2;
+      }
+    }
+    ASSERT_EQ(3 * kBatch + 1, next_id);
+  }
+  delete tail;
+  delete head;
+}
+
+TEST(LogStoreSubscriptionTest, WaitBlocksForRecords) {
+  slog::log_store store;
+  uint32_t index_id = store.add_index(1);
+  uint32_t stream_id = store.add_stream(OddRecord);
+  slog::log_store::subscription *sub = store.subscribe(stream_id);
+
+  std::vector<uint64_t> ids;
+  ASSERT_EQ(0U, sub->wait(ids, 1024, 10000000));
+
+  std::thread writer([&store, index_id] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    InsertBatch(store, index_id, 64);
+  });
+  ASSERT_EQ(kBatch / 2, sub->wait(ids, 1024, 10000000000ULL));
+  ASSERT_EQ(1U, ids[0]);
+  writer.join();
+  delete sub;
+
+  // With a batch delay, records that trickle in are returned together
+  sub = store.subscribe(stream_id, 10000000000ULL);
+  writer = std::thread([&store, index_id] {
+    for (int i = 0; i < 4; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      InsertBatch(store, index_id, 64);
+    }
+  });
+  ASSERT_EQ(2 * kBatch, sub->wait(ids, 2 * kBatch, 10000000000ULL));
+  writer.join();
+  delete sub;
+}
+
+TEST(LogStoreRetentionTest, SizeLimit) {
+  slog::log_store store;
+  uint32_t index_id = store.add_index(1);
+  ASSERT_TRUE(store.set_retention(2 * kBlock, 0));
+
+  uint64_t prev_id = 0;
+  while (store.size() < 6 * kBlock) {
+    uint64_t start_id = InsertBatch(store, index_id, 1024);
+    ASSERT_TRUE(start_id == 0 || start_id == prev_id + kBatch);
+    prev_id = start_id;
+    store.expire(0);
+  }
+
+  // Whole blocks were dropped, and the records left span at most the limit
+  // plus the block being filled
+  slog::logstore_storage storage;
+  store.storage_footprint(storage);
+  ASSERT_LE(storage.dlog_size,
+            3 * kBlock + slog::log_store::DLOG_NBUCKETS * sizeof(void *));
+  ASSERT_EQ(1U, storage.idx_sizes.size());
+
+  uint64_t first = store.first_record();
+  ASSERT_GT(first, 0U);
+  ASSERT_GE((store.num_records() - first) * 1024, kBlock);
+
+  unsigned char record[1024];
+  ASSERT_FALSE(store.get(record, 0));
+  ASSERT_FALSE(store.get(record, first - 1));
+  for (uint64_t id = first; id < store.num_records(); id += 997) {
+    ASSERT_TRUE(store.get(record, id));
+    uint64_t stored_id;
+    memcpy(&stored_id, record, sizeof(stored_id));
+    ASSERT_EQ(id, stored_id);
+  }
+
+  CheckFilter(store, index_id, 3);
+  CheckFilter(store, index_id, 15);
+}
+
+TEST(LogStoreRetentionTest, BatchesAcrossEpochs) {
+  slog::log_store store;
+  uint32_t index_id = store.add_index(1);
+  ASSERT_TRUE(store.set_retention(2 * kBlock, 0));
+
+  // Batches of 1000-byte records cross the epoch boundaries; the records
+  // past a boundary must outlive the epoch the batch started in
+  while (store.size() < 6 * kBlock) {
+    InsertBatch(store, index_id, 1000);
+    store.expire(0);
+  }
+  // Epochs span a block; the first record kept is the first one that starts
+  // in a block that was not dropped
+  uint64_t first = store.first_record();
+  ASSERT_GT(first, 0U);
+  ASSERT_NE((first - 1) * 1000 / kBlock, first * 1000 / kBlock);
+
+  for (uint64_t key = 0; key < kKeys; key++) {
+    CheckFilter(store, index_id, key);
+  }
+}
+
+TEST(LogStoreRetentionTest, StreamsAreTrimmed) {
+  slog::log_store store;
+  uint32_t index_id = store.add_index(1);
+  uint32_t stream_id = store.add_stream(OddRecord);
+  ASSERT_TRUE(store.set_retention(2 * kBlock, 0));
+  slog::log_store::subscription *sub = store.subscribe(stream_id, 0, true);
+
+  while (store.size() < 6 * kBlock) {
+    InsertBatch(store, index_id, 64);
+    store.expire(0);
+  }
+  uint64_t first = store.first_record();
+  ASSERT_GT(first, 0U);
+
+  // The entries of dropped records were released
+  slog::stream_list all;
+  for (uint64_t id = 1; id < store.num_records(); id += 2) {
+    all.push_back(id);
+  }
+  slog::logstore_storage storage;
+  store.storage_footprint(storage);
+  ASSERT_EQ(1U, storage.stream_sizes.size());
+  ASSERT_LT(storage.stream_sizes[0], all.storage_size());
+
+  // The entries of the records left are kept
+  std::vector<uint64_t> expected;
+  for (uint64_t id = first | 1; id < store.num_records(); id += 2) {
+    expected.push_back(id);
+  }
+  std::vector<uint64_t> results;
+  store.filter_stream(results, stream_id, UINT64_MAX);
+  ASSERT_EQ(expected, results);
+
+  std::vector<uint64_t> polled;
+  std::vector<uint64_t> ids;
+  while (sub->poll(ids, 4096) != 0) {
+    polled.insert(polled.end(), ids.begin(), ids.end());
+  }
+  ASSERT_EQ(expected, polled);
+  delete sub;
+}
+
+TEST(LogStoreRetentionTest, AgeLimit) {
+  const uint64_t kMaxAge = 8000;
+  const uint64_t kTick = 100;
+
+  slog::log_store store;
+  uint32_t index_id = store.add_index(1);
+  ASSERT_TRUE(store.set_retention(0, kMaxAge));
+
+  std::vector<uint64_t> batch_times;
+  uint64_t now = 1;
+  for (uint32_t i = 0; i < 400; i++, now += kTick) {
+    ASSERT_EQ(i * kBatch, InsertBatch(store, index_id, 64));
+    batch_times.push_back(now);
+    store.expire(now);
+  }
+  now -= kTick;
+  ASSERT_GT(store.first_record(), 0U);
+
+  // Epochs are closed after kMaxAge / 8, and dropped once their last record
+  // is kMaxAge old
+  uint64_t slack = kMaxAge / 8 + kTick;
+  for (uint32_t i = 0; i < batch_times.size(); i++) {
+    unsigned char record[64];
+    if (batch_times[i] + kMaxAge + slack <= now) {
+      ASSERT_FALSE(store.get(record, i * kBatch)) << "batch " << i;
+    } else if (batch_times[i] + kMaxAge > now) {
+      ASSERT_TRUE(store.get(record, i * kBatch)) << "batch " << i;
+    }
+  }
+
+  CheckFilter(store, index_id, 0);
+  CheckFilter(store, index_id, 7);
+}
+
+TEST(LogStoreRetentionTest, InvalidPolicies) {
+  slog::log_store store;
+  uint32_t index_id = store.add_index(1);
+  ASSERT_FALSE(store.set_retention(slog::log_store::MAX_RETAINED_BYTES + 1, 0));
+
+  InsertBatch(store, index_id, 64);
+  ASSERT_FALSE(store.set_retention(kBlock, 0));
+
+  // Without a policy, nothing is dropped
+  store.expire(UINT64_MAX);
+  ASSERT_EQ(0U, store.first_record());
+  unsigned char record[64];
+  ASSERT_TRUE(store.get(record, 0));
+}
+
+std::string MakeTempDir() {
+  char dir[] = "/tmp/logstore_test.XXXXXX";
+  return mkdtemp(dir);
+}
+
+void RemoveDir(const std::string &dir) {
+  DIR *d = opendir(dir.c_str());
+  struct dirent *entry;
+  while (d != NULL && (entry = readdir(d)) != NULL) {
+    unlink((dir + "/" + entry->d_name).c_str());
+  }
+  if (d != NULL) {
+    closedir(d);
+  }
+  rmdir(dir.c_str());
+}
+
+bool FileExists(const std::string &path) {
+  return access(path.c_str(), F_OK) == 0;
+}
+
+// Rebuilds the index entry of a record written by InsertBatch.
+slog::log_store::tokenizer_function Tokenizer(uint32_t index_id) {
+  return [index_id](const unsigned char *record, uint16_t,
+                    slog::token_list &tokens) {
+    uint64_t id;
+    memcpy(&id, record, sizeof(id));
+    tokens.push_back(slog::token_t(index_id, id % kKeys));
+  };
+}
+
+TEST(LogStorePersistenceTest, ReopenRestoresCheckpointedRecords) {
+  std::string dir = MakeTempDir();
+  uint64_t num_checkpointed;
+  {
+    slog::log_store store;
+    uint32_t index_id = store.add_index(1);
+    ASSERT_TRUE(store.open(dir, Tokenizer(index_id)));
+    ASSERT_FALSE(store.open(dir, Tokenizer(index_id)));
+    for (uint32_t i = 0; i < 100; i++) {
+      InsertBatch(store, index_id, 200);
+    }
+    ASSERT_TRUE(store.checkpoint());
+    num_checkpointed = store.num_records();
+
+    // Not covered by a checkpoint
+    InsertBatch(store, index_id, 200);
+  }
+
+  slog::log_store store;
+  uint32_t index_id = store.add_index(1);
+  ASSERT_TRUE(store.open(dir, Tokenizer(index_id)));
+  ASSERT_EQ(num_checkpointed, store.num_records());
+  ASSERT_EQ(num_checkpointed * 200, store.size());
+
+  unsigned char record[200];
+  for (uint64_t id = 0; id < num_checkpointed; id++) {
+    ASSERT_TRUE(store.get(record, id));
+    uint64_t stored_id;
+    memcpy(&stored_id, record, sizeof(stored_id));
+    ASSERT_EQ(id, stored_id);
+  }
+  CheckFilter(store, index_id, 5);
+
+  // Records discarded by the restore are not resurrected when their ids are
+  // reserved again
+  slog::log_store::handle *handle = store.get_handle();
+  slog::token_list tokens;
+  memcpy(record, &num_checkpointed, sizeof(num_checkpointed));
+  tokens.push_back(slog::token_t(index_id, num_checkpointed % kKeys));
+  handle->insert(record, sizeof(record), tokens);
+  ASSERT_LT(num_checkpointed + 1, store.num_records());
+  ASSERT_TRUE(store.get(record, num_checkpointed));
+  ASSERT_FALSE(store.get(record, num_checkpointed + 1));
+  delete handle;
+  CheckFilter(store, index_id, 0);
+  RemoveDir(dir);
+}
+
+TEST(LogStorePersistenceTest, ReopenAfterRetention) {
+  std::string dir = MakeTempDir();
+  {
+    slog::log_store store;
+    uint32_t index_id = store.add_index(1);
+    ASSERT_TRUE(store.set_retention(kBlock, 0));
+    ASSERT_TRUE(store.open(dir, Tokenizer(index_id)));
+    while (store.size() < 3 * kBlock) {
+      InsertBatch(store, index_id, 1024);
+      store.expire(0);
+    }
+    ASSERT_GT(store.first_record(), 0U);
+    ASSERT_TRUE(store.checkpoint());
+  }
+
+  // The retention policy must match
+  slog::log_store mismatched;
+  uint32_t mismatched_id = mismatched.add_index(1);
+  ASSERT_FALSE(mismatched.open(dir, Tokenizer(mismatched_id)));
+
+  slog::log_store store;
+  uint32_t index_id = store.add_index(1);
+  ASSERT_TRUE(store.set_retention(kBlock, 0));
+  ASSERT_TRUE(store.open(dir, Tokenizer(index_id)));
+  ASSERT_FALSE(FileExists(dir + "/data.0"));
+  ASSERT_FALSE(FileExists(dir + "/data.1"));
+
+  uint64_t first = store.first_record();
+  ASSERT_GT(first, 0U);
+  unsigned char record[1024];
+  ASSERT_FALSE(store.get(record, first - 1));
+  ASSERT_TRUE(store.get(record, first));
+  CheckFilter(store, index_id, 9);
+
+  // The restored store keeps expiring
+  while (store.size() < 5 * kBlock) {
+    InsertBatch(store, index_id, 1024);
+    store.expire(0);
+  }
+  ASSERT_GT(store.first_record(), first);
+  CheckFilter(store, index_id, 9);
+  RemoveDir(dir);
+}
+
+}  // namespace (unnamed)
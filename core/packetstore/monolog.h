@@ -5,11 +5,94 @@
 #include <vector>
 #include <atomic>
 #include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <functional>
 
+#include "allocator.h"
+#include "exceptions.h"
 #include "utils.h"
 
 namespace slog {
 
+/**
+ * Maps 64-bit MonoLog indexes to (bucket, offset) pairs.
+ *
+ * The first bucket holds FBS entries, and each subsequent bucket is twice as
+ * large as the previous one, up to 2^MAX_HIBIT entries; from there on, all
+ * buckets hold 2^MAX_HIBIT entries. Capping the bucket size bounds the memory
+ * allocated at once for very large logs, at the cost of more buckets.
+ */
+template<uint32_t MAX_HIBIT>
+struct __bucket_layout {
+  static const uint32_t FBS = 16;
+  static const uint32_t FBS_HIBIT = 4;
+
+  static_assert(MAX_HIBIT >= FBS_HIBIT && MAX_HIBIT < 64,
+                "Maximum bucket size out of range.");
+
+  static inline void locate(const uint64_t idx, uint32_t& bucket_idx,
+                            uint64_t& bucket_off) {
+    uint64_t pos = idx + FBS;
+    if (pos >> MAX_HIBIT) {
+      bucket_idx = MAX_HIBIT - FBS_HIBIT + (pos >> MAX_HIBIT) - 1;
+      bucket_off = pos & ((1ULL << MAX_HIBIT) - 1);
+    } else {
+      uint32_t hibit = bit_utils::highest_bit(pos);
+      bucket_idx = hibit - FBS_HIBIT;
+      bucket_off = pos ^ (1ULL << hibit);
+    }
+  }
+
+  static inline uint32_t bucket_of(const uint64_t idx) {
+    uint32_t bucket_idx;
+    uint64_t bucket_off;
+    locate(idx, bucket_idx, bucket_off);
+    return bucket_idx;
+  }
+
+  static inline uint64_t bucket_size(const uint32_t bucket_idx) {
+    return bucket_idx < MAX_HIBIT - FBS_HIBIT ?
+        ((uint64_t) FBS << bucket_idx) : (1ULL << MAX_HIBIT);
+  }
+
+  /* The first fixed-size bucket */
+  static const uint32_t FIRST_FIXED = MAX_HIBIT - FBS_HIBIT;
+};
+
+/**
+ * Maps bucket numbers to the NBUCKETS bucket slots of a MonoLog.
+ *
+ * Bucket b is kept in slot b for as long as b < NBUCKETS. Once the buckets
+ * below some floor have been released, fixed-size buckets (those from
+ * FIRST_FIXED on) wrap around and reuse the released slots, so a log whose
+ * head is trimmed can keep growing indefinitely. A bucket is only mapped if
+ * it lies within NBUCKETS - FIRST_FIXED buckets of the floor.
+ */
+template<uint32_t NBUCKETS, uint32_t FIRST_FIXED>
+struct __bucket_ring {
+  static const uint64_t RING_SIZE =
+      FIRST_FIXED < NBUCKETS ? NBUCKETS - FIRST_FIXED : 1;
+
+  static inline bool in_range(const uint64_t bucket_idx, const uint64_t floor) {
+    return bucket_idx < NBUCKETS
+        || (FIRST_FIXED < NBUCKETS
+            && bucket_idx - std::max<uint64_t>(floor, FIRST_FIXED) < RING_SIZE);
+  }
+
+  // Gets the slot for a bucket; throws log_overflow_exception if the bucket
+  // would overwrite a bucket that has not been released.
+  static inline uint64_t slot(const uint64_t bucket_idx, const uint64_t floor) {
+    if (bucket_idx < NBUCKETS) {
+      return bucket_idx;
+    }
+    if (!in_range(bucket_idx, floor)) {
+      throw log_overflow_exception();
+    }
+    return FIRST_FIXED + (bucket_idx - FIRST_FIXED) % RING_SIZE;
+  }
+};
+
 /**
  * The base class for Monotonic Log (MonoLog).
  *
@@ -17,121 +100,121 @@ namespace slog {
  * but does not maintain read or write tails and does not
  * provide any atomicity/consistency guarantees by itself.
  *
+ * Indexes are 64-bit; the log can hold as many entries as fit in NBUCKETS
+ * buckets (see __bucket_layout). Buckets below an index can be released with
+ * release_below(), after which the log may grow past NBUCKETS buckets (see
+ * __bucket_ring); released indexes must not be accessed again.
+ *
+ * Buckets are allocated on the heap, or by a bucket allocator passed to the
+ * constructor.
  */
-template<class T, uint32_t NBUCKETS = 32>
+template<class T, uint32_t NBUCKETS = 32, uint32_t MAX_HIBIT = 63>
 class __monolog_base {
  public:
-  static const uint32_t FBS = 16;
-  static const uint32_t FBS_HIBIT = 4;
+  typedef __bucket_layout<MAX_HIBIT> layout;
+  typedef __bucket_ring<NBUCKETS, layout::FIRST_FIXED> ring;
+  static const uint32_t FBS = layout::FBS;
+  static const uint32_t FBS_HIBIT = layout::FBS_HIBIT;
 
   typedef std::atomic<T*> __atomic_bucket_ref;
 
-  __monolog_base() {
+  explicit __monolog_base(bucket_allocator* allocator = NULL)
+      : floor_(0),
+        allocator_(allocator) {
     T* null_ptr = NULL;
     for (auto& x : buckets_) {
       x.store(null_ptr);
     }
-    buckets_[0].store(new T[FBS], std::memory_order_release);
+    buckets_[0].store(new_bucket(0), std::memory_order_release);
   }
 
   ~__monolog_base() {
-    for (auto& x : buckets_) {
-      delete[] x.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i < NBUCKETS; i++) {
+      delete_bucket(i, buckets_[i].load(std::memory_order_acquire));
     }
   }
 
-  void ensure_alloc(uint32_t start_idx, uint32_t end_idx) {
-    uint32_t pos1 = start_idx + FBS;
-    uint32_t pos2 = end_idx + FBS;
-    uint32_t hibit1 = bit_utils::highest_bit(pos1);
-    uint32_t hibit2 = bit_utils::highest_bit(pos2);
-    uint32_t bucket_idx1 = hibit1 - FBS_HIBIT;
-    uint32_t bucket_idx2 = hibit2 - FBS_HIBIT;
+  void ensure_alloc(uint64_t start_idx, uint64_t end_idx) {
+    uint32_t bucket_idx1 = layout::bucket_of(start_idx);
+    uint32_t bucket_idx2 = layout::bucket_of(end_idx);
     for (uint32_t i = bucket_idx1; i <= bucket_idx2; i++) {
-      if (buckets_[i].load(std::memory_order_acquire) == NULL) {
-        try_allocate_bucket(i);
-      }
+      bucket(i);
     }
   }
 
   // Sets the data at index idx to val. Allocates memory if necessary.
-  void set(uint32_t idx, const T val) {
-    uint32_t pos = idx + FBS;
-    uint32_t hibit = bit_utils::highest_bit(pos);
-    uint32_t bucket_off = pos ^ (1 << hibit);
-    uint32_t bucket_idx = hibit - FBS_HIBIT;
-    if (buckets_[bucket_idx].load(std::memory_order_acquire) == NULL) {
-      try_allocate_bucket(bucket_idx);
-    }
-    buckets_[bucket_idx].load(std::memory_order_acquire)[bucket_off] = val;
+  void set(uint64_t idx, const T val) {
+    uint32_t bucket_idx;
+    uint64_t bucket_off;
+    layout::locate(idx, bucket_idx, bucket_off);
+    bucket(bucket_idx)[bucket_off] = val;
   }
 
   // Sets a contiguous region of the MonoLog base to the provided data.
-  void set(uint32_t idx, const T* data, const uint32_t len) {
-    uint32_t pos = idx + FBS;
-    uint32_t hibit = bit_utils::highest_bit(pos);
-    uint32_t bucket_off = pos ^ (1 << hibit);
-    uint32_t bucket_idx = hibit - FBS_HIBIT;
-    uint32_t data_remaining = len * sizeof(T);
-    uint32_t data_off = 0;
-    while (data_remaining) {
-      if (buckets_[bucket_idx].load(std::memory_order_acquire) == NULL) {
-        try_allocate_bucket(bucket_idx);
-      }
-      uint32_t bucket_remaining =
-          ((1U << (bucket_idx + FBS_HIBIT)) - bucket_off) * sizeof(T);
-      uint32_t bytes_to_write = std::min(bucket_remaining, data_remaining);
-      data_remaining -= bytes_to_write;
-      data_off += bytes_to_write;
-      memcpy(buckets_[bucket_idx].load(std::memory_order_acquire) + bucket_off,
-             data + data_off, bytes_to_write);
-      bucket_idx++;
-      bucket_off = 0;
+  void set(uint64_t idx, const T* data, const uint64_t len) {
+    uint64_t remaining = len;
+    while (remaining) {
+      uint32_t bucket_idx;
+      uint64_t bucket_off;
+      layout::locate(idx, bucket_idx, bucket_off);
+      uint64_t to_write = std::min(
+          remaining, layout::bucket_size(bucket_idx) - bucket_off);
+      std::copy(data, data + to_write, bucket(bucket_idx) + bucket_off);
+      data += to_write;
+      idx += to_write;
+      remaining -= to_write;
     }
   }
 
   // Gets the data at index idx.
-  T get(const uint32_t idx) const {
-    uint32_t pos = idx + FBS;
-    uint32_t hibit = bit_utils::highest_bit(pos);
-    uint32_t bucket_off = pos ^ (1 << hibit);
-    uint32_t bucket_idx = hibit - FBS_HIBIT;
-    return buckets_[bucket_idx].load(std::memory_order_acquire)[bucket_off];
+  T get(const uint64_t idx) const {
+    uint32_t bucket_idx;
+    uint64_t bucket_off;
+    layout::locate(idx, bucket_idx, bucket_off);
+    return buckets_[slot(bucket_idx)].load(std::memory_order_acquire)[bucket_off];
   }
 
-  T& operator[](const uint32_t idx) {
-    uint32_t pos = idx + FBS;
-    uint32_t hibit = bit_utils::highest_bit(pos);
-    uint32_t bucket_off = pos ^ (1 << hibit);
-    uint32_t bucket_idx = hibit - FBS_HIBIT;
-    if (buckets_[bucket_idx].load(std::memory_order_acquire) == NULL) {
-      try_allocate_bucket(bucket_idx);
-    }
-    return buckets_[bucket_idx].load(std::memory_order_acquire)[bucket_off];
+  T& operator[](const uint64_t idx) {
+    uint32_t bucket_idx;
+    uint64_t bucket_off;
+    layout::locate(idx, bucket_idx, bucket_off);
+    return bucket(bucket_idx)[bucket_off];
   }
 
   // Copies a contiguous region of the MonoLog base into the provided buffer.
   // The buffer should have sufficient space to hold the data requested, otherwise
   // undefined behavior may result.
-  void get(T* data, const uint32_t idx, const uint32_t len) const {
-    uint32_t pos = idx + FBS;
-    uint32_t hibit = bit_utils::highest_bit(pos);
-    uint32_t bucket_off = pos ^ (1 << hibit);
-    uint32_t bucket_idx = hibit - FBS_HIBIT;
-    uint32_t data_remaining = len * sizeof(T);
-    uint32_t data_off = 0;
-    while (data_remaining) {
-      uint32_t bucket_remaining =
-          ((1U << (bucket_idx + FBS_HIBIT)) - bucket_off) * sizeof(T);
-      uint32_t bytes_to_read = std::min(bucket_remaining, data_remaining);
-      data_remaining -= bytes_to_read;
-      data_off += bytes_to_read;
-      memcpy(data + data_off,
-             buckets_[bucket_idx].load(std::memory_order_acquire) + bucket_off,
-             bytes_to_read);
-      bucket_idx++;
-      bucket_off = 0;
+  void get(T* data, uint64_t idx, const uint64_t len) const {
+    uint64_t remaining = len;
+    while (remaining) {
+      uint32_t bucket_idx;
+      uint64_t bucket_off;
+      layout::locate(idx, bucket_idx, bucket_off);
+      uint64_t to_read = std::min(
+          remaining, layout::bucket_size(bucket_idx) - bucket_off);
+      const T* bucket = buckets_[slot(bucket_idx)].load(
+          std::memory_order_acquire);
+      std::copy(bucket + bucket_off, bucket + bucket_off + to_read, data);
+      data += to_read;
+      idx += to_read;
+      remaining -= to_read;
+    }
+  }
+
+  // Unlinks all buckets that only hold indexes below idx, and passes a
+  // function that frees each of them to retire(std::function<void()>), which
+  // must invoke it once no reader can access the bucket.
+  template<typename F>
+  void release_below(const uint64_t idx, F retire) {
+    uint32_t end = layout::bucket_of(idx);
+    for (uint64_t i = floor_.load(std::memory_order_relaxed); i < end; i++) {
+      T* bucket = buckets_[ring::slot(i, i)].exchange(NULL);
+      if (bucket != NULL) {
+        retire(release_bucket(i, bucket));
+      }
     }
+    floor_.store(std::max<uint64_t>(floor_.load(std::memory_order_relaxed),
+                                    end), std::memory_order_release);
   }
 
   size_t storage_size() const {
@@ -139,74 +222,177 @@ class __monolog_base {
     size_t data_size = 0;
     for (uint32_t i = 0; i < buckets_.size(); i++) {
       if (buckets_[i].load(std::memory_order_acquire) != NULL) {
-        data_size += ((1U << (i + FBS_HIBIT)) * sizeof(T));
+        data_size += layout::bucket_size(i) * sizeof(T);
       }
     }
     return bucket_size + data_size;
   }
 
  protected:
+  // Gets the slot holding a bucket; throws log_overflow_exception if the
+  // bucket lies beyond the capacity of the log.
+  inline uint64_t slot(uint32_t bucket_idx) const {
+    return ring::slot(bucket_idx, floor_.load(std::memory_order_relaxed));
+  }
+
+  // Gets a bucket, allocating it if necessary.
+  inline T* bucket(uint32_t bucket_idx) {
+    uint64_t i = slot(bucket_idx);
+    T* bucket = buckets_[i].load(std::memory_order_acquire);
+    if (bucket == NULL) {
+      try_allocate_bucket(i, bucket_idx);
+      bucket = buckets_[i].load(std::memory_order_acquire);
+    }
+    return bucket;
+  }
+
   // Tries to allocate the specifies bucket. If another thread has already
   // succeeded in allocating the bucket, the current thread deallocates and
   // returns.
-  uint32_t try_allocate_bucket(uint32_t bucket_idx) {
-    uint32_t size = (1U << (bucket_idx + FBS_HIBIT));
-    T* new_bucket = new T[size];
+  uint64_t try_allocate_bucket(uint64_t slot_idx, uint32_t bucket_idx) {
+    T* allocated = new_bucket(bucket_idx);
     T* null_ptr = NULL;
 
     // Only one thread will be successful in replacing the NULL reference with newly
     // allocated bucket.
     if (!std::atomic_compare_exchange_strong_explicit(
-        &buckets_[bucket_idx], &null_ptr, new_bucket, std::memory_order_release,
+        &buckets_[slot_idx], &null_ptr, allocated, std::memory_order_release,
         std::memory_order_acquire)) {
       // All other threads will deallocate the newly allocated bucket.
-      delete[] new_bucket;
+      delete_bucket(bucket_idx, allocated);
+    }
+
+    return layout::bucket_size(bucket_idx);
+  }
+
+  T* new_bucket(uint64_t bucket_idx) {
+    uint64_t size = layout::bucket_size(bucket_idx);
+    if (allocator_ == NULL) {
+      return new T[size];
     }
+    return static_cast<T*>(allocator_->allocate(bucket_idx, size * sizeof(T)));
+  }
+
+  // Deletes a bucket that is no longer used; bucket_idx may also be the slot
+  // of the bucket, since all buckets in ring slots have the same size.
+  void delete_bucket(uint64_t bucket_idx, T* bucket) {
+    if (bucket == NULL) {
+      return;
+    }
+    if (allocator_ == NULL) {
+      delete[] bucket;
+    } else {
+      allocator_->deallocate(bucket, layout::bucket_size(bucket_idx) * sizeof(T));
+    }
+  }
 
-    return size;
+  std::function<void()> release_bucket(uint64_t bucket_idx, T* bucket) {
+    if (allocator_ == NULL) {
+      return [bucket] { delete[] bucket; };
+    }
+    return allocator_->release(bucket_idx, bucket,
+                               layout::bucket_size(bucket_idx) * sizeof(T));
   }
 
   std::array<__atomic_bucket_ref, NBUCKETS> buckets_;  // Stores the pointers to the buckets for MonoLog.
+  std::atomic<uint64_t> floor_;  // All buckets below the floor are released.
+  bucket_allocator* allocator_;  // Allocates the buckets; NULL for the heap.
 };
 
-template<class T, uint32_t NBUCKETS = 1024, uint32_t BLOCK_SIZE = 268435456U>
+/**
+ * MonoLog base made of fixed-size blocks, for byte-addressed logs. Blocks
+ * below an offset can be released with release_below(), after which the log
+ * may grow past NBUCKETS blocks by reusing their slots. Blocks are allocated
+ * on the heap, or by a bucket allocator passed to the constructor, when they
+ * are first written to; only written offsets may be read.
+ */
+template<class T, uint32_t NBUCKETS = 32768, uint32_t BLOCK_SIZE = 268435456U>
 class __monolog_linear_base {
  public:
   typedef std::atomic<T*> __atomic_bucket_ref;
+  typedef __bucket_ring<NBUCKETS, 0> ring;
 
-  __monolog_linear_base() {
+  explicit __monolog_linear_base(bucket_allocator* allocator = NULL)
+      : floor_(0),
+        allocator_(allocator) {
     T* null_ptr = NULL;
     for (auto& x : buckets_) {
       x = null_ptr;
     }
-    buckets_[0] = new T[BLOCK_SIZE];
   }
 
   ~__monolog_linear_base() {
     for (auto& x : buckets_) {
-      delete[] x.load();
+      delete_bucket(x.load());
+    }
+  }
+
+  // Allocates the blocks spanning [start_offset, end_offset), if necessary.
+  void ensure_alloc(uint64_t start_offset, uint64_t end_offset) {
+    for (uint64_t i = start_offset / BLOCK_SIZE; i * BLOCK_SIZE < end_offset;
+        i++) {
+      uint64_t slot_idx = ring::slot(i, floor_.load(std::memory_order_relaxed));
+      if (buckets_[slot_idx].load(std::memory_order_acquire) == NULL) {
+        try_allocate_bucket(slot_idx, i);
+      }
     }
   }
 
-  // Write len bytes of data at offset.
+  // Write len bytes of data at offset; the data may span several blocks.
   // Allocates memory if necessary.
   void write(const uint64_t offset, const T* data, const uint32_t len) {
-    uint32_t bucket_idx = offset / BLOCK_SIZE;
+    uint64_t bucket_idx = offset / BLOCK_SIZE;
     uint32_t bucket_off = offset % BLOCK_SIZE;
-    if (buckets_[bucket_idx].load(std::memory_order_acquire) == NULL) {
-      try_allocate_bucket(bucket_idx);
+    uint32_t remaining = len;
+    while (remaining) {
+      uint64_t i = ring::slot(bucket_idx,
+                              floor_.load(std::memory_order_relaxed));
+      if (buckets_[i].load(std::memory_order_acquire) == NULL) {
+        try_allocate_bucket(i, bucket_idx);
+      }
+      uint32_t to_write = std::min(remaining, BLOCK_SIZE - bucket_off);
+      memcpy(buckets_[i].load(std::memory_order_acquire) + bucket_off,
+             data, to_write * sizeof(T));
+      data += to_write;
+      remaining -= to_write;
+      bucket_idx++;
+      bucket_off = 0;
     }
-    memcpy(buckets_[bucket_idx].load(std::memory_order_acquire) + bucket_off,
-           data, len);
   }
 
-  // Get len bytes of data at offset.
+  // Get len bytes of data at offset; the data may span several blocks.
   void read(const uint64_t offset, T* data, const uint32_t len) const {
-    uint32_t bucket_idx = offset / BLOCK_SIZE;
+    uint64_t bucket_idx = offset / BLOCK_SIZE;
     uint32_t bucket_off = offset % BLOCK_SIZE;
-    memcpy(data,
-           buckets_[bucket_idx].load(std::memory_order_acquire) + bucket_off,
-           len);
+    uint32_t remaining = len;
+    while (remaining) {
+      uint64_t i = ring::slot(bucket_idx,
+                              floor_.load(std::memory_order_relaxed));
+      uint32_t to_read = std::min(remaining, BLOCK_SIZE - bucket_off);
+      memcpy(data,
+             buckets_[i].load(std::memory_order_acquire) + bucket_off,
+             to_read * sizeof(T));
+      data += to_read;
+      remaining -= to_read;
+      bucket_idx++;
+      bucket_off = 0;
+    }
+  }
+
+  // Unlinks all blocks that lie entirely below offset, and passes a function
+  // that frees each of them to retire(std::function<void()>), which must
+  // invoke it once no reader can access the block.
+  template<typename F>
+  void release_below(const uint64_t offset, F retire) {
+    uint64_t end = offset / BLOCK_SIZE;
+    for (uint64_t i = floor_.load(std::memory_order_relaxed); i < end; i++) {
+      T* bucket = buckets_[ring::slot(i, i)].exchange(NULL);
+      if (bucket != NULL) {
+        retire(release_bucket(i, bucket));
+      }
+    }
+    floor_.store(std::max<uint64_t>(floor_.load(std::memory_order_relaxed),
+                                    end), std::memory_order_release);
   }
 
   size_t storage_size() const {
@@ -214,7 +400,7 @@ class __monolog_linear_base {
     size_t data_size = 0;
     for (uint32_t i = 0; i < buckets_.size(); i++) {
       if (buckets_[i].load(std::memory_order_acquire) != NULL) {
-        data_size += (BLOCK_SIZE * sizeof(T));
+        data_size += ((size_t) BLOCK_SIZE * sizeof(T));
       }
     }
     return bucket_size + data_size;
@@ -224,136 +410,276 @@ class __monolog_linear_base {
   // Tries to allocate the specifies bucket. If another thread has already
   // succeeded in allocating the bucket, the current thread deallocates and
   // returns.
-  void try_allocate_bucket(uint32_t bucket_idx) {
-    T* bucket = new T[BLOCK_SIZE];
+  void try_allocate_bucket(uint64_t slot_idx, uint64_t bucket_idx) {
+    T* bucket = new_bucket(bucket_idx);
     T* null_ptr = NULL;
 
     // Only one thread will be successful in replacing the NULL reference with newly
     // allocated bucket.
     if (!std::atomic_compare_exchange_strong_explicit(
-        &buckets_[bucket_idx], &null_ptr, bucket, std::memory_order_release,
+        &buckets_[slot_idx], &null_ptr, bucket, std::memory_order_release,
         std::memory_order_acquire)) {
       // All other threads will deallocate the newly allocated bucket.
+      delete_bucket(bucket);
+    }
+  }
+
+  T* new_bucket(uint64_t bucket_idx) {
+    if (allocator_ == NULL) {
+      return new T[BLOCK_SIZE];
+    }
+    return static_cast<T*>(allocator_->allocate(
+        bucket_idx, (size_t) BLOCK_SIZE * sizeof(T)));
+  }
+
+  void delete_bucket(T* bucket) {
+    if (bucket == NULL) {
+      return;
+    }
+    if (allocator_ == NULL) {
       delete[] bucket;
+    } else {
+      allocator_->deallocate(bucket, (size_t) BLOCK_SIZE * sizeof(T));
+    }
+  }
+
+  std::function<void()> release_bucket(uint64_t bucket_idx, T* bucket) {
+    if (allocator_ == NULL) {
+      return [bucket] { delete[] bucket; };
     }
+    return allocator_->release(bucket_idx, bucket,
+                               (size_t) BLOCK_SIZE * sizeof(T));
   }
 
   std::array<__atomic_bucket_ref, NBUCKETS> buckets_;  // Stores the pointers to the buckets for MonoLog.
+  std::atomic<uint64_t> floor_;  // All blocks below the floor are released.
+  bucket_allocator* allocator_;  // Allocates the blocks; NULL for the heap.
 };
 
-template<class T, uint32_t NBUCKETS = 32>
+template<class T, uint32_t NBUCKETS = 32, uint32_t MAX_HIBIT = 63>
 class __atomic_monolog_base {
 
   static_assert(std::is_fundamental<T>::value, "Type for atomic monolog must be primitive.");
  public:
-  static const uint32_t FBS = 16;
-  static const uint32_t FBS_HIBIT = 4;
+  typedef __bucket_layout<MAX_HIBIT> layout;
+  typedef __bucket_ring<NBUCKETS, layout::FIRST_FIXED> ring;
+  static const uint32_t FBS = layout::FBS;
+  static const uint32_t FBS_HIBIT = layout::FBS_HIBIT;
 
   typedef std::atomic<T> __atomic_ref;
   typedef std::atomic<__atomic_ref *> __atomic_bucket_ref;
 
-  __atomic_monolog_base() {
+  explicit __atomic_monolog_base(bucket_allocator* allocator = NULL)
+      : floor_(0),
+        allocator_(allocator) {
     __atomic_ref* null_ptr = NULL;
     for (auto& x : buckets_) {
       x = null_ptr;
     }
-    buckets_[0].store(new __atomic_ref[FBS]);
+    buckets_[0].store(new_bucket(0));
   }
 
   ~__atomic_monolog_base() {
-    for (auto& x : buckets_) {
-      delete[] x.load();
+    for (uint32_t i = 0; i < NBUCKETS; i++) {
+      delete_bucket(i, buckets_[i].load());
     }
   }
 
-  void alloc(uint32_t idx) {
-    uint32_t pos = idx + FBS;
-    uint32_t hibit = bit_utils::highest_bit(pos);
-    uint32_t bucket_idx = hibit - FBS_HIBIT;
-    if (buckets_[bucket_idx].load(std::memory_order_acquire) == NULL) {
-      try_allocate_bucket(bucket_idx);
+  void alloc(uint64_t idx) {
+    bucket(layout::bucket_of(idx));
+  }
+
+  void ensure_alloc(uint64_t start_idx, uint64_t end_idx) {
+    uint32_t bucket_idx1 = layout::bucket_of(start_idx);
+    uint32_t bucket_idx2 = layout::bucket_of(end_idx);
+    for (uint32_t i = bucket_idx1; i <= bucket_idx2; i++) {
+      bucket(i);
     }
   }
 
-  void set(uint32_t idx, const T val) {
+  void set(uint64_t idx, const T val) {
     store(idx, val);
   }
 
   // Atomically store value at index idx.
   // Allocates memory if necessary.
-  void store(uint32_t idx, const T val) {
-    uint32_t pos = idx + FBS;
-    uint32_t hibit = bit_utils::highest_bit(pos);
-    uint32_t bucket_off = pos ^ (1 << hibit);
-    uint32_t bucket_idx = hibit - FBS_HIBIT;
-    if (buckets_[bucket_idx].load(std::memory_order_acquire) == NULL) {
-      try_allocate_bucket(bucket_idx);
-    }
-    buckets_[bucket_idx].load(std::memory_order_acquire)[bucket_off].store(val);
+  void store(uint64_t idx, const T val) {
+    uint32_t bucket_idx;
+    uint64_t bucket_off;
+    layout::locate(idx, bucket_idx, bucket_off);
+    bucket(bucket_idx)[bucket_off].store(val);
   }
 
-  __atomic_ref& operator[](const uint32_t idx) {
-    uint32_t pos = idx + FBS;
-    uint32_t hibit = bit_utils::highest_bit(pos);
-    uint32_t bucket_off = pos ^ (1 << hibit);
-    uint32_t bucket_idx = hibit - FBS_HIBIT;
-    if (buckets_[bucket_idx].load(std::memory_order_acquire) == NULL) {
-      try_allocate_bucket(bucket_idx);
-    }
-    return buckets_[bucket_idx].load(std::memory_order_acquire)[bucket_off].load();
+  __atomic_ref& operator[](const uint64_t idx) {
+    uint32_t bucket_idx;
+    uint64_t bucket_off;
+    layout::locate(idx, bucket_idx, bucket_off);
+    return bucket(bucket_idx)[bucket_off].load();
   }
 
-  T get(const uint32_t idx) const {
+  T get(const uint64_t idx) const {
     return load(idx);
   }
 
   // Atomically loads the data at index idx.
-  T load(const uint32_t idx) const {
-    uint32_t pos = idx + FBS;
-    uint32_t hibit = bit_utils::highest_bit(pos);
-    uint32_t bucket_off = pos ^ (1 << hibit);
-    uint32_t bucket_idx = hibit - FBS_HIBIT;
-    return buckets_[bucket_idx].load(std::memory_order_acquire)[bucket_off].load();
+  T load(const uint64_t idx) const {
+    uint32_t bucket_idx;
+    uint64_t bucket_off;
+    layout::locate(idx, bucket_idx, bucket_off);
+    return buckets_[slot(bucket_idx)].load(std::memory_order_acquire)[bucket_off]
+        .load(std::memory_order_acquire);
+  }
+
+  // Atomically loads the data at index idx, returning 0 if the bucket that
+  // holds idx has not been allocated yet, or lies beyond the capacity.
+  T try_load(const uint64_t idx) const {
+    uint32_t bucket_idx;
+    uint64_t bucket_off;
+    layout::locate(idx, bucket_idx, bucket_off);
+    uint64_t floor = floor_.load(std::memory_order_relaxed);
+    if (!ring::in_range(bucket_idx, floor)) {
+      return T(0);
+    }
+    __atomic_ref* bucket = buckets_[ring::slot(bucket_idx, floor)].load(
+        std::memory_order_acquire);
+    if (bucket == NULL) {
+      return T(0);
+    }
+    return bucket[bucket_off].load(std::memory_order_acquire);
   }
 
-  bool cas(const uint32_t idx, T& expected, T replacement) {
-    uint32_t pos = idx + FBS;
-    uint32_t hibit = bit_utils::highest_bit(pos);
-    uint32_t bucket_off = pos ^ (1 << hibit);
-    uint32_t bucket_idx = hibit - FBS_HIBIT;
-    return buckets_[bucket_idx].load(std::memory_order_acquire)[bucket_off].compare_exchange_strong(expected,
-        replacement);
+  // Atomically ORs val into the value at index idx, with release semantics.
+  // Allocates memory if necessary.
+  T fetch_or(const uint64_t idx, const T val) {
+    uint32_t bucket_idx;
+    uint64_t bucket_off;
+    layout::locate(idx, bucket_idx, bucket_off);
+    return bucket(bucket_idx)[bucket_off].fetch_or(val,
+                                                   std::memory_order_release);
+  }
+
+  // Atomically ANDs val into the value at index idx, with release semantics.
+  // Allocates memory if necessary.
+  T fetch_and(const uint64_t idx, const T val) {
+    uint32_t bucket_idx;
+    uint64_t bucket_off;
+    layout::locate(idx, bucket_idx, bucket_off);
+    return bucket(bucket_idx)[bucket_off].fetch_and(val,
+                                                    std::memory_order_release);
+  }
+
+  bool cas(const uint64_t idx, T& expected, T replacement) {
+    uint32_t bucket_idx;
+    uint64_t bucket_off;
+    layout::locate(idx, bucket_idx, bucket_off);
+    return buckets_[slot(bucket_idx)].load(std::memory_order_acquire)[bucket_off]
+        .compare_exchange_strong(expected, replacement);
+  }
+
+  // Unlinks all buckets that only hold indexes below idx, and passes a
+  // function that frees each of them to retire(std::function<void()>), which
+  // must invoke it once no reader can access the bucket.
+  template<typename F>
+  void release_below(const uint64_t idx, F retire) {
+    uint32_t end = layout::bucket_of(idx);
+    for (uint64_t i = floor_.load(std::memory_order_relaxed); i < end; i++) {
+      __atomic_ref* bucket = buckets_[ring::slot(i, i)].exchange(NULL);
+      if (bucket != NULL) {
+        retire(release_bucket(i, bucket));
+      }
+    }
+    floor_.store(std::max<uint64_t>(floor_.load(std::memory_order_relaxed),
+                                    end), std::memory_order_release);
+  }
+
+  size_t storage_size() const {
+    size_t bucket_size = buckets_.size() * sizeof(__atomic_bucket_ref);
+    size_t data_size = 0;
+    for (uint32_t i = 0; i < buckets_.size(); i++) {
+      if (buckets_[i].load(std::memory_order_acquire) != NULL) {
+        data_size += layout::bucket_size(i) * sizeof(__atomic_ref);
+      }
+    }
+    return bucket_size + data_size;
   }
 
 protected:
+  // Gets the slot holding a bucket; throws log_overflow_exception if the
+  // bucket lies beyond the capacity of the log.
+  inline uint64_t slot(uint32_t bucket_idx) const {
+    return ring::slot(bucket_idx, floor_.load(std::memory_order_relaxed));
+  }
+
+  // Gets a bucket, allocating it if necessary.
+  inline __atomic_ref* bucket(uint32_t bucket_idx) {
+    uint64_t i = slot(bucket_idx);
+    __atomic_ref* bucket = buckets_[i].load(std::memory_order_acquire);
+    if (bucket == NULL) {
+      try_allocate_bucket(i, bucket_idx);
+      bucket = buckets_[i].load(std::memory_order_acquire);
+    }
+    return bucket;
+  }
+
   // Tries to allocate the specifies bucket. If another thread has already
   // succeeded in allocating the bucket, the current thread deallocates and
   // returns.
-  uint32_t try_allocate_bucket(uint32_t bucket_idx) {
-    uint32_t size = (1U << (bucket_idx + FBS_HIBIT));
-    __atomic_ref* bucket = new_bucket(size);
+  uint64_t try_allocate_bucket(uint64_t slot_idx, uint32_t bucket_idx) {
+    __atomic_ref* bucket = new_bucket(bucket_idx);
     __atomic_ref* null_ptr = NULL;
 
     // Only one thread will be successful in replacing the NULL reference with newly
     // allocated bucket.
-    if (!std::atomic_compare_exchange_strong_explicit(&buckets_[bucket_idx], &null_ptr,
+    if (!std::atomic_compare_exchange_strong_explicit(&buckets_[slot_idx], &null_ptr,
             bucket, std::memory_order_release, std::memory_order_acquire)) {
       // All other threads will deallocate the newly allocated bucket.
-      delete[] bucket;
+      delete_bucket(bucket_idx, bucket);
     }
 
-    return size;
+    return layout::bucket_size(bucket_idx);
   }
 
-  __atomic_ref* new_bucket(uint32_t size) {
+  // Allocated buckets are zero-filled; an allocator's buckets are zero-filled
+  // or hold persisted values.
+  __atomic_ref* new_bucket(uint64_t bucket_idx) {
+    uint64_t size = layout::bucket_size(bucket_idx);
+    if (allocator_ != NULL) {
+      return static_cast<__atomic_ref*>(allocator_->allocate(
+          bucket_idx, size * sizeof(__atomic_ref)));
+    }
     __atomic_ref* bucket = new __atomic_ref[size];
-    for(uint32_t i = 0; i < size; i++) {
+    for(uint64_t i = 0; i < size; i++) {
       bucket[i].store(T(0));
     }
     return bucket;
   }
 
+  // Deletes a bucket that is no longer used; bucket_idx may also be the slot
+  // of the bucket, since all buckets in ring slots have the same size.
+  void delete_bucket(uint64_t bucket_idx, __atomic_ref* bucket) {
+    if (bucket == NULL) {
+      return;
+    }
+    if (allocator_ == NULL) {
+      delete[] bucket;
+    } else {
+      allocator_->deallocate(
+          bucket, layout::bucket_size(bucket_idx) * sizeof(__atomic_ref));
+    }
+  }
+
+  std::function<void()> release_bucket(uint64_t bucket_idx,
+                                       __atomic_ref* bucket) {
+    if (allocator_ == NULL) {
+      return [bucket] { delete[] bucket; };
+    }
+    return allocator_->release(
+        bucket_idx, bucket, layout::bucket_size(bucket_idx) * sizeof(__atomic_ref));
+  }
+
   std::array<__atomic_bucket_ref, NBUCKETS> buckets_;  // Stores the pointers to the buckets for MonoLog.
+  std::atomic<uint64_t> floor_;  // All buckets below the floor are released.
+  bucket_allocator* allocator_;  // Allocates the buckets; NULL for the heap.
 };
 
 /**
@@ -365,8 +691,8 @@ protected:
  * - Completion times for write operations are strictly ordered by their
  *   start times.
  */
-template<class T, uint32_t NBUCKETS = 32>
-class monolog_linearizable : public __monolog_base<T, NBUCKETS> {
+template<class T, uint32_t NBUCKETS = 32, uint32_t MAX_HIBIT = 63>
+class monolog_linearizable : public __monolog_base<T, NBUCKETS, MAX_HIBIT> {
  public:
   monolog_linearizable()
       : write_tail_(0),
@@ -374,27 +700,28 @@ class monolog_linearizable : public __monolog_base<T, NBUCKETS> {
   }
 
   // Append an entry at the end of the MonoLog
-  uint32_t push_back(const T val) {
-    uint32_t idx = std::atomic_fetch_add(&write_tail_, 1U);
+  uint64_t push_back(const T val) {
+    uint64_t idx = std::atomic_fetch_add(&write_tail_, UINT64_C(1));
     this->set(idx, val);
-    while (!std::atomic_compare_exchange_strong(&read_tail_, &idx, idx + 1))
-      ;
+    uint64_t expected = idx;
+    while (!std::atomic_compare_exchange_weak(&read_tail_, &expected, idx + 1))
+      expected = idx;
     return idx;
   }
 
   // Get the entry at the specified index `idx'.
-  T at(const uint32_t idx) const {
+  T at(const uint64_t idx) const {
     return this->get(idx);
   }
 
   // Get the size of the MonoLog (i.e., number of completely written entries)
-  uint32_t size() const {
+  uint64_t size() const {
     return read_tail_.load();
   }
 
  private:
-  std::atomic<uint32_t> write_tail_;
-  std::atomic<uint32_t> read_tail_;
+  std::atomic<uint64_t> write_tail_;
+  std::atomic<uint64_t> read_tail_;
 };
 
 /**
@@ -403,29 +730,58 @@ class monolog_linearizable : public __monolog_base<T, NBUCKETS> {
  * Maintains a single tail that ensures:
  * - Write operations are atomic
  */
-template<class T, uint32_t NBUCKETS = 32>
-class monolog_relaxed : public __monolog_base<T, NBUCKETS> {
+template<class T, uint32_t NBUCKETS = 32, uint32_t MAX_HIBIT = 63>
+class monolog_relaxed : public __monolog_base<T, NBUCKETS, MAX_HIBIT> {
  public:
-  monolog_relaxed()
-      : tail_(0) {
+  explicit monolog_relaxed(bucket_allocator* allocator = NULL)
+      : __monolog_base<T, NBUCKETS, MAX_HIBIT>(allocator),
+        tail_(0) {
   }
 
-  uint32_t push_back(const T val) {
-    uint32_t idx = tail_.fetch_add(1U, std::memory_order_release);
+  uint64_t push_back(const T val) {
+    uint64_t idx = tail_.fetch_add(1U, std::memory_order_release);
     this->set(idx, val);
     return idx;
   }
 
-  T at(const uint32_t idx) const {
+  T at(const uint64_t idx) const {
     return this->get(idx);
   }
 
-  uint32_t size() const {
+  uint64_t size() const {
     return tail_.load(std::memory_order_acquire);
   }
 
+  // Invokes fn on every entry in the MonoLog from index from on, in index
+  // order; from must not be below a released index. Entries in buckets that
+  // a concurrent push_back has not allocated yet are skipped.
+  template<typename F>
+  void for_each(F fn, uint64_t from = 0) const {
+    typedef __monolog_base<T, NBUCKETS, MAX_HIBIT> base;
+    uint64_t num_entries = size();
+    if (from >= num_entries) {
+      return;
+    }
+
+    uint32_t b;
+    uint64_t off;
+    base::layout::locate(from, b, off);
+    for (uint64_t idx = from; idx < num_entries; b++, off = 0) {
+      uint64_t n = std::min(base::layout::bucket_size(b) - off,
+                            num_entries - idx);
+      const T* data = this->buckets_[this->slot(b)].load(
+          std::memory_order_acquire);
+      if (data != NULL) {
+        for (uint64_t i = 0; i < n; i++) {
+          fn(data[off + i]);
+        }
+      }
+      idx += n;
+    }
+  }
+
  private:
-  std::atomic<uint32_t> tail_;
+  std::atomic<uint64_t> tail_;
 };
 
 }
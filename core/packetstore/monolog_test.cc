@@ -0,0 +1,204 @@
+#include "monolog.h"
+
+#include <functional>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+const uint64_t k4G = 1ULL << 32;
+
+// Consecutive indexes map to consecutive slots, across the switch from
+// exponential to fixed-size buckets.
+template <uint32_t MAX_HIBIT>
+void CheckLayout(uint64_t beg, uint64_t end) {
+  typedef slog::__bucket_layout<MAX_HIBIT> layout;
+  uint32_t prev_bucket;
+  uint64_t prev_off;
+  layout::locate(beg, prev_bucket, prev_off);
+  for (uint64_t i = beg + 1; i < end; i++) {
+    uint32_t bucket;
+    uint64_t off;
+    layout::locate(i, bucket, off);
+    if (off == 0) {
+      ASSERT_EQ(prev_bucket + 1, bucket) << "index " << i;
+      ASSERT_EQ(layout::bucket_size(prev_bucket) - 1, prev_off) << "index " << i;
+    } else {
+      ASSERT_EQ(prev_bucket, bucket) << "index " << i;
+      ASSERT_EQ(prev_off + 1, off) << "index " << i;
+    }
+    ASSERT_LT(off, layout::bucket_size(bucket));
+    prev_bucket = bucket;
+    prev_off = off;
+  }
+}
+
+TEST(BucketLayoutTest, Contiguous) {
+  CheckLayout<8>(0, 1 << 14);
+  CheckLayout<20>(0, 1 << 23);
+  CheckLayout<63>(0, 1 << 20);
+}
+
+TEST(BucketLayoutTest, Contiguous4G) {
+  CheckLayout<20>(k4G - (1 << 21), k4G + (1 << 21));
+  CheckLayout<63>(k4G - (1 << 21), k4G + (1 << 21));
+}
+
+TEST(BucketLayoutTest, CappedBucketCount) {
+  // 10^11 entries fit in 8192 buckets of at most 2^24 entries
+  ASSERT_LT(slog::__bucket_layout<24>::bucket_of(100000000000ULL), 8192U);
+  ASSERT_EQ(1ULL << 24, slog::__bucket_layout<24>::bucket_size(8000));
+}
+
+TEST(MonologBaseTest, SetGetAcross4G) {
+  slog::__monolog_base<uint64_t, 8192, 20> log;
+  for (uint64_t i = k4G - 16; i < k4G + 16; i++) {
+    log.set(i, i * 3);
+  }
+  for (uint64_t i = k4G - 16; i < k4G + 16; i++) {
+    ASSERT_EQ(i * 3, log.get(i));
+  }
+}
+
+TEST(MonologBaseTest, MultiSetGetAcrossBuckets) {
+  slog::__monolog_base<uint32_t, 64, 8> log;
+  std::vector<uint32_t> in(1000);
+  for (uint32_t i = 0; i < in.size(); i++) {
+    in[i] = i + 1;
+  }
+  log.set(7, in.data(), in.size());
+
+  std::vector<uint32_t> out(in.size());
+  log.get(out.data(), 7, out.size());
+  ASSERT_EQ(in, out);
+  for (uint32_t i = 0; i < in.size(); i++) {
+    ASSERT_EQ(in[i], log.get(7 + i));
+  }
+}
+
+TEST(MonologLinearBaseTest, WriteReadAcross4G) {
+  slog::__monolog_linear_base<uint8_t> log;
+  const char data[] = "straddles the 4 GiB boundary";
+  uint64_t offset = k4G - 10;
+  log.write(offset, reinterpret_cast<const uint8_t *>(data), sizeof(data));
+
+  char out[sizeof(data)];
+  log.read(offset, reinterpret_cast<uint8_t *>(out), sizeof(out));
+  ASSERT_STREQ(data, out);
+}
+
+TEST(AtomicMonologTest, FetchOrAcross4G) {
+  slog::__atomic_monolog_base<uint64_t, 8192, 20> log;
+  ASSERT_EQ(0U, log.try_load(k4G));
+  log.fetch_or(k4G - 1, 1);
+  log.fetch_or(k4G, 2);
+  log.fetch_or(k4G, 4);
+  ASSERT_EQ(1U, log.load(k4G - 1));
+  ASSERT_EQ(6U, log.load(k4G));
+  ASSERT_EQ(0U, log.load(k4G + 1));
+}
+
+// Released buckets are reused by later buckets, and the log throws rather
+// than overwrite a bucket that has not been released.
+TEST(MonologBaseTest, ReleaseAndWrap) {
+  slog::__monolog_base<uint64_t, 8, 4> log;  // 8 buckets of 16 entries
+  for (uint64_t i = 0; i < 128; i++) {
+    log.set(i, i);
+  }
+  ASSERT_THROW(log.set(128, 128), slog::log_overflow_exception);
+
+  std::vector<std::function<void()>> retired;
+  log.release_below(70, [&](std::function<void()> free_bucket) {
+    retired.push_back(free_bucket);
+  });
+  ASSERT_EQ(4U, retired.size());  // buckets [0, 64)
+  for (auto &free_bucket : retired) {
+    free_bucket();
+  }
+
+  for (uint64_t i = 128; i < 192; i++) {
+    log.set(i, i * 2);
+  }
+  ASSERT_THROW(log.set(192, 0), slog::log_overflow_exception);
+  for (uint64_t i = 64; i < 128; i++) {
+    ASSERT_EQ(i, log.get(i));
+  }
+  for (uint64_t i = 128; i < 192; i++) {
+    ASSERT_EQ(i * 2, log.get(i));
+  }
+}
+
+TEST(MonologLinearBaseTest, ReleaseAndWrap) {
+  slog::__monolog_linear_base<uint8_t, 4, 1024> log;
+  std::vector<uint8_t> data(1024 * 3 + 100, 0xab);
+  log.write(0, data.data(), data.size());
+  ASSERT_THROW(log.write(4096, data.data(), 1), slog::log_overflow_exception);
+
+  size_t num_retired = 0;
+  log.release_below(2048 + 10, [&](std::function<void()> free_block) {
+    num_retired++;
+    free_block();
+  });
+  ASSERT_EQ(2U, num_retired);
+
+  // Blocks 4 and 5 reuse the slots of blocks 0 and 1
+  const char tail[] = "written into a reused slot";
+  log.write(5120 - 10, reinterpret_cast<const uint8_t *>(tail), sizeof(tail));
+  char out[sizeof(tail)];
+  log.read(5120 - 10, reinterpret_cast<uint8_t *>(out), sizeof(out));
+  ASSERT_STREQ(tail, out);
+
+  uint8_t byte;
+  log.read(3000, &byte, 1);
+  ASSERT_EQ(0xab, byte);
+}
+
+TEST(AtomicMonologTest, ReleaseAndWrap) {
+  slog::__atomic_monolog_base<uint64_t, 8, 4> log;
+  for (uint64_t i = 0; i < 128; i++) {
+    log.fetch_or(i, i);
+  }
+  log.release_below(32, [](std::function<void()> free_bucket) {
+    free_bucket();
+  });
+  ASSERT_EQ(0U, log.try_load(128 + 32));  // beyond the capacity
+  log.fetch_or(128 + 31, 5);
+  ASSERT_EQ(5U, log.load(128 + 31));
+  ASSERT_EQ(127U, log.load(127));
+  ASSERT_THROW(log.fetch_or(128 + 32, 1), slog::log_overflow_exception);
+}
+
+TEST(MonologRelaxedTest, PushBack) {
+  slog::monolog_relaxed<uint64_t> log;
+  for (uint64_t i = 0; i < 10000; i++) {
+    ASSERT_EQ(i, log.push_back(i + k4G));
+  }
+  ASSERT_EQ(10000U, log.size());
+
+  uint64_t expected = k4G;
+  log.for_each([&](uint64_t val) { ASSERT_EQ(expected++, val); });
+}
+
+// Iteration from an index skips the released buckets, including the ones
+// whose slots were reused.
+TEST(MonologRelaxedTest, ForEachFromReleasedIndex) {
+  slog::monolog_relaxed<uint64_t, 8, 4> log;  // 8 buckets of 16 entries
+  for (uint64_t i = 0; i < 128; i++) {
+    log.push_back(i);
+  }
+  log.release_below(70, [](std::function<void()> free_bucket) {
+    free_bucket();
+  });
+  for (uint64_t i = 128; i < 150; i++) {
+    log.push_back(i);
+  }
+
+  uint64_t expected = 70;
+  log.for_each([&](uint64_t val) { ASSERT_EQ(expected++, val); }, 70);
+  ASSERT_EQ(150U, expected);
+
+  log.for_each([](uint64_t) { FAIL(); }, 150);
+}
+
+}  // namespace (unnamed)
@@ -10,75 +10,159 @@ namespace slog {
 
 class offsetlog {
  public:
-  struct atomic_bool {
-    std::atomic_bool valid;
-    atomic_bool() {
-      valid.store(0);
-    }
-
-    bool load() {
-      return valid.load();
-    }
-
-    void set() {
-      valid.store(true);
-    }
-  };
-
-  offsetlog() {
+  /* Validity flags are kept as a bitmap, one bit per record id */
+  static const uint32_t VALID_SHIFT = 6;
+  static const uint64_t VALID_MASK = 63;
+
+  /* Buckets grow up to 2^24 offsets (and 2^20 validity words), and are fixed
+   * size thereafter; either log holds over 10^11 live records */
+  typedef __monolog_base<uint64_t, 8192, 24> offlen_log;
+  typedef __atomic_monolog_base<uint64_t, 8192, 20> valid_log;
+
+  /**
+   * Constructor to initialize the offset log.
+   *
+   * @param offlen_allocator Allocator for the buckets of offsets, or NULL to
+   *  allocate them on the heap.
+   * @param valid_allocator Allocator for the buckets of validity words, or
+   *  NULL to allocate them on the heap.
+   */
+  offsetlog(bucket_allocator* offlen_allocator = NULL,
+            bucket_allocator* valid_allocator = NULL)
+      : offlens_(offlen_allocator),
+        valid_(valid_allocator) {
     current_id_.store(0L);
+    low_water_.store(0L);
   }
 
   uint64_t start(uint64_t offset, uint16_t length) {
     uint64_t record_id = current_id_.fetch_add(1L, std::memory_order_release);
     uint64_t offlen = ((uint64_t) length) << 48 | (offset & 0xFFFFFFFFFFFF);
     offlens_.set(record_id, offlen);
+    valid_.alloc(record_id >> VALID_SHIFT);
     return record_id;
   }
 
   void end(uint64_t record_id) {
-    valid_[record_id].set();
+    valid_.fetch_or(record_id >> VALID_SHIFT,
+                    1ULL << (record_id & VALID_MASK));
+  }
+
+  /**
+   * Marks the contiguous range of records [start_id, start_id + num_records)
+   * valid. A range of up to 64 records touches at most two bitmap words, so
+   * a whole batch is published with one or two release operations.
+   */
+  void end(uint64_t start_id, uint32_t num_records) {
+    uint64_t end_id = start_id + num_records;
+    while (start_id < end_id) {
+      uint64_t word = start_id >> VALID_SHIFT;
+      uint64_t word_end = std::min(end_id, (word + 1) << VALID_SHIFT);
+      uint32_t nbits = word_end - start_id;
+      uint64_t bits = (nbits == 64) ? ~0ULL : ((1ULL << nbits) - 1);
+      valid_.fetch_or(word, bits << (start_id & VALID_MASK));
+      start_id = word_end;
+    }
   }
 
   uint64_t request_id_block(uint32_t num_records) {
     uint64_t start_id = current_id_.fetch_add(num_records,
                                               std::memory_order_release);
     offlens_.ensure_alloc(start_id, start_id + num_records);
-    valid_.ensure_alloc(start_id, start_id + num_records);
+    valid_.ensure_alloc(start_id >> VALID_SHIFT,
+                        (start_id + num_records) >> VALID_SHIFT);
     return start_id;
   }
 
-  void set(uint32_t record_id, uint64_t offset, uint16_t length) {
+  /* Clears the validity of a record */
+  void invalidate(uint64_t record_id) {
+    valid_.fetch_and(record_id >> VALID_SHIFT,
+                     ~(1ULL << (record_id & VALID_MASK)));
+  }
+
+  void set(uint64_t record_id, uint64_t offset, uint16_t length) {
     uint64_t offlen = ((uint64_t) length) << 48 | (offset & 0xFFFFFFFFFFFF);
     offlens_.set(record_id, offlen);
   }
 
   void lookup(uint64_t record_id, uint64_t& offset, uint16_t& length) {
     uint64_t ol = offlens_.get(record_id);
-    offset = ol & 0xFFFFFFFF;
+    offset = ol & 0xFFFFFFFFFFFF;
     length = ol >> 48;
   }
 
   bool is_valid(uint64_t record_id) {
-    return record_id < current_id_.load(std::memory_order_acquire)
-        && valid_[record_id].load();
+    return record_id >= low_water()
+        && record_id < current_id_.load(std::memory_order_acquire)
+        && valid_bit(record_id);
   }
 
   bool is_valid(uint64_t record_id, uint64_t max_rid) {
-    return record_id < max_rid && valid_[record_id].load() > 0;
+    return record_id >= low_water() && record_id < max_rid
+        && valid_bit(record_id);
   }
 
   uint64_t num_ids() {
     return current_id_.load(std::memory_order_acquire);
   }
 
+  /* The smallest record id that has not been dropped */
+  uint64_t low_water() const {
+    return low_water_.load(std::memory_order_seq_cst);
+  }
+
+  /**
+   * Drops all records with ids smaller than record_id: raises the low-water
+   * mark, so that the records are no longer valid, and unlinks the buckets
+   * that only hold dropped records. A function that frees each unlinked
+   * bucket is passed to retire(std::function<void()>), which must invoke it
+   * once no reader can access the bucket.
+   */
+  template<typename F>
+  void drop_below(uint64_t record_id, F retire) {
+    if (record_id <= low_water_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    low_water_.store(record_id, std::memory_order_seq_cst);
+    offlens_.release_below(record_id, retire);
+    valid_.release_below(record_id >> VALID_SHIFT, retire);
+  }
+
+  /**
+   * Restore the tails of an offset log whose buckets were kept by an earlier
+   * instance (see segment_allocator): drops the records below low_water (as
+   * drop_below()), maps the buckets of the records in [low_water, num_ids),
+   * and clears the validity of the ids from num_ids on, which may have been
+   * set after the tails were saved. Must be called on a new offset log.
+   */
+  template<typename F>
+  void restore(uint64_t low_water, uint64_t num_ids, F retire) {
+    drop_below(low_water, retire);
+    current_id_.store(num_ids);
+    offlens_.ensure_alloc(low_water, num_ids);
+    valid_.ensure_alloc(low_water >> VALID_SHIFT, num_ids >> VALID_SHIFT);
+
+    uint64_t word = num_ids >> VALID_SHIFT;
+    uint32_t last_bucket = valid_log::layout::bucket_of(word);
+    valid_.fetch_and(word, (1ULL << (num_ids & VALID_MASK)) - 1);
+    while (valid_log::layout::bucket_of(++word) == last_bucket) {
+      valid_.store(word, 0);
+    }
+  }
+
   size_t storage_size() {
     return offlens_.storage_size() + valid_.storage_size();
   }
 
-  __monolog_base <uint64_t, 32> offlens_;
-  __monolog_base <atomic_bool, 32> valid_;
+  bool valid_bit(uint64_t record_id) const {
+    return (valid_.load(record_id >> VALID_SHIFT) >> (record_id & VALID_MASK))
+        & 1;
+  }
+
+  offlen_log offlens_;
+  valid_log valid_;
   std::atomic<uint64_t> current_id_;
+  std::atomic<uint64_t> low_water_;
 };
 
 }
@@ -0,0 +1,104 @@
+#include "offsetlog.h"
+
+#include <functional>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+const uint64_t k4G = 1ULL << 32;
+
+// Defers the deletion of buckets released by an offsetlog
+struct DeferredFree {
+  std::vector<std::function<void()>> &frees;
+
+  void operator()(std::function<void()> free_bucket) {
+    frees.push_back(free_bucket);
+  }
+};
+
+TEST(OffsetLogTest, OffsetsAbove4G) {
+  slog::offsetlog olog;
+  uint64_t offsets[] = {0, k4G - 1, k4G, k4G + 123, (1ULL << 47) + 5};
+  for (uint64_t offset : offsets) {
+    uint64_t id = olog.start(offset, 54);
+    olog.end(id);
+
+    uint64_t out_offset;
+    uint16_t out_length;
+    olog.lookup(id, out_offset, out_length);
+    ASSERT_EQ(offset, out_offset);
+    ASSERT_EQ(54, out_length);
+  }
+}
+
+TEST(OffsetLogTest, RecordIdsAcross4G) {
+  slog::offsetlog olog;
+  olog.current_id_.store(k4G - 40);
+
+  uint64_t start_id = olog.request_id_block(64);
+  ASSERT_EQ(k4G - 40, start_id);
+  for (uint64_t i = 0; i < 64; i++) {
+    olog.set(start_id + i, k4G + i * 100, i);
+    ASSERT_FALSE(olog.is_valid(start_id + i));
+  }
+  olog.end(start_id, 64);
+
+  for (uint64_t i = 0; i < 64; i++) {
+    ASSERT_TRUE(olog.is_valid(start_id + i));
+
+    uint64_t offset;
+    uint16_t length;
+    olog.lookup(start_id + i, offset, length);
+    ASSERT_EQ(k4G + i * 100, offset);
+    ASSERT_EQ(i, length);
+  }
+  ASSERT_FALSE(olog.is_valid(start_id + 64));
+  ASSERT_EQ(k4G + 24, olog.num_ids());
+
+  // Record ids that alias to the same 32-bit value stay distinct
+  uint64_t id = olog.start(7, 8);
+  olog.end(id);
+  ASSERT_EQ(k4G + 24, id);
+  ASSERT_FALSE(olog.is_valid(24));
+}
+
+TEST(OffsetLogTest, DropBelow) {
+  slog::offsetlog olog;
+  const uint64_t kRecords = 3 << 24;  // spans several fixed-size buckets
+  uint64_t start_id = olog.request_id_block(kRecords);
+  for (uint64_t i = 0; i < kRecords; i += 4096) {
+    olog.set(start_id + i, i * 10, 10);
+  }
+  olog.end(start_id, 64);
+  olog.end(kRecords - 64, 64);
+  size_t size_before = olog.storage_size();
+
+  std::vector<std::function<void()>> frees;
+  olog.drop_below(kRecords - 64, DeferredFree{frees});
+  ASSERT_EQ(kRecords - 64, olog.low_water());
+  ASSERT_FALSE(olog.is_valid(0));
+  ASSERT_FALSE(olog.is_valid(kRecords - 65, kRecords));
+  ASSERT_TRUE(olog.is_valid(kRecords - 64));
+  ASSERT_TRUE(olog.is_valid(kRecords - 1, kRecords));
+  ASSERT_FALSE(frees.empty());
+  ASSERT_LT(olog.storage_size(), size_before);
+  for (auto &fn : frees) {
+    fn();
+  }
+
+  // Record ids stay monotonic
+  uint64_t id = olog.start(123, 4);
+  ASSERT_EQ(kRecords, id);
+  olog.end(id);
+  ASSERT_TRUE(olog.is_valid(id));
+
+  // The low-water mark never moves back
+  frees.clear();
+  olog.drop_below(10, DeferredFree{frees});
+  ASSERT_TRUE(frees.empty());
+  ASSERT_EQ(kRecords - 64, olog.low_water());
+}
+
+}  // namespace (unnamed)
@@ -1,7 +1,12 @@
 #ifndef NETPLAY_PACKETSTORE_H_
 #define NETPLAY_PACKETSTORE_H_
 
+#include "columnstore.h"
+#include "flowcodec.h"
+#include "flowindex.h"
+#include "headerparse.h"
 #include "logstore.h"
+#include "timeindex.h"
 
 namespace netplay {
 
@@ -17,11 +22,96 @@ class packet_store {
 
   /** Type definitions **/
   // typedef slog::log_store::handle handle;
+  class subscription;
+
   class handle : public slog::log_store::handle {
    public:
     handle(packet_store& store)
         : slog::log_store::handle(store.store_),
-          store_(store) {
+          store_(store),
+          flows_(NULL) {
+      for (uint32_t i = 0; i < header_batch::MAX_BATCH; i++) {
+        tokens_[i].reserve(NUM_TOKENS);
+      }
+    }
+
+    ~handle() {
+      delete flows_;
+    }
+
+    /**
+     * Insert a batch of parsed packet headers into the packet store. The
+     * token lists are built in a per-handle arena, so no memory is allocated
+     * on this path.
+     *
+     * @param pkts The packets, starting at their Ethernet headers.
+     * @param hdrs The parsed headers of the packets.
+     * @param num_pkts The number of packets (at most header_batch::MAX_BATCH).
+     * @param now_ns The insertion time of the batch, in nanoseconds; must
+     *  not decrease across calls.
+     * @return The record id of the first packet in the batch.
+     */
+    uint64_t insert_packets(const unsigned char* const * pkts,
+                            const header_batch& hdrs, uint32_t num_pkts,
+                            uint64_t now_ns) {
+      return insert_packets(pkts, hdrs.hdr_len, hdrs, num_pkts, now_ns);
+    }
+
+    /**
+     * Insert a batch of records indexed on the parsed headers of their
+     * packets; e.g., headers with a prefix. With compression enabled, the
+     * records must be at most prefix_len + header_batch::MAX_HDR_LEN bytes
+     * long; see packet_store::enable_compression().
+     *
+     * @param records The records.
+     * @param record_lens The lengths of the records.
+     * @param hdrs The parsed headers of the packets.
+     * @param num_pkts The number of records (at most header_batch::MAX_BATCH).
+     * @param now_ns The insertion time of the batch, in nanoseconds; must
+     *  not decrease across calls.
+     * @return The record id of the first record in the batch.
+     */
+    uint64_t insert_packets(const unsigned char* const * records,
+                            const uint16_t* record_lens,
+                            const header_batch& hdrs, uint32_t num_pkts,
+                            uint64_t now_ns) {
+      /* The batch is indexed by time once, rather than per packet */
+      uint64_t start_id = reserve_ids(num_pkts);
+      store_.times_.add(now_ns, start_id);
+
+      for (uint32_t i = 0; i < num_pkts; i++) {
+        tokens_[i].clear();
+        store_.tokenize(hdrs, i, tokens_[i]);
+      }
+      /* Streams see the records as they were before encoding */
+      if (store_.codec_ != NULL) {
+        encode_batch(start_id, records, record_lens, hdrs, num_pkts);
+        insert_batch(start_id, encoded_, encoded_lens_, tokens_, num_pkts,
+                     records, record_lens);
+      } else {
+        insert_batch(start_id, records, record_lens, tokens_, num_pkts,
+                     records, record_lens);
+      }
+      if (store_.columns_ != NULL) {
+        store_.columns_->append(start_id, hdrs, num_pkts);
+      }
+      if (store_.flow_index_ != NULL) {
+        store_.flow_index_->add(start_id, hdrs, num_pkts, now_ns);
+      }
+      return start_id;
+    }
+
+    /**
+     * Apply the retention policy of the packet store; the header columns of
+     * dropped packets are dropped along with them.
+     *
+     * @param now_ns The current time, in nanoseconds.
+     */
+    void expire(uint64_t now_ns) {
+      slog::log_store::handle::expire(now_ns);
+      if (store_.columns_ != NULL) {
+        store_.columns_->drop_below(first_record());
+      }
     }
 
     void add_src_ip(slog::token_list& list, uint32_t src_ip) {
@@ -40,26 +130,462 @@ class packet_store {
       list.push_back(slog::token_t(store_.dstport_idx_id_, dst_port));
     }
 
-    void add_timestamp(slog::token_list& list, uint32_t timestamp) {
-      list.push_back(slog::token_t(store_.timestamp_idx_id_, timestamp));
+    /* Filter builders; all ranges are inclusive */
+
+    void add_src_ip_filter(slog::filter_conjunction& conj, uint32_t beg,
+                           uint32_t end) {
+      conj.push_back(slog::basic_filter(store_.srcip_idx_id_, beg, end));
+    }
+
+    void add_dst_ip_filter(slog::filter_conjunction& conj, uint32_t beg,
+                           uint32_t end) {
+      conj.push_back(slog::basic_filter(store_.dstip_idx_id_, beg, end));
+    }
+
+    void add_src_port_filter(slog::filter_conjunction& conj, uint16_t beg,
+                             uint16_t end) {
+      conj.push_back(slog::basic_filter(store_.srcport_idx_id_, beg, end));
+    }
+
+    void add_dst_port_filter(slog::filter_conjunction& conj, uint16_t beg,
+                             uint16_t end) {
+      conj.push_back(slog::basic_filter(store_.dstport_idx_id_, beg, end));
+    }
+
+    /**
+     * Get the range of record ids inserted within a time range, at
+     * slog::time_index::BUCKET_NS granularity; see filter().
+     *
+     * @param beg_ns The start of the time range.
+     * @param end_ns The end of the time range (inclusive).
+     * @param beg_id The first record id of the range.
+     * @param end_id One past the last record id of the range.
+     */
+    void time_range(uint64_t beg_ns, uint64_t end_ns, uint64_t& beg_id,
+                    uint64_t& end_id) const {
+      store_.times_.lookup(beg_ns, end_ns, beg_id, end_id);
+    }
+
+    /**
+     * Get the time a record was inserted at, at
+     * slog::time_index::BUCKET_NS granularity.
+     *
+     * @param record_id The id of the record.
+     * @return The insertion time, rounded down.
+     */
+    uint64_t insert_time(uint64_t record_id) const {
+      return store_.times_.time_of(record_id);
+    }
+
+    /**
+     * Get an upper bound of the insertion times of all packets in the store,
+     * e.g., of those restored by open().
+     *
+     * @return One past the last time bucket of a packet; 0 if there is none.
+     */
+    uint64_t insert_end_ns() const {
+      return store_.times_.end_ns();
+    }
+
+    /**
+     * Filter the records with ids in [min_rid, max_rid) on their header
+     * columns; see column_store::filter(). Records that have been dropped
+     * may be included.
+     *
+     * @param results The sorted record ids of the matching records.
+     * @param conj The predicates on the header columns.
+     * @param min_rid The smallest record id to consider.
+     * @param max_rid One past the largest record id to consider.
+     * @return true if the header columns are enabled, false otherwise.
+     */
+    bool filter_columns(std::vector<uint64_t>& results,
+                        const column_store::conjunction& conj,
+                        uint64_t min_rid, uint64_t max_rid) const {
+      if (store_.columns_ == NULL) {
+        results.clear();
+        return false;
+      }
+      store_.columns_->filter(results, conj,
+                              std::max(min_rid, first_record()), max_rid);
+      return true;
+    }
+
+    /**
+     * Get the record ids of the packets of a flow (in both directions) in
+     * [min_rid, max_rid); see flow_index::records().
+     *
+     * @param results The sorted record ids of the packets of the flow.
+     * @param key The key of the flow.
+     * @param min_rid The smallest record id to consider.
+     * @param max_rid One past the largest record id to consider.
+     * @return true if the flow index is enabled, false otherwise.
+     */
+    bool filter_flow(std::vector<uint64_t>& results, const flow_key& key,
+                     uint64_t min_rid, uint64_t max_rid) const {
+      results.clear();
+      if (store_.flow_index_ == NULL) {
+        return false;
+      }
+      uint32_t flow_id = store_.flow_index_->find(key);
+      if (flow_id != flow_index::NO_FLOW) {
+        store_.flow_index_->records(results, flow_id,
+                                    std::max(min_rid, first_record()),
+                                    max_rid);
+      }
+      return true;
+    }
+
+    /**
+     * Get the counters of all flows in the flow index, in order of their
+     * first packet.
+     *
+     * @param summaries The counters of the flows.
+     * @return true if the flow index is enabled, false otherwise.
+     */
+    bool flows(std::vector<flow_summary>& summaries) const {
+      summaries.clear();
+      if (store_.flow_index_ == NULL) {
+        return false;
+      }
+      uint32_t num_flows = store_.flow_index_->num_flows();
+      summaries.resize(num_flows);
+      for (uint32_t i = 0; i < num_flows; i++) {
+        store_.flow_index_->summary(summaries[i], i);
+      }
+      return true;
+    }
+
+    /* Reads decode the records if compression is enabled */
+
+    /**
+     * Subscribe to a stream; see subscription.
+     *
+     * @param stream_id The id of the stream.
+     * @param batch_delay_ns How long subscription::wait() holds off for a
+     *  full batch once a record is available.
+     * @param from_start Whether to return the records already in the stream.
+     * @param offset The offset into each record to begin reading.
+     * @return A subscription to the stream.
+     */
+    subscription* subscribe(uint32_t stream_id, uint64_t batch_delay_ns = 0,
+                            bool from_start = false, uint32_t offset = 0) {
+      return new subscription(
+          *this, slog::log_store::handle::subscribe(stream_id, batch_delay_ns,
+                                                    from_start),
+          offset, store_.codec_ != NULL);
+    }
+
+    /**
+     * Fetch a record; see slog::log_store::get(). A record whose reference
+     * has been dropped is treated as dropped.
+     *
+     * @param record The record buffer (at least
+     *  header_codec::MAX_RECORD_LEN bytes with compression enabled).
+     * @param record_id The id of the record being requested.
+     * @return true if the fetch is successful, false otherwise.
+     */
+    bool get(unsigned char* record, const uint64_t record_id) const {
+      if (store_.codec_ == NULL) {
+        return slog::log_store::handle::get(record, record_id);
+      }
+      uint16_t len;
+      uint64_t ref_id = UINT64_MAX;
+      unsigned char ref[header_codec::MAX_RECORD_LEN];
+      uint16_t ref_len = 0;
+      return decode(record_id, record, len, ref_id, ref, ref_len);
+    }
+
+    /**
+     * Extract a portion of a record; see slog::log_store::extract().
+     *
+     * @param record The record buffer.
+     * @param record_id The id of the record being requested.
+     * @param offset The offset into the record to begin extracting.
+     * @param length The number of bytes to extract. Updated with the actual
+     *  number of bytes extracted.
+     * @return true if the extract is successful, false otherwise.
+     */
+    bool extract(unsigned char* record, const uint64_t record_id,
+                 uint32_t offset, uint32_t& length) const {
+      if (store_.codec_ == NULL) {
+        return slog::log_store::handle::extract(record, record_id, offset,
+                                                length);
+      }
+      unsigned char buf[header_codec::MAX_RECORD_LEN];
+      uint16_t len;
+      uint64_t ref_id = UINT64_MAX;
+      unsigned char ref[header_codec::MAX_RECORD_LEN];
+      uint16_t ref_len = 0;
+      if (!decode(record_id, buf, len, ref_id, ref, ref_len)) {
+        return false;
+      }
+      length = offset < len ? std::min<uint32_t>(length, len - offset) : 0;
+      memcpy(record, buf + offset, length);
+      return true;
+    }
+
+    /**
+     * Read a portion of each of a set of records, in batches; see
+     * slog::log_store::scan(). Consecutive records of a flow usually share
+     * their reference, which is then read once.
+     *
+     * @param record_ids The ids of the records.
+     * @param offset The offset into each record to begin reading.
+     * @param max_length The maximum number of bytes read per record.
+     * @param fn The function called on each batch.
+     */
+    template<typename F>
+    void scan(const std::vector<uint64_t>& record_ids, uint32_t offset,
+              uint16_t max_length, F fn) const {
+      if (store_.codec_ == NULL) {
+        slog::log_store::handle::scan(record_ids, offset, max_length, fn);
+        return;
+      }
+      const uint32_t batch = slog::log_store::SCAN_BATCH;
+      std::vector<unsigned char> buf(
+          (size_t) batch * header_codec::MAX_RECORD_LEN);
+      const unsigned char* data[batch];
+      uint16_t lengths[batch];
+      uint64_t ref_id = UINT64_MAX;
+      unsigned char ref[header_codec::MAX_RECORD_LEN];
+      uint16_t ref_len = 0;
+
+      size_t i = 0;
+      while (i < record_ids.size()) {
+        uint32_t n = 0;
+        for (; n < batch && i < record_ids.size(); i++) {
+          unsigned char* out = &buf[(size_t) n * header_codec::MAX_RECORD_LEN];
+          uint16_t len;
+          if (!decode(record_ids[i], out, len, ref_id, ref, ref_len)) {
+            continue;
+          }
+          data[n] = out + std::min<uint32_t>(offset, len);
+          lengths[n] = len > offset ?
+              std::min<uint32_t>(len - offset, max_length) : 0;
+          n++;
+        }
+        if (n != 0) {
+          fn(data, lengths, n);
+        }
+      }
     }
 
    private:
+    /* Maximum number of tokens generated per packet */
+    static const size_t NUM_TOKENS = 4;
+
+    /**
+     * Encode a batch of records into encoded_, as deltas against the
+     * reference of their flow where possible; records that are not encoded
+     * as deltas become the reference of their flow.
+     */
+    void encode_batch(uint64_t start_id, const unsigned char* const * records,
+                      const uint16_t* record_lens, const header_batch& hdrs,
+                      uint32_t num_pkts) {
+      const header_codec& codec = *store_.codec_;
+      if (flows_ == NULL) {
+        flows_ = new flow_table;
+      }
+
+      /* References from earlier epochs may be dropped before the deltas */
+      uint64_t epoch = head_epoch();
+      for (uint32_t i = 0; i < num_pkts; i++) {
+        uint16_t len = record_lens[i];
+        uint16_t enc_len = 0;
+        encoded_[i] = encoded_buf_[i];
+        if (header_codec::is_tcp(hdrs, i)) {
+          uint64_t key;
+          flow_table::entry& flow = flows_->lookup(hdrs, i, key);
+          uint64_t id = start_id + i;
+          if (flow.ref_len == len && flow.key == key
+              && flow.ref_epoch == epoch) {
+            enc_len = codec.encode_delta(flow.ref, records[i], len,
+                                         id - flow.ref_id, encoded_buf_[i]);
+          }
+          if (enc_len == 0) {
+            flow.key = key;
+            flow.ref_id = id;
+            flow.ref_epoch = epoch;
+            flow.ref_len = len;
+            memcpy(flow.ref, records[i], len);
+          }
+        }
+        if (enc_len == 0) {
+          enc_len = header_codec::encode_full(records[i], len,
+                                              encoded_buf_[i]);
+        }
+        encoded_lens_[i] = enc_len;
+      }
+    }
+
+    /**
+     * Decode a record, reading its reference unless it is the one last
+     * read into ref.
+     *
+     * @return true if the record was decoded, false if it (or its reference)
+     *  is not valid.
+     */
+    bool decode(uint64_t record_id, unsigned char* out, uint16_t& len,
+                uint64_t& ref_id, unsigned char* ref, uint16_t& ref_len) const {
+      unsigned char enc[header_codec::MAX_ENCODED_LEN];
+      uint32_t enc_len = sizeof(enc);
+      if (!slog::log_store::handle::extract(enc, record_id, 0, enc_len)) {
+        return false;
+      }
+      uint64_t distance = header_codec::distance_of(enc, enc_len);
+      if (enc_len != 0 && enc[0] == header_codec::DELTA
+          && record_id - distance != ref_id) {
+        unsigned char ref_enc[header_codec::MAX_ENCODED_LEN];
+        uint32_t ref_enc_len = sizeof(ref_enc);
+        if (distance == 0 || distance > record_id
+            || !slog::log_store::handle::extract(ref_enc, record_id - distance,
+                                                 0, ref_enc_len)
+            || ref_enc_len == 0 || ref_enc[0] != header_codec::FULL) {
+          return false;
+        }
+        ref_id = record_id - distance;
+        ref_len = ref_enc_len - 1;
+        memcpy(ref, ref_enc + 1, ref_len);
+      }
+      len = store_.codec_->decode(enc, enc_len, ref, ref_len, out);
+      return len != 0 || enc_len == 1;
+    }
+
     packet_store& store_;
+    slog::token_list tokens_[header_batch::MAX_BATCH];
+
+    /* Reference headers of recent flows, if compression is enabled */
+    flow_table* flows_;
+    const unsigned char* encoded_[header_batch::MAX_BATCH];
+    uint16_t encoded_lens_[header_batch::MAX_BATCH];
+    unsigned char encoded_buf_[header_batch::MAX_BATCH]
+                              [header_codec::MAX_ENCODED_LEN];
+  };
+
+  /**
+   * Cursor over a stream of the store; see slog::log_store::subscription.
+   * Records are returned from the subscription's offset on, and decoded
+   * through the handle if compression is enabled. The handle must outlive
+   * the subscription.
+   */
+  class subscription {
+   public:
+    subscription(const handle& reader, slog::log_store::subscription* base,
+                 uint32_t offset, bool decode)
+        : reader_(reader),
+          base_(base),
+          offset_(offset),
+          decode_(decode) {
+    }
+
+    ~subscription() {
+      delete base_;
+    }
+
+    /**
+     * Get the eventfd the subscription blocks on; see
+     * slog::log_store::subscription::fd().
+     */
+    int fd() const {
+      return base_->fd();
+    }
+
+    /**
+     * Have the eventfd signaled once new records arrive; see
+     * slog::log_store::subscription::arm().
+     */
+    bool arm() {
+      return base_->arm();
+    }
+
+    /**
+     * Get the records appended to the stream since the last read, without
+     * blocking; see slog::log_store::subscription::poll().
+     *
+     * @param record_ids The ids of the records.
+     * @param max_records The maximum number of records to return.
+     * @param records If not NULL, the record data of each of the records.
+     * @return The number of records returned.
+     */
+    size_t poll(std::vector<uint64_t>& record_ids, size_t max_records,
+                std::vector<std::string>* records = NULL) {
+      base_->poll(record_ids, max_records, decode_ ? NULL : records);
+      return read(record_ids, records);
+    }
+
+    /**
+     * Get the records appended to the stream since the last read, blocking
+     * until at least one is available; see
+     * slog::log_store::subscription::wait().
+     *
+     * @param record_ids The ids of the records.
+     * @param max_records The maximum number of records to return.
+     * @param timeout_ns How long to block for the first record.
+     * @param records If not NULL, the record data of each of the records.
+     * @return The number of records returned; 0 on timeout.
+     */
+    size_t wait(std::vector<uint64_t>& record_ids, size_t max_records,
+                uint64_t timeout_ns, std::vector<std::string>* records = NULL) {
+      base_->wait(record_ids, max_records, timeout_ns,
+                  decode_ ? NULL : records);
+      return read(record_ids, records);
+    }
+
+   private:
+    /* Cuts the stored records at the offset, or decodes them, leaving out the
+     * ones (or whose references were) dropped since they were polled */
+    size_t read(std::vector<uint64_t>& record_ids,
+                std::vector<std::string>* records) const {
+      if (records == NULL) {
+        return record_ids.size();
+      }
+      if (!decode_) {
+        for (std::string& record : *records) {
+          record.erase(0, offset_);
+        }
+        return record_ids.size();
+      }
+      records->clear();
+      size_t n = 0;
+      for (uint64_t record_id : record_ids) {
+        unsigned char buf[header_codec::MAX_RECORD_LEN];
+        uint32_t length = sizeof(buf);
+        if (reader_.extract(buf, record_id, offset_, length)) {
+          record_ids[n++] = record_id;
+          records->push_back(std::string((const char*) buf, length));
+        }
+      }
+      record_ids.resize(n);
+      return n;
+    }
+
+    const handle& reader_;
+    slog::log_store::subscription* base_;
+    uint32_t offset_;
+    bool decode_;
   };
 
   /**
    * Constructor to initialize the packet store.
    *
-   * By default, the packet store creates indexes on 5 fields:
-   * Source IP, Destination IP, Source Port, Destination Port and Timestamp.
+   * By default, the packet store creates indexes on 4 fields:
+   * Source IP, Destination IP, Source Port and Destination Port. Packets are
+   * indexed by insertion time in a separate, sparse time index.
    */
-  packet_store() {
+  packet_store()
+      : columns_(NULL),
+        codec_(NULL),
+        flow_index_(NULL) {
     srcip_idx_id_ = store_.add_index(4);
     dstip_idx_id_ = store_.add_index(4);
     srcport_idx_id_ = store_.add_index(2);
     dstport_idx_id_ = store_.add_index(2);
-    timestamp_idx_id_ = store_.add_index(4);
+  }
+
+  ~packet_store() {
+    delete columns_;
+    delete codec_;
+    delete flow_index_;
   }
 
   /**
@@ -72,13 +598,204 @@ class packet_store {
     return new handle(*this);
   }
 
+  /**
+   * Add a stream of the packets matched by a filter on their headers, e.g.,
+   * a JIT-compiled BPF program; see slog::log_store::add_stream().
+   *
+   * @param fn The filter function.
+   * @param offset Number of leading record bytes the filter does not see.
+   * @return The id of the newly created stream.
+   */
+  uint32_t add_stream(slog::packet_filter_function fn, uint32_t offset = 0) {
+    return store_.add_stream(fn, offset);
+  }
+
+  /**
+   * Bound the memory used by the packet store, by dropping the oldest packets
+   * once the store holds more than max_bytes bytes of headers, or once they
+   * are older than max_age_ns. Handles apply the policy on expire(). Must be
+   * called before any packet is inserted.
+   *
+   * @param max_bytes Maximum number of header bytes retained; zero for no
+   *  limit.
+   * @param max_age_ns Maximum age of retained packets, in nanoseconds; zero
+   *  for no limit.
+   * @return true if the policy was set, false otherwise.
+   */
+  bool set_retention(uint64_t max_bytes, uint64_t max_age_ns) {
+    return store_.set_retention(max_bytes, max_age_ns);
+  }
+
+  /**
+   * Change the size limit of the retention policy, as
+   * slog::log_store::set_size_limit(); the header columns follow the packets.
+   *
+   * @param max_bytes Maximum number of header bytes retained; non-zero.
+   * @return true if the limit was changed, false otherwise.
+   */
+  bool set_size_limit(uint64_t max_bytes) {
+    return store_.set_size_limit(max_bytes);
+  }
+
+  /**
+   * Set the allocator for the memory holding the stored headers, which is
+   * otherwise mapped lazily from transparent hugepages; e.g., a
+   * slog::page_allocator that takes hugetlbfs pages. The allocator must
+   * outlive the packet store. Must be called before any packet is inserted.
+   *
+   * @param allocator The allocator, or NULL to allocate on the heap.
+   * @return true if the allocator was set, false otherwise.
+   */
+  bool set_allocator(slog::bucket_allocator* allocator) {
+    return store_.set_allocator(allocator);
+  }
+
+  /**
+   * Keep the parsed header fields of packets in a column_store as well, so
+   * that they can be filtered on fields without an index; see
+   * handle::filter_columns(). Must be called before any packet is inserted.
+   *
+   * @return true if the header columns were enabled, false otherwise.
+   */
+  bool enable_columns() {
+    if (store_.num_records() != 0) {
+      return false;
+    }
+    if (columns_ == NULL) {
+      columns_ = new column_store;
+    }
+    return true;
+  }
+
+  /**
+   * Store the headers of TCP packets as deltas against an earlier header of
+   * their flow; see header_codec. Reads through handles and their
+   * subscriptions decode the records. Must be called before any packet is
+   * inserted.
+   *
+   * @param prefix_len Number of record bytes before the packet headers (at
+   *  most header_codec::TIME_PREFIX_LEN).
+   * @return true if compression was enabled, false otherwise.
+   */
+  bool enable_compression(uint32_t prefix_len = 0) {
+    if (store_.num_records() != 0
+        || prefix_len > header_codec::TIME_PREFIX_LEN) {
+      return false;
+    }
+    if (codec_ == NULL) {
+      codec_ = new header_codec(prefix_len);
+    }
+    return codec_->prefix_len() == prefix_len;
+  }
+
+  /**
+   * Index the IPv4 packets of the store by flow as well; see flow_index and
+   * handle::filter_flow(). Must be called before any packet is inserted.
+   *
+   * @param max_flows Maximum number of flows indexed.
+   * @return true if the flow index was enabled, false otherwise.
+   */
+  bool enable_flows(uint32_t max_flows = flow_index::DEFAULT_MAX_FLOWS) {
+    if (store_.num_records() != 0) {
+      return false;
+    }
+    if (flow_index_ == NULL) {
+      flow_index_ = new flow_index(max_flows);
+    }
+    return true;
+  }
+
+  /**
+   * Persist the packet store in directory dir, as slog::log_store::open().
+   * If dir holds a checkpointed packet store, its packets are restored and
+   * indexed again from their stored headers, and its time index is
+   * restored. Header columns, the flow index and compressed headers are not
+   * persisted, so the store cannot be opened with any of them enabled.
+   *
+   * Must be called after the retention policy is set, the same as that of
+   * the stored packet store, and before any packet is inserted.
+   *
+   * @param dir The directory to persist the packet store in.
+   * @param prefix_len Number of record bytes before the packet headers.
+   * @return true if the packet store was opened, false otherwise.
+   * @throws slog::segment_exception if a segment cannot be mapped.
+   */
+  bool open(const std::string& dir, uint32_t prefix_len = 0) {
+    if (columns_ != NULL || codec_ != NULL || flow_index_ != NULL) {
+      return false;
+    }
+
+    header_batch hdrs;
+    auto tokenize_record = [this, prefix_len, &hdrs](
+        const unsigned char* record, uint16_t len, slog::token_list& tokens) {
+      if (len >= prefix_len) {
+        header_parser::parse_one(record + prefix_len, len - prefix_len, 0,
+                                 hdrs);
+        tokenize(hdrs, 0, tokens);
+      }
+    };
+    if (!store_.open(dir, tokenize_record)) {
+      return false;
+    }
+    dir_ = dir;
+    times_.load(times_path(), store_.num_records());
+    return true;
+  }
+
+  /**
+   * Flush a persisted packet store and durably record its tails and its
+   * time index, so that open() restores all packets inserted before the
+   * call; see slog::log_store::checkpoint().
+   *
+   * @return true if the checkpoint was recorded, false otherwise.
+   */
+  bool checkpoint() {
+    return store_.checkpoint() && times_.save(times_path());
+  }
+
+  /**
+   * Get the number of bytes used by the header columns, if enabled.
+   */
+  size_t columns_size() const {
+    return columns_ != NULL ? columns_->storage_size() : 0;
+  }
+
+  /**
+   * Get the number of bytes used by the flow index, if enabled.
+   */
+  size_t flows_size() const {
+    return flow_index_ != NULL ? flow_index_->storage_size() : 0;
+  }
+
  private:
+  /* Tokens of the packet in slot i of a batch, for the indexes */
+  void tokenize(const header_batch& hdrs, uint32_t i,
+                slog::token_list& list) const {
+    if (hdrs.flags[i] & header_batch::IPV4) {
+      list.push_back(slog::token_t(srcip_idx_id_, hdrs.src_ip[i]));
+      list.push_back(slog::token_t(dstip_idx_id_, hdrs.dst_ip[i]));
+    }
+    if (hdrs.flags[i] & header_batch::PORTS) {
+      list.push_back(slog::token_t(srcport_idx_id_, hdrs.src_port[i]));
+      list.push_back(slog::token_t(dstport_idx_id_, hdrs.dst_port[i]));
+    }
+  }
+
+  /* The time index is saved next to the manifest of the log-store */
+  std::string times_path() const {
+    return dir_ + "/TIMES";
+  }
+
   slog::log_store store_;
   uint32_t srcip_idx_id_;
   uint32_t dstip_idx_id_;
   uint32_t srcport_idx_id_;
   uint32_t dstport_idx_id_;
-  uint32_t timestamp_idx_id_;
+  slog::time_index times_;
+  column_store* columns_;
+  header_codec* codec_;
+  flow_index* flow_index_;
+  std::string dir_;
 };
 
 }
@@ -0,0 +1,237 @@
+// Benchmarks for the insert throughput, index footprint and query latency of
+// the packet store, to track regressions across changes to its indexes.
+//
+// Results go to JSON with google-benchmark's own flags: run with
+// --benchmark_out=packetstore.json --benchmark_out_format=json to write them
+// to a file, or with --benchmark_format=json to print them.
+//
+// Query benchmarks run on stores of 10^6 and 10^7 packets; set
+// PACKETSTORE_BENCH_MAX_RECORDS (e.g. to 1000000000) to add larger stores, up
+// to 10^9 packets, which take about 150 bytes of memory per packet.
+
+#include "packetstore.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "testpackets.h"
+
+namespace {
+
+const uint32_t kBatch = netplay::test::packet_batch::SIZE;
+const uint16_t kPacketLen = 54;  // Ethernet + IPv4 + TCP
+
+enum Query { kPoint = 0, kPrefix = 1, kConjunctive = 2 };
+
+typedef netplay::test::packet_batch PacketBatch;
+
+// Packet batches cycled through by the insert benchmarks, so that packet
+// construction and parsing are not measured.
+const std::vector<PacketBatch> &Batches() {
+  static std::vector<PacketBatch> *batches = NULL;
+  static std::once_flag once;
+  std::call_once(once, []() {
+    /* Reserved up front, as each batch points into itself */
+    batches = new std::vector<PacketBatch>;
+    batches->reserve(1024);
+    for (uint64_t first = 0; first < 1024 * kBatch; first += kBatch) {
+      batches->emplace_back(first, netplay::test::build_bench_packet);
+    }
+  });
+  return *batches;
+}
+
+// Store shared by the threads of a multi-threaded insert benchmark; each
+// thread holds a reference until it is done, so the store of a run is freed
+// before the next run starts.
+std::shared_ptr<netplay::packet_store> SharedStore() {
+  static std::mutex mutex;
+  static std::weak_ptr<netplay::packet_store> store;
+  std::lock_guard<std::mutex> lock(mutex);
+  std::shared_ptr<netplay::packet_store> shared = store.lock();
+  if (!shared) {
+    shared = std::make_shared<netplay::packet_store>();
+    store = shared;
+  }
+  return shared;
+}
+
+// Store sizes of the query benchmarks, from 10^6 packets up to
+// PACKETSTORE_BENCH_MAX_RECORDS.
+std::vector<int64_t> RecordCounts() {
+  const char *max_env = getenv("PACKETSTORE_BENCH_MAX_RECORDS");
+  int64_t max_records = max_env != NULL ? atoll(max_env) : 10000000;
+  std::vector<int64_t> counts;
+  for (int64_t n = 1000000; n <= max_records; n *= 10) {
+    counts.push_back(n);
+  }
+  return counts;
+}
+
+void FilterArgs(benchmark::internal::Benchmark *b) {
+  b->ArgNames({"records", "query"});
+  for (int64_t n : RecordCounts()) {
+    for (int64_t q : {kPoint, kPrefix, kConjunctive}) {
+      b->Args({n, q});
+    }
+  }
+}
+
+void LookupArgs(benchmark::internal::Benchmark *b) {
+  b->ArgNames({"records"});
+  for (int64_t n : RecordCounts()) {
+    b->Arg(n);
+  }
+}
+
+// Populated stores for the query benchmarks, by number of packets; they are
+// kept until exit, so each is built once.
+netplay::packet_store::handle *PopulatedStore(uint64_t num_records) {
+  static std::map<uint64_t, netplay::packet_store::handle *> handles;
+  auto it = handles.find(num_records);
+  if (it != handles.end()) {
+    return it->second;
+  }
+
+  netplay::packet_store *store = new netplay::packet_store;
+  netplay::packet_store::handle *handle = store->get_handle();
+  for (uint64_t first = 0; first < num_records; first += kBatch) {
+    PacketBatch batch(first, netplay::test::build_bench_packet);
+    handle->insert_packets(batch.pkts, batch.hdrs, kBatch, first);
+  }
+  handles[num_records] = handle;
+  return handle;
+}
+
+}  // namespace (unnamed)
+
+// Throughput of insert_batch() with explicit tokens, optionally from several
+// threads, each with its own handle to the same store.
+static void BM_Insert(benchmark::State &state) {
+  std::shared_ptr<netplay::packet_store> store = SharedStore();
+  netplay::packet_store::handle *handle = store->get_handle();
+  const std::vector<PacketBatch> &batches = Batches();
+
+  uint64_t seq = 0;
+  while (state.KeepRunning()) {
+    netplay::test::insert_tokens(handle, batches[seq++ % batches.size()]);
+  }
+  state.SetItemsProcessed(seq * kBatch);
+  delete handle;
+}
+
+BENCHMARK(BM_Insert)->ThreadRange(1, 8)->UseRealTime();
+
+// Throughput of handle::insert_packets() on parsed headers, optionally from
+// several threads.
+static void BM_InsertPackets(benchmark::State &state) {
+  std::shared_ptr<netplay::packet_store> store = SharedStore();
+  netplay::packet_store::handle *handle = store->get_handle();
+  const std::vector<PacketBatch> &batches = Batches();
+
+  uint64_t seq = 0;
+  while (state.KeepRunning()) {
+    const PacketBatch &batch = batches[seq % batches.size()];
+    handle->insert_packets(batch.pkts, batch.hdrs, kBatch, seq);
+    seq++;
+  }
+  state.SetItemsProcessed(seq * kBatch);
+  delete handle;
+}
+
+BENCHMARK(BM_InsertPackets)->ThreadRange(1, 8)->UseRealTime();
+
+// Storage per million packets, by component; the time is that of building
+// the store for the query benchmarks.
+static void BM_Footprint(benchmark::State &state) {
+  const uint64_t num_records = state.range(0);
+  netplay::packet_store::handle *handle = NULL;
+  while (state.KeepRunning()) {
+    handle = PopulatedStore(num_records);
+  }
+
+  slog::logstore_storage storage;
+  handle->storage_footprint(storage);
+  size_t idx_size = 0, posting_size = 0;
+  for (size_t i = 0; i < storage.idx_sizes.size(); i++) {
+    idx_size += storage.idx_sizes[i];
+    posting_size += storage.idx_posting_sizes[i];
+  }
+  double scale = 1e6 / num_records / 1048576.0;
+  state.counters["data_mb_per_million"] = handle->size() * scale;
+  state.counters["offsets_mb_per_million"] = storage.olog_size * scale;
+  state.counters["index_mb_per_million"] = idx_size * scale;
+  state.counters["postings_mb_per_million"] = posting_size * scale;
+}
+
+BENCHMARK(BM_Footprint)->Apply(LookupArgs)->Iterations(1);
+
+// Latency of a filter over the whole store: a single source address, a /24
+// of source addresses, or a /16 of source addresses with a destination
+// address and port.
+static void BM_Filter(benchmark::State &state) {
+  netplay::packet_store::handle *handle = PopulatedStore(state.range(0));
+  slog::filter_query query(1);
+  switch (state.range(1)) {
+    case kPoint:
+      handle->add_src_ip_filter(query[0], 0x0a000a0a, 0x0a000a0a);
+      break;
+    case kPrefix:
+      handle->add_src_ip_filter(query[0], 0x0a000a00, 0x0a000aff);
+      break;
+    case kConjunctive:
+      handle->add_src_ip_filter(query[0], 0x0a000000, 0x0a00ffff);
+      handle->add_dst_ip_filter(query[0], 0x0b000010, 0x0b000010);
+      handle->add_dst_port_filter(query[0], 80, 80);
+      break;
+  }
+
+  std::vector<uint64_t> results;
+  while (state.KeepRunning()) {
+    handle->filter(results, query);
+    benchmark::DoNotOptimize(results.data());
+  }
+  state.counters["results"] = results.size();
+}
+
+BENCHMARK(BM_Filter)->Apply(FilterArgs)->Unit(benchmark::kMicrosecond);
+
+// Latency of get() of a whole packet at a random record id.
+static void BM_Get(benchmark::State &state) {
+  netplay::packet_store::handle *handle = PopulatedStore(state.range(0));
+  const uint64_t num_records = handle->num_records();
+  unsigned char record[kPacketLen];
+  uint64_t seq = 0;
+  while (state.KeepRunning()) {
+    handle->get(record, (seq++ * 2654435761U) % num_records);
+    benchmark::DoNotOptimize(record);
+  }
+  state.SetItemsProcessed(seq);
+}
+
+BENCHMARK(BM_Get)->Apply(LookupArgs);
+
+// Latency of extract() of the source address of a packet at a random record
+// id.
+static void BM_Extract(benchmark::State &state) {
+  netplay::packet_store::handle *handle = PopulatedStore(state.range(0));
+  const uint64_t num_records = handle->num_records();
+  unsigned char field[4];
+  uint64_t seq = 0;
+  while (state.KeepRunning()) {
+    uint32_t len = sizeof(field);
+    handle->extract(field, (seq++ * 2654435761U) % num_records, 14 + 12, len);
+    benchmark::DoNotOptimize(field);
+  }
+  state.SetItemsProcessed(seq);
+}
+
+BENCHMARK(BM_Extract)->Apply(LookupArgs);
+
+BENCHMARK_MAIN();
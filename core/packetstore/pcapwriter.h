@@ -0,0 +1,198 @@
+#ifndef NETPLAY_PCAPWRITER_H_
+#define NETPLAY_PCAPWRITER_H_
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include "headerparse.h"
+
+namespace netplay {
+
+/**
+ * Writes packet headers to a pcap file, with nanosecond timestamps.
+ *
+ * Headers are copied into a buffer of BATCH records, and each full buffer
+ * is written with a single writev() of the record headers and the packet
+ * data, rather than with a write per record.
+ */
+class pcap_writer {
+ public:
+  /* Number of records per writev() */
+  static const uint32_t BATCH = 64;
+
+  /* Magic number of pcap files with nanosecond timestamps */
+  static const uint32_t MAGIC_NS = 0xa1b23c4d;
+  static const uint32_t LINKTYPE_ETHERNET = 1;
+  static const uint32_t SNAPLEN = 65535;
+
+  pcap_writer()
+      : fd_(-1),
+        num_pending_(0),
+        num_records_(0),
+        num_bytes_(0) {
+  }
+
+  ~pcap_writer() {
+    close();
+  }
+
+  /**
+   * Create (or truncate) a pcap file and write its header.
+   *
+   * @param path The path of the file.
+   * @return 0 on success, an errno value otherwise.
+   */
+  int open(const char* path) {
+    close();
+    fd_ = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      return errno;
+    }
+
+    file_header hdr;
+    hdr.magic = MAGIC_NS;
+    hdr.version_major = 2;
+    hdr.version_minor = 4;
+    hdr.thiszone = 0;
+    hdr.sigfigs = 0;
+    hdr.snaplen = SNAPLEN;
+    hdr.linktype = LINKTYPE_ETHERNET;
+    struct iovec iov = { &hdr, sizeof(hdr) };
+    return write_all(&iov, 1);
+  }
+
+  /**
+   * Add a packet to the file; it is written once BATCH packets are pending,
+   * or on flush().
+   *
+   * @param data The stored bytes of the packet.
+   * @param len The number of stored bytes (at most header_batch::MAX_HDR_LEN).
+   * @param orig_len The length of the packet on the wire.
+   * @param time_ns The capture time of the packet, in nanoseconds since the
+   *  epoch.
+   * @return 0 on success, an errno value otherwise.
+   */
+  int add(const unsigned char* data, uint32_t len, uint32_t orig_len,
+          uint64_t time_ns) {
+    if (len > header_batch::MAX_HDR_LEN) {
+      return EINVAL;
+    }
+    record_header& hdr = headers_[num_pending_];
+    hdr.ts_sec = time_ns / 1000000000;
+    hdr.ts_nsec = time_ns % 1000000000;
+    hdr.incl_len = len;
+    hdr.orig_len = len > orig_len ? len : orig_len;
+    memcpy(data_[num_pending_], data, len);
+    num_pending_++;
+    num_records_++;
+    num_bytes_ += sizeof(record_header) + len;
+    return num_pending_ == BATCH ? flush() : 0;
+  }
+
+  /**
+   * Write the pending packets.
+   *
+   * @return 0 on success, an errno value otherwise.
+   */
+  int flush() {
+    struct iovec iov[2 * BATCH];
+    for (uint32_t i = 0; i < num_pending_; i++) {
+      iov[2 * i].iov_base = &headers_[i];
+      iov[2 * i].iov_len = sizeof(record_header);
+      iov[2 * i + 1].iov_base = data_[i];
+      iov[2 * i + 1].iov_len = headers_[i].incl_len;
+    }
+    uint32_t n = num_pending_;
+    num_pending_ = 0;
+    return n != 0 ? write_all(iov, 2 * n) : 0;
+  }
+
+  /**
+   * Write the pending packets and close the file.
+   *
+   * @return 0 on success, an errno value otherwise.
+   */
+  int close() {
+    if (fd_ < 0) {
+      return 0;
+    }
+    int err = flush();
+    if (::close(fd_) != 0 && err == 0) {
+      err = errno;
+    }
+    fd_ = -1;
+    return err;
+  }
+
+  /**
+   * Get the number of packets added.
+   */
+  uint64_t num_records() const {
+    return num_records_;
+  }
+
+  /**
+   * Get the number of bytes of packet records added, excluding the file
+   * header.
+   */
+  uint64_t num_bytes() const {
+    return num_bytes_;
+  }
+
+ private:
+  struct file_header {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+  };
+
+  struct record_header {
+    uint32_t ts_sec;
+    uint32_t ts_nsec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+  };
+
+  /* Writes all of iov, resuming after short writes */
+  int write_all(struct iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+      ssize_t written = writev(fd_, iov, iovcnt);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return errno;
+      }
+      while (iovcnt > 0 && (size_t) written >= iov->iov_len) {
+        written -= iov->iov_len;
+        iov++;
+        iovcnt--;
+      }
+      if (iovcnt > 0) {
+        iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+        iov->iov_len -= written;
+      }
+    }
+    return 0;
+  }
+
+  int fd_;
+  uint32_t num_pending_;
+  uint64_t num_records_;
+  uint64_t num_bytes_;
+  record_header headers_[BATCH];
+  unsigned char data_[BATCH][header_batch::MAX_HDR_LEN];
+};
+
+}
+
+#endif /* NETPLAY_PCAPWRITER_H_ */
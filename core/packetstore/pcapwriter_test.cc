@@ -0,0 +1,79 @@
+#include "pcapwriter.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+std::vector<unsigned char> ReadFile(const char *path) {
+  std::vector<unsigned char> contents;
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    return contents;
+  }
+  unsigned char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    contents.insert(contents.end(), buf, buf + n);
+  }
+  fclose(f);
+  return contents;
+}
+
+uint32_t Load32(const std::vector<unsigned char> &contents, size_t offset) {
+  uint32_t v;
+  memcpy(&v, &contents[offset], sizeof(v));
+  return v;
+}
+
+TEST(PcapWriterTest, WritesRecordsInBatches) {
+  const uint32_t kRecords = 3 * netplay::pcap_writer::BATCH + 5;
+  char path[] = "/tmp/pcapwriter_test.XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_LE(0, fd);
+  close(fd);
+
+  // Record i holds i + 1 bytes of value i, of a packet 1000 bytes long
+  netplay::pcap_writer writer;
+  ASSERT_EQ(0, writer.open(path));
+  unsigned char data[netplay::header_batch::MAX_HDR_LEN];
+  for (uint32_t i = 0; i < kRecords; i++) {
+    uint32_t len = i % netplay::header_batch::MAX_HDR_LEN + 1;
+    memset(data, i, len);
+    ASSERT_EQ(0, writer.add(data, len, 1000, 5000000000ULL + i));
+  }
+  ASSERT_EQ(kRecords, writer.num_records());
+  ASSERT_EQ(0, writer.close());
+
+  std::vector<unsigned char> contents = ReadFile(path);
+  unlink(path);
+  ASSERT_EQ(24 + writer.num_bytes(), contents.size());
+  ASSERT_EQ(0xa1b23c4dU, Load32(contents, 0));
+  ASSERT_EQ(1U, Load32(contents, 20));
+
+  size_t offset = 24;
+  for (uint32_t i = 0; i < kRecords; i++) {
+    uint32_t len = i % netplay::header_batch::MAX_HDR_LEN + 1;
+    ASSERT_EQ(5U, Load32(contents, offset));
+    ASSERT_EQ(i, Load32(contents, offset + 4));
+    ASSERT_EQ(len, Load32(contents, offset + 8));
+    ASSERT_EQ(1000U, Load32(contents, offset + 12));
+    offset += 16;
+    for (uint32_t j = 0; j < len; j++) {
+      ASSERT_EQ((unsigned char) i, contents[offset + j]);
+    }
+    offset += len;
+  }
+}
+
+TEST(PcapWriterTest, ReportsErrors) {
+  netplay::pcap_writer writer;
+  ASSERT_EQ(ENOENT, writer.open("/nonexistent/dir/out.pcap"));
+  ASSERT_EQ(0, writer.close());
+}
+
+}  // namespace (unnamed)
@@ -0,0 +1,246 @@
+#ifndef SLOG_SEGMENT_H_
+#define SLOG_SEGMENT_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "allocator.h"
+#include "exceptions.h"
+
+namespace slog {
+
+/**
+ * Bucket allocator that maps each bucket of a log to a segment file.
+ *
+ * Bucket n of the log is stored in file <dir>/<name>.<n>, which is created
+ * (zero-filled) on first use and mapped shared, so the contents of the log
+ * survive the log. A log reopened on the same files sees the contents left by
+ * its earlier instance.
+ *
+ * Once bucket n + 1 is allocated, bucket n is considered sealed, and is
+ * flushed to its file by a background thread; sync() flushes all mapped
+ * buckets. Released buckets are unmapped and their files removed.
+ */
+class segment_allocator : public bucket_allocator {
+ public:
+  segment_allocator(const std::string& dir, const std::string& name)
+      : dir_(dir),
+        name_(name),
+        stop_(false) {
+    syncer_ = std::thread([this] {sync_sealed();});
+  }
+
+  ~segment_allocator() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    sealed_cv_.notify_one();
+    syncer_.join();
+  }
+
+  void* allocate(uint64_t bucket_idx, size_t size) {
+    std::string path = segment_path(bucket_idx);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+      throw segment_exception(path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0
+        || ((size_t) st.st_size < size && ftruncate(fd, size) != 0)) {
+      close(fd);
+      throw segment_exception(path);
+    }
+
+    void* bucket = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (bucket == MAP_FAILED) {
+      throw segment_exception(path);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& seg : mapped_) {
+      if (seg.second.bucket_idx + 1 == bucket_idx) {
+        sealed_.push_back(std::make_pair(seg.first, seg.second.size));
+      }
+    }
+    mapped_[bucket] = segment { bucket_idx, size };
+    sealed_cv_.notify_one();
+    return bucket;
+  }
+
+  void deallocate(void* bucket, size_t size) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      mapped_.erase(bucket);
+    }
+    munmap(bucket, size);
+  }
+
+  std::function<void()> release(uint64_t bucket_idx, void* bucket,
+                                size_t size) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      mapped_.erase(bucket);
+    }
+    std::string path = segment_path(bucket_idx);
+    return [bucket, size, path] {
+      munmap(bucket, size);
+      unlink(path.c_str());
+    };
+  }
+
+  /**
+   * Synchronously flush all mapped buckets to their files.
+   *
+   * @return true if all buckets were flushed, false otherwise.
+   */
+  bool sync() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool ok = true;
+    for (auto& seg : mapped_) {
+      ok = (msync(seg.first, seg.second.size, MS_SYNC) == 0) && ok;
+    }
+    return ok;
+  }
+
+  /**
+   * Remove the segment files of all buckets outside [beg_idx, end_idx).
+   * Must be called before any bucket is allocated.
+   *
+   * @param beg_idx The first bucket to keep.
+   * @param end_idx One past the last bucket to keep.
+   */
+  void remove_outside(uint64_t beg_idx, uint64_t end_idx) {
+    DIR* dir = opendir(dir_.c_str());
+    if (dir == NULL) {
+      return;
+    }
+    std::string prefix = name_ + ".";
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+      const char* file = entry->d_name;
+      if (strncmp(file, prefix.c_str(), prefix.size()) != 0) {
+        continue;
+      }
+      char* end;
+      uint64_t bucket_idx = strtoull(file + prefix.size(), &end, 10);
+      if (*end == '\0' && end != file + prefix.size()
+          && (bucket_idx < beg_idx || bucket_idx >= end_idx)) {
+        unlink(segment_path(bucket_idx).c_str());
+      }
+    }
+    closedir(dir);
+  }
+
+ private:
+  struct segment {
+    uint64_t bucket_idx;
+    size_t size;
+  };
+
+  std::string segment_path(uint64_t bucket_idx) const {
+    return dir_ + "/" + name_ + "." + std::to_string(bucket_idx);
+  }
+
+  // Flushes sealed buckets in the background. A sealed bucket may be unmapped
+  // (and its address reused) before it is flushed, which only makes msync
+  // fail or flush an unrelated mapping.
+  void sync_sealed() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      sealed_cv_.wait(lock, [this] {return stop_ || !sealed_.empty();});
+      if (stop_) {
+        return;
+      }
+      std::pair<void*, size_t> seg = sealed_.front();
+      sealed_.pop_front();
+      lock.unlock();
+      msync(seg.first, seg.second, MS_SYNC);
+      lock.lock();
+    }
+  }
+
+  const std::string dir_;
+  const std::string name_;
+
+  std::mutex mutex_;
+  std::map<void*, segment> mapped_;
+  std::deque<std::pair<void*, size_t>> sealed_;
+  std::condition_variable sealed_cv_;
+  bool stop_;
+  std::thread syncer_;
+};
+
+/**
+ * A small set of named counters, stored durably in a file. The file is
+ * replaced atomically on each save, so a reader sees either the old or the
+ * new set.
+ */
+class log_manifest {
+ public:
+  typedef std::map<std::string, uint64_t> entries;
+
+  /**
+   * Load the manifest at path.
+   *
+   * @param path The path of the manifest.
+   * @param values Populated with the counters in the manifest.
+   * @return true if the manifest exists and was read, false otherwise.
+   */
+  static bool load(const std::string& path, entries& values) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (f == NULL) {
+      return false;
+    }
+    char key[64];
+    unsigned long long value;
+    while (fscanf(f, "%63s %llu", key, &value) == 2) {
+      values[key] = value;
+    }
+    fclose(f);
+    return true;
+  }
+
+  /**
+   * Durably replace the manifest at path.
+   *
+   * @param path The path of the manifest.
+   * @param values The counters to store.
+   * @return true if the manifest was saved, false otherwise.
+   */
+  static bool save(const std::string& path, const entries& values) {
+    std::string tmp_path = path + ".tmp";
+    FILE* f = fopen(tmp_path.c_str(), "w");
+    if (f == NULL) {
+      return false;
+    }
+    for (auto& entry : values) {
+      fprintf(f, "%s %llu\n", entry.first.c_str(),
+              (unsigned long long) entry.second);
+    }
+    bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+    return ok && rename(tmp_path.c_str(), path.c_str()) == 0;
+  }
+};
+
+}
+
+#endif /* SLOG_SEGMENT_H_ */
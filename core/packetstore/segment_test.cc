@@ -0,0 +1,124 @@
+#include "segment.h"
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "monolog.h"
+
+namespace {
+
+class SegmentTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    char dir[] = "/tmp/segment_test.XXXXXX";
+    dir_ = mkdtemp(dir);
+  }
+
+  virtual void TearDown() {
+    DIR *d = opendir(dir_.c_str());
+    struct dirent *entry;
+    while (d != NULL && (entry = readdir(d)) != NULL) {
+      unlink(path(entry->d_name).c_str());
+    }
+    if (d != NULL) {
+      closedir(d);
+    }
+    rmdir(dir_.c_str());
+  }
+
+  std::string path(const std::string &file) const {
+    return dir_ + "/" + file;
+  }
+
+  bool exists(const std::string &file) const {
+    return access(path(file).c_str(), F_OK) == 0;
+  }
+
+  std::string dir_;
+};
+
+TEST_F(SegmentTest, ContentsSurviveTheLog) {
+  {
+    slog::segment_allocator segments(dir_, "log");
+    slog::__monolog_base<uint64_t, 8, 4> log(&segments);
+    for (uint64_t i = 0; i < 100; i++) {
+      log.set(i, i * 3);
+    }
+    ASSERT_TRUE(segments.sync());
+  }
+  ASSERT_TRUE(exists("log.0"));
+  ASSERT_TRUE(exists("log.6"));  // 16 entries per bucket
+  ASSERT_FALSE(exists("log.7"));
+
+  slog::segment_allocator segments(dir_, "log");
+  slog::__monolog_base<uint64_t, 8, 4> log(&segments);
+  log.ensure_alloc(0, 100);
+  for (uint64_t i = 0; i < 100; i++) {
+    ASSERT_EQ(i * 3, log.get(i));
+  }
+}
+
+TEST_F(SegmentTest, ReleaseRemovesSegments) {
+  slog::segment_allocator segments(dir_, "log");
+  slog::__monolog_linear_base<uint8_t, 4, 4096> log(&segments);
+  const char data[] = "spans two blocks";
+  log.write(4096 - 4, reinterpret_cast<const uint8_t *>(data), sizeof(data));
+  ASSERT_TRUE(exists("log.0"));
+  ASSERT_TRUE(exists("log.1"));
+
+  std::vector<std::function<void()>> frees;
+  log.release_below(4096, [&](std::function<void()> free_block) {
+    frees.push_back(free_block);
+  });
+  ASSERT_EQ(1U, frees.size());
+  ASSERT_TRUE(exists("log.0"));
+  frees[0]();
+  ASSERT_FALSE(exists("log.0"));
+
+  char out[sizeof(data)];
+  log.read(4096, reinterpret_cast<uint8_t *>(out), sizeof(data) - 4);
+  ASSERT_STREQ(data + 4, out);
+}
+
+TEST_F(SegmentTest, RemoveOutside) {
+  {
+    slog::segment_allocator segments(dir_, "log");
+    slog::__monolog_linear_base<uint8_t, 8, 4096> log(&segments);
+    log.ensure_alloc(0, 6 * 4096);
+  }
+  slog::segment_allocator other(dir_, "other");
+  other.deallocate(other.allocate(0, 4096), 4096);
+
+  slog::segment_allocator segments(dir_, "log");
+  segments.remove_outside(2, 4);
+  ASSERT_FALSE(exists("log.0"));
+  ASSERT_FALSE(exists("log.1"));
+  ASSERT_TRUE(exists("log.2"));
+  ASSERT_TRUE(exists("log.3"));
+  ASSERT_FALSE(exists("log.4"));
+  ASSERT_FALSE(exists("log.5"));
+  ASSERT_TRUE(exists("other.0"));
+}
+
+TEST_F(SegmentTest, Manifest) {
+  slog::log_manifest::entries entries;
+  ASSERT_FALSE(slog::log_manifest::load(path("MANIFEST"), entries));
+
+  entries["num_records"] = 1ULL << 40;
+  entries["size"] = 12345;
+  ASSERT_TRUE(slog::log_manifest::save(path("MANIFEST"), entries));
+  ASSERT_FALSE(exists("MANIFEST.tmp"));
+
+  slog::log_manifest::entries loaded;
+  ASSERT_TRUE(slog::log_manifest::load(path("MANIFEST"), loaded));
+  ASSERT_EQ(entries, loaded);
+}
+
+}  // namespace (unnamed)
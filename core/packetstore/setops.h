@@ -0,0 +1,158 @@
+#ifndef SLOG_SETOPS_H_
+#define SLOG_SETOPS_H_
+
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace slog {
+
+/**
+ * Sorts and removes duplicates from a vector of record ids. Posting lists are
+ * mostly sorted already, so the sort is skipped when possible.
+ */
+static inline void sort_unique(std::vector<uint64_t>& ids) {
+  if (!std::is_sorted(ids.begin(), ids.end())) {
+    std::sort(ids.begin(), ids.end());
+  }
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+}
+
+/**
+ * Membership tests against a sorted vector of record ids, for a stream of
+ * mostly increasing probes.
+ *
+ * Keeps a finger into the vector and gallops forward from it, so a sorted
+ * stream of m probes into a set of n ids costs O(m log(n/m)) comparisons,
+ * which pays off when the probes are the smaller side (m <= n); a larger
+ * stream is better galloped through by the set instead. Probes that go
+ * backwards fall back to a binary search.
+ */
+class sorted_probe {
+ public:
+  sorted_probe(const std::vector<uint64_t>& ids)
+      : ids_(ids),
+        pos_(0) {
+  }
+
+  bool contains(uint64_t id) {
+    const size_t n = ids_.size();
+    if (pos_ < n && ids_[pos_] < id) {
+      /* ids_[pos_ + bound / 2] < id <= ids_[pos_ + bound] */
+      size_t bound = 1;
+      while (pos_ + bound < n && ids_[pos_ + bound] < id) {
+        bound <<= 1;
+      }
+      size_t lo = pos_ + (bound >> 1) + 1;
+      size_t hi = std::min(pos_ + bound + 1, n);
+      pos_ = std::lower_bound(ids_.begin() + lo, ids_.begin() + hi, id)
+          - ids_.begin();
+    } else if (pos_ > 0 && ids_[pos_ - 1] >= id) {
+      pos_ = std::lower_bound(ids_.begin(), ids_.begin() + pos_, id)
+          - ids_.begin();
+    }
+    return pos_ < n && ids_[pos_] == id;
+  }
+
+ private:
+  const std::vector<uint64_t>& ids_;
+  size_t pos_;
+};
+
+/**
+ * Bitmap over the range of a sorted vector of record ids; used in place of a
+ * sorted_probe when the ids are dense within their range.
+ */
+class rid_bitmap {
+ public:
+  rid_bitmap(const std::vector<uint64_t>& ids)
+      : base_(ids.empty() ? 0 : ids.front()),
+        last_(ids.empty() ? 0 : ids.back()),
+        bits_(ids.empty() ? 0 : ((last_ - base_) >> 6) + 1, 0) {
+    for (uint64_t id : ids) {
+      bits_[(id - base_) >> 6] |= 1ULL << ((id - base_) & 63);
+    }
+  }
+
+  /* Whether a bitmap is cheaper to build than probing a sorted vector */
+  static bool is_dense(const std::vector<uint64_t>& ids) {
+    return !ids.empty() && ((ids.back() - ids.front()) >> 6) <= ids.size();
+  }
+
+  bool contains(uint64_t id) const {
+    if (id < base_ || id > last_) {
+      return false;
+    }
+    return bits_[(id - base_) >> 6] & (1ULL << ((id - base_) & 63));
+  }
+
+ private:
+  uint64_t base_;
+  uint64_t last_;
+  std::vector<uint64_t> bits_;
+};
+
+/**
+ * Merges consecutive sorted runs of record ids, in place, into one sorted
+ * vector without duplicates (k-way union); run i ends at ends[i], and the
+ * last run ends at ids.size(). Costs O(N log k) for N ids in k runs.
+ */
+static inline void merge_runs(std::vector<uint64_t>& ids,
+                              const std::vector<size_t>& ends) {
+  if (ends.size() <= 1) {
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    return;
+  }
+
+  /* Heads of the runs, as (id, run) pairs */
+  typedef std::pair<uint64_t, size_t> run_head;
+  std::priority_queue<run_head, std::vector<run_head>,
+                      std::greater<run_head>> heads;
+  std::vector<size_t> pos(ends.size());
+  size_t beg = 0;
+  for (size_t i = 0; i < ends.size(); i++) {
+    pos[i] = beg;
+    if (beg < ends[i]) {
+      heads.push(run_head(ids[beg], i));
+    }
+    beg = ends[i];
+  }
+
+  std::vector<uint64_t> merged;
+  merged.reserve(ids.size());
+  while (!heads.empty()) {
+    run_head head = heads.top();
+    heads.pop();
+    if (merged.empty() || merged.back() != head.first) {
+      merged.push_back(head.first);
+    }
+    if (++pos[head.second] < ends[head.second]) {
+      heads.push(run_head(ids[pos[head.second]], head.second));
+    }
+  }
+  ids.swap(merged);
+}
+
+/**
+ * Merges a sorted vector of record ids into another (set union).
+ */
+static inline void union_sorted(std::vector<uint64_t>& acc,
+                                const std::vector<uint64_t>& ids) {
+  if (acc.empty()) {
+    acc = ids;
+    return;
+  }
+  std::vector<uint64_t> merged;
+  merged.reserve(acc.size() + ids.size());
+  std::set_union(acc.begin(), acc.end(), ids.begin(), ids.end(),
+                 std::back_inserter(merged));
+  acc.swap(merged);
+}
+
+}
+
+#endif /* SLOG_SETOPS_H_ */
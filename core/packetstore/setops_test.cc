@@ -0,0 +1,103 @@
+#include "setops.h"
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+TEST(SetOpsTest, SortUnique) {
+  std::vector<uint64_t> ids = {5, 1, 3, 3, 9, 1};
+  slog::sort_unique(ids);
+  ASSERT_EQ(std::vector<uint64_t>({1, 3, 5, 9}), ids);
+
+  std::vector<uint64_t> sorted = {1, 1, 2, 4, 4, 4};
+  slog::sort_unique(sorted);
+  ASSERT_EQ(std::vector<uint64_t>({1, 2, 4}), sorted);
+}
+
+TEST(SetOpsTest, SortedProbe) {
+  std::vector<uint64_t> ids;
+  for (uint64_t id = 0; id < 10000; id += 3) {
+    ids.push_back(id);
+  }
+
+  // Increasing probes, both dense and with long gallops
+  slog::sorted_probe probe(ids);
+  for (uint64_t id = 0; id < 200; id++) {
+    ASSERT_EQ(id % 3 == 0, probe.contains(id)) << id;
+  }
+  for (uint64_t id = 200; id < 10100; id += 97) {
+    ASSERT_EQ(id % 3 == 0, probe.contains(id)) << id;
+  }
+
+  // Probes that go backwards
+  ASSERT_TRUE(probe.contains(9));
+  ASSERT_FALSE(probe.contains(10));
+  ASSERT_TRUE(probe.contains(9999));
+  ASSERT_TRUE(probe.contains(0));
+
+  std::vector<uint64_t> empty;
+  slog::sorted_probe empty_probe(empty);
+  ASSERT_FALSE(empty_probe.contains(0));
+}
+
+TEST(SetOpsTest, RidBitmap) {
+  std::vector<uint64_t> sparse = {1, 1000, 100000};
+  ASSERT_FALSE(slog::rid_bitmap::is_dense(sparse));
+  ASSERT_FALSE(slog::rid_bitmap::is_dense(std::vector<uint64_t>()));
+
+  std::vector<uint64_t> ids;
+  for (uint64_t id = 100; id < 5000; id += 7) {
+    ids.push_back(id);
+  }
+  ASSERT_TRUE(slog::rid_bitmap::is_dense(ids));
+  slog::rid_bitmap bitmap(ids);
+  for (uint64_t id = 0; id < 5100; id++) {
+    ASSERT_EQ(id >= 100 && id < 5000 && (id - 100) % 7 == 0,
+              bitmap.contains(id)) << id;
+  }
+}
+
+TEST(SetOpsTest, UnionSorted) {
+  std::vector<uint64_t> acc;
+  slog::union_sorted(acc, {2, 4, 6});
+  ASSERT_EQ(std::vector<uint64_t>({2, 4, 6}), acc);
+  slog::union_sorted(acc, {1, 4, 7});
+  ASSERT_EQ(std::vector<uint64_t>({1, 2, 4, 6, 7}), acc);
+  slog::union_sorted(acc, {});
+  ASSERT_EQ(std::vector<uint64_t>({1, 2, 4, 6, 7}), acc);
+}
+
+TEST(SetOpsTest, MergeRuns) {
+  // Overlapping runs, with duplicates within and across them
+  std::vector<uint64_t> ids = {1, 5, 9, 9, 2, 5, 10, 0, 11};
+  slog::merge_runs(ids, {4, 7, 9});
+  ASSERT_EQ(std::vector<uint64_t>({0, 1, 2, 5, 9, 10, 11}), ids);
+
+  // A single run
+  std::vector<uint64_t> single = {1, 1, 3};
+  slog::merge_runs(single, {3});
+  ASSERT_EQ(std::vector<uint64_t>({1, 3}), single);
+
+  std::vector<uint64_t> empty;
+  slog::merge_runs(empty, {});
+  ASSERT_TRUE(empty.empty());
+
+  // Many interleaved runs
+  std::vector<uint64_t> interleaved;
+  std::vector<size_t> ends;
+  for (uint64_t run = 0; run < 100; run++) {
+    for (uint64_t id = run; id < 10000; id += 100) {
+      interleaved.push_back(id);
+    }
+    ends.push_back(interleaved.size());
+  }
+  slog::merge_runs(interleaved, ends);
+  ASSERT_EQ(10000U, interleaved.size());
+  for (uint64_t id = 0; id < 10000; id++) {
+    ASSERT_EQ(id, interleaved[id]);
+  }
+}
+
+}  // namespace (unnamed)
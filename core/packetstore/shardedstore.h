@@ -0,0 +1,1035 @@
+#ifndef NETPLAY_SHARDEDSTORE_H_
+#define NETPLAY_SHARDEDSTORE_H_
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "aggregate.h"
+#include "packetstore.h"
+
+namespace netplay {
+
+/**
+ * A packet store split into shards, each a packet store with its own
+ * data-log, offset-log and indexes. Each shard is written by a single thread
+ * (e.g., one per worker), so writers share no cache lines on the insert path.
+ *
+ * Records are identified by global record ids, which interleave the record
+ * ids of the shards. With more than one shard, each stored record is
+ * prefixed with the time it was inserted at, which orders records across
+ * shards; the prefix is hidden from extract(). Queries are evaluated on all
+ * shards in parallel, and their results merged in global time order.
+ */
+class sharded_packet_store {
+ public:
+  /* Stream id that selects no stream in filter() */
+  static const uint32_t NO_STREAM = UINT32_MAX;
+
+  /* Range of insertion times, on the clock passed to insert_packets(); both
+   * ends inclusive. Resolved at slog::time_index::BUCKET_NS granularity. */
+  struct time_window {
+    time_window(uint64_t beg = 0, uint64_t end = UINT64_MAX)
+        : beg_ns(beg),
+          end_ns(end) {
+    }
+
+    uint64_t beg_ns;
+    uint64_t end_ns;
+  };
+
+  /* Size of the insertion time prefixed to records with several shards */
+  static const uint32_t TIME_PREFIX_LEN = sizeof(uint64_t);
+
+  /**
+   * Handle that inserts into a single shard. Each shard **must** be written
+   * through a single handle, by a single thread.
+   */
+  class handle : public packet_store::handle {
+   public:
+    handle(sharded_packet_store& store, uint32_t shard)
+        : packet_store::handle(*store.shards_[shard]),
+          store_(store),
+          shard_(shard),
+          written_(false) {
+    }
+
+    /**
+     * Insert a batch of parsed packet headers into the shard of the handle.
+     *
+     * @param pkts The packets, starting at their Ethernet headers.
+     * @param hdrs The parsed headers of the packets.
+     * @param num_pkts The number of packets (at most header_batch::MAX_BATCH).
+     * @param now_ns The insertion time, in nanoseconds; must not decrease
+     *  across calls.
+     * @return The global record id of the first packet in the batch.
+     */
+    uint64_t insert_packets(const unsigned char* const * pkts,
+                            const header_batch& hdrs, uint32_t num_pkts,
+                            uint64_t now_ns) {
+      if (!written_) {
+        store_.activate(shard_);
+        written_ = true;
+      }
+      if (!store_.stamped_) {
+        return store_.global_id(shard_,
+            packet_store::handle::insert_packets(pkts, hdrs, num_pkts,
+                                                 now_ns));
+      }
+
+      const unsigned char* records[header_batch::MAX_BATCH];
+      uint16_t record_lens[header_batch::MAX_BATCH];
+      for (uint32_t i = 0; i < num_pkts; i++) {
+        memcpy(staged_[i], &now_ns, TIME_PREFIX_LEN);
+        memcpy(staged_[i] + TIME_PREFIX_LEN, pkts[i], hdrs.hdr_len[i]);
+        records[i] = staged_[i];
+        record_lens[i] = TIME_PREFIX_LEN + hdrs.hdr_len[i];
+      }
+      return store_.global_id(shard_,
+          packet_store::handle::insert_packets(records, record_lens, hdrs,
+                                               num_pkts, now_ns));
+    }
+
+   private:
+    sharded_packet_store& store_;
+    uint32_t shard_;
+    bool written_;
+    unsigned char staged_[header_batch::MAX_BATCH]
+                         [TIME_PREFIX_LEN + header_batch::MAX_HDR_LEN];
+  };
+
+  /**
+   * Cursor over a stream of one shard; see packet_store::subscription.
+   * Records are returned with their global ids, without their time prefix.
+   */
+  class subscription {
+   public:
+    subscription(packet_store::subscription* base, uint32_t shard,
+                 uint32_t num_shards)
+        : base_(base),
+          shard_(shard),
+          num_shards_(num_shards) {
+    }
+
+    ~subscription() {
+      delete base_;
+    }
+
+    int fd() const {
+      return base_->fd();
+    }
+
+    bool arm() {
+      return base_->arm();
+    }
+
+    size_t poll(std::vector<uint64_t>& ids, size_t max_records,
+                std::vector<std::string>* records = NULL) {
+      base_->poll(ids, max_records, records);
+      return to_global(ids);
+    }
+
+    size_t wait(std::vector<uint64_t>& ids, size_t max_records,
+                uint64_t timeout_ns, std::vector<std::string>* records = NULL) {
+      base_->wait(ids, max_records, timeout_ns, records);
+      return to_global(ids);
+    }
+
+   private:
+    size_t to_global(std::vector<uint64_t>& ids) const {
+      for (uint64_t& id : ids) {
+        id = id * num_shards_ + shard_;
+      }
+      return ids.size();
+    }
+
+    packet_store::subscription* base_;
+    uint32_t shard_;
+    uint32_t num_shards_;
+  };
+
+  /**
+   * Constructor to initialize the sharded packet store.
+   *
+   * @param num_shards The number of shards (at least 1).
+   */
+  explicit sharded_packet_store(uint32_t num_shards)
+      : stamped_(num_shards > 1),
+        max_bytes_(0),
+        active_(num_shards, false),
+        num_active_(0) {
+    for (uint32_t i = 0; i < num_shards; i++) {
+      shards_.push_back(new packet_store);
+      readers_.push_back(shards_[i]->get_handle());
+    }
+  }
+
+  ~sharded_packet_store() {
+    for (uint32_t i = 0; i < shards_.size(); i++) {
+      delete readers_[i];
+      delete shards_[i];
+    }
+  }
+
+  uint32_t num_shards() const {
+    return shards_.size();
+  }
+
+  /**
+   * Get a handle that inserts into a shard.
+   *
+   * @param shard The shard.
+   * @return A handle to the shard.
+   */
+  handle* get_handle(uint32_t shard) {
+    return new handle(*this, shard);
+  }
+
+  /**
+   * Get a handle that builds filters for queries on all shards; it must not
+   * be used for anything else.
+   */
+  packet_store::handle& filters() {
+    return *readers_[0];
+  }
+
+  /**
+   * Bound the memory used by the store, as packet_store::set_retention(). The
+   * size limit is on all shards together: it is split evenly among the
+   * shards that have been written to, and split again whenever a handle
+   * writes to a shard for the first time, so shards that are never written
+   * (e.g., those of idle workers) take no share. Must be called before any
+   * packet is inserted.
+   *
+   * @param max_bytes Maximum number of bytes retained; zero for no limit. At
+   *  most slog::log_store::MAX_RETAINED_BYTES.
+   * @param max_age_ns Maximum age of retained packets, in nanoseconds; zero
+   *  for no limit.
+   * @return true if the policy was set, false otherwise.
+   */
+  bool set_retention(uint64_t max_bytes, uint64_t max_age_ns) {
+    if (max_bytes > slog::log_store::MAX_RETAINED_BYTES) {
+      return false;
+    }
+
+    /* Epochs are sized for the smallest share, when all shards are written */
+    uint64_t shard_bytes = (max_bytes + shards_.size() - 1) / shards_.size();
+    for (packet_store* shard : shards_) {
+      if (!shard->set_retention(shard_bytes, max_age_ns)) {
+        return false;
+      }
+    }
+    max_bytes_ = max_bytes;
+    return true;
+  }
+
+  /**
+   * Set the allocator for the memory of all shards, as
+   * packet_store::set_allocator(). Must be called before any packet is
+   * inserted.
+   *
+   * @param allocator The allocator, or NULL to allocate on the heap.
+   * @return true if the allocator was set, false otherwise.
+   */
+  bool set_allocator(slog::bucket_allocator* allocator) {
+    for (packet_store* shard : shards_) {
+      if (!shard->set_allocator(allocator)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Keep the parsed header fields of all shards in columns as well, as
+   * packet_store::enable_columns(). Must be called before any packet is
+   * inserted.
+   *
+   * @return true if the header columns were enabled, false otherwise.
+   */
+  bool enable_columns() {
+    for (packet_store* shard : shards_) {
+      if (!shard->enable_columns()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Store the headers of TCP packets in all shards as deltas against an
+   * earlier header of their flow, as packet_store::enable_compression(); the
+   * time prefix is encoded as a difference as well. Must be called before
+   * any packet is inserted.
+   *
+   * @return true if compression was enabled, false otherwise.
+   */
+  bool enable_compression() {
+    for (packet_store* shard : shards_) {
+      if (!shard->enable_compression(stamped_ ? TIME_PREFIX_LEN : 0)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Index the packets of all shards by flow as well, as
+   * packet_store::enable_flows(). Must be called before any packet is
+   * inserted.
+   *
+   * @param max_flows Maximum number of flows indexed per shard.
+   * @return true if the flow index was enabled, false otherwise.
+   */
+  bool enable_flows(uint32_t max_flows = flow_index::DEFAULT_MAX_FLOWS) {
+    for (packet_store* shard : shards_) {
+      if (!shard->enable_flows(max_flows)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Persist all shards in directory dir, each in a subdirectory of its own,
+   * as packet_store::open(); restores the shards of a checkpointed store.
+   * Must be called after the retention policy is set, and before any packet
+   * is inserted.
+   *
+   * @param dir The directory to persist the store in.
+   * @return true if the store was opened, false otherwise; e.g., if dir
+   *  holds a store with a different number of shards.
+   * @throws slog::segment_exception if a segment cannot be mapped.
+   */
+  bool open(const std::string& dir) {
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      return false;
+    }
+    slog::log_manifest::entries manifest;
+    std::string manifest_path = dir + "/SHARDS";
+    if (slog::log_manifest::load(manifest_path, manifest)
+        && manifest["shards"] != shards_.size()) {
+      return false;
+    }
+    manifest["shards"] = shards_.size();
+    if (!slog::log_manifest::save(manifest_path, manifest)) {
+      return false;
+    }
+
+    for (uint32_t s = 0; s < shards_.size(); s++) {
+      std::string shard_dir = dir + "/shard" + std::to_string(s);
+      if (!shards_[s]->open(shard_dir, stamped_ ? TIME_PREFIX_LEN : 0)) {
+        return false;
+      }
+      /* Restored shards take their share of the size limit */
+      if (readers_[s]->num_records() != 0) {
+        activate(s);
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Checkpoint all shards of a persisted store, as
+   * packet_store::checkpoint().
+   *
+   * @return true if all shards were checkpointed, false otherwise.
+   */
+  bool checkpoint() {
+    bool ok = true;
+    for (packet_store* shard : shards_) {
+      ok = shard->checkpoint() && ok;
+    }
+    return ok;
+  }
+
+  /**
+   * Get an upper bound of the insertion times of all records, e.g., of
+   * those restored by open(); new records must be inserted at or after it
+   * to be ordered after them.
+   *
+   * @return The bound, on the clock passed to insert_packets(); 0 if the
+   *  store is empty.
+   */
+  uint64_t insert_end_ns() const {
+    uint64_t end_ns = 0;
+    for (const packet_store::handle* reader : readers_) {
+      end_ns = std::max(end_ns, reader->insert_end_ns());
+    }
+    return end_ns;
+  }
+
+  /**
+   * Get the counters of all flows; the counters of a flow seen by several
+   * shards are added up.
+   *
+   * @param summaries The counters of the flows.
+   * @return true if the flow index is enabled, false otherwise.
+   */
+  bool flows(std::vector<flow_summary>& summaries) const {
+    struct key_hash {
+      size_t operator()(const flow_key& key) const {
+        return key.hash();
+      }
+    };
+
+    summaries.clear();
+    std::unordered_map<flow_key, size_t, key_hash> positions;
+    std::vector<flow_summary> shard_flows;
+    for (const packet_store::handle* reader : readers_) {
+      if (!reader->flows(shard_flows)) {
+        return false;
+      }
+      if (readers_.size() == 1) {
+        summaries.swap(shard_flows);
+        break;
+      }
+      for (const flow_summary& f : shard_flows) {
+        auto it = positions.insert(std::make_pair(f.key, summaries.size()));
+        if (it.second) {
+          summaries.push_back(f);
+          continue;
+        }
+        flow_summary& merged = summaries[it.first->second];
+        merged.packets += f.packets;
+        merged.bytes += f.bytes;
+        merged.first_ns = std::min(merged.first_ns, f.first_ns);
+        merged.last_ns = std::max(merged.last_ns, f.last_ns);
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Add a stream of the packets matched by a filter on their headers to all
+   * shards; the filter does not see the time prefix.
+   *
+   * @param fn The filter function.
+   * @return The id of the newly created stream.
+   */
+  uint32_t add_stream(slog::packet_filter_function fn) {
+    uint32_t prefix_len = stamped_ ? TIME_PREFIX_LEN : 0;
+    uint32_t stream_id = 0;
+    for (packet_store* shard : shards_) {
+      stream_id = shard->add_stream(fn, prefix_len);
+    }
+    return stream_id;
+  }
+
+  uint32_t num_streams() const {
+    return readers_[0]->num_streams();
+  }
+
+  /**
+   * Subscribe to a stream of a shard; see subscription. A consumer of all
+   * the packets of a stream subscribes to it on every shard.
+   *
+   * @param shard The shard.
+   * @param stream_id The id of the stream.
+   * @param batch_delay_ns How long subscription::wait() holds off for a
+   *  full batch once a record is available.
+   * @param from_start Whether to return the records already in the stream.
+   * @return A subscription to the stream of the shard.
+   */
+  subscription* subscribe(uint32_t shard, uint32_t stream_id,
+                          uint64_t batch_delay_ns = 0,
+                          bool from_start = false) {
+    return new subscription(
+        readers_[shard]->subscribe(stream_id, batch_delay_ns, from_start,
+                                   stamped_ ? TIME_PREFIX_LEN : 0),
+        shard, shards_.size());
+  }
+
+  /**
+   * Get the number of shards that have been written to.
+   */
+  uint32_t num_active_shards() const {
+    std::lock_guard<std::mutex> lock(active_mutex_);
+    return num_active_;
+  }
+
+  uint64_t global_id(uint32_t shard, uint64_t record_id) const {
+    return record_id * shards_.size() + shard;
+  }
+
+  /**
+   * Get the total number of records inserted into the shards.
+   */
+  uint64_t num_records() const {
+    uint64_t num_records = 0;
+    for (packet_store::handle* reader : readers_) {
+      num_records += reader->num_records();
+    }
+    return num_records;
+  }
+
+  /**
+   * Get a snapshot of the store for filter(): the number of records with a
+   * single shard, and now_ns otherwise, which selects the records inserted
+   * before now_ns. Records still being inserted when the snapshot is taken
+   * may be missed by queries on it.
+   *
+   * @param now_ns The current time, on the clock passed to insert_packets().
+   * @return The snapshot.
+   */
+  uint64_t snapshot(uint64_t now_ns) const {
+    return stamped_ ? now_ns : readers_[0]->num_records();
+  }
+
+  /**
+   * Filter the records in a snapshot of all shards, in parallel. The query
+   * is evaluated on each shard with records in the snapshot by a thread of
+   * its own (the calling thread takes the first one), and the results are
+   * merged in time order.
+   * An empty query matches all records.
+   *
+   * Results may be paged: each shard stops after limit + 1 matches in time
+   * order, and the first match past the page becomes the cursor of the next
+   * one.
+   *
+   * @param results The global ids of the matching records, in time order.
+   * @param query The filter query.
+   * @param snapshot The snapshot, from snapshot().
+   * @param stream If not NO_STREAM, only the records in this stream match.
+   * @param window If given, only the records inserted within this time
+   *  window match.
+   * @param columns If not empty, only the records whose header columns match
+   *  these predicates match; requires enable_columns().
+   * @param flow If not NULL, only the packets of this flow (in both
+   *  directions) match; requires enable_flows().
+   * @param proto If not 0, only the IPv4 packets of this protocol match.
+   * @param cursor 0 to start, or the cursor returned for the previous page
+   *  of the same query and snapshot; only the records from there on match,
+   *  without matching the records before.
+   * @param limit The maximum number of results.
+   * @return The cursor of the next page; 0 if there are no more matches.
+   */
+  uint64_t filter(std::vector<uint64_t>& results,
+                  const slog::filter_query& query, uint64_t snapshot,
+                  uint32_t stream = NO_STREAM,
+                  const time_window& window = time_window(),
+                  const column_store::conjunction& columns =
+                      column_store::conjunction(),
+                  const flow_key* flow = NULL, uint8_t proto = 0,
+                  uint64_t cursor = 0, uint64_t limit = UINT64_MAX) {
+    /* A cursor is the global id of the first record of its page, plus one */
+    keyed_id from = cursor != 0 ? key_of(cursor - 1) : keyed_id(0, 0);
+    const keyed_id* start = cursor != 0 ? &from : NULL;
+
+    /* One match past the page tells whether there is a next one */
+    uint64_t shard_limit = limit == UINT64_MAX ? limit : limit + 1;
+    std::vector<std::vector<keyed_id>> matches(shards_.size());
+    for_each_shard(snapshot, [&](uint32_t s) {
+      filter_shard(s, query, snapshot, stream, window, columns, flow, proto,
+                   start, shard_limit, matches[s]);
+    });
+
+    /* Each shard's results are in time order already */
+    std::vector<keyed_id> merged;
+    for (std::vector<keyed_id>& shard_matches : matches) {
+      size_t mid = merged.size();
+      merged.insert(merged.end(), shard_matches.begin(), shard_matches.end());
+      std::inplace_merge(merged.begin(), merged.begin() + mid, merged.end());
+    }
+
+    uint64_t next_cursor = 0;
+    if (merged.size() > limit) {
+      next_cursor = merged[limit].second + 1;
+      merged.resize(limit);
+    }
+
+    results.clear();
+    results.reserve(merged.size());
+    for (const keyed_id& match : merged) {
+      results.push_back(match.second);
+    }
+    return next_cursor;
+  }
+
+  /**
+   * Count the records in a snapshot of all shards that match a query, as
+   * filter() without a limit. If the query has no predicates, the count is
+   * taken from the range of record ids in the snapshot of each shard,
+   * without visiting the records.
+   *
+   * @param query The filter query.
+   * @param snapshot The snapshot, from snapshot().
+   * @param stream If not NO_STREAM, only the records in this stream match.
+   * @param window If given, only the records inserted within this time
+   *  window match.
+   * @param columns If not empty, only the records whose header columns match
+   *  these predicates match; requires enable_columns().
+   * @param flow If not NULL, only the packets of this flow (in both
+   *  directions) match; requires enable_flows().
+   * @param proto If not 0, only the IPv4 packets of this protocol match.
+   * @param cursor 0 to start, or a cursor returned by filter() for the same
+   *  query and snapshot; only the records from there on are counted.
+   * @return The number of matching records.
+   */
+  uint64_t count(const slog::filter_query& query, uint64_t snapshot,
+                 uint32_t stream = NO_STREAM,
+                 const time_window& window = time_window(),
+                 const column_store::conjunction& columns =
+                     column_store::conjunction(),
+                 const flow_key* flow = NULL, uint8_t proto = 0,
+                 uint64_t cursor = 0) {
+    keyed_id from = cursor != 0 ? key_of(cursor - 1) : keyed_id(0, 0);
+    const keyed_id* start = cursor != 0 ? &from : NULL;
+    bool all = query.empty() && stream == NO_STREAM && columns.empty()
+        && flow == NULL && proto == 0;
+
+    std::vector<uint64_t> counts(shards_.size(), 0);
+    for_each_shard(snapshot, [&](uint32_t s) {
+      uint64_t first_rid = start != NULL ? shard_cursor(s, *start) : 0;
+      if (all) {
+        uint64_t min_rid, max_rid;
+        if (shard_range(s, snapshot, window, first_rid, min_rid, max_rid)) {
+          counts[s] = max_rid - min_rid;
+        }
+        return;
+      }
+      std::vector<uint64_t> record_ids;
+      match_shard(s, query, snapshot, stream, window, columns, flow, proto,
+                  first_rid, UINT64_MAX, record_ids);
+      counts[s] = record_ids.size();
+    });
+
+    uint64_t total = 0;
+    for (uint64_t c : counts) {
+      total += c;
+    }
+    return total;
+  }
+
+  /**
+   * Aggregate the records in a snapshot of all shards that match a query,
+   * in parallel, as filter(). Each shard reads its matching headers in
+   * batches into an aggregator of its own, and the aggregators are merged.
+   *
+   * @param result The aggregator to add the matching records to.
+   * @param query The filter query.
+   * @param snapshot The snapshot, from snapshot().
+   * @param stream If not NO_STREAM, only the records in this stream match.
+   * @param window If given, only the records inserted within this time
+   *  window match.
+   * @param columns If not empty, only the records whose header columns match
+   *  these predicates match; requires enable_columns().
+   * @param flow If not NULL, only the packets of this flow (in both
+   *  directions) match; requires enable_flows().
+   */
+  void aggregate(aggregator& result, const slog::filter_query& query,
+                 uint64_t snapshot, uint32_t stream = NO_STREAM,
+                 const time_window& window = time_window(),
+                 const column_store::conjunction& columns =
+                     column_store::conjunction(),
+                 const flow_key* flow = NULL) {
+    std::vector<aggregator> partials(
+        shards_.size(), aggregator(result.group_by(), result.proto()));
+    for_each_shard(snapshot, [&](uint32_t s) {
+      aggregate_shard(s, query, snapshot, stream, window, columns, flow,
+                      partials[s]);
+    });
+
+    for (const aggregator& partial : partials) {
+      result.merge(partial);
+    }
+  }
+
+  /**
+   * Find the position of a record in (or after which it would be in) the
+   * results of filter(). If the record has been dropped by the retention
+   * policy, resumes from the oldest record left in its shard.
+   *
+   * @param results The results of filter().
+   * @param id The global id of the record.
+   * @return The position of the first result at or after the record.
+   */
+  size_t seek(const std::vector<uint64_t>& results, uint64_t id) const {
+    if (!stamped_) {
+      return std::lower_bound(results.begin(), results.end(), id)
+          - results.begin();
+    }
+
+    keyed_id key = key_of(id);
+    return std::lower_bound(results.begin(), results.end(), key,
+                            [this](uint64_t result, const keyed_id& k) {
+                              keyed_id rk(0, result);
+                              time_of(result % shards_.size(),
+                                      result / shards_.size(), rk.first);
+                              return rk < k;
+                            })
+        - results.begin();
+  }
+
+  /**
+   * Extract a portion of a record, as log_store::extract().
+   *
+   * @param record The (pre-allocated) record-buffer.
+   * @param id The global id of the record.
+   * @param offset The offset into the record to begin extracting.
+   * @param length The number of bytes to extract. Updated with the actual
+   *  number of bytes extracted.
+   * @return true if the extract is successful, false otherwise.
+   */
+  bool extract(unsigned char* record, uint64_t id, uint32_t offset,
+               uint32_t& length) const {
+    uint32_t prefix_len = stamped_ ? TIME_PREFIX_LEN : 0;
+    return readers_[id % shards_.size()]->extract(
+        record, id / shards_.size(), prefix_len + offset, length);
+  }
+
+  /**
+   * Fetch a record along with the time it was inserted at; e.g., to export
+   * or replay it. With a single shard, the time is only known at
+   * slog::time_index::BUCKET_NS granularity.
+   *
+   * @param record The record buffer (at least header_batch::MAX_HDR_LEN
+   *  bytes).
+   * @param id The global id of the record.
+   * @param length The length of the record.
+   * @param time_ns The insertion time of the record.
+   * @return true if the fetch is successful, false otherwise.
+   */
+  bool read(unsigned char* record, uint64_t id, uint32_t& length,
+            uint64_t& time_ns) const {
+    uint32_t shard = id % shards_.size();
+    uint64_t record_id = id / shards_.size();
+    if (!stamped_) {
+      length = header_batch::MAX_HDR_LEN;
+      if (!readers_[shard]->extract(record, record_id, 0, length)) {
+        return false;
+      }
+      time_ns = readers_[shard]->insert_time(record_id);
+      return true;
+    }
+
+    unsigned char buf[TIME_PREFIX_LEN + header_batch::MAX_HDR_LEN];
+    length = sizeof(buf);
+    if (!readers_[shard]->extract(buf, record_id, 0, length)
+        || length < TIME_PREFIX_LEN) {
+      return false;
+    }
+    memcpy(&time_ns, buf, TIME_PREFIX_LEN);
+    length -= TIME_PREFIX_LEN;
+    memcpy(record, buf + TIME_PREFIX_LEN, length);
+    return true;
+  }
+
+ private:
+  /* Insertion time and global id of a record */
+  typedef std::pair<uint64_t, uint64_t> keyed_id;
+
+  bool time_of(uint32_t shard, uint64_t record_id, uint64_t& time_ns) const {
+    uint32_t len = TIME_PREFIX_LEN;
+    unsigned char buf[TIME_PREFIX_LEN];
+    if (!readers_[shard]->extract(buf, record_id, 0, len)
+        || len != TIME_PREFIX_LEN) {
+      return false;
+    }
+    memcpy(&time_ns, buf, TIME_PREFIX_LEN);
+    return true;
+  }
+
+  // Position of a record in the results of filter(); a dropped record is
+  // replaced by the oldest record left in its shard, as in seek().
+  keyed_id key_of(uint64_t id) const {
+    uint32_t shard = id % shards_.size();
+    uint64_t record_id = id / shards_.size();
+    keyed_id key(0, 0);
+    if (stamped_ && !time_of(shard, record_id, key.first)) {
+      record_id = std::max(record_id, readers_[shard]->first_record());
+      if (!time_of(shard, record_id, key.first)) {
+        key.first = 0;
+      }
+    }
+    key.second = global_id(shard, record_id);
+    return key;
+  }
+
+  // First record id of a shard at or after a position in the results of
+  // filter(); records are inserted in time order, so it is found by binary
+  // search.
+  uint64_t shard_cursor(uint32_t shard, const keyed_id& from) const {
+    const packet_store::handle* reader = readers_[shard];
+    uint64_t lo = reader->first_record();
+    uint64_t hi = reader->num_records();
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      keyed_id key(0, global_id(shard, mid));
+      bool before = !stamped_ || time_of(shard, mid, key.first)
+          ? key < from
+          : mid < reader->first_record();  // dropped meanwhile, or in flight
+      if (before) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  // Marks a shard written to, and splits the size limit of the retention
+  // policy again among the shards written to.
+  void activate(uint32_t shard) {
+    std::lock_guard<std::mutex> lock(active_mutex_);
+    if (active_[shard]) {
+      return;
+    }
+    active_[shard] = true;
+    num_active_++;
+    if (max_bytes_ == 0) {
+      return;
+    }
+    uint64_t share = std::max<uint64_t>(1, max_bytes_ / num_active_);
+    for (packet_store* s : shards_) {
+      s->set_size_limit(share);
+    }
+  }
+
+  // Runs fn(shard) for each shard with records in a snapshot, in parallel;
+  // the calling thread takes the first one.
+  template <typename F>
+  void for_each_shard(uint64_t snapshot, F fn) const {
+    std::vector<uint32_t> nonempty;
+    for (uint32_t s = 0; s < shards_.size(); s++) {
+      if (shard_snapshot(s, snapshot) > readers_[s]->first_record()) {
+        nonempty.push_back(s);
+      }
+    }
+    if (nonempty.empty()) {
+      return;
+    }
+
+    std::vector<std::thread> fanout;
+    for (size_t i = 1; i < nonempty.size(); i++) {
+      fanout.push_back(std::thread(fn, nonempty[i]));
+    }
+    fn(nonempty[0]);
+    for (std::thread& t : fanout) {
+      t.join();
+    }
+  }
+
+  // Number of records of a shard in the snapshot; records are inserted in
+  // time order, so the snapshot time is found by binary search.
+  uint64_t shard_snapshot(uint32_t shard, uint64_t snapshot) const {
+    const packet_store::handle* reader = readers_[shard];
+    if (!stamped_) {
+      return std::min(snapshot, reader->num_records());
+    }
+
+    uint64_t lo = reader->first_record();
+    uint64_t hi = reader->num_records();
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      uint64_t time_ns;
+      bool before = time_of(shard, mid, time_ns)
+          ? time_ns < snapshot
+          : mid < reader->first_record();  // dropped meanwhile, or in flight
+      if (before) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  // Keeps the ids that are also in other; both are sorted.
+  static void intersect(std::vector<uint64_t>& ids,
+                        const std::vector<uint64_t>& other) {
+    slog::sorted_probe probe(other);
+    ids.erase(std::remove_if(ids.begin(), ids.end(),
+                             [&probe](uint64_t id) {
+                               return !probe.contains(id);
+                             }),
+              ids.end());
+  }
+
+  // Whether a record is an IPv4 packet of a protocol; parses its header
+  // into slot 0 of hdrs.
+  bool has_proto(uint32_t shard, uint64_t record_id, uint8_t proto,
+                 header_batch& hdrs) const {
+    unsigned char hdr[header_batch::MAX_HDR_LEN];
+    uint32_t len = sizeof(hdr);
+    if (!readers_[shard]->extract(hdr, record_id,
+                                  stamped_ ? TIME_PREFIX_LEN : 0, len)) {
+      return false;
+    }
+    header_parser::parse_one(hdr, len, 0, hdrs);
+    return (hdrs.flags[0] & header_batch::IPV4) && hdrs.proto[0] == proto;
+  }
+
+  // Range [min_rid, max_rid) of the record ids of a shard in the snapshot and
+  // the time window, from first_rid on, of those not dropped; false if it
+  // is empty.
+  bool shard_range(uint32_t shard, uint64_t snapshot,
+                   const time_window& window, uint64_t first_rid,
+                   uint64_t& min_rid, uint64_t& max_rid) const {
+    const packet_store::handle* reader = readers_[shard];
+    max_rid = shard_snapshot(shard, snapshot);
+
+    /* The time window maps to a range of record ids */
+    min_rid = 0;
+    if (window.beg_ns != 0 || window.end_ns != UINT64_MAX) {
+      uint64_t end_rid;
+      reader->time_range(window.beg_ns, window.end_ns, min_rid, end_rid);
+      max_rid = std::min(max_rid, end_rid);
+    }
+    min_rid = std::max(min_rid, std::max(first_rid, reader->first_record()));
+    return min_rid < max_rid;
+  }
+
+  // Record ids of a shard in the snapshot that match the query, in order,
+  // from first_rid on; at most the first limit of them. If proto is not 0,
+  // only the IPv4 packets of this protocol match.
+  void match_shard(uint32_t shard, slog::filter_query query,
+                   uint64_t snapshot, uint32_t stream,
+                   const time_window& window,
+                   const column_store::conjunction& columns,
+                   const flow_key* flow, uint8_t proto, uint64_t first_rid,
+                   uint64_t limit, std::vector<uint64_t>& record_ids) const {
+    const packet_store::handle* reader = readers_[shard];
+    uint64_t min_rid, max_rid;
+    record_ids.clear();
+    if (!shard_range(shard, snapshot, window, first_rid, min_rid, max_rid)) {
+      return;
+    }
+
+    /* Column predicates are evaluated by a scan of the (zone-mapped) header
+     * columns over the whole range, and narrow down the other results */
+    std::vector<uint64_t> column_ids;
+    if (!columns.empty()
+        && (!reader->filter_columns(column_ids, columns, min_rid, max_rid)
+            || column_ids.empty())) {
+      return;
+    }
+
+    /* The packets of a flow are read off its chain in the flow index */
+    std::vector<uint64_t> flow_ids;
+    if (flow != NULL
+        && (!reader->filter_flow(flow_ids, *flow, min_rid, max_rid)
+            || flow_ids.empty())) {
+      return;
+    }
+
+    if (stream != NO_STREAM) {
+      reader->filter_stream(record_ids, stream, max_rid);
+      record_ids.erase(record_ids.begin(),
+                       std::lower_bound(record_ids.begin(), record_ids.end(),
+                                        min_rid));
+      if (!query.empty()) {
+        std::vector<uint64_t> query_ids;
+        reader->filter(query_ids, query, min_rid, max_rid);
+        intersect(record_ids, query_ids);
+      }
+    } else if (query.empty() && flow != NULL) {
+      record_ids.swap(flow_ids);
+      flow = NULL;
+    } else if (query.empty() && !columns.empty()) {
+      record_ids.swap(column_ids);
+      keep(shard, proto, limit, record_ids);
+      return;
+    } else if (query.empty()) {
+      /* All records match; only as many are generated as are kept */
+      header_batch hdrs;
+      for (uint64_t id = min_rid; id < max_rid && record_ids.size() < limit;
+           id++) {
+        if (proto == 0 || has_proto(shard, id, proto, hdrs)) {
+          record_ids.push_back(id);
+        }
+      }
+      return;
+    } else {
+      reader->filter(record_ids, query, min_rid, max_rid);
+    }
+
+    if (flow != NULL) {
+      intersect(record_ids, flow_ids);
+    }
+    if (!columns.empty()) {
+      intersect(record_ids, column_ids);
+    }
+    keep(shard, proto, limit, record_ids);
+  }
+
+  // Keeps the first limit record ids of a shard, of those that are IPv4
+  // packets of proto if it is not 0; headers are only read until then.
+  void keep(uint32_t shard, uint8_t proto, uint64_t limit,
+            std::vector<uint64_t>& record_ids) const {
+    if (proto == 0) {
+      record_ids.resize(std::min<uint64_t>(record_ids.size(), limit));
+      return;
+    }
+
+    header_batch hdrs;
+    size_t kept = 0;
+    for (size_t i = 0; i < record_ids.size() && kept < limit; i++) {
+      if (has_proto(shard, record_ids[i], proto, hdrs)) {
+        record_ids[kept++] = record_ids[i];
+      }
+    }
+    record_ids.resize(kept);
+  }
+
+  void filter_shard(uint32_t shard, const slog::filter_query& query,
+                    uint64_t snapshot, uint32_t stream,
+                    const time_window& window,
+                    const column_store::conjunction& columns,
+                    const flow_key* flow, uint8_t proto, const keyed_id* from,
+                    uint64_t limit, std::vector<keyed_id>& matches) const {
+    std::vector<uint64_t> record_ids;
+    uint64_t first_rid = from != NULL ? shard_cursor(shard, *from) : 0;
+    match_shard(shard, query, snapshot, stream, window, columns, flow, proto,
+                first_rid, limit, record_ids);
+
+    matches.reserve(record_ids.size());
+    for (uint64_t id : record_ids) {
+      keyed_id match(0, global_id(shard, id));
+      if (!stamped_ || time_of(shard, id, match.first)) {
+        matches.push_back(match);
+      }
+    }
+  }
+
+  void aggregate_shard(uint32_t shard, const slog::filter_query& query,
+                       uint64_t snapshot, uint32_t stream,
+                       const time_window& window,
+                       const column_store::conjunction& columns,
+                       const flow_key* flow, aggregator& result) const {
+    static_assert(slog::log_store::SCAN_BATCH <= header_batch::MAX_BATCH,
+                  "scanned batches must fit in a header batch");
+    std::vector<uint64_t> record_ids;
+    match_shard(shard, query, snapshot, stream, window, columns, flow, 0, 0,
+                UINT64_MAX, record_ids);
+
+    readers_[shard]->scan(record_ids, stamped_ ? TIME_PREFIX_LEN : 0,
+                          header_batch::MAX_HDR_LEN,
+                          [&result](const unsigned char* const * hdrs,
+                                    const uint16_t* hdr_lens,
+                                    uint32_t num_hdrs) {
+                            result.add(hdrs, hdr_lens, num_hdrs);
+                          });
+  }
+
+  const bool stamped_;
+  std::vector<packet_store*> shards_;
+
+  /* Size limit on all shards together, and the shards written to */
+  uint64_t max_bytes_;
+  mutable std::mutex active_mutex_;
+  std::vector<bool> active_;
+  uint32_t num_active_;
+
+  /* Read-only handles to the shards */
+  std::vector<packet_store::handle*> readers_;
+};
+
+}
+
+#endif /* NETPLAY_SHARDEDSTORE_H_ */
@@ -0,0 +1,601 @@
+#include "shardedstore.h"
+
+#include <ftw.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "testpackets.h"
+
+namespace {
+
+const uint32_t kBatch = netplay::test::packet_batch::SIZE;
+const uint16_t kHeaderLen = 42;  // Ethernet + IPv4 + UDP
+
+// Packet number seq is a UDP header from 10.0.0.1:1000 to 10.0.0.2 holding
+// seq in its first 8 bytes, with seq % 8 as its destination port and
+// seq % 8 + 1 as its TTL.
+uint16_t BuildPacket(unsigned char *pkt, uint64_t seq) {
+  netplay::test::packet_fields f = {};
+  f.proto = 17;
+  f.src_ip = 0x0a000001;
+  f.dst_ip = 0x0a000002;
+  f.src_port = 1000;
+  f.dst_port = seq % 8;
+  f.ip_len = 40;
+  f.ttl = seq % 8 + 1;
+  netplay::test::build_packet(pkt, kHeaderLen, f);
+  memcpy(pkt, &seq, sizeof(seq));
+  return kHeaderLen;
+}
+
+// Inserts packets [batch * kBatch, (batch + 1) * kBatch).
+uint64_t InsertBatch(netplay::sharded_packet_store::handle *handle,
+                     uint64_t batch, uint64_t now_ns) {
+  netplay::test::packet_batch packets(batch * kBatch, BuildPacket);
+  return handle->insert_packets(packets.pkts, packets.hdrs, kBatch, now_ns);
+}
+
+uint64_t SequenceOf(netplay::sharded_packet_store &store, uint64_t id) {
+  unsigned char buf[sizeof(uint64_t)];
+  uint32_t len = sizeof(buf);
+  EXPECT_TRUE(store.extract(buf, id, 0, len));
+  EXPECT_EQ(sizeof(buf), len);
+  uint64_t seq;
+  memcpy(&seq, buf, sizeof(seq));
+  return seq;
+}
+
+// Packet filter with the signature of a JIT-compiled BPF program; matches the
+// headers whose sequence number is odd.
+u_int OddSequence(u_char *pkt, u_int wirelen, u_int buflen) {
+  return wirelen == kHeaderLen && buflen == kHeaderLen && (pkt[0] & 1);
+}
+
+slog::filter_query PortQuery(netplay::sharded_packet_store &store,
+                             uint16_t port) {
+  slog::filter_query query(1);
+  store.filters().add_dst_port_filter(query[0], port, port);
+  return query;
+}
+
+// Filters the records inserted before time 101 (or all of them, with a single
+// shard) a page of at most limit records at a time, and returns all pages.
+std::vector<uint64_t> PagedFilter(netplay::sharded_packet_store &store,
+                                  const slog::filter_query &query,
+                                  uint8_t proto, uint64_t limit) {
+  std::vector<uint64_t> results;
+  uint64_t cursor = 0;
+  do {
+    std::vector<uint64_t> page;
+    cursor = store.filter(page, query, store.snapshot(101),
+                          netplay::sharded_packet_store::NO_STREAM,
+                          netplay::sharded_packet_store::time_window(),
+                          netplay::column_store::conjunction(), NULL, proto,
+                          cursor, limit);
+    EXPECT_LE(page.size(), limit);
+    EXPECT_TRUE(cursor == 0 || page.size() == limit);
+    results.insert(results.end(), page.begin(), page.end());
+  } while (cursor != 0);
+  return results;
+}
+
+TEST(ShardedStoreTest, SingleShardKeepsRecordIds) {
+  netplay::sharded_packet_store store(1);
+  netplay::sharded_packet_store::handle *handle = store.get_handle(0);
+  for (uint64_t b = 0; b < 10; b++) {
+    ASSERT_EQ(b * kBatch, InsertBatch(handle, b, 1000));
+  }
+  ASSERT_EQ(10 * kBatch, store.snapshot(0));
+
+  std::vector<uint64_t> results;
+  store.filter(results, PortQuery(store, 3), store.snapshot(0));
+  ASSERT_EQ(10 * kBatch / 8, results.size());
+  for (size_t i = 0; i < results.size(); i++) {
+    ASSERT_EQ(i * 8 + 3, results[i]);
+    ASSERT_EQ(results[i], SequenceOf(store, results[i]));
+  }
+  ASSERT_EQ(2U, store.seek(results, 12));
+
+  // Pages of results resume from the cursor of the previous page, including
+  // record 0
+  for (uint64_t limit : {1UL, 7UL, 8UL, 40UL}) {
+    ASSERT_EQ(results, PagedFilter(store, PortQuery(store, 3), 0, limit));
+  }
+  store.filter(results, slog::filter_query(), store.snapshot(0));
+  ASSERT_EQ(results, PagedFilter(store, slog::filter_query(), 0, 7));
+  ASSERT_EQ(results.size(), store.count(slog::filter_query(),
+                                        store.snapshot(0)));
+  delete handle;
+}
+
+TEST(ShardedStoreTest, MergesShardsInTimeOrder) {
+  const uint32_t kShards = 4;
+  const uint64_t kBatches = 200;
+  netplay::sharded_packet_store store(kShards);
+
+  // Batch b is inserted at time b + 1 by shard b % kShards, concurrently
+  std::vector<std::thread> writers;
+  for (uint32_t s = 0; s < kShards; s++) {
+    writers.push_back(std::thread([&store, s] {
+      netplay::sharded_packet_store::handle *handle = store.get_handle(s);
+      for (uint64_t b = s; b < kBatches; b += kShards) {
+        uint64_t id = InsertBatch(handle, b, b + 1);
+        ASSERT_EQ(s, id % kShards);
+      }
+      delete handle;
+    }));
+  }
+  for (std::thread &t : writers) {
+    t.join();
+  }
+  ASSERT_EQ(kBatches * kBatch, store.num_records());
+
+  std::vector<uint64_t> results;
+  store.filter(results, PortQuery(store, 5), store.snapshot(UINT64_MAX));
+  ASSERT_EQ(kBatches * kBatch / 8, results.size());
+  for (size_t i = 0; i < results.size(); i++) {
+    ASSERT_EQ(i * 8 + 5, SequenceOf(store, results[i]));
+  }
+
+  // The empty query matches all records; the snapshot only those inserted
+  // before time 101
+  store.filter(results, slog::filter_query(), store.snapshot(101));
+  ASSERT_EQ(100 * kBatch, results.size());
+  for (size_t i = 0; i < results.size(); i++) {
+    ASSERT_EQ(i, SequenceOf(store, results[i]));
+  }
+
+  ASSERT_EQ(0U, store.seek(results, results[0]));
+  ASSERT_EQ(1234U, store.seek(results, results[1234]));
+
+  // Pages of results resume from the cursor of the previous page, and only
+  // match the IPv4 packets of a protocol if one is given
+  for (uint64_t limit : {1000UL, 1234UL, results.size()}) {
+    ASSERT_EQ(results, PagedFilter(store, slog::filter_query(), 0, limit));
+    ASSERT_EQ(results, PagedFilter(store, slog::filter_query(), 17, limit));
+  }
+  std::vector<uint64_t> port_results;
+  store.filter(port_results, PortQuery(store, 5), store.snapshot(101));
+  ASSERT_EQ(port_results, PagedFilter(store, PortQuery(store, 5), 17, 33));
+  ASSERT_TRUE(PagedFilter(store, slog::filter_query(), 6, 100).empty());
+  ASSERT_TRUE(PagedFilter(store, PortQuery(store, 5), 6, 100).empty());
+}
+
+TEST(ShardedStoreTest, CountsMatches) {
+  const uint32_t kShards = 4;
+  netplay::sharded_packet_store store(kShards);
+  std::vector<netplay::sharded_packet_store::handle *> handles;
+  for (uint32_t s = 0; s < kShards; s++) {
+    handles.push_back(store.get_handle(s));
+  }
+  for (uint64_t b = 0; b < 200; b++) {
+    InsertBatch(handles[b % kShards], b, b + 1);
+  }
+
+  // Counts from the id ranges agree with the matches, from the start and
+  // from the cursors of pages
+  netplay::sharded_packet_store::time_window window(50, 150);
+  uint64_t snapshot = store.snapshot(101);
+  std::vector<uint64_t> results;
+  ASSERT_EQ(100 * kBatch, store.count(slog::filter_query(), snapshot));
+  store.filter(results, slog::filter_query(), snapshot,
+               netplay::sharded_packet_store::NO_STREAM, window);
+  ASSERT_EQ(results.size(),
+            store.count(slog::filter_query(), snapshot,
+                        netplay::sharded_packet_store::NO_STREAM, window));
+  for (uint64_t limit : {1UL, 33UL, 1000UL}) {
+    uint64_t cursor = store.filter(results, slog::filter_query(), snapshot,
+                                   netplay::sharded_packet_store::NO_STREAM,
+                                   netplay::sharded_packet_store::time_window(),
+                                   netplay::column_store::conjunction(), NULL,
+                                   0, 0, limit);
+    ASSERT_EQ(100 * kBatch - limit,
+              store.count(slog::filter_query(), snapshot,
+                          netplay::sharded_packet_store::NO_STREAM,
+                          netplay::sharded_packet_store::time_window(),
+                          netplay::column_store::conjunction(), NULL, 0,
+                          cursor));
+  }
+
+  // Queries with predicates count their matches
+  ASSERT_EQ(100 * kBatch / 8, store.count(PortQuery(store, 5), snapshot));
+  ASSERT_EQ(100 * kBatch,
+            store.count(slog::filter_query(), snapshot,
+                        netplay::sharded_packet_store::NO_STREAM,
+                        netplay::sharded_packet_store::time_window(),
+                        netplay::column_store::conjunction(), NULL, 17));
+  ASSERT_EQ(0U, store.count(slog::filter_query(), snapshot,
+                            netplay::sharded_packet_store::NO_STREAM,
+                            netplay::sharded_packet_store::time_window(),
+                            netplay::column_store::conjunction(), NULL, 6));
+  ASSERT_EQ(0U, store.count(slog::filter_query(), store.snapshot(1)));
+
+  for (netplay::sharded_packet_store::handle *handle : handles) {
+    delete handle;
+  }
+}
+
+TEST(ShardedStoreTest, SkipsEmptyShards) {
+  // Only shards 1 and 2 are written to
+  netplay::sharded_packet_store store(4);
+  netplay::sharded_packet_store::handle *h1 = store.get_handle(1);
+  netplay::sharded_packet_store::handle *h2 = store.get_handle(2);
+  for (uint64_t b = 0; b < 20; b++) {
+    InsertBatch(b % 2 == 0 ? h1 : h2, b, b + 1);
+  }
+  ASSERT_EQ(2U, store.num_active_shards());
+
+  std::vector<uint64_t> results;
+  store.filter(results, slog::filter_query(), store.snapshot(UINT64_MAX));
+  ASSERT_EQ(20 * kBatch, results.size());
+  for (size_t i = 0; i < results.size(); i++) {
+    ASSERT_EQ(i, SequenceOf(store, results[i]));
+  }
+  store.filter(results, PortQuery(store, 2), store.snapshot(UINT64_MAX));
+  ASSERT_EQ(20 * kBatch / 8, results.size());
+
+  netplay::aggregator agg(netplay::aggregator::NONE, 0);
+  store.aggregate(agg, slog::filter_query(), store.snapshot(UINT64_MAX));
+  ASSERT_EQ(20 * kBatch, agg.packets());
+
+  // Nothing is in a snapshot before the first insert
+  ASSERT_EQ(0U, store.count(slog::filter_query(), store.snapshot(1)));
+  store.filter(results, slog::filter_query(), store.snapshot(1));
+  ASSERT_TRUE(results.empty());
+  delete h1;
+  delete h2;
+}
+
+TEST(ShardedStoreTest, FiltersStreams) {
+  for (uint32_t shards : {1U, 3U}) {
+    netplay::sharded_packet_store store(shards);
+    uint32_t stream = store.add_stream(OddSequence);
+    ASSERT_EQ(1U, store.num_streams());
+
+    for (uint64_t b = 0; b < 30; b++) {
+      netplay::sharded_packet_store::handle *handle =
+          store.get_handle(b % shards);
+      InsertBatch(handle, b, b + 1);
+      delete handle;
+    }
+
+    std::vector<uint64_t> results;
+    store.filter(results, slog::filter_query(), store.snapshot(UINT64_MAX),
+                 stream);
+    ASSERT_EQ(30 * kBatch / 2, results.size());
+    for (size_t i = 0; i < results.size(); i++) {
+      ASSERT_EQ(i * 2 + 1, SequenceOf(store, results[i]));
+    }
+
+    // Streams combine with queries
+    store.filter(results, PortQuery(store, 3), store.snapshot(UINT64_MAX),
+                 stream);
+    ASSERT_EQ(30 * kBatch / 8, results.size());
+    for (size_t i = 0; i < results.size(); i++) {
+      ASSERT_EQ(i * 8 + 3, SequenceOf(store, results[i]));
+    }
+    store.filter(results, PortQuery(store, 4), store.snapshot(UINT64_MAX),
+                 stream);
+    ASSERT_TRUE(results.empty());
+  }
+}
+
+TEST(ShardedStoreTest, SubscriptionsReturnPackets) {
+  for (bool compress : {false, true}) {
+    for (uint32_t shards : {1U, 3U}) {
+      netplay::sharded_packet_store store(shards);
+      ASSERT_TRUE(!compress || store.enable_compression());
+      uint32_t stream = store.add_stream(OddSequence);
+      std::vector<netplay::sharded_packet_store::subscription *> subs;
+      for (uint32_t s = 0; s < shards; s++) {
+        subs.push_back(store.subscribe(s, stream));
+      }
+
+      for (uint64_t b = 0; b < 30; b++) {
+        netplay::sharded_packet_store::handle *handle =
+            store.get_handle(b % shards);
+        InsertBatch(handle, b, b + 1);
+        delete handle;
+      }
+
+      // Records are the packets, without their time prefix, and their ids
+      // are global ids
+      std::vector<uint64_t> seqs;
+      for (netplay::sharded_packet_store::subscription *sub : subs) {
+        std::vector<uint64_t> ids;
+        std::vector<std::string> records;
+        while (sub->poll(ids, 100, &records) != 0) {
+          ASSERT_EQ(ids.size(), records.size());
+          for (size_t i = 0; i < ids.size(); i++) {
+            ASSERT_EQ(kHeaderLen, records[i].size());
+            unsigned char pkt[kHeaderLen];
+            BuildPacket(pkt, SequenceOf(store, ids[i]));
+            ASSERT_EQ(0, memcmp(pkt, records[i].data(), kHeaderLen));
+            seqs.push_back(SequenceOf(store, ids[i]));
+          }
+        }
+        delete sub;
+      }
+      std::sort(seqs.begin(), seqs.end());
+      ASSERT_EQ(30 * kBatch / 2, seqs.size());
+      for (size_t i = 0; i < seqs.size(); i++) {
+        ASSERT_EQ(i * 2 + 1, seqs[i]);
+      }
+    }
+  }
+}
+
+TEST(ShardedStoreTest, FiltersTimeWindows) {
+  const uint64_t kMs = 1000000;
+  for (uint32_t shards : {1U, 3U}) {
+    netplay::sharded_packet_store store(shards);
+    // Batch b is inserted b + 1 milliseconds in
+    for (uint64_t b = 0; b < 30; b++) {
+      netplay::sharded_packet_store::handle *handle =
+          store.get_handle(b % shards);
+      InsertBatch(handle, b, (b + 1) * kMs + 500);
+      delete handle;
+    }
+
+    netplay::sharded_packet_store::time_window window(10 * kMs, 19 * kMs);
+    std::vector<uint64_t> results;
+    store.filter(results, slog::filter_query(), store.snapshot(UINT64_MAX),
+                 netplay::sharded_packet_store::NO_STREAM, window);
+    ASSERT_EQ(10 * kBatch, results.size());
+    for (size_t i = 0; i < results.size(); i++) {
+      ASSERT_EQ(9 * kBatch + i, SequenceOf(store, results[i]));
+    }
+
+    store.filter(results, PortQuery(store, 3), store.snapshot(UINT64_MAX),
+                 netplay::sharded_packet_store::NO_STREAM, window);
+    ASSERT_EQ(10 * kBatch / 8, results.size());
+    for (size_t i = 0; i < results.size(); i++) {
+      ASSERT_EQ(9 * kBatch + i * 8 + 3, SequenceOf(store, results[i]));
+    }
+
+    // Windows outside the inserted times match nothing
+    store.filter(results, slog::filter_query(), store.snapshot(UINT64_MAX),
+                 netplay::sharded_packet_store::NO_STREAM,
+                 netplay::sharded_packet_store::time_window(0, kMs / 2));
+    ASSERT_TRUE(results.empty());
+    store.filter(results, slog::filter_query(), store.snapshot(UINT64_MAX),
+                 netplay::sharded_packet_store::NO_STREAM,
+                 netplay::sharded_packet_store::time_window(40 * kMs));
+    ASSERT_TRUE(results.empty());
+  }
+}
+
+TEST(ShardedStoreTest, FiltersHeaderColumns) {
+  netplay::column_store::conjunction ttl4 = {
+      netplay::column_store::predicate(netplay::column_store::TTL, 4, 4)};
+  for (uint32_t shards : {1U, 3U}) {
+    netplay::sharded_packet_store store(shards);
+    ASSERT_TRUE(store.enable_columns());
+    uint32_t stream = store.add_stream(OddSequence);
+    for (uint64_t b = 0; b < 30; b++) {
+      netplay::sharded_packet_store::handle *handle =
+          store.get_handle(b % shards);
+      InsertBatch(handle, b, b + 1);
+      delete handle;
+    }
+    ASSERT_FALSE(store.enable_columns());
+
+    std::vector<uint64_t> results;
+    store.filter(results, slog::filter_query(), store.snapshot(UINT64_MAX),
+                 netplay::sharded_packet_store::NO_STREAM,
+                 netplay::sharded_packet_store::time_window(), ttl4);
+    ASSERT_EQ(30 * kBatch / 8, results.size());
+    for (size_t i = 0; i < results.size(); i++) {
+      ASSERT_EQ(i * 8 + 3, SequenceOf(store, results[i]));
+    }
+
+    // Columns combine with queries and streams
+    std::vector<uint64_t> combined;
+    store.filter(combined, PortQuery(store, 3), store.snapshot(UINT64_MAX),
+                 stream, netplay::sharded_packet_store::time_window(), ttl4);
+    ASSERT_EQ(results, combined);
+    store.filter(combined, PortQuery(store, 4), store.snapshot(UINT64_MAX),
+                 netplay::sharded_packet_store::NO_STREAM,
+                 netplay::sharded_packet_store::time_window(), ttl4);
+    ASSERT_TRUE(combined.empty());
+  }
+}
+
+TEST(ShardedStoreTest, FiltersFlows) {
+  for (uint32_t shards : {1U, 3U}) {
+    netplay::sharded_packet_store store(shards);
+    ASSERT_TRUE(store.enable_flows());
+    for (uint64_t b = 0; b < 30; b++) {
+      netplay::sharded_packet_store::handle *handle =
+          store.get_handle(b % shards);
+      InsertBatch(handle, b, b + 1);
+      delete handle;
+    }
+    ASSERT_FALSE(store.enable_flows());
+
+    // Flows match both directions of the connection
+    netplay::flow_key flow(0x0a000002, 0x0a000001, 3, 1000, 17);
+    std::vector<uint64_t> results;
+    store.filter(results, slog::filter_query(), store.snapshot(UINT64_MAX),
+                 netplay::sharded_packet_store::NO_STREAM,
+                 netplay::sharded_packet_store::time_window(),
+                 netplay::column_store::conjunction(), &flow);
+    ASSERT_EQ(30 * kBatch / 8, results.size());
+    for (size_t i = 0; i < results.size(); i++) {
+      ASSERT_EQ(i * 8 + 3, SequenceOf(store, results[i]));
+    }
+
+    // Flows combine with queries; other protocols are other flows
+    std::vector<uint64_t> combined;
+    store.filter(combined, PortQuery(store, 3), store.snapshot(UINT64_MAX),
+                 netplay::sharded_packet_store::NO_STREAM,
+                 netplay::sharded_packet_store::time_window(),
+                 netplay::column_store::conjunction(), &flow);
+    ASSERT_EQ(results, combined);
+    netplay::flow_key tcp(0x0a000001, 0x0a000002, 1000, 3, 6);
+    store.filter(combined, slog::filter_query(), store.snapshot(UINT64_MAX),
+                 netplay::sharded_packet_store::NO_STREAM,
+                 netplay::sharded_packet_store::time_window(),
+                 netplay::column_store::conjunction(), &tcp);
+    ASSERT_TRUE(combined.empty());
+
+    // The counters of a flow are added up across shards
+    std::vector<netplay::flow_summary> flows;
+    ASSERT_TRUE(store.flows(flows));
+    ASSERT_EQ(8U, flows.size());
+    for (const netplay::flow_summary &f : flows) {
+      ASSERT_EQ(30 * kBatch / 8, f.packets);
+      ASSERT_EQ(40 * f.packets, f.bytes);
+      ASSERT_EQ(1U, f.first_ns);
+      ASSERT_EQ(30U, f.last_ns);
+    }
+  }
+}
+
+TEST(ShardedStoreTest, ReadsRecordsWithInsertionTimes) {
+  const uint64_t kMs = slog::time_index::BUCKET_NS;
+  for (uint32_t shards : {1U, 3U}) {
+    netplay::sharded_packet_store store(shards);
+    // Batch b is inserted b + 1 milliseconds in
+    for (uint64_t b = 0; b < 30; b++) {
+      netplay::sharded_packet_store::handle *handle =
+          store.get_handle(b % shards);
+      InsertBatch(handle, b, (b + 1) * kMs + 500);
+      delete handle;
+    }
+
+    std::vector<uint64_t> results;
+    store.filter(results, PortQuery(store, 3), store.snapshot(UINT64_MAX));
+    for (size_t i = 0; i < results.size(); i++) {
+      unsigned char hdr[netplay::header_batch::MAX_HDR_LEN];
+      uint32_t len;
+      uint64_t time_ns;
+      ASSERT_TRUE(store.read(hdr, results[i], len, time_ns));
+      ASSERT_EQ(kHeaderLen, len);
+      uint64_t seq;
+      memcpy(&seq, hdr, sizeof(seq));
+      ASSERT_EQ(i * 8 + 3, seq);
+
+      // Times are exact with several shards, and rounded down otherwise
+      uint64_t inserted = (seq / kBatch + 1) * kMs + 500;
+      ASSERT_EQ(shards > 1 ? inserted : inserted - 500, time_ns);
+    }
+  }
+}
+
+TEST(ShardedStoreTest, RetentionLimitsAllShardsTogether) {
+  const uint64_t kBlock = slog::log_store::DLOG_BLOCK_SIZE;
+  const uint64_t kRecordLen =
+      netplay::sharded_packet_store::TIME_PREFIX_LEN + kHeaderLen;
+  netplay::sharded_packet_store store(2);
+  ASSERT_FALSE(
+      store.set_retention(slog::log_store::MAX_RETAINED_BYTES + 1, 0));
+  ASSERT_TRUE(store.set_retention(2 * kBlock, 0));
+
+  // A single shard written to takes the whole limit, rather than half of it
+  netplay::sharded_packet_store::handle *h0 = store.get_handle(0);
+  uint64_t b = 0;
+  while (h0->num_records() * kRecordLen < 5 * kBlock) {
+    InsertBatch(h0, b++, 1);
+    h0->expire(1);
+  }
+  ASSERT_EQ(1U, store.num_active_shards());
+  uint64_t retained = (h0->num_records() - h0->first_record()) * kRecordLen;
+  ASSERT_GT(retained, kBlock);
+  ASSERT_LE(retained, 3 * kBlock);
+
+  // ... until another shard is written to
+  netplay::sharded_packet_store::handle *h1 = store.get_handle(1);
+  InsertBatch(h1, b++, 2);
+  ASSERT_EQ(2U, store.num_active_shards());
+  h0->expire(2);
+  retained = (h0->num_records() - h0->first_record()) * kRecordLen;
+  ASSERT_LE(retained, kBlock + kBlock / 2);
+  delete h0;
+  delete h1;
+}
+
+std::string MakeTempDir() {
+  char dir[] = "/tmp/shardedstore_test.XXXXXX";
+  return mkdtemp(dir);
+}
+
+void RemoveTree(const std::string &dir) {
+  nftw(dir.c_str(),
+       [](const char *path, const struct stat *, int, struct FTW *) {
+         return remove(path);
+       },
+       16, FTW_DEPTH | FTW_PHYS);
+}
+
+TEST(ShardedStoreTest, RestoresCheckpointedShards) {
+  const uint64_t kMs = slog::time_index::BUCKET_NS;
+  netplay::sharded_packet_store::time_window window(10 * kMs, 20 * kMs);
+  for (uint32_t shards : {1U, 2U}) {
+    std::string dir = MakeTempDir();
+    uint64_t num_checkpointed;
+    std::vector<uint64_t> expected, expected_window;
+    {
+      netplay::sharded_packet_store store(shards);
+      ASSERT_TRUE(store.open(dir));
+      std::vector<netplay::sharded_packet_store::handle *> handles;
+      for (uint32_t s = 0; s < shards; s++) {
+        handles.push_back(store.get_handle(s));
+      }
+      for (uint64_t b = 0; b < 40; b++) {
+        InsertBatch(handles[b % shards], b, (b + 1) * kMs);
+      }
+      ASSERT_TRUE(store.checkpoint());
+      num_checkpointed = store.num_records();
+      store.filter(expected, PortQuery(store, 3), store.snapshot(UINT64_MAX));
+      store.filter(expected_window, slog::filter_query(),
+                   store.snapshot(UINT64_MAX),
+                   netplay::sharded_packet_store::NO_STREAM, window);
+
+      // Not covered by a checkpoint
+      InsertBatch(handles[0], 40, 41 * kMs);
+      for (netplay::sharded_packet_store::handle *handle : handles) {
+        delete handle;
+      }
+    }
+
+    // The number of shards must match
+    netplay::sharded_packet_store mismatched(shards + 1);
+    ASSERT_FALSE(mismatched.open(dir));
+
+    // The packets are indexed again, and the time index is restored
+    netplay::sharded_packet_store store(shards);
+    ASSERT_TRUE(store.open(dir));
+    ASSERT_EQ(num_checkpointed, store.num_records());
+    ASSERT_EQ(41 * kMs, store.insert_end_ns());
+    std::vector<uint64_t> results;
+    store.filter(results, PortQuery(store, 3), store.snapshot(UINT64_MAX));
+    ASSERT_EQ(40 * kBatch / 8, results.size());
+    ASSERT_EQ(expected, results);
+    for (size_t i = 0; i < results.size(); i++) {
+      ASSERT_EQ(i * 8 + 3, SequenceOf(store, results[i]));
+    }
+    store.filter(results, slog::filter_query(), store.snapshot(UINT64_MAX),
+                 netplay::sharded_packet_store::NO_STREAM, window);
+    ASSERT_EQ(expected_window, results);
+
+    // Packets inserted from the end of the restored ones on follow them
+    netplay::sharded_packet_store::handle *handle = store.get_handle(0);
+    InsertBatch(handle, 40, store.insert_end_ns());
+    store.filter(results, PortQuery(store, 3), store.snapshot(UINT64_MAX));
+    ASSERT_EQ(41 * kBatch / 8, results.size());
+    for (size_t i = 0; i < results.size(); i++) {
+      ASSERT_EQ(i * 8 + 3, SequenceOf(store, results[i]));
+    }
+    delete handle;
+    RemoveTree(dir);
+  }
+}
+
+}  // namespace (unnamed)
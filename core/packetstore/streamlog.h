@@ -1,6 +1,12 @@
 #ifndef SLOG_STREAMLOG_H_
 #define SLOG_STREAMLOG_H_
 
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+
 #include "monolog.h"
 #include "entrylist.h"
 #include "tokens.h"
@@ -11,19 +17,58 @@ namespace slog {
  * otherwise filtered out. */
 typedef bool (*filter_function)(uint64_t&, const unsigned char*, const uint16_t, const token_list&);
 
+/* Filter function on raw record data, with the signature of a (JIT-compiled)
+ * BPF program: called with the record, its length and the number of bytes
+ * available, and returns non-zero if the record is kept. */
+typedef u_int (*packet_filter_function)(u_char*, u_int, u_int);
+
+/* Record ids of a stream; buckets are capped at 2^24 entries, so that
+ * releasing the head of the list frees memory however long it grows. */
+typedef monolog_relaxed<uint64_t, 8192, 24> stream_list;
+
 /**
  * A stream-log stores record-ids for all records that satisfy the
- * stream-specific filter function.
+ * stream-specific filter function. The entries for dropped records are
+ * released with drop_below().
  */
 class streamlog {
  public:
+  /* Maximum number of consumers waiting on the stream at once */
+  static const uint32_t MAX_WAITERS = 16;
+
   /**
    * Constructor to initialize stream-log.
    * @param fn Filter function to use for this stream.
    */
-  streamlog(filter_function fn) {
-    fn_ = fn;
-    stream_log_ = new entry_list;
+  streamlog(filter_function fn)
+      : fn_(fn),
+        packet_fn_(NULL),
+        offset_(0),
+        published_(0),
+        first_(0),
+        num_waiters_(0) {
+    stream_log_ = new stream_list;
+    clear_waiters();
+  }
+
+  /**
+   * Constructor to initialize stream-log with a filter on raw record data.
+   * @param fn Filter function to use for this stream.
+   * @param offset Number of leading record bytes the filter does not see.
+   */
+  streamlog(packet_filter_function fn, uint32_t offset)
+      : fn_(NULL),
+        packet_fn_(fn),
+        offset_(offset),
+        published_(0),
+        first_(0),
+        num_waiters_(0) {
+    stream_log_ = new stream_list;
+    clear_waiters();
+  }
+
+  ~streamlog() {
+    delete stream_log_;
   }
 
   /**
@@ -37,8 +82,139 @@ class streamlog {
    */
   void check_and_add(uint64_t record_id, const unsigned char* record,
                      const uint16_t record_len, const token_list& tokens) {
-    if (fn_(record_id, record, record_len, tokens)) {
-      stream_log_->push_back(record_id);
+    if (matches(record_id, record, record_len, tokens)) {
+      uint64_t idx = stream_log_->push_back(record_id);
+      publish(idx, idx + 1);
+    }
+  }
+
+  /**
+   * Filters a batch of records with consecutive ids, and adds the records
+   * the function matches.
+   *
+   * @param start_id The id of the first record.
+   * @param records The record data.
+   * @param record_lens The record data lengths.
+   * @param tokens The tokens for each of the records.
+   * @param num_records The number of records.
+   */
+  void check_and_add(uint64_t start_id, const unsigned char* const * records,
+                     const uint16_t* record_lens, const token_list* tokens,
+                     uint32_t num_records) {
+    /* Entries are published in runs of consecutive indexes */
+    uint64_t run_beg = 0;
+    uint64_t run_end = 0;
+    for (uint32_t i = 0; i < num_records; i++) {
+      uint64_t record_id = start_id + i;
+      if (matches(record_id, records[i], record_lens[i], tokens[i])) {
+        uint64_t idx = stream_log_->push_back(record_id);
+        if (idx != run_end) {
+          publish(run_beg, run_end);
+          run_beg = idx;
+        }
+        run_end = idx + 1;
+      }
+    }
+    publish(run_beg, run_end);
+  }
+
+  /**
+   * Get the number of entries that are completely written; entries are
+   * published in index order, so all entries below are readable.
+   *
+   * @return The number of published entries.
+   */
+  uint64_t num_published() const {
+    return published_.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Get the index of the first entry that has not been released; entries
+   * below must not be accessed.
+   *
+   * @return The index of the first entry.
+   */
+  uint64_t first() const {
+    return first_.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Release the entries below an index, which must be published and refer
+   * to dropped records only. A function that frees each unlinked bucket is
+   * passed to retire(std::function<void()>), which must invoke it once no
+   * reader can access the bucket.
+   *
+   * @param idx The index of the first entry to keep.
+   * @param retire Called with the function freeing each unlinked bucket.
+   */
+  template<typename F>
+  void drop_below(uint64_t idx, F retire) {
+    if (idx <= first_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    first_.store(idx, std::memory_order_seq_cst);
+    stream_log_->release_below(idx, retire);
+  }
+
+  /**
+   * Register an eventfd to be signaled once, by the next call to notify().
+   * The caller must re-check for new entries after arming, since entries
+   * published before the registration do not signal it.
+   *
+   * @param fd The eventfd.
+   * @return false if all waiter slots are taken.
+   */
+  bool arm(int fd) {
+    for (std::atomic<int>& slot : waiters_) {
+      int expected = -1;
+      if (slot.load(std::memory_order_relaxed) == -1
+          && slot.compare_exchange_strong(expected, fd)) {
+        num_waiters_.fetch_add(1U);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Unregister an eventfd that has not been signaled yet.
+   *
+   * @param fd The eventfd.
+   * @return false if the eventfd was signaled (or never registered).
+   */
+  bool disarm(int fd) {
+    for (std::atomic<int>& slot : waiters_) {
+      int expected = fd;
+      if (slot.load(std::memory_order_relaxed) == fd
+          && slot.compare_exchange_strong(expected, -1)) {
+        num_waiters_.fetch_sub(1U);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Signal and unregister all registered eventfds. Called once the records
+   * of the published entries are readable; costs a single load when no
+   * consumer waits.
+   */
+  void notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (num_waiters_.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+    for (std::atomic<int>& slot : waiters_) {
+      if (slot.load(std::memory_order_relaxed) != -1) {
+        int fd = slot.exchange(-1);
+        if (fd != -1) {
+          num_waiters_.fetch_sub(1U);
+          uint64_t one = 1;
+          if (write(fd, &one, sizeof(one)) != sizeof(one)) {
+            /* The counter only overflows if nobody reads it */
+          }
+        }
+      }
     }
   }
 
@@ -47,16 +223,58 @@ class streamlog {
    *
    * @return The underlying stream.
    */
-  entry_list* get_stream() {
+  stream_list* get_stream() {
     return stream_log_;
   }
 
  private:
-  /* Filter function */
+  /* Waits for the entries below beg to be published, then publishes
+   * [beg, end) */
+  void publish(uint64_t beg, uint64_t end) {
+    if (beg == end) {
+      return;
+    }
+    uint64_t expected = beg;
+    while (!published_.compare_exchange_weak(expected, end)) {
+      expected = beg;
+    }
+  }
+
+  void clear_waiters() {
+    for (std::atomic<int>& slot : waiters_) {
+      slot.store(-1);
+    }
+  }
+
+  bool matches(uint64_t& record_id, const unsigned char* record,
+               const uint16_t record_len, const token_list& tokens) const {
+    if (packet_fn_ == NULL) {
+      return fn_(record_id, record, record_len, tokens);
+    }
+    if (record_len < offset_) {
+      return false;
+    }
+    u_int len = record_len - offset_;
+    return packet_fn_(const_cast<u_char*>(record + offset_), len, len) != 0;
+  }
+
+  /* Filter function; one of fn_ and packet_fn_ is set */
   filter_function fn_;
+  packet_filter_function packet_fn_;
+  uint32_t offset_;
 
   /* Stream monolog */
-  entry_list* stream_log_;
+  stream_list* stream_log_;
+
+  /* Number of entries of the stream monolog that are completely written */
+  std::atomic<uint64_t> published_;
+
+  /* Index of the first entry that has not been released */
+  std::atomic<uint64_t> first_;
+
+  /* Eventfds of the consumers waiting for new entries; -1 for free slots */
+  std::array<std::atomic<int>, MAX_WAITERS> waiters_;
+  std::atomic<uint32_t> num_waiters_;
 };
 
 }
@@ -0,0 +1,121 @@
+#ifndef NETPLAY_TESTPACKETS_H_
+#define NETPLAY_TESTPACKETS_H_
+
+#include <cstdint>
+#include <cstring>
+
+#include "headerparse.h"
+#include "tokens.h"
+
+/* Packets for the tests and benchmarks of the packet stores */
+
+namespace netplay {
+namespace test {
+
+/**
+ * Header fields of a test packet, in host byte order.
+ */
+struct packet_fields {
+  uint8_t proto;      /* TCP gets a 20-byte header, anything else 8 bytes */
+  uint32_t src_ip;
+  uint32_t dst_ip;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint16_t ip_len;
+  uint8_t ttl;
+  uint8_t tcp_flags;
+};
+
+/**
+ * Writes an Ethernet/IPv4 packet with the given fields to the first len bytes
+ * of pkt, with the bytes past its headers zeroed; headers that do not fit are
+ * cut at len, which must hold at least the ports. Returns len.
+ */
+inline uint16_t build_packet(unsigned char* pkt, uint16_t len,
+                             const packet_fields& f) {
+  memset(pkt, 0, len);
+  pkt[12] = 0x08;
+  unsigned char* ip = pkt + header_parser::ETHER_HDR_LEN;
+  ip[0] = 0x45;
+  ip[2] = f.ip_len >> 8;
+  ip[3] = f.ip_len & 0xff;
+  ip[8] = f.ttl;
+  ip[9] = f.proto;
+  for (int i = 0; i < 4; i++) {
+    ip[12 + i] = f.src_ip >> (24 - 8 * i);
+    ip[16 + i] = f.dst_ip >> (24 - 8 * i);
+  }
+  unsigned char* l4 = ip + header_parser::IPV4_MIN_HDR_LEN;
+  l4[0] = f.src_port >> 8;
+  l4[1] = f.src_port & 0xff;
+  l4[2] = f.dst_port >> 8;
+  l4[3] = f.dst_port & 0xff;
+  if (f.proto == header_parser::PROTO_TCP
+      && l4 + header_parser::TCP_MIN_HDR_LEN <= pkt + len) {
+    l4[12] = 0x50;
+    l4[13] = f.tcp_flags;
+  }
+  return len;
+}
+
+/**
+ * A batch of packets numbered from first, each written by build(pkt, n),
+ * which returns its length, and parsed as by NetPlay. Packets point into the
+ * batch itself.
+ */
+struct packet_batch {
+  static const uint32_t SIZE = header_batch::MAX_BATCH;
+  static const uint16_t MAX_LEN = 128;
+
+  template <typename BUILD>
+  packet_batch(uint64_t first, BUILD build) {
+    for (uint32_t i = 0; i < SIZE; i++) {
+      lens[i] = build(bufs[i], first + i);
+      pkts[i] = bufs[i];
+    }
+    header_parser::parse(pkts, lens, SIZE, hdrs);
+  }
+
+  unsigned char bufs[SIZE][MAX_LEN];
+  const unsigned char* pkts[SIZE];
+  uint16_t lens[SIZE];
+  header_batch hdrs;
+};
+
+/**
+ * Inserts a batch through the generic log store path, with the tokens NetPlay
+ * extracts from its addresses and ports.
+ */
+template <typename HANDLE>
+void insert_tokens(HANDLE* handle, const packet_batch& batch) {
+  slog::token_list tokens[packet_batch::SIZE];
+  for (uint32_t i = 0; i < packet_batch::SIZE; i++) {
+    handle->add_src_ip(tokens[i], batch.hdrs.src_ip[i]);
+    handle->add_dst_ip(tokens[i], batch.hdrs.dst_ip[i]);
+    handle->add_src_port(tokens[i], batch.hdrs.src_port[i]);
+    handle->add_dst_port(tokens[i], batch.hdrs.dst_port[i]);
+  }
+  handle->insert_batch(batch.pkts, batch.lens, tokens, packet_batch::SIZE);
+}
+
+/**
+ * Packet number n of the benchmarks: a 54-byte TCP packet from 10.0.0.0/16 to
+ * 11.0.0.0/22, with the addresses spread by a multiplicative hash and 16
+ * destination ports.
+ */
+inline uint16_t build_bench_packet(unsigned char* pkt, uint64_t n) {
+  packet_fields f = {};
+  f.proto = header_parser::PROTO_TCP;
+  f.src_ip = 0x0a000000 + (n * 2654435761U) % 65536;
+  f.dst_ip = 0x0b000000 + n % 1024;
+  f.src_port = 1024 + n % 50000;
+  f.dst_port = 80 + n % 16;
+  f.ip_len = 40;
+  f.ttl = 64;
+  return build_packet(pkt, 54, f);
+}
+
+}
+}
+
+#endif /* NETPLAY_TESTPACKETS_H_ */
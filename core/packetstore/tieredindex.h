@@ -3,25 +3,36 @@
 
 #include <atomic>
 #include <array>
+#include <algorithm>
 
+#include "allocator.h"
 #include "entrylist.h"
 
 namespace slog {
+
+/*
+ * Array of SIZE lazily allocated items. The slots are mapped zero-filled
+ * (i.e., NULL) and faulted in as they are written, so a sparse indexlet only
+ * pays for the pages of its populated slots.
+ */
 template<typename T, size_t SIZE = 65536>
 class indexlet {
  public:
   typedef std::atomic<T*> atomic_ref;
 
-  indexlet() {
-    for (uint32_t i = 0; i < SIZE; i++) {
-      idx_[i].store(NULL, std::memory_order_release);
-    }
+  indexlet()
+      : idx_(static_cast<atomic_ref*>(
+          page_allocator::map_pages(SIZE * sizeof(atomic_ref)))) {
   }
 
+  indexlet(const indexlet&) = delete;
+  indexlet& operator=(const indexlet&) = delete;
+
   ~indexlet() {
     for (uint32_t i = 0; i < SIZE; i++) {
       delete idx_[i].load(std::memory_order_acquire);
     }
+    page_allocator::unmap_pages(idx_, SIZE * sizeof(atomic_ref));
   }
 
   T* operator[](const uint32_t i) {
@@ -50,6 +61,17 @@ class indexlet {
     return SIZE;
   }
 
+  // Invokes fn on every allocated item.
+  template<typename F>
+  void for_each(F fn) const {
+    for (uint32_t i = 0; i < SIZE; i++) {
+      T* item = idx_[i].load(std::memory_order_acquire);
+      if (item != NULL) {
+        fn(item);
+      }
+    }
+  }
+
   size_t storage_size() {
     size_t tot_size = SIZE * sizeof(atomic_ref);
     for (uint32_t i = 0; i < SIZE; i++) {
@@ -61,21 +83,47 @@ class indexlet {
   }
 
  private:
-  std::array<atomic_ref, SIZE> idx_;
+  atomic_ref* idx_;
 };
 
 template<size_t SIZE>
 class __index_depth1 {
  public:
-  entry_list* get(const uint64_t key) {
+  posting_list* get(const uint64_t key) {
     return idx_[key];
   }
 
   void add_entry(const uint64_t key, const uint64_t val) {
-    entry_list* list = get(key);
+    posting_list* list = get(key);
     list->push_back(val);
   }
 
+  // Gets the posting list for key without allocating; NULL if absent.
+  const posting_list* find(const uint64_t key) const {
+    return key < SIZE ? idx_.at(key) : NULL;
+  }
+
+  // Invokes fn(key, list) on every posting list with key in [beg, end],
+  // without allocating.
+  template<typename F>
+  void for_each(const uint64_t beg, const uint64_t end, F fn) const {
+    visit(beg, end, 0, fn);
+  }
+
+  // Range scan relative to base; used by the enclosing tiers.
+  template<typename F>
+  void visit(const uint64_t beg, const uint64_t end, const uint64_t base,
+             F& fn) const {
+    if (beg >= SIZE || beg > end)
+      return;
+    uint64_t last = std::min<uint64_t>(end, SIZE - 1);
+    for (uint64_t i = beg; i <= last; i++) {
+      const posting_list* list = idx_.at(i);
+      if (list != NULL)
+        fn(base + i, list);
+    }
+  }
+
   size_t max_size() {
     return SIZE;
   }
@@ -84,23 +132,66 @@ class __index_depth1 {
     return idx_.storage_size();
   }
 
+  // Accumulates the number of postings, and the storage used by the posting
+  // lists alone (excluding the index tiers).
+  void posting_footprint(size_t& num_postings, size_t& list_size) const {
+    idx_.for_each([&](const posting_list* list) {
+      num_postings += list->size();
+      list_size += list->storage_size();
+    });
+  }
+
  protected:
-  indexlet<entry_list, SIZE> idx_;
+  indexlet<posting_list, SIZE> idx_;
 };
 
 template<size_t SIZE1, size_t SIZE2>
 class __index_depth2 {
  public:
-  entry_list* get(const uint64_t key) {
+  posting_list* get(const uint64_t key) {
     __index_depth1 <SIZE2>* ilet = idx_[key / SIZE2];
     return ilet->get(key % SIZE2);
   }
 
   void add_entry(const uint64_t key, const uint64_t val) {
-    entry_list* list = get(key);
+    posting_list* list = get(key);
     list->push_back(val);
   }
 
+  // Gets the posting list for key without allocating; NULL if absent.
+  const posting_list* find(const uint64_t key) const {
+    if (key / SIZE2 >= SIZE1)
+      return NULL;
+    const __index_depth1 <SIZE2>* ilet = idx_.at(key / SIZE2);
+    return ilet == NULL ? NULL : ilet->find(key % SIZE2);
+  }
+
+  // Invokes fn(key, list) on every posting list with key in [beg, end],
+  // without allocating; unpopulated subtrees are skipped.
+  template<typename F>
+  void for_each(const uint64_t beg, const uint64_t end, F fn) const {
+    visit(beg, end, 0, fn);
+  }
+
+  // Range scan relative to base; used by the enclosing tiers.
+  template<typename F>
+  void visit(const uint64_t beg, const uint64_t end, const uint64_t base,
+             F& fn) const {
+    const uint64_t div = SIZE2;
+    uint64_t first = beg / div;
+    if (first >= SIZE1 || beg > end)
+      return;
+    uint64_t last = std::min<uint64_t>(end / div, SIZE1 - 1);
+    for (uint64_t i = first; i <= last; i++) {
+      const __index_depth1 <SIZE2>* ilet = idx_.at(i);
+      if (ilet == NULL)
+        continue;
+      uint64_t lo = (i == first) ? beg % div : 0;
+      uint64_t hi = (i == end / div) ? end % div : div - 1;
+      ilet->visit(lo, hi, base + i * div, fn);
+    }
+  }
+
   size_t max_size() {
     return SIZE1 * SIZE2;
   }
@@ -109,6 +200,12 @@ class __index_depth2 {
     return idx_.storage_size();
   }
 
+  void posting_footprint(size_t& num_postings, size_t& list_size) const {
+    idx_.for_each([&](const __index_depth1 <SIZE2>* ilet) {
+      ilet->posting_footprint(num_postings, list_size);
+    });
+  }
+
  private:
   indexlet<__index_depth1 <SIZE2>, SIZE1> idx_;
 };
@@ -116,16 +213,50 @@ class __index_depth2 {
 template<size_t SIZE1, size_t SIZE2, size_t SIZE3>
 class __index_depth3 {
  public:
-  entry_list* get(const uint64_t key) {
+  posting_list* get(const uint64_t key) {
     __index_depth2 <SIZE2, SIZE3>* ilet = idx_[key / (SIZE2 * SIZE3)];
     return ilet->get(key % (SIZE2 * SIZE3));
   }
 
   void add_entry(const uint64_t key, const uint64_t val) {
-    entry_list* list = get(key);
+    posting_list* list = get(key);
     list->push_back(val);
   }
 
+  // Gets the posting list for key without allocating; NULL if absent.
+  const posting_list* find(const uint64_t key) const {
+    if (key / (SIZE2 * SIZE3) >= SIZE1)
+      return NULL;
+    const __index_depth2 <SIZE2, SIZE3>* ilet = idx_.at(key / (SIZE2 * SIZE3));
+    return ilet == NULL ? NULL : ilet->find(key % (SIZE2 * SIZE3));
+  }
+
+  // Invokes fn(key, list) on every posting list with key in [beg, end],
+  // without allocating; unpopulated subtrees are skipped.
+  template<typename F>
+  void for_each(const uint64_t beg, const uint64_t end, F fn) const {
+    visit(beg, end, 0, fn);
+  }
+
+  // Range scan relative to base; used by the enclosing tiers.
+  template<typename F>
+  void visit(const uint64_t beg, const uint64_t end, const uint64_t base,
+             F& fn) const {
+    const uint64_t div = (SIZE2 * SIZE3);
+    uint64_t first = beg / div;
+    if (first >= SIZE1 || beg > end)
+      return;
+    uint64_t last = std::min<uint64_t>(end / div, SIZE1 - 1);
+    for (uint64_t i = first; i <= last; i++) {
+      const __index_depth2 <SIZE2, SIZE3>* ilet = idx_.at(i);
+      if (ilet == NULL)
+        continue;
+      uint64_t lo = (i == first) ? beg % div : 0;
+      uint64_t hi = (i == end / div) ? end % div : div - 1;
+      ilet->visit(lo, hi, base + i * div, fn);
+    }
+  }
+
   size_t max_size() {
     return SIZE1 * SIZE2 * SIZE3;
   }
@@ -134,6 +265,12 @@ class __index_depth3 {
     return idx_.storage_size();
   }
 
+  void posting_footprint(size_t& num_postings, size_t& list_size) const {
+    idx_.for_each([&](const __index_depth2 <SIZE2, SIZE3>* ilet) {
+      ilet->posting_footprint(num_postings, list_size);
+    });
+  }
+
  private:
   indexlet<__index_depth2 <SIZE2, SIZE3>, SIZE1> idx_;
 };
@@ -141,25 +278,66 @@ class __index_depth3 {
 template<size_t SIZE1, size_t SIZE2, size_t SIZE3, size_t SIZE4>
 class __index_depth4 {
  public:
-  entry_list* get(const uint64_t key) {
+  posting_list* get(const uint64_t key) {
     __index_depth3 <SIZE2, SIZE3, SIZE4>* ilet = idx_[key
         / (SIZE2 * SIZE3 * SIZE4)];
     return ilet->get(key % (SIZE2 * SIZE3 * SIZE4));
   }
 
   void add_entry(const uint64_t key, uint64_t val) {
-    entry_list* list = get(key);
+    posting_list* list = get(key);
     list->push_back(val);
   }
 
+  // Gets the posting list for key without allocating; NULL if absent.
+  const posting_list* find(const uint64_t key) const {
+    if (key / (SIZE2 * SIZE3 * SIZE4) >= SIZE1)
+      return NULL;
+    const __index_depth3 <SIZE2, SIZE3, SIZE4>* ilet = idx_.at(key / (SIZE2 * SIZE3 * SIZE4));
+    return ilet == NULL ? NULL : ilet->find(key % (SIZE2 * SIZE3 * SIZE4));
+  }
+
+  // Invokes fn(key, list) on every posting list with key in [beg, end],
+  // without allocating; unpopulated subtrees are skipped.
+  template<typename F>
+  void for_each(const uint64_t beg, const uint64_t end, F fn) const {
+    visit(beg, end, 0, fn);
+  }
+
+  // Range scan relative to base; used by the enclosing tiers.
+  template<typename F>
+  void visit(const uint64_t beg, const uint64_t end, const uint64_t base,
+             F& fn) const {
+    const uint64_t div = (SIZE2 * SIZE3 * SIZE4);
+    uint64_t first = beg / div;
+    if (first >= SIZE1 || beg > end)
+      return;
+    uint64_t last = std::min<uint64_t>(end / div, SIZE1 - 1);
+    for (uint64_t i = first; i <= last; i++) {
+      const __index_depth3 <SIZE2, SIZE3, SIZE4>* ilet = idx_.at(i);
+      if (ilet == NULL)
+        continue;
+      uint64_t lo = (i == first) ? beg % div : 0;
+      uint64_t hi = (i == end / div) ? end % div : div - 1;
+      ilet->visit(lo, hi, base + i * div, fn);
+    }
+  }
+
+  // Note: wraps to 0 when the index spans the full 64-bit key space.
   size_t max_size() {
-    return SIZE1 * SIZE2 * SIZE3;
+    return SIZE1 * SIZE2 * SIZE3 * SIZE4;
   }
 
   size_t storage_size() {
     return idx_.storage_size();
   }
 
+  void posting_footprint(size_t& num_postings, size_t& list_size) const {
+    idx_.for_each([&](const __index_depth3 <SIZE2, SIZE3, SIZE4>* ilet) {
+      ilet->posting_footprint(num_postings, list_size);
+    });
+  }
+
  private:
   indexlet<__index_depth3 <SIZE2, SIZE3, SIZE4>, SIZE1> idx_;
 };
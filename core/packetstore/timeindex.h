@@ -0,0 +1,204 @@
+#ifndef SLOG_TIMEINDEX_H_
+#define SLOG_TIMEINDEX_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+#include <unistd.h>
+
+#include "monolog.h"
+
+namespace slog {
+
+/**
+ * Sparse index from insertion time to record ids.
+ *
+ * Records are inserted in time order, so the records inserted within a time
+ * bucket form a range of record ids. The index holds one entry per non-empty
+ * bucket: the bucket and the first record id inserted in it, in increasing
+ * order of both. A time range maps to a record id range with two binary
+ * searches, instead of an index token per record.
+ *
+ * Inserters add an entry only when a batch starts a new bucket, under a
+ * mutex; lookups are lock-free. With several concurrent inserters, the
+ * boundaries of a range are exact up to the records in flight when its
+ * buckets began.
+ */
+class time_index {
+ public:
+  /* Time bucket granularity */
+  static const uint64_t BUCKET_NS = 1000000;
+
+  time_index()
+      : size_(0),
+        last_bucket_(UINT64_MAX) {
+  }
+
+  /**
+   * Record that the records from next_id on are inserted at or after
+   * time_ns. Called once per batch, with non-decreasing times.
+   *
+   * @param time_ns The insertion time of the batch.
+   * @param next_id The smallest record id that may be assigned to the batch.
+   */
+  void add(uint64_t time_ns, uint64_t next_id) {
+    uint64_t bucket = time_ns / BUCKET_NS;
+    uint64_t last = last_bucket_.load(std::memory_order_relaxed);
+    if (last != UINT64_MAX && bucket <= last) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t n = size_.load(std::memory_order_relaxed);
+    if (n != 0 && bucket <= buckets_.get(n - 1)) {
+      return;
+    }
+    buckets_.set(n, bucket);
+    ids_.set(n, next_id);
+    size_.store(n + 1, std::memory_order_release);
+    last_bucket_.store(bucket, std::memory_order_relaxed);
+  }
+
+  /**
+   * Get the range of record ids inserted within [beg_ns, end_ns], at bucket
+   * granularity.
+   *
+   * @param beg_ns The start of the time range.
+   * @param end_ns The end of the time range (inclusive).
+   * @param beg_id The first record id of the range.
+   * @param end_id One past the last record id of the range; UINT64_MAX if
+   *  the range extends to the latest records.
+   */
+  void lookup(uint64_t beg_ns, uint64_t end_ns, uint64_t& beg_id,
+              uint64_t& end_id) const {
+    uint64_t n = size_.load(std::memory_order_acquire);
+    uint64_t beg = first_after(beg_ns / BUCKET_NS, n, false);
+    uint64_t end = first_after(end_ns / BUCKET_NS, n, true);
+    beg_id = beg < n ? ids_.get(beg) : UINT64_MAX;
+    end_id = end < n ? ids_.get(end) : UINT64_MAX;
+  }
+
+  /**
+   * Get the time a record was inserted at, at bucket granularity.
+   *
+   * @param record_id The id of the record.
+   * @return The start of the bucket of the record; 0 if it precedes the
+   *  index.
+   */
+  uint64_t time_of(uint64_t record_id) const {
+    uint64_t lo = 0;
+    uint64_t hi = size_.load(std::memory_order_acquire);
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (ids_.get(mid) <= record_id) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo != 0 ? buckets_.get(lo - 1) * BUCKET_NS : 0;
+  }
+
+  /**
+   * Get the end of the last bucket in the index, which bounds the insertion
+   * times of all records from above.
+   *
+   * @return One past the last time covered by the index; 0 if it is empty.
+   */
+  uint64_t end_ns() const {
+    uint64_t n = size_.load(std::memory_order_acquire);
+    return n != 0 ? (buckets_.get(n - 1) + 1) * BUCKET_NS : 0;
+  }
+
+  /**
+   * Durably replace the entries saved at path with those of the index;
+   * e.g., along with a checkpoint of the log-store it indexes. Entries may
+   * be added concurrently.
+   *
+   * @param path The path of the saved index.
+   * @return true if the index was saved, false otherwise.
+   */
+  bool save(const std::string& path) {
+    std::string tmp_path = path + ".tmp";
+    FILE* f = fopen(tmp_path.c_str(), "w");
+    if (f == NULL) {
+      return false;
+    }
+    uint64_t n;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      n = size_.load(std::memory_order_relaxed);
+    }
+    for (uint64_t i = 0; i < n; i++) {
+      fprintf(f, "%llu %llu\n", (unsigned long long) buckets_.get(i),
+              (unsigned long long) ids_.get(i));
+    }
+    bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+    return ok && rename(tmp_path.c_str(), path.c_str()) == 0;
+  }
+
+  /**
+   * Restore the entries saved at path into an empty index, up to those of
+   * the records that were restored with it.
+   *
+   * @param path The path of the saved index.
+   * @param num_ids The number of records restored; entries for the records
+   *  from there on are skipped.
+   * @return true if the saved index exists and was read, false otherwise.
+   */
+  bool load(const std::string& path, uint64_t num_ids) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (f == NULL) {
+      return false;
+    }
+    unsigned long long bucket, id;
+    while (fscanf(f, "%llu %llu", &bucket, &id) == 2 && id < num_ids) {
+      add(bucket * BUCKET_NS, id);
+    }
+    fclose(f);
+    return true;
+  }
+
+  /**
+   * Get the number of entries (non-empty time buckets).
+   */
+  uint64_t size() const {
+    return size_.load(std::memory_order_acquire);
+  }
+
+  size_t storage_size() const {
+    return buckets_.storage_size() + ids_.storage_size();
+  }
+
+ private:
+  /* Index of the first of the n entries with a bucket greater than (or, if
+   * not strict, equal to) bucket; n if there is none */
+  uint64_t first_after(uint64_t bucket, uint64_t n, bool strict) const {
+    uint64_t lo = 0;
+    uint64_t hi = n;
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      uint64_t b = buckets_.get(mid);
+      if (b < bucket || (strict && b == bucket)) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  __monolog_base<uint64_t> buckets_;
+  __monolog_base<uint64_t> ids_;
+  std::atomic<uint64_t> size_;
+  std::atomic<uint64_t> last_bucket_;
+  std::mutex mutex_;
+};
+
+}
+
+#endif /* SLOG_TIMEINDEX_H_ */
@@ -0,0 +1,73 @@
+#include "timeindex.h"
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+const uint64_t kMs = slog::time_index::BUCKET_NS;
+
+TEST(TimeIndexTest, MapsTimeRangesToRecordRanges) {
+  slog::time_index index;
+  uint64_t beg_id;
+  uint64_t end_id;
+  index.lookup(0, UINT64_MAX, beg_id, end_id);
+  ASSERT_EQ(UINT64_MAX, beg_id);
+
+  // Batches of 10 records every half millisecond, from 5ms on
+  for (uint64_t b = 0; b < 100; b++) {
+    index.add(5 * kMs + b * kMs / 2, b * 10);
+  }
+  ASSERT_EQ(50U, index.size());
+
+  index.lookup(0, UINT64_MAX, beg_id, end_id);
+  ASSERT_EQ(0U, beg_id);
+  ASSERT_EQ(UINT64_MAX, end_id);
+
+  // Buckets 10 to 19 hold batches 10 to 29
+  index.lookup(10 * kMs + 1, 19 * kMs + 1, beg_id, end_id);
+  ASSERT_EQ(100U, beg_id);
+  ASSERT_EQ(300U, end_id);
+
+  index.lookup(0, 4 * kMs, beg_id, end_id);
+  ASSERT_EQ(beg_id, end_id);
+  index.lookup(60 * kMs, UINT64_MAX, beg_id, end_id);
+  ASSERT_EQ(UINT64_MAX, beg_id);
+
+  // Records map back to the start of their bucket
+  ASSERT_EQ(5 * kMs, index.time_of(0));
+  ASSERT_EQ(10 * kMs, index.time_of(100));
+  ASSERT_EQ(10 * kMs, index.time_of(119));
+  ASSERT_EQ(11 * kMs, index.time_of(120));
+  ASSERT_EQ(54 * kMs, index.time_of(UINT64_MAX));
+}
+
+TEST(TimeIndexTest, ConcurrentInserters) {
+  slog::time_index index;
+  std::vector<std::thread> writers;
+  for (uint64_t t = 0; t < 4; t++) {
+    writers.push_back(std::thread([&index, t] {
+      for (uint64_t i = 0; i < 10000; i++) {
+        index.add((i * 4 + t) * kMs / 4, i * 4 + t);
+      }
+    }));
+  }
+  for (std::thread &t : writers) {
+    t.join();
+  }
+
+  // Entries stay ordered by both time and record id
+  uint64_t prev_beg = 0;
+  for (uint64_t ms = 0; ms < 10000; ms++) {
+    uint64_t beg_id;
+    uint64_t end_id;
+    index.lookup(ms * kMs, ms * kMs, beg_id, end_id);
+    ASSERT_LE(prev_beg, beg_id);
+    ASSERT_LE(beg_id, end_id);
+    prev_beg = beg_id;
+  }
+}
+
+}  // namespace (unnamed)
@@ -22,6 +22,20 @@ class bit_utils {
 #endif
     return y;
   }
+
+  static inline uint32_t highest_bit(uint64_t x) {
+    uint64_t y = 0;
+#ifdef BSR
+    asm ( "\tbsrq %1, %0\n"
+        : "=r"(y)
+        : "r" (x)
+    );
+#else
+    while (x >>= 1)
+    ++y;
+#endif
+    return (uint32_t) y;
+  }
 };
 
 class cast_utils {
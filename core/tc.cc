@@ -12,6 +12,7 @@
 #include "worker.h"
 #include "task.h"
 #include "utils/common.h"
+#include "utils/rcu.h"
 #include "utils/time.h"
 #include "utils/random.h"
 
@@ -667,6 +668,10 @@ void sched_loop(struct sched *s) {
     /* periodic check for every 2^8 rounds,
      * to mitigate expensive operations */
     if ((round & accounting_mask) == 0) {
+      if (unlikely(rcu_num_deferred)) {
+        rcu_reclaim();
+      }
+
       if (unlikely(ctx.is_pause_requested())) {
         if (unlikely(ctx.Block())) {
           // TODO(barath): Add log message here?
@@ -682,5 +687,8 @@ void sched_loop(struct sched *s) {
     }
 
     schedule_once(s);
+
+    /* no packet (or table entry) is referenced across rounds */
+    rcu_quiescent(ctx.wid());
   }
 }
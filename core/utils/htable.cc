@@ -7,63 +7,157 @@
 #include <rte_hash_crc.h>
 
 #include "../mem_alloc.h"
+#include "rcu.h"
 
-const HTableBase::KeyCmpFunc HTableBase::kDefaultKeyCmpFunc = memcmp;
-const HTableBase::HashFunc HTableBase::kDefaultHashFunc = rte_hash_crc;
+template <int W>
+const typename HTableBaseT<W>::KeyCmpFunc HTableBaseT<W>::kDefaultKeyCmpFunc =
+    memcmp;
+template <int W>
+const typename HTableBaseT<W>::HashFunc HTableBaseT<W>::kDefaultHashFunc =
+    rte_hash_crc;
 
 /* from the stored key pointer, return its value pointer */
-void *HTableBase::key_to_value(const void *key) const {
+template <int W>
+void *HTableBaseT<W>::key_to_value(const void *key) const {
   return (void *)((char *)key + value_offset_);
 }
 
 /* actually works faster for very small tables */
-HTableBase::KeyIndex HTableBase::_get_keyidx(uint32_t pri) const {
+template <int W>
+typename HTableBaseT<W>::KeyIndex HTableBaseT<W>::_get_keyidx(
+    uint32_t pri) const {
   Bucket *bucket = hv_to_bucket(pri);
+  int m = match_slots(bucket, pri);
 
-  for (int i = 0; i < kEntriesPerBucket; i++) {
-    if (pri == bucket->hv[i]) return bucket->keyidx[i];
-  }
+  if (m) return bucket->keyidx[__builtin_ctz(m)];
 
   uint32_t sec = hash_secondary(pri);
   bucket = hv_to_bucket(sec);
-  for (int i = 0; i < kEntriesPerBucket; i++) {
-    if (pri == bucket->hv[i]) return bucket->keyidx[i];
-  }
+  m = match_slots(bucket, pri);
+
+  if (m) return bucket->keyidx[__builtin_ctz(m)];
 
   return kInvalidKeyIdx;
 }
 
-void HTableBase::push_free_keyidx(KeyIndex idx) {
+template <int W>
+void HTableBaseT<W>::push_free_keyidx(KeyIndex idx) {
   assert(idx < num_entries_);
 
   *(KeyIndex *)((uintptr_t)entries_ + entry_size_ * idx) = free_keyidx_;
   free_keyidx_ = idx;
 }
 
-uint32_t HTableBase::hash(const void *key) const {
+/* Concurrent mode: the slot may still be read by lookups, so it is reused
+ * only after a grace period */
+template <int W>
+void HTableBaseT<W>::retire_keyidx(KeyIndex idx) {
+  assert(idx < num_entries_);
+
+  *(KeyIndex *)keyidx_to_ptr(idx) = retiring_keyidx_;
+  retiring_keyidx_ = idx;
+  retiring_epoch_ = rcu_retire();
+}
+
+/* Concurrent mode: move retired slots whose grace period has elapsed to the
+ * free list */
+template <int W>
+void HTableBaseT<W>::reclaim_keyidx() {
+  if (retired_keyidx_ != kInvalidKeyIdx && rcu_elapsed(retired_epoch_)) {
+    while (retired_keyidx_ != kInvalidKeyIdx) {
+      KeyIndex idx = retired_keyidx_;
+      retired_keyidx_ = get_next(idx);
+      push_free_keyidx(idx);
+    }
+  }
+
+  if (retired_keyidx_ == kInvalidKeyIdx) {
+    retired_keyidx_ = retiring_keyidx_;
+    retired_epoch_ = retiring_epoch_;
+    retiring_keyidx_ = kInvalidKeyIdx;
+  }
+}
+
+/* Concurrent mode: lookups of the buckets in the stripes of "a" and "b" (if
+ * any) that overlap with the update will be retried. A stripe shared by both
+ * buckets is bumped only once, so that it stays odd until write_end(). */
+template <int W>
+void HTableBaseT<W>::write_begin(const Bucket *a, const Bucket *b) {
+  if (concurrent_) {
+    uint32_t *va = stripe_version(a);
+    uint32_t *vb = b ? stripe_version(b) : va;
+
+    ACCESS_ONCE(*va)++;
+    if (vb != va) ACCESS_ONCE(*vb)++;
+    STORE_BARRIER();
+  }
+}
+
+template <int W>
+void HTableBaseT<W>::write_end(const Bucket *a, const Bucket *b) {
+  if (concurrent_) {
+    uint32_t *va = stripe_version(a);
+    uint32_t *vb = b ? stripe_version(b) : va;
+
+    STORE_BARRIER();
+    if (vb != va) ACCESS_ONCE(*vb)++;
+    ACCESS_ONCE(*va)++;
+  }
+}
+
+/* mem_alloc() may align only to 16 bytes (as calloc() does), which would let
+ * 8-way buckets straddle two cache lines */
+template <int W>
+typename HTableBaseT<W>::Bucket *HTableBaseT<W>::alloc_buckets(
+    uint32_t num_buckets) {
+  return (Bucket *)mem_alloc_aligned(num_buckets * sizeof(Bucket),
+                                     alignof(Bucket));
+}
+
+template <int W>
+uint32_t HTableBaseT<W>::hash(const void *key) const {
   return hash_func_(key, key_size_, kHashInitval);
 }
 
-uint32_t HTableBase::hash_nonzero(const void *key) const {
+template <int W>
+uint32_t HTableBaseT<W>::hash_nonzero(const void *key) const {
   return make_nonzero(hash(key));
 }
 
 /* entry array grows much more gently (50%) than bucket array (100%),
  * since space efficiency may be important for large keys and/or values. */
-int HTableBase::expand_entries() {
+template <int W>
+int HTableBaseT<W>::expand_entries() {
   KeyIndex old_size = num_entries_;
   KeyIndex new_size = old_size + old_size / 2;
 
+  void *old_entries = entries_;
   void *new_entries;
 
-  new_entries = mem_realloc(entries_, new_size * entry_size_);
-  if (!new_entries) {
-    return -ENOMEM;
+  if (concurrent_) {
+    /* lookups may still read the old array, so it is not reallocated */
+    new_entries = mem_alloc(new_size * entry_size_);
+    if (!new_entries) {
+      return -ENOMEM;
+    }
+    memcpy(new_entries, old_entries, old_size * entry_size_);
+
+    /* published before any bucket refers to the new slots */
+    STORE_BARRIER();
+  } else {
+    new_entries = mem_realloc(entries_, new_size * entry_size_);
+    if (!new_entries) {
+      return -ENOMEM;
+    }
   }
 
   num_entries_ = new_size;
   entries_ = new_entries;
 
+  if (concurrent_) {
+    rcu_defer(mem_free, old_entries);
+  }
+
   for (KeyIndex i = new_size - 1; i-- > old_size;) {
     push_free_keyidx(i);
   }
@@ -71,13 +165,21 @@ int HTableBase::expand_entries() {
   return 0;
 }
 
-HTableBase::KeyIndex HTableBase::get_next(KeyIndex curr) const {
+template <int W>
+typename HTableBaseT<W>::KeyIndex HTableBaseT<W>::get_next(
+    KeyIndex curr) const {
   return *(KeyIndex *)keyidx_to_ptr(curr);
 }
 
-HTableBase::KeyIndex HTableBase::pop_free_keyidx() {
+template <int W>
+typename HTableBaseT<W>::KeyIndex HTableBaseT<W>::pop_free_keyidx() {
   KeyIndex ret = free_keyidx_;
 
+  if (ret == kInvalidKeyIdx && concurrent_) {
+    reclaim_keyidx();
+    ret = free_keyidx_;
+  }
+
   if (ret == kInvalidKeyIdx) {
     ret = expand_entries();
     if (ret) return ret;
@@ -91,9 +193,11 @@ HTableBase::KeyIndex HTableBase::pop_free_keyidx() {
 }
 
 /* returns an empty slot ID, or -ENOSPC */
-int HTableBase::find_empty_slot(const Bucket *bucket) {
-  for (int i = 0; i < kEntriesPerBucket; i++)
-    if (bucket->hv[i] == 0) return i;
+template <int W>
+int HTableBaseT<W>::find_empty_slot(const Bucket *bucket) {
+  int m = match_slots(bucket, 0);
+
+  if (m) return __builtin_ctz(m);
 
   return -ENOSPC;
 }
@@ -101,7 +205,8 @@ int HTableBase::find_empty_slot(const Bucket *bucket) {
 /* Recursive function to try making an empty slot in the bucket.
  * Returns a slot ID in [0, kEntriesPerBucket) for successful operation,
  * or -ENOSPC if failed */
-int HTableBase::make_space(Bucket *bucket, int depth) {
+template <int W>
+int HTableBaseT<W>::make_space(Bucket *bucket, int depth) {
   if (depth >= kMaxCuckooPath) return -ENOSPC;
 
   /* Something is wrong if there's already an empty slot in this bucket */
@@ -119,17 +224,21 @@ int HTableBase::make_space(Bucket *bucket, int depth) {
       alt_bucket = hv_to_bucket(sec);
     else if (sec == bucket->hv[i])
       alt_bucket = hv_to_bucket(pri);
-    else
+    else {
       assert(0);
+      continue;
+    }
 
     j = find_empty_slot(alt_bucket);
     if (j == -ENOSPC) j = make_space(alt_bucket, depth + 1);
 
     if (j >= 0) {
       /* Yay, we found one. Push recursively... */
-      alt_bucket->hv[j] = bucket->hv[i];
+      write_begin(alt_bucket, bucket);
       alt_bucket->keyidx[j] = bucket->keyidx[i];
+      alt_bucket->hv[j] = bucket->hv[i];
       bucket->hv[i] = 0;
+      write_end(alt_bucket, bucket);
       return i;
     }
   }
@@ -138,31 +247,34 @@ int HTableBase::make_space(Bucket *bucket, int depth) {
 }
 
 /* -ENOSPC if the bucket is full, 0 for success */
-int HTableBase::add_to_bucket(Bucket *bucket, const void *key,
-                              const void *value) {
-  for (int i = 0; i < kEntriesPerBucket; i++) {
-    if (bucket->hv[i] == 0) {
-      void *entry;
-      KeyIndex k_idx = pop_free_keyidx();
-
-      bucket->hv[i] = hash_nonzero(key);
-      bucket->keyidx[i] = k_idx;
-
-      entry = keyidx_to_ptr(k_idx);
-      memcpy(entry, key, key_size_);
-      memcpy((void *)((uintptr_t)entry + value_offset_), value, value_size_);
-
-      cnt_++;
-      return 0;
-    }
-  }
-
-  return -ENOSPC;
+template <int W>
+int HTableBaseT<W>::add_to_bucket(Bucket *bucket, const void *key,
+                                  const void *value) {
+  int i = find_empty_slot(bucket);
+  if (i < 0) return i;
+
+  void *entry;
+  KeyIndex k_idx = pop_free_keyidx();
+
+  entry = keyidx_to_ptr(k_idx);
+  memcpy(entry, key, key_size_);
+  memcpy((void *)((uintptr_t)entry + value_offset_), value, value_size_);
+
+  /* the entry is complete before it is published */
+  write_begin(bucket);
+  bucket->keyidx[i] = k_idx;
+  STORE_BARRIER();
+  bucket->hv[i] = hash_nonzero(key);
+  write_end(bucket);
+
+  cnt_++;
+  return 0;
 }
 
 /* the key must not already exist in the hash table */
-int HTableBase::add_entry(uint32_t pri, uint32_t sec, const void *key,
-                          const void *value) {
+template <int W>
+int HTableBaseT<W>::add_entry(uint32_t pri, uint32_t sec, const void *key,
+                              const void *value) {
   Bucket *pri_bucket;
   Bucket *sec_bucket;
 
@@ -183,17 +295,16 @@ again:
   return -ENOSPC;
 }
 
-void *HTableBase::get_from_bucket(uint32_t pri, uint32_t hv,
-                                  const void *key) const {
+template <int W>
+void *HTableBaseT<W>::get_from_bucket(uint32_t pri, uint32_t hv,
+                                      const void *key) const {
   Bucket *bucket = hv_to_bucket(hv);
 
-  for (int i = 0; i < kEntriesPerBucket; i++) {
+  for (int m = match_slots(bucket, pri); m; m &= m - 1) {
     KeyIndex k_idx;
     void *key_stored;
 
-    if (pri != bucket->hv[i]) continue;
-
-    k_idx = bucket->keyidx[i];
+    k_idx = bucket->keyidx[__builtin_ctz(m)];
     key_stored = keyidx_to_ptr(k_idx);
 
     if (keycmp_func_(key, key_stored, key_size_) == 0)
@@ -203,21 +314,27 @@ void *HTableBase::get_from_bucket(uint32_t pri, uint32_t hv,
   return nullptr;
 }
 
-int HTableBase::del_from_bucket(uint32_t pri, uint32_t hv, const void *key) {
+template <int W>
+int HTableBaseT<W>::del_from_bucket(uint32_t pri, uint32_t hv,
+                                    const void *key) {
   Bucket *bucket = hv_to_bucket(hv);
 
-  for (int i = 0; i < kEntriesPerBucket; i++) {
+  for (int m = match_slots(bucket, pri); m; m &= m - 1) {
+    int i = __builtin_ctz(m);
     KeyIndex k_idx;
     void *key_stored;
 
-    if (pri != bucket->hv[i]) continue;
-
     k_idx = bucket->keyidx[i];
     key_stored = keyidx_to_ptr(k_idx);
 
     if (keycmp_func_(key, key_stored, key_size_) == 0) {
+      write_begin(bucket);
       bucket->hv[i] = 0;
-      push_free_keyidx(k_idx);
+      write_end(bucket);
+      if (concurrent_)
+        retire_keyidx(k_idx);
+      else
+        push_free_keyidx(k_idx);
       cnt_--;
       return 0;
     }
@@ -226,7 +343,8 @@ int HTableBase::del_from_bucket(uint32_t pri, uint32_t hv, const void *key) {
   return -ENOENT;
 }
 
-int HTableBase::InitEx(struct ht_params *params) {
+template <int W>
+int HTableBaseT<W>::InitEx(struct ht_params *params) {
   if (!params) {
     return -EINVAL;
   }
@@ -259,6 +377,11 @@ int HTableBase::InitEx(struct ht_params *params) {
     return -EINVAL;
   }
 
+  /* retired slots are linked through the first bytes of their keys */
+  if (params->concurrent && params->key_size < sizeof(KeyIndex)) {
+    return -EINVAL;
+  }
+
   hash_func_ = params->hash_func ?: kDefaultHashFunc;
   keycmp_func_ = params->keycmp_func ?: kDefaultKeyCmpFunc;
 
@@ -267,13 +390,15 @@ int HTableBase::InitEx(struct ht_params *params) {
   cnt_ = 0;
   num_entries_ = params->num_entries;
   free_keyidx_ = kInvalidKeyIdx;
+  retiring_keyidx_ = kInvalidKeyIdx;
+  retired_keyidx_ = kInvalidKeyIdx;
 
   key_size_ = params->key_size;
   value_size_ = params->value_size;
   value_offset_ = align_ceil(key_size_, std::max(1ul, params->value_align));
   entry_size_ = align_ceil(value_offset_ + value_size_, params->key_align);
 
-  buckets_ = (Bucket *)mem_alloc((bucket_mask_ + 1) * sizeof(Bucket));
+  buckets_ = alloc_buckets(bucket_mask_ + 1);
   if (!buckets_) return -ENOMEM;
 
   entries_ = mem_alloc(num_entries_ * entry_size_);
@@ -282,13 +407,25 @@ int HTableBase::InitEx(struct ht_params *params) {
     return -ENOMEM;
   }
 
+  if (params->concurrent) {
+    bucket_versions_ =
+        (uint32_t *)mem_alloc(kNumVersionStripes * sizeof(uint32_t));
+    if (!bucket_versions_) {
+      mem_free(buckets_);
+      mem_free(entries_);
+      return -ENOMEM;
+    }
+    concurrent_ = true;
+  }
+
   // beware of underflow
   for (KeyIndex i = num_entries_ - 1; i-- > 0;) push_free_keyidx(i);
 
   return 0;
 }
 
-int HTableBase::Init(size_t key_size, size_t value_size) {
+template <int W>
+int HTableBaseT<W>::Init(size_t key_size, size_t value_size, bool concurrent) {
   struct ht_params params = {};
 
   params.key_size = key_size;
@@ -311,33 +448,42 @@ int HTableBase::Init(size_t key_size, size_t value_size) {
   params.hash_func = nullptr;
   params.keycmp_func = nullptr;
 
+  params.concurrent = concurrent;
+
   return InitEx(&params);
 }
 
-void HTableBase::Close() {
+template <int W>
+void HTableBaseT<W>::Close() {
   mem_free(buckets_);
   mem_free(entries_);
+  mem_free(bucket_versions_);
   memset(this, 0, sizeof(*this));
 }
 
-void HTableBase::Clear() {
+template <int W>
+void HTableBaseT<W>::Clear() {
   uint32_t next = 0;
   void *key;
 
   while ((key = Iterate(&next))) Del(key);
 }
 
-void *HTableBase::Get(const void *key) const {
+template <int W>
+void *HTableBaseT<W>::Get(const void *key) const {
   uint32_t pri = hash(key);
 
   return GetHash(pri, key);
 }
 
-void *HTableBase::GetHash(uint32_t pri, const void *key) const {
+template <int W>
+void *HTableBaseT<W>::GetHash(uint32_t pri, const void *key) const {
   void *ret;
 
   pri = make_nonzero(pri);
 
+  if (concurrent_) return get_concurrent(pri, key, keycmp_func_);
+
   /* check primary bucket */
   ret = get_from_bucket(pri, pri, key);
   if (ret) return ret;
@@ -346,14 +492,19 @@ void *HTableBase::GetHash(uint32_t pri, const void *key) const {
   return get_from_bucket(pri, hash_secondary(pri), key);
 }
 
-int HTableBase::clone_table(HTableBase *t_old, uint32_t num_buckets,
-                            KeyIndex num_entries) {
+template <int W>
+int HTableBaseT<W>::clone_table(HTableBaseT *t_old, uint32_t num_buckets,
+                                KeyIndex num_entries) {
   uint32_t next = 0;
   void *key;
 
   *this = *t_old;
 
-  buckets_ = (Bucket *)mem_alloc(num_buckets * sizeof(Bucket));
+  /* the clone is private until it is published */
+  concurrent_ = false;
+  bucket_versions_ = nullptr;
+
+  buckets_ = alloc_buckets(num_buckets);
   if (!buckets_) return -ENOMEM;
 
   entries_ = mem_alloc(num_entries * entry_size_);
@@ -384,22 +535,68 @@ int HTableBase::clone_table(HTableBase *t_old, uint32_t num_buckets,
 }
 
 /* may be called recursively */
-int HTableBase::expand_buckets() {
-  HTableBase *t = new HTableBase;
+template <int W>
+int HTableBaseT<W>::expand_buckets() {
+  HTableBaseT *t = new HTableBaseT;
   uint32_t num_buckets = (bucket_mask_ + 1) * 2;
 
   assert(num_buckets == align_ceil_pow2(num_buckets));
 
   int ret = t->clone_table(this, num_buckets, num_entries_);
   if (ret == 0) {
-    Close();
-    *this = *t;
+    if (concurrent_) {
+      publish_table(t);
+    } else {
+      Close();
+      *this = *t;
+
+      /* the arrays now belong to this table */
+      t->buckets_ = nullptr;
+      t->entries_ = nullptr;
+      delete t;
+    }
   }
 
   return ret;
 }
 
-int HTableBase::Set(const void *key, const void *value) {
+/* Concurrent mode: replace the arrays with those of the expanded table "t".
+ * Lookups that overlap with the swap are retried; the old arrays are freed
+ * once no lookup can be reading them. */
+template <int W>
+void HTableBaseT<W>::publish_table(HTableBaseT *t) {
+  void *old_buckets = buckets_;
+  void *old_entries = entries_;
+
+  table_version_++;
+  STORE_BARRIER();
+
+  entries_ = t->entries_;
+  buckets_ = t->buckets_;
+  STORE_BARRIER();
+  bucket_mask_ = t->bucket_mask_;
+
+  cnt_ = t->cnt_;
+  num_entries_ = t->num_entries_;
+  free_keyidx_ = t->free_keyidx_;
+
+  /* retired slots of the old entry array go away with it */
+  retiring_keyidx_ = kInvalidKeyIdx;
+  retired_keyidx_ = kInvalidKeyIdx;
+
+  STORE_BARRIER();
+  table_version_++;
+
+  rcu_defer(mem_free, old_buckets);
+  rcu_defer(mem_free, old_entries);
+
+  t->buckets_ = nullptr;
+  t->entries_ = nullptr;
+  delete t;
+}
+
+template <int W>
+int HTableBaseT<W>::Set(const void *key, const void *value) {
   uint32_t pri = hash(key);
   uint32_t sec = hash_secondary(pri);
 
@@ -408,6 +605,7 @@ int HTableBase::Set(const void *key, const void *value) {
   /* If the key already exists, its value is updated with the new one */
   void *old_value = GetHash(pri, key);
   if (old_value) {
+    if (concurrent_) return replace_entry(make_nonzero(pri), key, value);
     memcpy(old_value, value, value_size_);
     return 1;
   }
@@ -425,7 +623,46 @@ int HTableBase::Set(const void *key, const void *value) {
   return ret;
 }
 
-int HTableBase::Del(const void *key) {
+/* Concurrent mode: lookups may be reading the old value, so the entry is
+ * replaced with a new one rather than updated in place.
+ * Returns 1, or -ENOMEM. */
+template <int W>
+int HTableBaseT<W>::replace_entry(uint32_t pri, const void *key,
+                                  const void *value) {
+  const uint32_t hvs[2] = {pri, hash_secondary(pri)};
+
+  for (int b = 0; b < 2; b++) {
+    Bucket *bucket = hv_to_bucket(hvs[b]);
+
+    for (int i = 0; i < kEntriesPerBucket; i++) {
+      KeyIndex old_idx = bucket->keyidx[i];
+
+      if (pri != bucket->hv[i] ||
+          keycmp_func_(key, keyidx_to_ptr(old_idx), key_size_) != 0)
+        continue;
+
+      KeyIndex new_idx = pop_free_keyidx();
+      if (new_idx >= num_entries_) return -ENOMEM;
+
+      void *entry = keyidx_to_ptr(new_idx);
+      memcpy(entry, key, key_size_);
+      memcpy((void *)((uintptr_t)entry + value_offset_), value, value_size_);
+
+      write_begin(bucket);
+      bucket->keyidx[i] = new_idx;
+      write_end(bucket);
+
+      retire_keyidx(old_idx);
+      return 1;
+    }
+  }
+
+  assert(0);
+  return -ENOENT;
+}
+
+template <int W>
+int HTableBaseT<W>::Del(const void *key) {
   uint32_t pri = hash_nonzero(key);
   uint32_t sec;
 
@@ -437,7 +674,8 @@ int HTableBase::Del(const void *key) {
   return -ENOENT;
 }
 
-void *HTableBase::Iterate(uint32_t *next) const {
+template <int W>
+void *HTableBaseT<W>::Iterate(uint32_t *next) const {
   uint32_t idx = *next;
 
   uint32_t i;
@@ -459,9 +697,11 @@ void *HTableBase::Iterate(uint32_t *next) const {
   return keyidx_to_ptr(buckets_[i].keyidx[j]);
 }
 
-int HTableBase::Count() const { return cnt_; }
+template <int W>
+int HTableBaseT<W>::Count() const { return cnt_; }
 
-int HTableBase::count_entries_in_pri_bucket() const {
+template <int W>
+int HTableBaseT<W>::count_entries_in_pri_bucket() const {
   int ret = 0;
 
   for (uint32_t i = 0; i < bucket_mask_ + 1; i++) {
@@ -474,7 +714,8 @@ int HTableBase::count_entries_in_pri_bucket() const {
   return ret;
 }
 
-void HTableBase::Dump(bool detail) const {
+template <int W>
+void HTableBaseT<W>::Dump(bool detail) const {
   int in_pri_bucket = count_entries_in_pri_bucket();
 
   printf("--------------------------------------------\n");
@@ -521,3 +762,6 @@ void HTableBase::Dump(bool detail) const {
   printf("entry_size = %zu\n", entry_size_);
   printf("\n");
 }
+
+template class HTableBaseT<4>;
+template class HTableBaseT<8>;
@@ -1,15 +1,28 @@
 /* Streamlined hash table implementation, with emphasis on lookup performance.
- * Key and value sizes are fixed. Lookup is thread-safe, but update is not. */
+ * Key and value sizes are fixed. Lookup is thread-safe, but update is not,
+ * unless the table is in concurrent mode (see ht_params::concurrent).
+ *
+ * The table is W-way set associative. The hash values of a bucket are
+ * compared all at once with SIMD instructions, so that only the slots with a
+ * matching hash value are followed to their keys. W = 4 (the default) packs
+ * a bucket in 32 bytes; W = 8 fills a 64-byte cache line, for higher
+ * occupancy before the bucket array has to grow, still with a single compare
+ * per bucket (with AVX2). */
 
 #ifndef BESS_UTILS_HTABLE_H_
 #define BESS_UTILS_HTABLE_H_
 
 #include <algorithm>
+#include <cerrno>
+#include <cstdio>
 #include <cstring>
+#include <limits>
 
+#include "../mem_alloc.h"
 #include "common.h"
 
-class HTableBase {
+/* Types shared by the tables of all bucket widths */
+class HTableTypes {
  public:
   /* compatible with DPDK's */
   typedef uint32_t (*HashFunc)(const void *key, uint32_t key_len,
@@ -19,9 +32,6 @@ class HTableBase {
   typedef int (*KeyCmpFunc)(const void *key, const void *key_stored,
                             size_t key_size);
 
-  static const KeyCmpFunc kDefaultKeyCmpFunc;
-  static const HashFunc kDefaultHashFunc;
-
   struct ht_params {
     size_t key_size;
     size_t value_size;
@@ -29,24 +39,78 @@ class HTableBase {
     size_t value_align;
 
     uint32_t num_buckets; /* must be a power of 2 */
-    int num_entries;      /* >= 4 */
+    int num_entries;      /* >= bucket width */
 
     HashFunc hash_func;
     KeyCmpFunc keycmp_func;
+
+    /* Concurrent mode: a single writer may update the table while workers
+     * look it up, without pausing them. Lookups retry if a bucket they read
+     * was modified meanwhile (seqlock style); replaced entries and the old
+     * arrays of a resized table are freed after an RCU grace period (see
+     * rcu.h), so the pointers returned by lookups stay valid until the
+     * worker's next quiescent state. Requires key_size >= 4. */
+    bool concurrent;
   };
 
-  HTableBase() = default;
-  ~HTableBase() { Close(); };
+ protected:
+  static const uint32_t kHashInitval = UINT32_MAX;
+
+  static uint32_t make_nonzero(uint32_t v) {
+    /* Set the MSB and unset the 2nd MSB (NOTE: must be idempotent).
+     * Then the result will never be a zero, and not a non-number when
+     * represented as float (so we are good to use _mm_*_ps() SIMD ops) */
+    return (v | (1u << 31)) & (~(1u << 30));
+  }
+
+  static uint32_t hash_secondary(uint32_t primary) {
+    /* from DPDK */
+    uint32_t tag = primary >> 12;
+    return primary ^ ((tag + 1) * 0x5bd1e995);
+  }
+
+  /* Returns a bitmask of the entries of "hvs", an array of W hash values,
+   * equal to "hv". W must be a multiple of 4. */
+  template <int W>
+  static int match_hv(const uint32_t *hvs, uint32_t hv) {
+#if __AVX2__
+    if (W == 8) {
+      __m256i tags = _mm256_loadu_si256((const __m256i *)hvs);
+      __m256i eq = _mm256_cmpeq_epi32(tags, _mm256_set1_epi32(hv));
+      return _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+    }
+#endif
+    __m128i v = _mm_set1_epi32(hv);
+    int mask = 0;
+
+    for (int i = 0; i < W; i += 4) {
+      __m128i tags = _mm_loadu_si128((const __m128i *)&hvs[i]);
+      __m128i eq = _mm_cmpeq_epi32(tags, v);
+      mask |= _mm_movemask_ps(_mm_castsi128_ps(eq)) << i;
+    }
+
+    return mask;
+  }
+};
+
+template <int W>
+class HTableBaseT : public HTableTypes {
+ public:
+  static const KeyCmpFunc kDefaultKeyCmpFunc;
+  static const HashFunc kDefaultHashFunc;
+
+  HTableBaseT() = default;
+  ~HTableBaseT() { Close(); };
 
   // not allowing copying for now
-  HTableBase(HTableBase &) = delete;
-  HTableBase(HTableBase &&) = delete;
+  HTableBaseT(HTableBaseT &) = delete;
+  HTableBaseT(HTableBaseT &&) = delete;
 
-  HTableBase &operator=(HTableBase &) = default;
-  HTableBase &operator=(HTableBase &&) = default;
+  HTableBaseT &operator=(HTableBaseT &) = default;
+  HTableBaseT &operator=(HTableBaseT &&) = default;
 
   /* -errno, or 0 for success */
-  int Init(size_t key_size, size_t value_size);
+  int Init(size_t key_size, size_t value_size, bool concurrent = false);
   int InitEx(struct ht_params *params);
   void Close();
 
@@ -77,24 +141,29 @@ class HTableBase {
  protected:
   typedef uint32_t KeyIndex;
 
-  static const int kEntriesPerBucket = 4; /* 4-way set associative */
+  static const int kEntriesPerBucket = W; /* W-way set associative */
+  static_assert(W % 4 == 0 && W <= 32, "bucket width must be a multiple of 4");
 
-  struct Bucket {
+  /* # of bucket version counters in concurrent mode (buckets share them) */
+  static const uint32_t kNumVersionStripes = 1024;
+
+  /* 32 bytes for 4-way buckets, a cache line for 8-way ones */
+  struct alignas(sizeof(uint32_t) * 2 * W) Bucket {
     uint32_t hv[kEntriesPerBucket];
     KeyIndex keyidx[kEntriesPerBucket];
-  } __ymm_aligned;
+  };
 
-  static uint32_t make_nonzero(uint32_t v) {
-    /* Set the MSB and unset the 2nd MSB (NOTE: must be idempotent).
-     * Then the result will never be a zero, and not a non-number when
-     * represented as float (so we are good to use _mm_*_ps() SIMD ops) */
-    return (v | (1u << 31)) & (~(1u << 30));
-  }
+  /* versions read by a concurrent lookup */
+  struct ReadVersion {
+    uint32_t table;
+    uint32_t pri;
+    uint32_t sec;
+  };
 
-  static uint32_t hash_secondary(uint32_t primary) {
-    /* from DPDK */
-    uint32_t tag = primary >> 12;
-    return primary ^ ((tag + 1) * 0x5bd1e995);
+  /* Returns a bitmask of the slots in "bucket" with the hash value "hv".
+   * Iterate over it with __builtin_ctz() and "mask &= mask - 1". */
+  static int match_slots(const Bucket *bucket, uint32_t hv) {
+    return match_hv<W>(bucket->hv, hv);
   }
 
   void *keyidx_to_ptr(KeyIndex idx) const {
@@ -105,25 +174,96 @@ class HTableBase {
     return &buckets_[hv & bucket_mask_];
   }
 
+  /* the version counter that "bucket" shares with the rest of its stripe */
+  uint32_t *stripe_version(const Bucket *bucket) const {
+    return &bucket_versions_[(bucket - buckets_) & (kNumVersionStripes - 1)];
+  }
+
+  /* hv_to_bucket() for lookups concurrent with a resize: the mask is read
+   * before the array, which is published before a larger mask */
+  const Bucket *hv_to_bucket_concurrent(uint32_t hv) const {
+    uint32_t mask = ACCESS_ONCE(bucket_mask_);
+    LOAD_BARRIER();
+    return &ACCESS_ONCE(buckets_)[hv & mask];
+  }
+
+  uint32_t bucket_version(uint32_t hv) const {
+    uint32_t mask = ACCESS_ONCE(bucket_mask_);
+    return ACCESS_ONCE(bucket_versions_[hv & mask & (kNumVersionStripes - 1)]);
+  }
+
+  /* Snapshot the versions of the table and of the buckets of "pri" and "sec",
+   * waiting for the writer to finish any update of them */
+  void read_begin(ReadVersion *v, uint32_t pri, uint32_t sec) const {
+    do {
+      v->table = ACCESS_ONCE(table_version_);
+      LOAD_BARRIER();
+      v->pri = bucket_version(pri);
+      v->sec = bucket_version(sec);
+    } while ((v->table | v->pri | v->sec) & 1);
+    LOAD_BARRIER();
+  }
+
+  /* Whether a lookup that started with read_begin() must be retried */
+  bool read_retry(const ReadVersion &v, uint32_t pri, uint32_t sec) const {
+    LOAD_BARRIER();
+    return bucket_version(pri) != v.pri || bucket_version(sec) != v.sec ||
+           ACCESS_ONCE(table_version_) != v.table;
+  }
+
+  /* Lookup in concurrent mode. "pri" must be non-zero. */
+  void *get_concurrent(uint32_t pri, const void *key, KeyCmpFunc cmp) const {
+    const uint32_t hvs[2] = {pri, hash_secondary(pri)};
+    ReadVersion v;
+    void *ret;
+
+    do {
+      read_begin(&v, hvs[0], hvs[1]);
+      ret = nullptr;
+
+      for (int b = 0; b < 2 && !ret; b++) {
+        const Bucket *bucket = hv_to_bucket_concurrent(hvs[b]);
+
+        /* torn reads of the hash values are caught by read_retry() */
+        for (int m = match_slots(bucket, pri); m; m &= m - 1) {
+          int i = __builtin_ctz(m);
+
+          /* the entry array is read after the index it must hold */
+          KeyIndex k_idx = ACCESS_ONCE(bucket->keyidx[i]);
+          LOAD_BARRIER();
+          void *key_stored = keyidx_to_ptr(k_idx);
+
+          if (cmp(key, key_stored, key_size_) == 0) {
+            ret = (void *)((uintptr_t)key_stored + value_offset_);
+            break;
+          }
+        }
+      }
+    } while (read_retry(v, hvs[0], hvs[1]));
+
+    return ret;
+  }
+
   /* in bytes */
   size_t key_size_ = {};
   size_t value_size_ = {};
   size_t value_offset_ = {};
   size_t entry_size_ = {};
 
+  bool concurrent_ = {};
+
  private:
   /* tunable macros */
   static const int kInitNumBucket = 4;
   static const int kInitNumEntries = 16;
 
-  /* 4^kMaxCuckooPath buckets will be considered to make a empty slot,
+  /* W^kMaxCuckooPath buckets will be considered to make a empty slot,
    * before giving up and expand the table.
    * Higher number will yield better occupancy, but the worst case performance
    * of insertion will grow exponentially, so be careful. */
   static const int kMaxCuckooPath = 3;
 
   /* non-tunable macros */
-  static const uint32_t kHashInitval = UINT32_MAX;
   static const KeyIndex kInvalidKeyIdx = std::numeric_limits<KeyIndex>::max();
 
   int count_entries_in_pri_bucket() const;
@@ -134,12 +274,19 @@ class HTableBase {
   int find_empty_slot(const Bucket *bucket);
   int make_space(Bucket *bucket, int depth);
   KeyIndex pop_free_keyidx();
+  static Bucket *alloc_buckets(uint32_t num_buckets);
   // XXX: clone_table() is a good candidate for a copy constructor
-  int clone_table(HTableBase *t_old, uint32_t num_buckets,
+  int clone_table(HTableBaseT *t_old, uint32_t num_buckets,
                   KeyIndex num_entries);
   int expand_buckets();
   int expand_entries();
   void push_free_keyidx(KeyIndex idx);
+  void retire_keyidx(KeyIndex idx);
+  void reclaim_keyidx();
+  void write_begin(const Bucket *a, const Bucket *b = nullptr);
+  void write_end(const Bucket *a, const Bucket *b = nullptr);
+  int replace_entry(uint32_t pri, const void *key, const void *value);
+  void publish_table(HTableBaseT *t);
   uint32_t hash(const void *key) const;
   uint32_t hash_nonzero(const void *key) const;
 
@@ -161,14 +308,36 @@ class HTableBase {
   /* Linked list head for empty key slots (LIFO). kInvalidKeyIdx if empty */
   KeyIndex free_keyidx_ = {};
 
+  /* Concurrent mode: incremented before and after the arrays are swapped,
+   * and before and after any bucket of a stripe is modified */
+  volatile uint32_t table_version_ = {};
+  uint32_t *bucket_versions_ = nullptr;
+
+  /* Concurrent mode: deleted or replaced key slots, which lookups may still
+   * read. The closed list is reusable once its grace period has elapsed;
+   * the open one is closed when the closed one is reused. */
+  KeyIndex retiring_keyidx_ = {};
+  KeyIndex retired_keyidx_ = {};
+  uint64_t retiring_epoch_ = {};
+  uint64_t retired_epoch_ = {};
+
   HashFunc hash_func_;
   KeyCmpFunc keycmp_func_;
 };
 
+/* instantiated in htable.cc */
+extern template class HTableBaseT<4>;
+extern template class HTableBaseT<8>;
+
+typedef HTableBaseT<4> HTableBase;
+
+/* Keys and values are stored in a separate entry array, unless they are small
+ * enough to be stored in the buckets (see the specialization below) */
 template <typename K, typename V,
           HTableBase::KeyCmpFunc C = HTableBase::kDefaultKeyCmpFunc,
-          HTableBase::HashFunc H = HTableBase::kDefaultHashFunc>
-class HTable : public HTableBase {
+          HTableBase::HashFunc H = HTableBase::kDefaultHashFunc, int W = 4,
+          bool Inline = (sizeof(K) + sizeof(V) <= 16)>
+class HTable : public HTableBaseT<W> {
  public:
   /* returns nullptr or the pointer to the data */
   V *Get(const K *key) const;
@@ -176,23 +345,62 @@ class HTable : public HTableBase {
   /* identical to ht_Get(), but you can supply a precomputed hash value "pri" */
   V *GetHash(uint32_t pri, const K *key) const;
 
+  /* Looks up n keys at once: values[i] is set to nullptr or the pointer to
+   * the data of keys[i]. The buckets and entries of a round of keys are
+   * prefetched before any of them is compared, so that their cache misses
+   * overlap rather than stall one after another.
+   * Returns the number of keys found. */
+  int GetBulk(const K *keys, int n, V **values) const;
+
+  /* identical to GetBulk(), with the precomputed hash values of the keys */
+  int GetBulkHash(const uint32_t *hashes, const K *keys, int n,
+                  V **values) const;
+
+  /* the hash value of "key", for GetHash() and GetBulkHash() */
+  uint32_t Hash(const K *key) const {
+    return H(key, key_size_, kHashInitval);
+  }
+
+ protected:
+  typedef HTableBaseT<W> Base;
+
+  using typename Base::Bucket;
+  using typename Base::KeyIndex;
+  using Base::kHashInitval;
+  using Base::make_nonzero;
+  using Base::hash_secondary;
+  using Base::match_slots;
+  using Base::keyidx_to_ptr;
+  using Base::hv_to_bucket;
+  using Base::get_concurrent;
+  using Base::key_size_;
+  using Base::value_offset_;
+  using Base::concurrent_;
+
  private:
+  /* max # of keys whose cache misses overlap in GetBulk() */
+  static const int kBulkRound = 32;
+
   V *get_from_bucket(uint32_t pri, uint32_t hv, const K *key) const;
+  const void *match_in_bucket(uint32_t pri, uint32_t hv) const;
 };
 
 template <typename K, typename V, HTableBase::KeyCmpFunc C,
-          HTableBase::HashFunc H>
-inline V *HTable<K, V, C, H>::Get(const K *key) const {
+          HTableBase::HashFunc H, int W, bool Inline>
+inline V *HTable<K, V, C, H, W, Inline>::Get(const K *key) const {
   uint32_t pri = H(key, key_size_, kHashInitval);
 
   return GetHash(pri, key);
 }
 
 template <typename K, typename V, HTableBase::KeyCmpFunc C,
-          HTableBase::HashFunc H>
-inline V *HTable<K, V, C, H>::GetHash(uint32_t pri, const K *key) const {
+          HTableBase::HashFunc H, int W, bool Inline>
+inline V *HTable<K, V, C, H, W, Inline>::GetHash(uint32_t pri,
+                                                  const K *key) const {
   pri = make_nonzero(pri);
 
+  if (unlikely(concurrent_)) return (V *)get_concurrent(pri, key, C);
+
   /* check primary bucket */
   V *ret = get_from_bucket(pri, pri, key);
   if (ret) return ret;
@@ -202,18 +410,113 @@ inline V *HTable<K, V, C, H>::GetHash(uint32_t pri, const K *key) const {
 }
 
 template <typename K, typename V, HTableBase::KeyCmpFunc C,
-          HTableBase::HashFunc H>
-inline V *HTable<K, V, C, H>::get_from_bucket(uint32_t pri, uint32_t hv,
-                                              const K *key) const {
+          HTableBase::HashFunc H, int W, bool Inline>
+inline int HTable<K, V, C, H, W, Inline>::GetBulk(const K *keys, int n,
+                                                  V **values) const {
+  uint32_t hashes[kBulkRound];
+  int found = 0;
+
+  for (int base = 0; base < n; base += kBulkRound) {
+    int cnt = (n - base < kBulkRound) ? n - base : kBulkRound;
+
+    for (int i = 0; i < cnt; i++) {
+      hashes[i] = Hash(&keys[base + i]);
+    }
+
+    found += GetBulkHash(hashes, keys + base, cnt, values + base);
+  }
+
+  return found;
+}
+
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W, bool Inline>
+inline int HTable<K, V, C, H, W, Inline>::GetBulkHash(const uint32_t *hashes,
+                                                      const K *keys, int n,
+                                                      V **values) const {
+  uint32_t pri[kBulkRound];
+  uint32_t sec[kBulkRound];
+  const void *cand[kBulkRound];
+  int found = 0;
+
+  for (int base = 0; base < n; base += kBulkRound) {
+    const K *round_keys = keys + base;
+    V **round_values = values + base;
+    int cnt = (n - base < kBulkRound) ? n - base : kBulkRound;
+
+    /* phase 1: prefetch both buckets of all keys */
+    for (int i = 0; i < cnt; i++) {
+      pri[i] = make_nonzero(hashes[base + i]);
+      sec[i] = hash_secondary(pri[i]);
+      __builtin_prefetch(hv_to_bucket(pri[i]));
+      __builtin_prefetch(hv_to_bucket(sec[i]));
+    }
+
+    if (unlikely(concurrent_)) {
+      for (int i = 0; i < cnt; i++) {
+        round_values[i] = (V *)get_concurrent(pri[i], &round_keys[i], C);
+        found += (round_values[i] != nullptr);
+      }
+      continue;
+    }
+
+    /* phase 2: find the entries with matching hash values and prefetch them */
+    for (int i = 0; i < cnt; i++) {
+      cand[i] = match_in_bucket(pri[i], pri[i]);
+      if (!cand[i]) {
+        cand[i] = match_in_bucket(pri[i], sec[i]);
+      }
+      if (cand[i]) {
+        __builtin_prefetch(cand[i]);
+      }
+    }
+
+    /* phase 3: compare keys. On a hash collision, fall back to a full
+     * lookup, which also considers further entries with the same hash */
+    for (int i = 0; i < cnt; i++) {
+      V *ret = nullptr;
+
+      if (cand[i]) {
+        if (likely(C(&round_keys[i], cand[i], key_size_) == 0)) {
+          ret = (V *)((uintptr_t)cand[i] + value_offset_);
+        } else {
+          ret = GetHash(pri[i], &round_keys[i]);
+        }
+      }
+
+      round_values[i] = ret;
+      found += (ret != nullptr);
+    }
+  }
+
+  return found;
+}
+
+/* returns the first stored key with the hash value "pri" in the bucket, or
+ * nullptr */
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W, bool Inline>
+inline const void *HTable<K, V, C, H, W, Inline>::match_in_bucket(
+    uint32_t pri, uint32_t hv) const {
   Bucket *bucket = hv_to_bucket(hv);
+  int m = match_slots(bucket, pri);
 
-  for (int i = 0; i < kEntriesPerBucket; i++) {
+  if (m) return keyidx_to_ptr(bucket->keyidx[__builtin_ctz(m)]);
+
+  return nullptr;
+}
+
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W, bool Inline>
+inline V *HTable<K, V, C, H, W, Inline>::get_from_bucket(
+    uint32_t pri, uint32_t hv, const K *key) const {
+  Bucket *bucket = hv_to_bucket(hv);
+
+  for (int m = match_slots(bucket, pri); m; m &= m - 1) {
     KeyIndex k_idx;
     void *key_stored;
 
-    if (pri != bucket->hv[i]) continue;
-
-    k_idx = bucket->keyidx[i];
+    k_idx = bucket->keyidx[__builtin_ctz(m)];
     key_stored = keyidx_to_ptr(k_idx);
 
     if (C(key, key_stored, key_size_) == 0)
@@ -223,4 +526,561 @@ inline V *HTable<K, V, C, H>::get_from_bucket(uint32_t pri, uint32_t hv,
   return nullptr;
 }
 
+/* HTable for keys and values small enough to be stored in the buckets, next
+ * to their hash values, rather than in a separate entry array. A lookup then
+ * reads only its buckets, each a cache line (or two, for 8-way buckets or
+ * entries larger than 12 bytes), instead of following the key index of a
+ * matching slot to another cache line. Selected by default if
+ * sizeof(K) + sizeof(V) <= 16.
+ *
+ * Entries move between buckets as the table is updated, so the pointers
+ * returned by lookups are valid only until the next update. In concurrent
+ * mode, lookups must return pointers that stay valid until a quiescent
+ * state, so the table stores its entries in an entry array instead, as
+ * HTable<K, V, C, H, W, false> does. C and H are used for all keys; the
+ * hash_func and keycmp_func parameters are ignored. */
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+class HTable<K, V, C, H, W, true> : public HTableTypes {
+ public:
+  HTable() = default;
+  ~HTable() { Close(); };
+
+  // not allowing copying for now
+  HTable(HTable &) = delete;
+  HTable(HTable &&) = delete;
+
+  /* -errno, or 0 for success. The key and value sizes may be smaller than
+   * those of K and V. */
+  int Init(size_t key_size, size_t value_size, bool concurrent = false);
+  int InitEx(struct ht_params *params);
+  void Close();
+
+  void Clear();
+
+  /* returns nullptr or the pointer to the data */
+  V *Get(const K *key) const;
+
+  /* identical to Get(), but you can supply a precomputed hash value "pri" */
+  V *GetHash(uint32_t pri, const K *key) const;
+
+  /* Looks up n keys at once, prefetching the buckets of a round of keys
+   * before any of them is compared (see HTable::GetBulk()).
+   * Returns the number of keys found. */
+  int GetBulk(const K *keys, int n, V **values) const;
+
+  /* identical to GetBulk(), with the precomputed hash values of the keys */
+  int GetBulkHash(const uint32_t *hashes, const K *keys, int n,
+                  V **values) const;
+
+  /* the hash value of "key", for GetHash() and GetBulkHash() */
+  uint32_t Hash(const K *key) const {
+    return H(key, key_size_, kHashInitval);
+  }
+
+  /* -ENOMEM on error, 0 for succesful insertion, or 1 if updated */
+  int Set(const void *key, const void *value);
+
+  /* -ENOENT on error, or 0 for success */
+  int Del(const void *key);
+
+  /* Iterate over key pointers.
+   * nullptr if it reached the end of the table, or the pointer to the key.
+   * User should set *next to 0 when starting iteration */
+  void *Iterate(uint32_t *next) const;
+
+  int Count() const {
+    return unlikely(concurrent_) ? fallback_.Count() : cnt_;
+  }
+
+  /* with non-zero 'detail', each item in the hash table will be shown */
+  void Dump(bool detail) const;
+
+ private:
+  static const int kEntriesPerBucket = W; /* W-way set associative */
+  static_assert(W % 4 == 0 && W <= 32, "bucket width must be a multiple of 4");
+
+  static const int kInitNumBucket = 4;
+  static const int kInitNumEntries = 16; /* of the concurrent-mode table */
+
+  /* see HTableBaseT */
+  static const int kMaxCuckooPath = 3;
+  static const int kBulkRound = 32;
+
+  struct Entry {
+    K key;
+    V value;
+  };
+
+  struct Bucket {
+    uint32_t hv[kEntriesPerBucket];
+    Entry entries[kEntriesPerBucket];
+  } __cacheline_aligned;
+
+  Bucket *hv_to_bucket(uint32_t hv) const {
+    return &buckets_[hv & bucket_mask_];
+  }
+
+  static void prefetch_bucket(const Bucket *bucket) {
+    __builtin_prefetch(bucket);
+    if (sizeof(Bucket) > 64) {
+      __builtin_prefetch((const char *)bucket + 64);
+    }
+  }
+
+  static Bucket *alloc_buckets(uint32_t num_buckets) {
+    return (Bucket *)mem_alloc_aligned(num_buckets * sizeof(Bucket),
+                                       alignof(Bucket));
+  }
+
+  int find_in_bucket(const Bucket *bucket, uint32_t pri, const void *key) const;
+  V *get_from_bucket(uint32_t pri, uint32_t hv, const K *key) const;
+  int find_empty_slot(const Bucket *bucket) const;
+  int make_space(Bucket *bucket, int depth);
+  int add_entry(uint32_t pri, const Entry *entry);
+  int expand_buckets();
+
+  /* in bytes */
+  size_t key_size_ = {};
+  size_t value_size_ = {};
+
+  /* # of buckets == mask + 1 */
+  uint32_t bucket_mask_ = {};
+  Bucket *buckets_ = nullptr;
+
+  int cnt_ = 0; /* current number of entries */
+
+  /* Concurrent mode: all operations are passed on to the table with an
+   * entry array */
+  bool concurrent_ = {};
+  HTable<K, V, C, H, W, false> fallback_;
+};
+
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+int HTable<K, V, C, H, W, true>::InitEx(struct ht_params *params) {
+  if (!params) {
+    return -EINVAL;
+  }
+
+  if (params->key_size < 1 || params->key_size > sizeof(K)) {
+    return -EINVAL;
+  }
+
+  if (params->value_size > sizeof(V)) {
+    return -EINVAL;
+  }
+
+  if (params->num_buckets < 1) {
+    return -EINVAL;
+  }
+
+  if (params->num_buckets != align_ceil_pow2(params->num_buckets)) {
+    return -EINVAL;
+  }
+
+  key_size_ = params->key_size;
+  value_size_ = params->value_size;
+
+  /* lookups would return pointers into the buckets, whose entries move */
+  if (params->concurrent) {
+    struct ht_params fallback_params = *params;
+
+    fallback_params.key_align = std::max<size_t>(params->key_align, 1);
+    if (params->value_size > 0 && params->value_align == 0) {
+      fallback_params.value_align = alignof(V);
+    }
+    if (params->num_entries < kInitNumEntries) {
+      fallback_params.num_entries = kInitNumEntries;
+    }
+    fallback_params.hash_func = H;
+    fallback_params.keycmp_func = C;
+
+    int ret = fallback_.InitEx(&fallback_params);
+    if (ret) return ret;
+
+    concurrent_ = true;
+    return 0;
+  }
+
+  bucket_mask_ = params->num_buckets - 1;
+  cnt_ = 0;
+
+  buckets_ = alloc_buckets(bucket_mask_ + 1);
+  if (!buckets_) return -ENOMEM;
+
+  return 0;
+}
+
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+int HTable<K, V, C, H, W, true>::Init(size_t key_size, size_t value_size,
+                                      bool concurrent) {
+  struct ht_params params = {};
+
+  params.key_size = key_size;
+  params.value_size = value_size;
+  params.num_buckets = kInitNumBucket;
+  params.concurrent = concurrent;
+
+  return InitEx(&params);
+}
+
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+void HTable<K, V, C, H, W, true>::Close() {
+  fallback_.Close();
+  mem_free(buckets_);
+
+  key_size_ = 0;
+  value_size_ = 0;
+  bucket_mask_ = 0;
+  buckets_ = nullptr;
+  cnt_ = 0;
+  concurrent_ = false;
+}
+
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+void HTable<K, V, C, H, W, true>::Clear() {
+  if (unlikely(concurrent_)) return fallback_.Clear();
+
+  if (buckets_) {
+    memset(buckets_, 0, (bucket_mask_ + 1) * sizeof(Bucket));
+  }
+  cnt_ = 0;
+}
+
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+inline V *HTable<K, V, C, H, W, true>::Get(const K *key) const {
+  uint32_t pri = H(key, key_size_, kHashInitval);
+
+  return GetHash(pri, key);
+}
+
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+inline V *HTable<K, V, C, H, W, true>::GetHash(uint32_t pri,
+                                               const K *key) const {
+  if (unlikely(concurrent_)) return fallback_.GetHash(pri, key);
+
+  pri = make_nonzero(pri);
+
+  /* check primary bucket */
+  V *ret = get_from_bucket(pri, pri, key);
+  if (ret) return ret;
+
+  /* check secondary bucket */
+  return get_from_bucket(pri, hash_secondary(pri), key);
+}
+
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+inline int HTable<K, V, C, H, W, true>::GetBulk(const K *keys, int n,
+                                                V **values) const {
+  uint32_t hashes[kBulkRound];
+  int found = 0;
+
+  for (int base = 0; base < n; base += kBulkRound) {
+    int cnt = (n - base < kBulkRound) ? n - base : kBulkRound;
+
+    for (int i = 0; i < cnt; i++) {
+      hashes[i] = Hash(&keys[base + i]);
+    }
+
+    found += GetBulkHash(hashes, keys + base, cnt, values + base);
+  }
+
+  return found;
+}
+
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+inline int HTable<K, V, C, H, W, true>::GetBulkHash(const uint32_t *hashes,
+                                                    const K *keys, int n,
+                                                    V **values) const {
+  uint32_t pri[kBulkRound];
+  uint32_t sec[kBulkRound];
+  int found = 0;
+
+  if (unlikely(concurrent_)) {
+    return fallback_.GetBulkHash(hashes, keys, n, values);
+  }
+
+  for (int base = 0; base < n; base += kBulkRound) {
+    const K *round_keys = keys + base;
+    V **round_values = values + base;
+    int cnt = (n - base < kBulkRound) ? n - base : kBulkRound;
+
+    /* phase 1: prefetch both buckets of all keys */
+    for (int i = 0; i < cnt; i++) {
+      pri[i] = make_nonzero(hashes[base + i]);
+      sec[i] = hash_secondary(pri[i]);
+      prefetch_bucket(hv_to_bucket(pri[i]));
+      prefetch_bucket(hv_to_bucket(sec[i]));
+    }
+
+    /* phase 2: compare keys, which are in the buckets */
+    for (int i = 0; i < cnt; i++) {
+      V *ret = get_from_bucket(pri[i], pri[i], &round_keys[i]);
+      if (!ret) {
+        ret = get_from_bucket(pri[i], sec[i], &round_keys[i]);
+      }
+
+      round_values[i] = ret;
+      found += (ret != nullptr);
+    }
+  }
+
+  return found;
+}
+
+/* returns the slot of "key" in the bucket, or -ENOENT */
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+inline int HTable<K, V, C, H, W, true>::find_in_bucket(const Bucket *bucket,
+                                                       uint32_t pri,
+                                                       const void *key) const {
+  for (int m = match_hv<W>(bucket->hv, pri); m; m &= m - 1) {
+    int i = __builtin_ctz(m);
+
+    if (C(key, &bucket->entries[i].key, key_size_) == 0) return i;
+  }
+
+  return -ENOENT;
+}
+
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+inline V *HTable<K, V, C, H, W, true>::get_from_bucket(uint32_t pri,
+                                                       uint32_t hv,
+                                                       const K *key) const {
+  Bucket *bucket = hv_to_bucket(hv);
+  int i = find_in_bucket(bucket, pri, key);
+
+  if (i < 0) return nullptr;
+
+  return &bucket->entries[i].value;
+}
+
+/* returns an empty slot ID, or -ENOSPC */
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+int HTable<K, V, C, H, W, true>::find_empty_slot(const Bucket *bucket) const {
+  int m = match_hv<W>(bucket->hv, 0);
+
+  if (m) return __builtin_ctz(m);
+
+  return -ENOSPC;
+}
+
+/* Recursive function to try making an empty slot in the bucket, by moving
+ * its entries to their alternative buckets.
+ * Returns a slot ID in [0, kEntriesPerBucket) for successful operation,
+ * or -ENOSPC if failed */
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+int HTable<K, V, C, H, W, true>::make_space(Bucket *bucket, int depth) {
+  if (depth >= kMaxCuckooPath) return -ENOSPC;
+
+  for (int i = 0; i < kEntriesPerBucket; i++) {
+    /* the stored hash value is that of the primary bucket */
+    uint32_t pri = bucket->hv[i];
+    Bucket *alt_bucket = hv_to_bucket(pri);
+
+    if (alt_bucket == bucket) alt_bucket = hv_to_bucket(hash_secondary(pri));
+    if (alt_bucket == bucket) continue;
+
+    int j = find_empty_slot(alt_bucket);
+    if (j == -ENOSPC) j = make_space(alt_bucket, depth + 1);
+    if (j < 0) continue;
+
+    /* the path may have gone through this bucket and moved the entry */
+    if (bucket->hv[i] != pri) return find_empty_slot(bucket);
+
+    alt_bucket->entries[j] = bucket->entries[i];
+    alt_bucket->hv[j] = pri;
+    bucket->hv[i] = 0;
+    return i;
+  }
+
+  return -ENOSPC;
+}
+
+/* the key must not already exist in the hash table */
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+int HTable<K, V, C, H, W, true>::add_entry(uint32_t pri, const Entry *entry) {
+  Bucket *pri_bucket = hv_to_bucket(pri);
+  Bucket *sec_bucket = hv_to_bucket(hash_secondary(pri));
+  Bucket *bucket;
+  int i;
+
+  /* empty space in the primary or the secondary bucket? Otherwise, try
+   * kicking out someone in either of them. */
+  if ((i = find_empty_slot(pri_bucket)) >= 0) {
+    bucket = pri_bucket;
+  } else if ((i = find_empty_slot(sec_bucket)) >= 0) {
+    bucket = sec_bucket;
+  } else if ((i = make_space(pri_bucket, 0)) >= 0) {
+    bucket = pri_bucket;
+  } else if ((i = make_space(sec_bucket, 0)) >= 0) {
+    bucket = sec_bucket;
+  } else {
+    return -ENOSPC;
+  }
+
+  bucket->entries[i] = *entry;
+  bucket->hv[i] = pri;
+  return 0;
+}
+
+/* Doubles the bucket array, until all entries fit in it */
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+int HTable<K, V, C, H, W, true>::expand_buckets() {
+  Bucket *old_buckets = buckets_;
+  uint32_t old_mask = bucket_mask_;
+  uint32_t num_buckets = (old_mask + 1) * 2;
+
+again:
+  buckets_ = alloc_buckets(num_buckets);
+  if (!buckets_) {
+    buckets_ = old_buckets;
+    bucket_mask_ = old_mask;
+    return -ENOMEM;
+  }
+  bucket_mask_ = num_buckets - 1;
+
+  for (uint32_t b = 0; b <= old_mask; b++) {
+    const Bucket *bucket = &old_buckets[b];
+
+    for (int i = 0; i < kEntriesPerBucket; i++) {
+      if (bucket->hv[i] && add_entry(bucket->hv[i], &bucket->entries[i]) < 0) {
+        mem_free(buckets_);
+        num_buckets *= 2;
+        goto again;
+      }
+    }
+  }
+
+  mem_free(old_buckets);
+  return 0;
+}
+
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+int HTable<K, V, C, H, W, true>::Set(const void *key, const void *value) {
+  if (unlikely(concurrent_)) return fallback_.Set(key, value);
+
+  uint32_t pri = make_nonzero(H(key, key_size_, kHashInitval));
+  Entry entry = {};
+
+  /* If the key already exists, its value is updated with the new one */
+  V *old_value = GetHash(pri, (const K *)key);
+  if (old_value) {
+    memcpy(old_value, value, value_size_);
+    return 1;
+  }
+
+  memcpy(&entry.key, key, key_size_);
+  memcpy(&entry.value, value, value_size_);
+
+  while (add_entry(pri, &entry) < 0) {
+    /* expand the table as the last resort */
+    int ret = expand_buckets();
+    if (ret < 0) return ret;
+    /* retry on the newly expanded table */
+  }
+
+  cnt_++;
+  return 0;
+}
+
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+int HTable<K, V, C, H, W, true>::Del(const void *key) {
+  if (unlikely(concurrent_)) return fallback_.Del(key);
+
+  uint32_t pri = make_nonzero(H(key, key_size_, kHashInitval));
+  const uint32_t hvs[2] = {pri, hash_secondary(pri)};
+
+  for (int b = 0; b < 2; b++) {
+    Bucket *bucket = hv_to_bucket(hvs[b]);
+    int i = find_in_bucket(bucket, pri, key);
+
+    if (i >= 0) {
+      bucket->hv[i] = 0;
+      cnt_--;
+      return 0;
+    }
+  }
+
+  return -ENOENT;
+}
+
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+void *HTable<K, V, C, H, W, true>::Iterate(uint32_t *next) const {
+  if (unlikely(concurrent_)) return fallback_.Iterate(next);
+
+  uint32_t idx = *next;
+
+  uint32_t i;
+  int j;
+
+  do {
+    i = idx / kEntriesPerBucket;
+    j = idx % kEntriesPerBucket;
+
+    if (i >= bucket_mask_ + 1) {
+      *next = idx;
+      return nullptr;
+    }
+
+    idx++;
+  } while (buckets_[i].hv[j] == 0);
+
+  *next = idx;
+  return &buckets_[i].entries[j].key;
+}
+
+template <typename K, typename V, HTableBase::KeyCmpFunc C,
+          HTableBase::HashFunc H, int W>
+void HTable<K, V, C, H, W, true>::Dump(bool detail) const {
+  if (unlikely(concurrent_)) return fallback_.Dump(detail);
+
+  printf("--------------------------------------------\n");
+
+  if (detail) {
+    for (uint32_t i = 0; i < bucket_mask_ + 1; i++) {
+      printf("%4d:  ", i);
+
+      for (int j = 0; j < kEntriesPerBucket; j++) {
+        uint32_t pri = buckets_[i].hv[j];
+
+        if (!pri) {
+          printf("  --------     ");
+          continue;
+        }
+
+        printf("%c %08x     ", (pri & bucket_mask_) == i ? ' ' : '!', pri);
+      }
+
+      printf("\n");
+    }
+  }
+
+  printf("cnt = %d\n", cnt_);
+  printf("buckets = %d\n", bucket_mask_ + 1);
+  printf("occupancy = %.1f%%\n",
+         100.0 * cnt_ / ((bucket_mask_ + 1) * kEntriesPerBucket));
+
+  printf("key_size = %zu\n", key_size_);
+  printf("value_size = %zu\n", value_size_);
+  printf("bucket_size = %zu\n", sizeof(Bucket));
+  printf("\n");
+}
+
 #endif  // BESS_UTILS_HTABLE_H_
@@ -43,14 +43,16 @@ static inline value_t derive_val(uint32_t key) {
 
 static Random rng;
 
-// Performs BESS init/close before/after each test.
-class BessFixture : public benchmark::Fixture {
+// Performs BESS init/close before/after each test, on a table of type T.
+template <typename T>
+class BessFixtureT : public benchmark::Fixture {
  public:
-  BessFixture() : arg_() {}
+  typedef T table_t;
+
+  BessFixtureT() : arg_() {}
 
   virtual void SetUp(benchmark::State &state) {
-    HTable<uint32_t, value_t, inlined_keycmp, inlined_hash> *t =
-        new HTable<uint32_t, value_t, inlined_keycmp, inlined_hash>();
+    table_t *t = new table_t();
 
     if (t->Init(sizeof(uint32_t), sizeof(value_t)) == -ENOMEM) {
       CHECK(false) << "Out of memory.";
@@ -69,23 +71,30 @@ class BessFixture : public benchmark::Fixture {
       }
     }
 
-    arg_ = static_cast<HTableBase *>(t);
+    arg_ = t;
   }
 
-  virtual void TearDown(benchmark::State &) {
-    HTable<uint32_t, value_t, inlined_keycmp, inlined_hash> *t =
-        (HTable<uint32_t, value_t, inlined_keycmp, inlined_hash> *) arg_;
-    t->Close();
-  }
+  virtual void TearDown(benchmark::State &) { arg_->Close(); }
 
  protected:
-  HTableBase *arg_;
+  table_t *arg_;
 };
 
-// Benchmarks the Get() method in HTableBase.
-BENCHMARK_DEFINE_F(BessFixture, BessGet)(benchmark::State& state) {
-  HTableBase *t = static_cast<HTableBase *>(arg_);
-
+// Tables with entry arrays, of 4-way and 8-way buckets
+typedef BessFixtureT<
+    HTable<uint32_t, value_t, inlined_keycmp, inlined_hash, 4, false>>
+    BessFixture;
+typedef BessFixtureT<
+    HTable<uint32_t, value_t, inlined_keycmp, inlined_hash, 8, false>>
+    Bess8WayFixture;
+
+// Table with the keys and values in its buckets
+typedef BessFixtureT<HTable<uint32_t, value_t, inlined_keycmp, inlined_hash>>
+    BessInlineFixture;
+
+// Looks up the keys of the table one by one with the inlined Get().
+template <typename T>
+static void InlinedGet(T *t, benchmark::State &state) {
   while (true) {
     const size_t n = state.range(0);
     rng.SetSeed(0);
@@ -96,6 +105,7 @@ BENCHMARK_DEFINE_F(BessFixture, BessGet)(benchmark::State& state) {
 
       val = (value_t *)t->Get(&key);
       assert(val && *val == derive_val(key));
+      benchmark::DoNotOptimize(val);
 
       if (!state.KeepRunning()) {
         state.SetItemsProcessed(state.iterations());
@@ -105,14 +115,44 @@ BENCHMARK_DEFINE_F(BessFixture, BessGet)(benchmark::State& state) {
   }
 }
 
-BENCHMARK_REGISTER_F(BessFixture, BessGet)
-    ->RangeMultiplier(4)
-    ->Range(4, 4 << 20);
+// Looks up the keys of the table with GetBulk(), in bursts of 32.
+template <typename T>
+static void GetBulk(T *t, benchmark::State &state) {
+  const int kBurst = 32;
+  uint32_t keys[kBurst];
+  value_t *vals[kBurst];
 
-// Benchmarks the Get() method in HTable, which is inlined.
-BENCHMARK_DEFINE_F(BessFixture, BessInlinedGet)(benchmark::State& state) {
-  HTable<uint32_t, value_t, inlined_keycmp, inlined_hash> *t =
-      (HTable<uint32_t, value_t, inlined_keycmp, inlined_hash> *)arg_;
+  while (true) {
+    const size_t n = state.range(0);
+    rng.SetSeed(0);
+
+    for (size_t i = 0; i + kBurst <= n; i += kBurst) {
+      for (int j = 0; j < kBurst; j++) {
+        keys[j] = rng.Get();
+      }
+
+      t->GetBulk(keys, kBurst, vals);
+      for (int j = 0; j < kBurst; j++) {
+        assert(vals[j] && *vals[j] == derive_val(keys[j]));
+      }
+      benchmark::DoNotOptimize(vals);
+
+      if (!state.KeepRunning()) {
+        state.SetItemsProcessed(state.iterations() * kBurst);
+        return;
+      }
+    }
+  }
+}
+
+// Tables of 1M-100M entries, which do not fit in cache.
+static void LargeTables(benchmark::internal::Benchmark *b) {
+  b->Arg(1000000)->Arg(10000000)->Arg(100000000);
+}
+
+// Benchmarks the Get() method in HTableBase.
+BENCHMARK_DEFINE_F(BessFixture, BessGet)(benchmark::State& state) {
+  HTableBase *t = static_cast<HTableBase *>(arg_);
 
   while (true) {
     const size_t n = state.range(0);
@@ -124,6 +164,7 @@ BENCHMARK_DEFINE_F(BessFixture, BessInlinedGet)(benchmark::State& state) {
 
       val = (value_t *)t->Get(&key);
       assert(val && *val == derive_val(key));
+      benchmark::DoNotOptimize(val);
 
       if (!state.KeepRunning()) {
         state.SetItemsProcessed(state.iterations());
@@ -133,8 +174,72 @@ BENCHMARK_DEFINE_F(BessFixture, BessInlinedGet)(benchmark::State& state) {
   }
 }
 
+BENCHMARK_REGISTER_F(BessFixture, BessGet)
+    ->RangeMultiplier(4)
+    ->Range(4, 4 << 20);
+
+// Benchmarks the Get() method in HTable, which is inlined.
+BENCHMARK_DEFINE_F(BessFixture, BessInlinedGet)(benchmark::State& state) {
+  InlinedGet(arg_, state);
+}
+
 BENCHMARK_REGISTER_F(BessFixture, BessInlinedGet)
     ->RangeMultiplier(4)
     ->Range(4, 4 << 20);
 
+BENCHMARK_REGISTER_F(BessFixture, BessInlinedGet)->Apply(LargeTables);
+
+// Benchmarks the GetBulk() method in HTable, with bursts of 32 keys.
+BENCHMARK_DEFINE_F(BessFixture, BessGetBulk)(benchmark::State& state) {
+  GetBulk(arg_, state);
+}
+
+BENCHMARK_REGISTER_F(BessFixture, BessGetBulk)
+    ->RangeMultiplier(4)
+    ->Range(32, 4 << 20);
+
+BENCHMARK_REGISTER_F(BessFixture, BessGetBulk)->Apply(LargeTables);
+
+// The same lookups on a table with 8-way buckets, each in a cache line.
+BENCHMARK_DEFINE_F(Bess8WayFixture, BessInlinedGet)(benchmark::State& state) {
+  InlinedGet(arg_, state);
+}
+
+BENCHMARK_REGISTER_F(Bess8WayFixture, BessInlinedGet)
+    ->RangeMultiplier(4)
+    ->Range(4, 4 << 20);
+
+BENCHMARK_REGISTER_F(Bess8WayFixture, BessInlinedGet)->Apply(LargeTables);
+
+BENCHMARK_DEFINE_F(Bess8WayFixture, BessGetBulk)(benchmark::State& state) {
+  GetBulk(arg_, state);
+}
+
+BENCHMARK_REGISTER_F(Bess8WayFixture, BessGetBulk)
+    ->RangeMultiplier(4)
+    ->Range(32, 4 << 20);
+
+BENCHMARK_REGISTER_F(Bess8WayFixture, BessGetBulk)->Apply(LargeTables);
+
+// The same lookups on a table with the keys and values in its buckets.
+BENCHMARK_DEFINE_F(BessInlineFixture, BessInlinedGet)(benchmark::State& state) {
+  InlinedGet(arg_, state);
+}
+
+BENCHMARK_REGISTER_F(BessInlineFixture, BessInlinedGet)
+    ->RangeMultiplier(4)
+    ->Range(4, 4 << 20);
+
+BENCHMARK_REGISTER_F(BessInlineFixture, BessInlinedGet)->Apply(LargeTables);
+
+BENCHMARK_DEFINE_F(BessInlineFixture, BessGetBulk)(benchmark::State& state) {
+  GetBulk(arg_, state);
+}
+
+BENCHMARK_REGISTER_F(BessInlineFixture, BessGetBulk)
+    ->RangeMultiplier(4)
+    ->Range(32, 4 << 20);
+
+BENCHMARK_REGISTER_F(BessInlineFixture, BessGetBulk)->Apply(LargeTables);
+
 BENCHMARK_MAIN();
@@ -0,0 +1,259 @@
+#include "htable.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include <rte_config.h>
+#include <rte_hash_crc.h>
+
+#include "rcu.h"
+
+namespace {
+
+struct Value {
+  uint64_t key;  // the key the value was set for
+  uint64_t gen;
+};
+
+inline int keycmp(const void *key, const void *key_stored, size_t) {
+  return *(uint64_t *)key != *(uint64_t *)key_stored;
+}
+
+inline uint32_t hash(const void *key, uint32_t, uint32_t init_val) {
+  return rte_hash_crc_8byte(*(uint64_t *)key, init_val);
+}
+
+inline void SetValue(Value *v, uint64_t key, uint64_t gen) {
+  v->key = key;
+  v->gen = gen;
+}
+
+inline void SetValue(uint64_t *v, uint64_t key, uint64_t) {
+  *v = key;
+}
+
+inline uint64_t KeyOf(const Value &v) {
+  return v.key;
+}
+
+inline uint64_t KeyOf(uint64_t v) {
+  return v;
+}
+
+// Entries are in an entry array
+typedef HTable<uint64_t, Value, keycmp, hash> Table;
+typedef HTable<uint64_t, Value, keycmp, hash, 8> Table8;
+
+// Entries are in the buckets, but in an entry array in concurrent mode
+typedef HTable<uint64_t, uint64_t, keycmp, hash> SmallTable;
+typedef HTable<uint64_t, uint64_t, keycmp, hash, 8> SmallTable8;
+
+// Enough keys for more than kNumVersionStripes buckets, so that the buckets
+// moved between by cuckoo hashing may share a version stripe
+const uint64_t kNumStable = 20000;
+const uint64_t kNumChurn = 20000;
+const int kNumRounds = 10;
+const int kNumReaders = 2;
+const int kBatch = 32;
+
+template <typename T>
+void RunBasic() {
+  T t;
+  ASSERT_EQ(0, t.Init(sizeof(uint64_t), sizeof(Value)));
+
+  for (uint64_t k = 0; k < 1000; k++) {
+    Value v = {k, 0};
+    ASSERT_EQ(0, t.Set(&k, &v));
+  }
+  ASSERT_EQ(1000, t.Count());
+  for (uint64_t k = 0; k < 1000; k++) {
+    ASSERT_NE(nullptr, t.Get(&k)) << k;
+    ASSERT_EQ(k, t.Get(&k)->key);
+  }
+
+  uint64_t k = 7;
+  Value v = {k, 1};
+  ASSERT_EQ(1, t.Set(&k, &v)) << "An existing key should be updated.";
+  ASSERT_EQ(1U, t.Get(&k)->gen);
+
+  ASSERT_EQ(0, t.Del(&k));
+  ASSERT_EQ(nullptr, t.Get(&k));
+  ASSERT_EQ(-ENOENT, t.Del(&k));
+  ASSERT_EQ(999, t.Count());
+}
+
+TEST(HTableTest, Basic) {
+  RunBasic<Table>();
+}
+
+TEST(HTableTest, Basic8) {
+  RunBasic<Table8>();
+}
+
+// Inserts, updates and deletes random keys of a small key space, so that
+// entries are moved between buckets by cuckoo hashing and the table expands
+// with entries in the buckets, and checks every lookup and iteration
+// against a reference map.
+template <typename T>
+void RunSmallChurn() {
+  T t;
+  ASSERT_EQ(0, t.Init(sizeof(uint64_t), sizeof(uint64_t)));
+
+  std::map<uint64_t, uint64_t> expected;
+  uint64_t x = 12345;
+  for (int op = 1; op <= 200000; op++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    uint64_t k = (x >> 33) % 5000;
+    uint64_t v = op;
+
+    switch ((x >> 20) % 4) {
+      case 0:
+      case 1:
+        ASSERT_EQ(expected.count(k) ? 1 : 0, t.Set(&k, &v)) << k;
+        expected[k] = v;
+        break;
+      case 2:
+        ASSERT_EQ(expected.erase(k) ? 0 : -ENOENT, t.Del(&k)) << k;
+        break;
+      default:
+        if (expected.count(k)) {
+          ASSERT_NE(nullptr, t.Get(&k)) << k;
+          ASSERT_EQ(expected[k], *t.Get(&k)) << k;
+        } else {
+          ASSERT_EQ(nullptr, t.Get(&k)) << k;
+        }
+    }
+
+    if (op % 10000 == 0) {
+      ASSERT_EQ((int)expected.size(), t.Count());
+
+      std::map<uint64_t, uint64_t> iterated;
+      uint32_t next = 0;
+      while (uint64_t *key = (uint64_t *)t.Iterate(&next)) {
+        ASSERT_EQ(0U, iterated.count(*key)) << "Keys are iterated once.";
+        iterated[*key] = *t.Get(key);
+      }
+      ASSERT_EQ(expected, iterated);
+
+      uint64_t keys[kBatch];
+      uint64_t *values[kBatch];
+      for (int i = 0; i < kBatch; i++) {
+        keys[i] = (x + i * 157) % 5000;
+      }
+      t.GetBulk(keys, kBatch, values);
+      for (int i = 0; i < kBatch; i++) {
+        if (expected.count(keys[i])) {
+          ASSERT_NE(nullptr, values[i]) << keys[i];
+          ASSERT_EQ(expected[keys[i]], *values[i]) << keys[i];
+        } else {
+          ASSERT_EQ(nullptr, values[i]) << keys[i];
+        }
+      }
+    }
+  }
+}
+
+TEST(HTableTest, SmallChurn) {
+  RunSmallChurn<SmallTable>();
+}
+
+TEST(HTableTest, SmallChurn8) {
+  RunSmallChurn<SmallTable8>();
+}
+
+// Workers look up keys that are always present, while the control thread
+// inserts and deletes other keys (moving entries between buckets and
+// resizing the table) and replaces the values of the present ones.
+template <typename T, typename V>
+void RunConcurrentLookups() {
+  T t;
+  ASSERT_EQ(0, t.Init(sizeof(uint64_t), sizeof(V), true));
+
+  for (uint64_t k = 0; k < kNumStable; k++) {
+    V v;
+    SetValue(&v, k, 0);
+    ASSERT_EQ(0, t.Set(&k, &v));
+  }
+
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> misses(0);
+  std::atomic<uint64_t> mismatches(0);
+  std::vector<std::thread> readers;
+
+  for (int r = 0; r < kNumReaders; r++) {
+    readers.emplace_back([&, r]() {
+      uint64_t keys[kBatch];
+      V *values[kBatch];
+      uint64_t next = r;
+
+      rcu_thread_online(r);
+      while (!stop.load(std::memory_order_relaxed)) {
+        for (int i = 0; i < kBatch; i++) {
+          keys[i] = next++ % kNumStable;
+        }
+
+        t.GetBulk(keys, kBatch, values);
+        for (int i = 0; i < kBatch; i++) {
+          V *v = t.Get(&keys[i]);
+          if (!v || !values[i]) {
+            misses++;
+          } else if (KeyOf(*v) != keys[i] || KeyOf(*values[i]) != keys[i]) {
+            mismatches++;
+          }
+        }
+
+        rcu_quiescent(r);
+      }
+      rcu_thread_offline(r);
+    });
+  }
+
+  // EXPECT rather than ASSERT, so that the readers are always joined
+  for (int round = 1; round <= kNumRounds; round++) {
+    for (uint64_t k = kNumStable; k < kNumStable + kNumChurn; k++) {
+      V v;
+      SetValue(&v, k, 0);
+      EXPECT_EQ(0, t.Set(&k, &v));
+    }
+    for (uint64_t k = round % 7; k < kNumStable; k += 7) {
+      V v;
+      SetValue(&v, k, round);
+      EXPECT_EQ(1, t.Set(&k, &v));
+    }
+    for (uint64_t k = kNumStable; k < kNumStable + kNumChurn; k++) {
+      EXPECT_EQ(0, t.Del(&k));
+    }
+  }
+
+  stop = true;
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  rcu_reclaim();
+
+  EXPECT_EQ(0U, misses) << "Present keys should never be missed.";
+  EXPECT_EQ(0U, mismatches) << "Lookups should return the value of their key.";
+  EXPECT_EQ((int)kNumStable, t.Count());
+}
+
+TEST(HTableTest, ConcurrentLookupsNeverMissPresentKeys) {
+  RunConcurrentLookups<Table, Value>();
+}
+
+TEST(HTableTest, ConcurrentLookupsNeverMissPresentKeys8) {
+  RunConcurrentLookups<Table8, Value>();
+}
+
+TEST(HTableTest, SmallConcurrentLookupsNeverMissPresentKeys) {
+  RunConcurrentLookups<SmallTable, uint64_t>();
+}
+
+TEST(HTableTest, SmallConcurrentLookupsNeverMissPresentKeys8) {
+  RunConcurrentLookups<SmallTable8, uint64_t>();
+}
+
+}  // namespace
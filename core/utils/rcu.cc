@@ -0,0 +1,74 @@
+#include "rcu.h"
+
+#include <mutex>
+#include <vector>
+
+volatile uint64_t rcu_epoch = 1;
+volatile uint64_t rcu_num_deferred = 0;
+struct rcu_reader rcu_readers[RCU_MAX_READERS];
+
+struct rcu_deferred {
+  void (*func)(void *);
+  void *arg;
+  uint64_t epoch;
+};
+
+static std::mutex deferred_lock;
+static std::vector<rcu_deferred> deferred;
+
+void rcu_thread_online(int rid) {
+  rcu_readers[rid].epoch = rcu_epoch;
+
+  /* writers must see this reader online before it reads any pointer */
+  FULL_BARRIER();
+}
+
+void rcu_thread_offline(int rid) {
+  FULL_BARRIER();
+  rcu_readers[rid].epoch = 0;
+}
+
+uint64_t rcu_retire() {
+  /* the data has been unpublished before the epoch advances */
+  return __sync_add_and_fetch(&rcu_epoch, 1);
+}
+
+bool rcu_elapsed(uint64_t epoch) {
+  FULL_BARRIER();
+
+  for (int i = 0; i < RCU_MAX_READERS; i++) {
+    uint64_t seen = rcu_readers[i].epoch;
+    if (seen != 0 && seen < epoch) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void rcu_defer(void (*func)(void *), void *arg) {
+  {
+    std::lock_guard<std::mutex> guard(deferred_lock);
+    deferred.push_back({func, arg, rcu_retire()});
+    rcu_num_deferred = deferred.size();
+  }
+
+  /* nothing to wait for if no worker is running */
+  rcu_reclaim();
+}
+
+int rcu_reclaim() {
+  std::lock_guard<std::mutex> guard(deferred_lock);
+  int cnt = 0;
+
+  /* calls are deferred in epoch order */
+  auto it = deferred.begin();
+  for (; it != deferred.end() && rcu_elapsed(it->epoch); ++it) {
+    it->func(it->arg);
+    cnt++;
+  }
+  deferred.erase(deferred.begin(), it);
+  rcu_num_deferred = deferred.size();
+
+  return cnt;
+}
@@ -0,0 +1,55 @@
+/* Quiescent-state-based reclamation (QSBR) of memory that workers read
+ * without locks while the control thread updates it, e.g., the arrays of a
+ * hash table that is resized under traffic.
+ *
+ * Readers report a quiescent state whenever they hold no references to
+ * shared data (between scheduling rounds), and go offline while they are
+ * blocked. A writer first unpublishes an object, then passes it to
+ * rcu_defer(); the object is freed once every online reader has gone
+ * through a quiescent state, by the next call to rcu_reclaim(). */
+
+#ifndef BESS_UTILS_RCU_H_
+#define BESS_UTILS_RCU_H_
+
+#include <cstdint>
+
+#include "common.h"
+
+#define RCU_MAX_READERS 64
+
+struct rcu_reader {
+  /* the global epoch at the last quiescent state; 0 while offline */
+  volatile uint64_t epoch;
+} __cacheline_aligned;
+
+extern volatile uint64_t rcu_epoch;
+extern volatile uint64_t rcu_num_deferred;
+extern struct rcu_reader rcu_readers[RCU_MAX_READERS];
+
+/* Report a quiescent state of reader "rid" */
+static inline void rcu_quiescent(int rid) {
+  /* x86: earlier loads are not reordered with the following store */
+  INST_BARRIER();
+  rcu_readers[rid].epoch = rcu_epoch;
+}
+
+/* Reader "rid" starts (or stops) reading shared data */
+void rcu_thread_online(int rid);
+void rcu_thread_offline(int rid);
+
+/* Start a grace period for data that has just been unpublished.
+ * Returns its epoch, to be passed to rcu_elapsed(). */
+uint64_t rcu_retire();
+
+/* Has every reader gone through a quiescent state since rcu_retire()
+ * returned "epoch"? */
+bool rcu_elapsed(uint64_t epoch);
+
+/* Call func(arg) once a grace period has elapsed, e.g., with mem_free() */
+void rcu_defer(void (*func)(void *), void *arg);
+
+/* Run the deferred calls whose grace periods have elapsed.
+ * Returns the number of calls made. */
+int rcu_reclaim();
+
+#endif  // BESS_UTILS_RCU_H_
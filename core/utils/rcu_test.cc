@@ -0,0 +1,38 @@
+#include "rcu.h"
+
+#include <gtest/gtest.h>
+
+static void count_call(void *arg) {
+  (*static_cast<int *>(arg))++;
+}
+
+TEST(RcuTest, NoReadersNoWait) {
+  int calls = 0;
+  rcu_defer(count_call, &calls);
+  ASSERT_EQ(1, calls) << "Nothing to wait for without online readers.";
+  ASSERT_EQ(0U, rcu_num_deferred);
+}
+
+TEST(RcuTest, WaitsForQuiescentStates) {
+  int calls = 0;
+  rcu_thread_online(0);
+  rcu_thread_online(1);
+
+  rcu_defer(count_call, &calls);
+  ASSERT_EQ(0, calls);
+
+  rcu_quiescent(0);
+  ASSERT_EQ(0, rcu_reclaim()) << "Reader 1 may still hold a reference.";
+
+  rcu_quiescent(1);
+  ASSERT_EQ(1, rcu_reclaim());
+  ASSERT_EQ(1, calls);
+
+  rcu_defer(count_call, &calls);
+  rcu_quiescent(0);
+  rcu_thread_offline(1);
+  ASSERT_EQ(1, rcu_reclaim()) << "Offline readers hold no references.";
+  ASSERT_EQ(2, calls);
+
+  rcu_thread_offline(0);
+}
@@ -15,8 +15,12 @@
 #include "snbuf.h"
 #include "task.h"
 #include "tc.h"
+#include "utils/rcu.h"
 #include "utils/time.h"
 
+static_assert(MAX_WORKERS <= RCU_MAX_READERS,
+              "every worker must be able to read RCU-protected data");
+
 int num_workers = 0;
 std::thread worker_threads[MAX_WORKERS];
 Worker *volatile workers[MAX_WORKERS];
@@ -152,12 +156,15 @@ int Worker::Block() {
   worker_signal t;
   int ret;
 
+  /* a paused worker holds no references to RCU-protected data */
+  rcu_thread_offline(wid_);
   status_ = WORKER_PAUSED;
 
   ret = read(fd_event_, &t, sizeof(t));
   assert(ret == sizeof(t));
 
   if (t == worker_signal::unblock) {
+    rcu_thread_online(wid_);
     status_ = WORKER_RUNNING;
     return 0;
   }